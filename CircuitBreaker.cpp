@@ -0,0 +1,166 @@
+/*++
+
+Program name:
+
+  Apostol CRM
+
+Module Name:
+
+  CircuitBreaker.cpp
+
+Notices:
+
+  Module: Upstream circuit breaker
+
+Author:
+
+  Copyright (c) Prepodobny Alen
+
+  mailto: alienufo@inbox.ru
+  mailto: ufocomp@gmail.com
+
+--*/
+
+//----------------------------------------------------------------------------------------------------------------------
+
+#include "Core.hpp"
+#include "CircuitBreaker.hpp"
+//----------------------------------------------------------------------------------------------------------------------
+
+extern "C++" {
+
+namespace Apostol {
+
+    namespace Module {
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        //-- CCircuitBreaker -------------------------------------------------------------------------------------------
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        CCircuitBreaker::CCircuitBreaker(): m_Active(false), m_Window(0), m_OpenTime(0), m_MinRequests(0),
+                m_FailureRate(0), m_Opened(0), m_Rejected(0) {
+
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CCircuitBreaker::Open(int Window, int MinRequests, int FailureRate, int OpenTime) {
+            m_Window = (CDateTime) Window / SecsPerDay;
+            m_OpenTime = (CDateTime) OpenTime / SecsPerDay;
+            m_MinRequests = MinRequests;
+            m_FailureRate = FailureRate;
+            m_Active = true;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        CCircuit &CCircuitBreaker::Circuit(const CString &Key, CDateTime Now) {
+            auto &Circuit = m_Circuits[Key.c_str()];
+
+            if (Circuit.State == csClosed && Now - Circuit.WindowStart >= m_Window) {
+                Circuit.WindowStart = Now;
+                Circuit.Successes = 0;
+                Circuit.Failures = 0;
+            }
+
+            return Circuit;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CCircuitBreaker::Open(CCircuit &Circuit, CDateTime Now) {
+            Circuit.State = csOpen;
+            Circuit.OpenUntil = Now + m_OpenTime;
+            Circuit.Probing = false;
+            m_Opened++;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        bool CCircuitBreaker::Allow(const CString &Key) {
+            if (!m_Active)
+                return true;
+
+            const auto now = Now();
+            auto &Circuit = this->Circuit(Key, now);
+
+            if (Circuit.State == csOpen && now >= Circuit.OpenUntil) {
+                Circuit.State = csHalfOpen;
+                Circuit.Probing = false;
+            }
+
+            // A probe that never reported back (e.g. its handler timed out) is replaced after another open period.
+            if (Circuit.State == csHalfOpen && (!Circuit.Probing || now >= Circuit.OpenUntil)) {
+                Circuit.Probing = true;
+                Circuit.OpenUntil = now + m_OpenTime;
+                return true;
+            }
+
+            if (Circuit.State == csClosed)
+                return true;
+
+            m_Rejected++;
+
+            return false;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CCircuitBreaker::Success(const CString &Key) {
+            if (!m_Active)
+                return;
+
+            auto &Circuit = this->Circuit(Key, Now());
+
+            if (Circuit.State == csHalfOpen) {
+                Circuit = CCircuit();
+                Circuit.WindowStart = Now();
+            }
+
+            Circuit.Successes++;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CCircuitBreaker::Failure(const CString &Key) {
+            if (!m_Active)
+                return;
+
+            const auto now = Now();
+            auto &Circuit = this->Circuit(Key, now);
+
+            if (Circuit.State == csHalfOpen) {
+                Open(Circuit, now);
+                return;
+            }
+
+            if (Circuit.State != csClosed)
+                return;
+
+            Circuit.Failures++;
+
+            const auto total = Circuit.Successes + Circuit.Failures;
+            if (total >= m_MinRequests && Circuit.Failures * 100 >= m_FailureRate * total) {
+                Open(Circuit, now);
+            }
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CCircuitBreaker::Metrics(CString &Output, const CString &Module) const {
+            uint64_t open = 0;
+            for (const auto &it : m_Circuits) {
+                if (it.second.State != csClosed)
+                    open++;
+            }
+
+            Output += CString().Format("# TYPE apostol_circuit_opened_total counter\n"
+                                       "apostol_circuit_opened_total{module=\"%s\"} %llu\n",
+                                       Module.c_str(), (unsigned long long) m_Opened);
+            Output += CString().Format("# TYPE apostol_circuit_rejected_total counter\n"
+                                       "apostol_circuit_rejected_total{module=\"%s\"} %llu\n",
+                                       Module.c_str(), (unsigned long long) m_Rejected);
+            Output += CString().Format("# TYPE apostol_circuit_open gauge\n"
+                                       "apostol_circuit_open{module=\"%s\"} %llu\n",
+                                       Module.c_str(), (unsigned long long) open);
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+    }
+}
+}
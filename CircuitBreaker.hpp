@@ -0,0 +1,109 @@
+/*++
+
+Program name:
+
+  Apostol CRM
+
+Module Name:
+
+  CircuitBreaker.hpp
+
+Notices:
+
+  Module: Upstream circuit breaker
+
+Author:
+
+  Copyright (c) Prepodobny Alen
+
+  mailto: alienufo@inbox.ru
+  mailto: ufocomp@gmail.com
+
+--*/
+
+#ifndef APOSTOL_CIRCUIT_BREAKER_HPP
+#define APOSTOL_CIRCUIT_BREAKER_HPP
+//----------------------------------------------------------------------------------------------------------------------
+
+#include <string>
+#include <unordered_map>
+//----------------------------------------------------------------------------------------------------------------------
+
+extern "C++" {
+
+namespace Apostol {
+
+    namespace Module {
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        //-- CCircuit --------------------------------------------------------------------------------------------------
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        typedef enum circuit_state_e {
+            csClosed = 0, csOpen, csHalfOpen
+        } CCircuitState;
+        //--------------------------------------------------------------------------------------------------------------
+
+        typedef struct circuit_s {
+            CCircuitState State = csClosed;
+
+            CDateTime WindowStart = 0;
+            CDateTime OpenUntil = 0;
+
+            uint32_t Successes = 0;
+            uint32_t Failures = 0;
+
+            bool Probing = false;
+        } CCircuit;
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        //-- CCircuitBreaker -------------------------------------------------------------------------------------------
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        class CCircuitBreaker {
+        private:
+
+            bool m_Active;
+
+            CDateTime m_Window;
+            CDateTime m_OpenTime;
+
+            uint32_t m_MinRequests;
+            uint32_t m_FailureRate;
+
+            std::unordered_map<std::string, CCircuit> m_Circuits;
+
+            uint64_t m_Opened;
+            uint64_t m_Rejected;
+
+            CCircuit &Circuit(const CString &Key, CDateTime Now);
+
+            void Open(CCircuit &Circuit, CDateTime Now);
+
+        public:
+
+            CCircuitBreaker();
+
+            void Open(int Window, int MinRequests, int FailureRate, int OpenTime);
+
+            bool Active() const { return m_Active; }
+
+            bool Allow(const CString &Key);
+
+            void Success(const CString &Key);
+            void Failure(const CString &Key);
+
+            void Metrics(CString &Output, const CString &Module) const;
+
+        };
+
+    }
+}
+
+using namespace Apostol::Module;
+}
+#endif //APOSTOL_CIRCUIT_BREAKER_HPP
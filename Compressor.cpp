@@ -0,0 +1,355 @@
+/*++
+
+Program name:
+
+  Apostol CRM
+
+Module Name:
+
+  Compressor.cpp
+
+Notices:
+
+  Module: Body compression
+
+Author:
+
+  Copyright (c) Prepodobny Alen
+
+  mailto: alienufo@inbox.ru
+  mailto: ufocomp@gmail.com
+
+--*/
+
+//----------------------------------------------------------------------------------------------------------------------
+
+#include "Core.hpp"
+#include "Compressor.hpp"
+//----------------------------------------------------------------------------------------------------------------------
+
+#if (APOSTOL_USE_ZSTD)
+#include <zstd.h>
+#endif
+
+#if (APOSTOL_USE_LZ4)
+#include <lz4frame.h>
+#endif
+
+#include <chrono>
+#include <algorithm>
+#include <sys/xattr.h>
+//----------------------------------------------------------------------------------------------------------------------
+
+extern "C++" {
+
+namespace Apostol {
+
+    namespace Module {
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        //-- CCompressor -----------------------------------------------------------------------------------------------
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        CCompressor::CCompressor(): m_Active(false), m_Codec(ccNone), m_Level(0), m_Threshold(0),
+                m_Compressed(0), m_Input(0), m_Output(0), m_Time(0) {
+
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        CCompressorCodec CCompressor::StringToCodec(const CString &Value) {
+            if (Value == "zstd")
+                return ccZstd;
+            if (Value == "lz4")
+                return ccLZ4;
+            return ccNone;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        const char *CCompressor::CodecToString(CCompressorCodec Codec) {
+            switch (Codec) {
+                case ccZstd:
+                    return "zstd";
+                case ccLZ4:
+                    return "lz4";
+                default:
+                    return "";
+            }
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        bool CCompressor::Open(const CString &Codec, int Level, size_t Threshold, const CString &Types) {
+            m_Codec = StringToCodec(Codec);
+            m_Level = Level;
+            m_Threshold = Threshold;
+
+            m_Types = ParseList(Types);
+
+            switch (m_Codec) {
+#if (APOSTOL_USE_ZSTD)
+                case ccZstd:
+                    m_Active = true;
+                    break;
+#endif
+#if (APOSTOL_USE_LZ4)
+                case ccLZ4:
+                    m_Active = true;
+                    break;
+#endif
+                default:
+                    m_Active = false;
+                    break;
+            }
+
+            return m_Active;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        std::vector<std::string> CCompressor::ParseList(const CString &Value) {
+            std::vector<std::string> Result;
+
+            std::string caValue(Value.c_str());
+            std::transform(caValue.begin(), caValue.end(), caValue.begin(), ::tolower);
+
+            size_t pos = 0;
+            while (pos < caValue.size()) {
+                auto end = caValue.find(',', pos);
+                if (end == std::string::npos)
+                    end = caValue.size();
+
+                const auto first = caValue.find_first_not_of(' ', pos);
+                if (first < end) {
+                    const auto last = caValue.find_last_not_of(' ', end - 1);
+                    Result.push_back(caValue.substr(first, last - first + 1));
+                }
+
+                pos = end + 1;
+            }
+
+            return Result;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        bool CCompressor::MatchType(const std::vector<std::string> &Types, const CString &ContentType) {
+            std::string caType(ContentType.c_str());
+            std::transform(caType.begin(), caType.end(), caType.begin(), ::tolower);
+
+            const auto semicolon = caType.find(';');
+            if (semicolon != std::string::npos)
+                caType.resize(semicolon);
+
+            if (caType.find("+json") != std::string::npos || caType.find("+xml") != std::string::npos)
+                return true;
+
+            for (const auto &Type : Types) {
+                if (caType.compare(0, Type.size(), Type) == 0)
+                    return true;
+            }
+
+            return false;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        bool CCompressor::Eligible(const CString &ContentType, const CString &ContentEncoding, size_t Size) const {
+            if (!m_Active || Size < m_Threshold)
+                return false;
+
+            // Already encoded bodies (gzip, br) gain nothing from a second pass.
+            if (!ContentEncoding.IsEmpty() && ContentEncoding != "identity")
+                return false;
+
+            return MatchType(m_Types, ContentType);
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        bool CCompressor::Compress(const CString &Input, CString &Output) {
+            const auto start = std::chrono::steady_clock::now();
+
+            bool bSuccess = false;
+
+            switch (m_Codec) {
+#if (APOSTOL_USE_ZSTD)
+                case ccZstd: {
+                    std::string Buffer(ZSTD_compressBound(Input.Size()), '\0');
+                    const auto size = ZSTD_compress(&Buffer[0], Buffer.size(), Input.c_str(), Input.Size(), m_Level);
+                    if (!ZSTD_isError(size)) {
+                        Output.Clear();
+                        Output.Append(Buffer.data(), size);
+                        bSuccess = true;
+                    }
+                    break;
+                }
+#endif
+#if (APOSTOL_USE_LZ4)
+                case ccLZ4: {
+                    LZ4F_preferences_t Preferences = {};
+                    Preferences.frameInfo.contentSize = Input.Size();
+                    Preferences.compressionLevel = m_Level;
+
+                    std::string Buffer(LZ4F_compressFrameBound(Input.Size(), &Preferences), '\0');
+                    const auto size = LZ4F_compressFrame(&Buffer[0], Buffer.size(), Input.c_str(), Input.Size(), &Preferences);
+                    if (!LZ4F_isError(size)) {
+                        Output.Clear();
+                        Output.Append(Buffer.data(), size);
+                        bSuccess = true;
+                    }
+                    break;
+                }
+#endif
+                default:
+                    break;
+            }
+
+            // A body that does not shrink is stored as is.
+            if (bSuccess && Output.Size() >= Input.Size())
+                bSuccess = false;
+
+            if (bSuccess) {
+                m_Compressed++;
+                m_Input += Input.Size();
+                m_Output += Output.Size();
+            }
+
+            m_Time += std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+
+            return bSuccess;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        bool CCompressor::Decompress(const CString &Encoding, const CString &Input, CString &Output) {
+            switch (StringToCodec(Encoding)) {
+#if (APOSTOL_USE_ZSTD)
+                case ccZstd: {
+                    const auto size = ZSTD_getFrameContentSize(Input.c_str(), Input.Size());
+                    if (size == ZSTD_CONTENTSIZE_ERROR || size == ZSTD_CONTENTSIZE_UNKNOWN)
+                        return false;
+
+                    std::string Buffer(size, '\0');
+                    const auto result = ZSTD_decompress(&Buffer[0], Buffer.size(), Input.c_str(), Input.Size());
+                    if (ZSTD_isError(result))
+                        return false;
+
+                    Output.Clear();
+                    Output.Append(Buffer.data(), result);
+                    return true;
+                }
+#endif
+#if (APOSTOL_USE_LZ4)
+                case ccLZ4: {
+                    LZ4F_dctx *pContext = nullptr;
+                    if (LZ4F_isError(LZ4F_createDecompressionContext(&pContext, LZ4F_VERSION)))
+                        return false;
+
+                    LZ4F_frameInfo_t Info = {};
+                    size_t consumed = Input.Size();
+
+                    auto result = LZ4F_getFrameInfo(pContext, &Info, Input.c_str(), &consumed);
+                    if (LZ4F_isError(result) || Info.contentSize == 0) {
+                        LZ4F_freeDecompressionContext(pContext);
+                        return false;
+                    }
+
+                    std::string Buffer(Info.contentSize, '\0');
+
+                    size_t written = Buffer.size();
+                    size_t read = Input.Size() - consumed;
+
+                    result = LZ4F_decompress(pContext, &Buffer[0], &written, Input.c_str() + consumed, &read, nullptr);
+                    LZ4F_freeDecompressionContext(pContext);
+
+                    if (LZ4F_isError(result) || written != Buffer.size())
+                        return false;
+
+                    Output.Clear();
+                    Output.Append(Buffer.data(), written);
+                    return true;
+                }
+#endif
+                default:
+                    return false;
+            }
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        CString CCompressor::FileEncoding(const CString &FileName) {
+            char szBuffer[32] = {0};
+            const auto size = getxattr(FileName.c_str(), COMPRESSOR_ENCODING_XATTR, szBuffer, sizeof(szBuffer) - 1);
+            if (size <= 0)
+                return {};
+            return CString(szBuffer, (size_t) size);
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        bool CCompressor::FileEncoding(const CString &FileName, const CString &Encoding) {
+            return setxattr(FileName.c_str(), COMPRESSOR_ENCODING_XATTR, Encoding.c_str(), Encoding.Size(), 0) == 0;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        double CCompressor::Quality(const CString &AcceptEncoding, const CString &Encoding) {
+            std::string caAccept(AcceptEncoding.c_str());
+            std::transform(caAccept.begin(), caAccept.end(), caAccept.begin(), ::tolower);
+
+            // Few clients decode zstd or lz4, so "*" does not stand for them: they must be named explicitly.
+            const auto bExplicit = StringToCodec(Encoding) != ccNone;
+
+            double wildcard = 0;
+
+            size_t pos = 0;
+            while (pos < caAccept.size()) {
+                auto end = caAccept.find(',', pos);
+                if (end == std::string::npos)
+                    end = caAccept.size();
+
+                auto Token = caAccept.substr(pos, end - pos);
+
+                const auto semicolon = Token.find(';');
+                const auto Params = semicolon == std::string::npos ? std::string() : Token.substr(semicolon + 1);
+
+                Token = Token.substr(0, semicolon);
+                Token.erase(0, Token.find_first_not_of(' '));
+                Token.erase(Token.find_last_not_of(' ') + 1);
+
+                const auto q = Params.find("q=");
+                const auto value = q == std::string::npos ? 1.0 : strtod(Params.c_str() + q + 2, nullptr);
+
+                if (Token == Encoding.c_str())
+                    return value;
+
+                if (Token == "*" && !bExplicit)
+                    wildcard = value;
+
+                pos = end + 1;
+            }
+
+            return wildcard;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        bool CCompressor::Accepts(const CString &AcceptEncoding, const CString &Encoding) {
+            return Quality(AcceptEncoding, Encoding) > 0;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CCompressor::Metrics(CString &Output, const CString &Module) const {
+            if (!m_Active)
+                return;
+
+            Output += CString().Format("# TYPE apostol_compress_bodies_total counter\n"
+                                       "apostol_compress_bodies_total{module=\"%s\",codec=\"%s\"} %llu\n",
+                                       Module.c_str(), Encoding(), (unsigned long long) m_Compressed.load());
+            Output += CString().Format("# TYPE apostol_compress_input_bytes_total counter\n"
+                                       "apostol_compress_input_bytes_total{module=\"%s\",codec=\"%s\"} %llu\n",
+                                       Module.c_str(), Encoding(), (unsigned long long) m_Input.load());
+            Output += CString().Format("# TYPE apostol_compress_output_bytes_total counter\n"
+                                       "apostol_compress_output_bytes_total{module=\"%s\",codec=\"%s\"} %llu\n",
+                                       Module.c_str(), Encoding(), (unsigned long long) m_Output.load());
+            Output += CString().Format("# TYPE apostol_compress_seconds_total counter\n"
+                                       "apostol_compress_seconds_total{module=\"%s\",codec=\"%s\"} %.6f\n",
+                                       Module.c_str(), Encoding(), (double) m_Time.load() / 1000000);
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+    }
+}
+}
@@ -0,0 +1,107 @@
+/*++
+
+Program name:
+
+  Apostol CRM
+
+Module Name:
+
+  Compressor.hpp
+
+Notices:
+
+  Module: Body compression
+
+Author:
+
+  Copyright (c) Prepodobny Alen
+
+  mailto: alienufo@inbox.ru
+  mailto: ufocomp@gmail.com
+
+--*/
+
+#ifndef APOSTOL_COMPRESSOR_HPP
+#define APOSTOL_COMPRESSOR_HPP
+//----------------------------------------------------------------------------------------------------------------------
+
+#include <atomic>
+#include <string>
+#include <vector>
+//----------------------------------------------------------------------------------------------------------------------
+
+#define COMPRESSOR_ENCODING_XATTR "user.apostol.encoding"
+#define COMPRESSOR_DEFAULT_TYPES "application/json, application/xml, application/javascript, text/"
+//----------------------------------------------------------------------------------------------------------------------
+
+extern "C++" {
+
+namespace Apostol {
+
+    namespace Module {
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        //-- CCompressor -----------------------------------------------------------------------------------------------
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        typedef enum compressor_codec_e {
+            ccNone = 0, ccZstd, ccLZ4
+        } CCompressorCodec;
+        //--------------------------------------------------------------------------------------------------------------
+
+        class CCompressor {
+        private:
+
+            bool m_Active;
+
+            CCompressorCodec m_Codec;
+            int m_Level;
+            size_t m_Threshold;
+
+            std::vector<std::string> m_Types;
+
+            std::atomic<uint64_t> m_Compressed;
+            std::atomic<uint64_t> m_Input;
+            std::atomic<uint64_t> m_Output;
+            std::atomic<uint64_t> m_Time;
+
+        public:
+
+            CCompressor();
+
+            bool Open(const CString &Codec, int Level, size_t Threshold, const CString &Types);
+
+            bool Active() const { return m_Active; }
+
+            const char *Encoding() const { return CodecToString(m_Codec); }
+
+            bool Eligible(const CString &ContentType, const CString &ContentEncoding, size_t Size) const;
+
+            bool Compress(const CString &Input, CString &Output);
+
+            void Metrics(CString &Output, const CString &Module) const;
+
+            static bool Decompress(const CString &Encoding, const CString &Input, CString &Output);
+
+            static CString FileEncoding(const CString &FileName);
+            static bool FileEncoding(const CString &FileName, const CString &Encoding);
+
+            static double Quality(const CString &AcceptEncoding, const CString &Encoding);
+            static bool Accepts(const CString &AcceptEncoding, const CString &Encoding);
+
+            static std::vector<std::string> ParseList(const CString &Value);
+            static bool MatchType(const std::vector<std::string> &Types, const CString &ContentType);
+
+            static CCompressorCodec StringToCodec(const CString &Value);
+            static const char *CodecToString(CCompressorCodec Codec);
+
+        };
+
+    }
+}
+
+using namespace Apostol::Module;
+}
+#endif //APOSTOL_COMPRESSOR_HPP
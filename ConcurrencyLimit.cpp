@@ -0,0 +1,142 @@
+/*++
+
+Program name:
+
+  Apostol CRM
+
+Module Name:
+
+  ConcurrencyLimit.cpp
+
+Notices:
+
+  Module: Adaptive concurrency limit
+
+Author:
+
+  Copyright (c) Prepodobny Alen
+
+  mailto: alienufo@inbox.ru
+  mailto: ufocomp@gmail.com
+
+--*/
+
+//----------------------------------------------------------------------------------------------------------------------
+
+#include "Core.hpp"
+#include "ConcurrencyLimit.hpp"
+//----------------------------------------------------------------------------------------------------------------------
+
+#include <cmath>
+#include <algorithm>
+//----------------------------------------------------------------------------------------------------------------------
+
+#define CONCURRENCY_LONG_WINDOW 600
+//----------------------------------------------------------------------------------------------------------------------
+
+extern "C++" {
+
+namespace Apostol {
+
+    namespace Module {
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        //-- CConcurrencyLimit -----------------------------------------------------------------------------------------
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        CConcurrencyLimit::CConcurrencyLimit(): m_Active(false), m_Limit(0), m_MinLimit(0), m_MaxLimit(0),
+                m_Smoothing(0.2), m_ShortRTT(0), m_LongRTT(0), m_WindowSum(0), m_WindowCount(0), m_WindowSize(0),
+                m_WindowInFlight(0), m_QueueDelay(0), m_Samples(0) {
+
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CConcurrencyLimit::Open(int MinLimit, int MaxLimit, int WindowSize, double Smoothing) {
+            m_MaxLimit = std::max(1, MaxLimit);
+            m_MinLimit = std::min<double>(std::max(1, MinLimit), m_MaxLimit);
+            m_Limit = m_MaxLimit;
+            m_WindowSize = std::max(1, WindowSize);
+            m_Smoothing = Smoothing;
+            m_Active = true;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CConcurrencyLimit::Update(double RTT, size_t InFlight) {
+            m_ShortRTT = RTT;
+
+            if (m_LongRTT == 0) {
+                m_LongRTT = RTT;
+            } else {
+                m_LongRTT += (RTT - m_LongRTT) / CONCURRENCY_LONG_WINDOW;
+            }
+
+            // Latency fell below half of the baseline: decay the baseline towards it, so a later rise is measured
+            // against the new level rather than against a stale, slower one.
+            if (m_LongRTT / m_ShortRTT > 2) {
+                m_LongRTT *= 0.95;
+            }
+
+            // Gradient2: shrink proportionally to the latency increase, always leaving room for a small queue.
+            const auto gradient = std::max(0.5, std::min(1.0, m_LongRTT / m_ShortRTT));
+            auto limit = m_Limit * gradient + std::sqrt(m_Limit);
+
+            // The limit is not raised while the load is too low to prove it.
+            if ((double) InFlight < m_Limit / 2 && limit > m_Limit) {
+                return;
+            }
+
+            limit = m_Limit * (1 - m_Smoothing) + limit * m_Smoothing;
+
+            m_Limit = std::max(m_MinLimit, std::min(m_MaxLimit, limit));
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CConcurrencyLimit::Sample(double RTT, size_t InFlight) {
+            if (!m_Active || RTT <= 0)
+                return;
+
+            m_Samples++;
+
+            m_WindowSum += RTT;
+            m_WindowInFlight = std::max(m_WindowInFlight, InFlight);
+
+            if (++m_WindowCount >= m_WindowSize) {
+                Update(m_WindowSum / (double) m_WindowCount, m_WindowInFlight);
+
+                m_WindowSum = 0;
+                m_WindowCount = 0;
+                m_WindowInFlight = 0;
+            }
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CConcurrencyLimit::Queued(double Delay) {
+            m_QueueDelay += (Delay - m_QueueDelay) * 0.1;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CConcurrencyLimit::Metrics(CString &Output, const CString &Module) const {
+            Output += CString().Format("# TYPE apostol_concurrency_limit gauge\n"
+                                       "apostol_concurrency_limit{module=\"%s\"} %d\n",
+                                       Module.c_str(), Limit());
+            Output += CString().Format("# TYPE apostol_concurrency_limit_max gauge\n"
+                                       "apostol_concurrency_limit_max{module=\"%s\"} %d\n",
+                                       Module.c_str(), (int) m_MaxLimit);
+            Output += CString().Format("# TYPE apostol_queue_delay_ms gauge\n"
+                                       "apostol_queue_delay_ms{module=\"%s\"} %.3f\n",
+                                       Module.c_str(), m_QueueDelay);
+            Output += CString().Format("# TYPE apostol_latency_ms gauge\n"
+                                       "apostol_latency_ms{module=\"%s\",window=\"short\"} %.3f\n"
+                                       "apostol_latency_ms{module=\"%s\",window=\"long\"} %.3f\n",
+                                       Module.c_str(), m_ShortRTT, Module.c_str(), m_LongRTT);
+            Output += CString().Format("# TYPE apostol_concurrency_samples_total counter\n"
+                                       "apostol_concurrency_samples_total{module=\"%s\"} %llu\n",
+                                       Module.c_str(), (unsigned long long) m_Samples);
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+    }
+}
+}
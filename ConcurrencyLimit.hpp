@@ -0,0 +1,87 @@
+/*++
+
+Program name:
+
+  Apostol CRM
+
+Module Name:
+
+  ConcurrencyLimit.hpp
+
+Notices:
+
+  Module: Adaptive concurrency limit
+
+Author:
+
+  Copyright (c) Prepodobny Alen
+
+  mailto: alienufo@inbox.ru
+  mailto: ufocomp@gmail.com
+
+--*/
+
+#ifndef APOSTOL_CONCURRENCY_LIMIT_HPP
+#define APOSTOL_CONCURRENCY_LIMIT_HPP
+//----------------------------------------------------------------------------------------------------------------------
+
+extern "C++" {
+
+namespace Apostol {
+
+    namespace Module {
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        //-- CConcurrencyLimit -----------------------------------------------------------------------------------------
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        class CConcurrencyLimit {
+        private:
+
+            bool m_Active;
+
+            double m_Limit;
+            double m_MinLimit;
+            double m_MaxLimit;
+
+            double m_Smoothing;
+
+            double m_ShortRTT;
+            double m_LongRTT;
+
+            double m_WindowSum;
+            size_t m_WindowCount;
+            size_t m_WindowSize;
+            size_t m_WindowInFlight;
+
+            double m_QueueDelay;
+
+            uint64_t m_Samples;
+
+            void Update(double RTT, size_t InFlight);
+
+        public:
+
+            CConcurrencyLimit();
+
+            void Open(int MinLimit, int MaxLimit, int WindowSize, double Smoothing);
+
+            bool Active() const { return m_Active; }
+
+            int Limit() const { return (int) m_Limit; }
+
+            void Sample(double RTT, size_t InFlight);
+            void Queued(double Delay);
+
+            void Metrics(CString &Output, const CString &Module) const;
+
+        };
+
+    }
+}
+
+using namespace Apostol::Module;
+}
+#endif //APOSTOL_CONCURRENCY_LIMIT_HPP
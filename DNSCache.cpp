@@ -0,0 +1,224 @@
+/*++
+
+Program name:
+
+  Apostol CRM
+
+Module Name:
+
+  DNSCache.cpp
+
+Notices:
+
+  Module: Asynchronous DNS cache
+
+Author:
+
+  Copyright (c) Prepodobny Alen
+
+  mailto: alienufo@inbox.ru
+  mailto: ufocomp@gmail.com
+
+--*/
+
+//----------------------------------------------------------------------------------------------------------------------
+
+#include "Core.hpp"
+#include "DNSCache.hpp"
+//----------------------------------------------------------------------------------------------------------------------
+
+#include <algorithm>
+#include <netdb.h>
+#include <arpa/inet.h>
+//----------------------------------------------------------------------------------------------------------------------
+
+extern "C++" {
+
+namespace Apostol {
+
+    namespace Module {
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        //-- CDNSCache -------------------------------------------------------------------------------------------------
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        CDNSCache::CDNSCache(CWorkerPool &Pool): m_Pool(Pool), m_Active(false), m_TTL(0), m_NegativeTTL(0),
+                m_Hits(0), m_Misses(0), m_Failures(0) {
+
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CDNSCache::Open(int TTL, int NegativeTTL) {
+            m_TTL = (CDateTime) TTL / SecsPerDay;
+            m_NegativeTTL = (CDateTime) NegativeTTL / SecsPerDay;
+            m_Active = true;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CDNSCache::Close() {
+            m_Entries.clear();
+            m_Deferred.clear();
+            m_Active = false;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        int CDNSCache::Lookup(const std::string &Host, std::vector<std::string> &Addresses) {
+            struct addrinfo hints = {};
+            struct addrinfo *pResult = nullptr;
+
+            hints.ai_family = AF_UNSPEC;
+            hints.ai_socktype = SOCK_STREAM;
+            hints.ai_flags = AI_ADDRCONFIG;
+
+            const auto error = getaddrinfo(Host.c_str(), nullptr, &hints, &pResult);
+            if (error != 0)
+                return error;
+
+            std::vector<std::string> IPv6;
+            std::vector<std::string> IPv4;
+
+            char szAddress[INET6_ADDRSTRLEN];
+
+            for (auto pInfo = pResult; pInfo != nullptr; pInfo = pInfo->ai_next) {
+                if (pInfo->ai_family == AF_INET6) {
+                    const auto pAddress = reinterpret_cast<struct sockaddr_in6 *> (pInfo->ai_addr);
+                    if (inet_ntop(AF_INET6, &pAddress->sin6_addr, szAddress, sizeof(szAddress)) != nullptr)
+                        IPv6.emplace_back(szAddress);
+                } else if (pInfo->ai_family == AF_INET) {
+                    const auto pAddress = reinterpret_cast<struct sockaddr_in *> (pInfo->ai_addr);
+                    if (inet_ntop(AF_INET, &pAddress->sin_addr, szAddress, sizeof(szAddress)) != nullptr)
+                        IPv4.emplace_back(szAddress);
+                }
+            }
+
+            freeaddrinfo(pResult);
+
+            // Happy Eyeballs (RFC 8305): interleave the families, preferred family first.
+            const auto &First = IPv6.empty() ? IPv4 : IPv6;
+            const auto &Second = IPv6.empty() ? IPv6 : IPv4;
+
+            Addresses.clear();
+
+            for (size_t i = 0; i < First.size() || i < Second.size(); ++i) {
+                if (i < First.size() && std::find(Addresses.begin(), Addresses.end(), First[i]) == Addresses.end())
+                    Addresses.push_back(First[i]);
+                if (i < Second.size() && std::find(Addresses.begin(), Addresses.end(), Second[i]) == Addresses.end())
+                    Addresses.push_back(Second[i]);
+            }
+
+            return Addresses.empty() ? EAI_NONAME : 0;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CDNSCache::Complete(const std::string &Host, int Error, std::vector<std::string> &&Addresses) {
+            auto &Entry = m_Entries[Host];
+
+            Entry.Error = Error;
+            Entry.Pending = false;
+            Entry.Addresses = std::move(Addresses);
+            Entry.Expires = Now() + (Error == 0 ? m_TTL : m_NegativeTTL);
+
+            if (Error != 0)
+                m_Failures++;
+
+            std::vector<COnDNSResolvedEvent> Waiters;
+            Waiters.swap(Entry.Waiters);
+
+            const auto Result = Entry.Addresses;
+
+            for (auto &Done : Waiters) {
+                Done(Error, Result);
+            }
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CDNSCache::Resolve(const CString &Host, COnDNSResolvedEvent &&Done) {
+            const std::string caHost(Host.c_str());
+
+            auto &Entry = m_Entries[caHost];
+
+            if (Entry.Pending) {
+                Entry.Waiters.push_back(std::move(Done));
+                return;
+            }
+
+            if (Entry.Expires != 0 && Now() < Entry.Expires) {
+                m_Hits++;
+                const auto Result = Entry.Addresses;
+                Done(Entry.Error, Result);
+                return;
+            }
+
+            m_Misses++;
+
+            Entry.Pending = true;
+            Entry.Waiters.push_back(std::move(Done));
+
+            // getaddrinfo never runs on the loop: without a pool the lookup fails, with a full one it waits for Flush().
+            if (!m_Pool.Active()) {
+                Complete(caHost, EAI_AGAIN, std::vector<std::string>());
+                return;
+            }
+
+            if (!Post(caHost)) {
+                m_Deferred.push_back(caHost);
+            }
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        bool CDNSCache::Post(const std::string &Host) {
+            const auto pResult = std::make_shared<std::vector<std::string>>();
+            const auto pError = std::make_shared<int>(0);
+
+            auto Work = [Host, pResult, pError]() {
+                *pError = Lookup(Host, *pResult);
+            };
+
+            auto Finish = [this, Host, pResult, pError]() {
+                Complete(Host, *pError, std::move(*pResult));
+            };
+
+            return m_Pool.Post(CString(Host.c_str()), std::move(Work), std::move(Finish));
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CDNSCache::Flush() {
+            size_t posted = 0;
+
+            while (posted < m_Deferred.size() && Post(m_Deferred[posted])) {
+                posted++;
+            }
+
+            m_Deferred.erase(m_Deferred.begin(), m_Deferred.begin() + (long) posted);
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CDNSCache::Expire(CDateTime Now) {
+            for (auto it = m_Entries.begin(); it != m_Entries.end(); ) {
+                if (!it->second.Pending && Now >= it->second.Expires) {
+                    it = m_Entries.erase(it);
+                } else {
+                    ++it;
+                }
+            }
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CDNSCache::Metrics(CString &Output, const CString &Module) const {
+            Output += CString().Format("# TYPE apostol_dns_cache_hits_total counter\n"
+                                       "apostol_dns_cache_hits_total{module=\"%s\"} %llu\n",
+                                       Module.c_str(), (unsigned long long) m_Hits);
+            Output += CString().Format("# TYPE apostol_dns_cache_misses_total counter\n"
+                                       "apostol_dns_cache_misses_total{module=\"%s\"} %llu\n",
+                                       Module.c_str(), (unsigned long long) m_Misses);
+            Output += CString().Format("# TYPE apostol_dns_failures_total counter\n"
+                                       "apostol_dns_failures_total{module=\"%s\"} %llu\n",
+                                       Module.c_str(), (unsigned long long) m_Failures);
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+    }
+}
+}
@@ -0,0 +1,115 @@
+/*++
+
+Program name:
+
+  Apostol CRM
+
+Module Name:
+
+  DNSCache.hpp
+
+Notices:
+
+  Module: Asynchronous DNS cache
+
+Author:
+
+  Copyright (c) Prepodobny Alen
+
+  mailto: alienufo@inbox.ru
+  mailto: ufocomp@gmail.com
+
+--*/
+
+#ifndef APOSTOL_DNS_CACHE_HPP
+#define APOSTOL_DNS_CACHE_HPP
+//----------------------------------------------------------------------------------------------------------------------
+
+#include <string>
+#include <vector>
+#include <functional>
+#include <unordered_map>
+//----------------------------------------------------------------------------------------------------------------------
+
+#ifndef APOSTOL_WORKER_POOL_HPP
+#include "WorkerPool.hpp"
+#endif
+//----------------------------------------------------------------------------------------------------------------------
+
+extern "C++" {
+
+namespace Apostol {
+
+    namespace Module {
+
+        typedef std::function<void (int Error, const std::vector<std::string> &Addresses)> COnDNSResolvedEvent;
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        //-- CDNSEntry -------------------------------------------------------------------------------------------------
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        typedef struct dns_entry_s {
+            int Error = 0;
+            bool Pending = false;
+            CDateTime Expires = 0;
+            std::vector<std::string> Addresses;
+            std::vector<COnDNSResolvedEvent> Waiters;
+        } CDNSEntry;
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        //-- CDNSCache -------------------------------------------------------------------------------------------------
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        class CDNSCache {
+        private:
+
+            CWorkerPool &m_Pool;
+
+            bool m_Active;
+
+            CDateTime m_TTL;
+            CDateTime m_NegativeTTL;
+
+            std::unordered_map<std::string, CDNSEntry> m_Entries;
+            std::vector<std::string> m_Deferred;
+
+            uint64_t m_Hits;
+            uint64_t m_Misses;
+            uint64_t m_Failures;
+
+            void Complete(const std::string &Host, int Error, std::vector<std::string> &&Addresses);
+
+            bool Post(const std::string &Host);
+
+        public:
+
+            explicit CDNSCache(CWorkerPool &Pool);
+
+            void Open(int TTL, int NegativeTTL);
+            void Close();
+
+            bool Active() const { return m_Active; }
+
+            void Resolve(const CString &Host, COnDNSResolvedEvent &&Done);
+
+            size_t Pending() const { return m_Deferred.size(); }
+            void Flush();
+
+            void Expire(CDateTime Now);
+
+            void Metrics(CString &Output, const CString &Module) const;
+
+            static int Lookup(const std::string &Host, std::vector<std::string> &Addresses);
+
+        };
+
+    }
+}
+
+using namespace Apostol::Module;
+}
+#endif //APOSTOL_DNS_CACHE_HPP
@@ -0,0 +1,115 @@
+/*++
+
+Program name:
+
+  Apostol CRM
+
+Module Name:
+
+  Deadline.cpp
+
+Notices:
+
+  Module: Request deadline
+
+Author:
+
+  Copyright (c) Prepodobny Alen
+
+  mailto: alienufo@inbox.ru
+  mailto: ufocomp@gmail.com
+
+--*/
+
+//----------------------------------------------------------------------------------------------------------------------
+
+#include "Core.hpp"
+#include "Deadline.hpp"
+//----------------------------------------------------------------------------------------------------------------------
+
+#include <chrono>
+//----------------------------------------------------------------------------------------------------------------------
+
+extern "C++" {
+
+namespace Apostol {
+
+    namespace Module {
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        //-- CDeadline -------------------------------------------------------------------------------------------------
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        CDateTime CDeadline::FromEpoch(double Milliseconds, CDateTime Now) {
+            if (Milliseconds <= 0)
+                return 0;
+
+            // Now() is local time, so the absolute deadline is applied as an offset from the current wall clock.
+            const auto current = std::chrono::duration_cast<std::chrono::milliseconds>(
+                    std::chrono::system_clock::now().time_since_epoch()).count();
+
+            return Now + (Milliseconds - (double) current) / MSecsPerDay;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        CDateTime CDeadline::FromPayload(const CPayload &Payload, CDateTime Now) {
+            const auto &caValue = Payload.String(DEADLINE_PAYLOAD_KEY);
+            if (caValue.IsEmpty())
+                return 0;
+
+            return FromEpoch(strtod(caValue.c_str(), nullptr), Now);
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        CDateTime CDeadline::FromHeaders(const CHeaders &Headers, CDateTime Now) {
+            CDateTime Result = 0;
+
+            const auto &caDeadline = Headers[DEADLINE_HEADER];
+            if (!caDeadline.IsEmpty()) {
+                Result = FromEpoch(strtod(caDeadline.c_str(), nullptr), Now);
+            }
+
+            const auto &caTimeOut = Headers[DEADLINE_TIMEOUT_HEADER];
+            if (!caTimeOut.IsEmpty()) {
+                const auto timeout = strtod(caTimeOut.c_str(), nullptr);
+                if (timeout > 0) {
+                    Result = Earliest(Result, Now + timeout / MSecsPerDay);
+                }
+            }
+
+            return Result;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        CDateTime CDeadline::Earliest(CDateTime A, CDateTime B) {
+            if (A == 0)
+                return B;
+            if (B == 0)
+                return A;
+            return A < B ? A : B;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        long CDeadline::Remaining(CDateTime Deadline, CDateTime Now) {
+            return (long) ((Deadline - Now) * MSecsPerDay);
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CDeadline::StatementTimeout(CStringList &SQL, CDateTime Deadline, CDateTime Now) {
+            if (Deadline == 0)
+                return;
+
+            // An expired deadline must not block reporting the outcome, so only a live budget is propagated.
+            const auto remaining = Remaining(Deadline, Now);
+            if (remaining <= 0)
+                return;
+
+            SQL.Insert(0, CString().Format("SELECT set_config('statement_timeout', '%ld', true);", remaining));
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+    }
+}
+}
@@ -0,0 +1,73 @@
+/*++
+
+Program name:
+
+  Apostol CRM
+
+Module Name:
+
+  Deadline.hpp
+
+Notices:
+
+  Module: Request deadline
+
+Author:
+
+  Copyright (c) Prepodobny Alen
+
+  mailto: alienufo@inbox.ru
+  mailto: ufocomp@gmail.com
+
+--*/
+
+#ifndef APOSTOL_DEADLINE_HPP
+#define APOSTOL_DEADLINE_HPP
+//----------------------------------------------------------------------------------------------------------------------
+
+#ifndef APOSTOL_PAYLOAD_HPP
+#include "Payload.hpp"
+#endif
+//----------------------------------------------------------------------------------------------------------------------
+
+#define DEADLINE_PAYLOAD_KEY "deadline"
+#define DEADLINE_HEADER "X-Request-Deadline"
+#define DEADLINE_TIMEOUT_HEADER "X-Request-Timeout"
+//----------------------------------------------------------------------------------------------------------------------
+
+extern "C++" {
+
+namespace Apostol {
+
+    namespace Module {
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        //-- CDeadline -------------------------------------------------------------------------------------------------
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        class CDeadline {
+        public:
+
+            static CDateTime FromEpoch(double Milliseconds, CDateTime Now);
+
+            static CDateTime FromPayload(const CPayload &Payload, CDateTime Now);
+            static CDateTime FromHeaders(const CHeaders &Headers, CDateTime Now);
+
+            static CDateTime Earliest(CDateTime A, CDateTime B);
+
+            static bool Expired(CDateTime Deadline, CDateTime Now) { return Deadline != 0 && Now >= Deadline; }
+            static long Remaining(CDateTime Deadline, CDateTime Now);
+
+            // For the work statements only: the write-back of an outcome must never be cancelled by the budget.
+            static void StatementTimeout(CStringList &SQL, CDateTime Deadline, CDateTime Now);
+
+        };
+
+    }
+}
+
+using namespace Apostol::Module;
+}
+#endif //APOSTOL_DEADLINE_HPP
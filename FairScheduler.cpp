@@ -0,0 +1,248 @@
+/*++
+
+Program name:
+
+  Apostol CRM
+
+Module Name:
+
+  FairScheduler.cpp
+
+Notices:
+
+  Module: Weighted fair queue scheduler
+
+Author:
+
+  Copyright (c) Prepodobny Alen
+
+  mailto: alienufo@inbox.ru
+  mailto: ufocomp@gmail.com
+
+--*/
+
+//----------------------------------------------------------------------------------------------------------------------
+
+#include "Core.hpp"
+#include "FairScheduler.hpp"
+//----------------------------------------------------------------------------------------------------------------------
+
+#define FAIR_DEFAULT_CLASS "default"
+#define FAIR_OTHER_CLASS "other"
+//----------------------------------------------------------------------------------------------------------------------
+
+extern "C++" {
+
+namespace Apostol {
+
+    namespace Module {
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        //-- CFairScheduler --------------------------------------------------------------------------------------------
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        CFairScheduler::CFairScheduler(): m_Active(false), m_ClassLimit(0), m_Next(0) {
+
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CFairScheduler::Open(const CString &Key, const CString &Weights, int ClassLimit) {
+            m_Key = Key;
+            m_ClassLimit = ClassLimit > 0 ? ClassLimit : 0;
+
+            m_Weights.clear();
+
+            // "name:weight,name:weight"
+            const std::string caWeights(Weights.c_str());
+
+            size_t pos = 0;
+            while (pos < caWeights.size()) {
+                auto end = caWeights.find(',', pos);
+                if (end == std::string::npos)
+                    end = caWeights.size();
+
+                const auto Pair = caWeights.substr(pos, end - pos);
+                const auto delimiter = Pair.find(':');
+
+                if (delimiter != std::string::npos) {
+                    const auto weight = strtod(Pair.c_str() + delimiter + 1, nullptr);
+                    if (weight > 0)
+                        m_Weights[Pair.substr(0, delimiter)] = weight;
+                }
+
+                pos = end + 1;
+            }
+
+            m_Active = !m_Key.IsEmpty();
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        std::string CFairScheduler::Classify(const CPayload &Payload) const {
+            const auto &caValue = Payload.String(m_Key);
+            if (!caValue.IsEmpty())
+                return caValue.c_str();
+
+            return FAIR_DEFAULT_CLASS;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        CFairClass &CFairScheduler::Class(const std::string &Name) {
+            const auto it = m_Classes.find(Name);
+            if (it != m_Classes.end())
+                return it->second;
+
+            auto &Class = m_Classes[Name];
+
+            const auto weight = m_Weights.find(Name);
+            if (weight != m_Weights.end())
+                Class.Weight = weight->second;
+
+            m_Order.push_back(Name);
+
+            return Class;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CFairScheduler::Finished(CQueueHandler *AHandler) {
+            const auto it = m_Running.find(AHandler);
+            if (it == m_Running.end())
+                return;
+
+            const auto Class = m_Classes.find(it->second);
+            if (Class != m_Classes.end() && Class->second.Running > 0)
+                Class->second.Running--;
+
+            m_Running.erase(it);
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CFairScheduler::Schedule(const CFairQueue &Waiting, const COnFairDispatchEvent &Dispatch) {
+            std::unordered_map<std::string, std::deque<CQueueHandler *>> Groups;
+
+            for (const auto &Item : Waiting) {
+                // A handler that is back in the queue (e.g. waiting for a retry) no longer holds its class slot.
+                Finished(Item.second);
+                Groups[Item.first].push_back(Item.second);
+            }
+
+            for (auto &it : m_Classes) {
+                it.second.Waiting = 0;
+            }
+
+            for (const auto &it : Groups) {
+                Class(it.first).Waiting = it.second.size();
+            }
+
+            // Forget idle classes so per-session keys do not accumulate.
+            for (size_t i = 0; i < m_Order.size(); ) {
+                const auto it = m_Classes.find(m_Order[i]);
+                if (it != m_Classes.end() && it->second.Waiting == 0 && it->second.Running == 0) {
+                    m_Classes.erase(it);
+                    m_Order.erase(m_Order.begin() + i);
+                } else {
+                    ++i;
+                }
+            }
+
+            if (m_Order.empty())
+                return;
+
+            m_Next %= m_Order.size();
+
+            // Weights are scaled so that the lightest waiting class earns a whole credit per round: a round without
+            // a dispatch would otherwise end the loop with work still queued.
+            double scale = 1;
+            for (const auto &it : Groups) {
+                const auto weight = m_Classes[it.first].Weight;
+                if (weight * scale < 1)
+                    scale = 1 / weight;
+            }
+
+            // Deficit round robin: each visit credits the class with its weight, one dispatch costs one credit.
+            bool progress = true;
+            while (progress) {
+                progress = false;
+
+                for (size_t n = 0; n < m_Order.size(); ++n) {
+                    const auto index = (m_Next + n) % m_Order.size();
+                    const auto &Name = m_Order[index];
+
+                    auto group = Groups.find(Name);
+                    if (group == Groups.end() || group->second.empty())
+                        continue;
+
+                    auto &Class = m_Classes[Name];
+
+                    if (m_ClassLimit != 0 && Class.Running >= m_ClassLimit)
+                        continue;
+
+                    Class.Deficit += Class.Weight * scale;
+
+                    while (Class.Deficit >= 1 && !group->second.empty() && (m_ClassLimit == 0 || Class.Running < m_ClassLimit)) {
+                        const auto pHandler = group->second.front();
+                        group->second.pop_front();
+
+                        Class.Deficit -= 1;
+                        Class.Running++;
+                        Class.Waiting--;
+
+                        m_Running[pHandler] = Name;
+
+                        progress = true;
+
+                        if (!Dispatch(pHandler)) {
+                            m_Next = (index + 1) % m_Order.size();
+                            return;
+                        }
+                    }
+
+                    if (group->second.empty())
+                        Class.Deficit = 0;
+                }
+            }
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CFairScheduler::Metrics(CString &Output, const CString &Module) const {
+            if (!m_Active)
+                return;
+
+            // Class names come from the payload (sessions, tenants): only the configured ones become label values,
+            // everything else is summed up under one class.
+            std::unordered_map<std::string, std::pair<size_t, size_t>> Totals;
+
+            for (const auto &it : m_Weights) {
+                Totals[it.first];
+            }
+
+            auto &Other = Totals[FAIR_OTHER_CLASS];
+
+            for (const auto &it : m_Classes) {
+                auto &Total = m_Weights.find(it.first) != m_Weights.end() ? Totals[it.first] : Other;
+                Total.first += it.second.Waiting;
+                Total.second += it.second.Running;
+            }
+
+            Output += "# TYPE apostol_fair_queue_depth gauge\n";
+            for (const auto &it : Totals) {
+                Output += CString().Format("apostol_fair_queue_depth{module=\"%s\",class=\"%s\"} %llu\n",
+                                           Module.c_str(), it.first.c_str(), (unsigned long long) it.second.first);
+            }
+
+            Output += "# TYPE apostol_fair_running gauge\n";
+            for (const auto &it : Totals) {
+                Output += CString().Format("apostol_fair_running{module=\"%s\",class=\"%s\"} %llu\n",
+                                           Module.c_str(), it.first.c_str(), (unsigned long long) it.second.second);
+            }
+
+            Output += CString().Format("# TYPE apostol_fair_classes gauge\n"
+                                       "apostol_fair_classes{module=\"%s\"} %llu\n",
+                                       Module.c_str(), (unsigned long long) m_Classes.size());
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+    }
+}
+}
@@ -0,0 +1,109 @@
+/*++
+
+Program name:
+
+  Apostol CRM
+
+Module Name:
+
+  FairScheduler.hpp
+
+Notices:
+
+  Module: Weighted fair queue scheduler
+
+Author:
+
+  Copyright (c) Prepodobny Alen
+
+  mailto: alienufo@inbox.ru
+  mailto: ufocomp@gmail.com
+
+--*/
+
+#ifndef APOSTOL_FAIR_SCHEDULER_HPP
+#define APOSTOL_FAIR_SCHEDULER_HPP
+//----------------------------------------------------------------------------------------------------------------------
+
+#include <deque>
+#include <string>
+#include <vector>
+#include <functional>
+#include <unordered_map>
+//----------------------------------------------------------------------------------------------------------------------
+
+#ifndef APOSTOL_PAYLOAD_HPP
+#include "Payload.hpp"
+#endif
+//----------------------------------------------------------------------------------------------------------------------
+
+extern "C++" {
+
+namespace Apostol {
+
+    namespace Module {
+
+        typedef std::function<bool (CQueueHandler *AHandler)> COnFairDispatchEvent;
+
+        typedef std::vector<std::pair<std::string, CQueueHandler *>> CFairQueue;
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        //-- CFairClass ------------------------------------------------------------------------------------------------
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        typedef struct fair_class_s {
+            double Weight = 1;
+            double Deficit = 0;
+            size_t Running = 0;
+            size_t Waiting = 0;
+        } CFairClass;
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        //-- CFairScheduler --------------------------------------------------------------------------------------------
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        class CFairScheduler {
+        private:
+
+            bool m_Active;
+
+            CString m_Key;
+            size_t m_ClassLimit;
+
+            std::unordered_map<std::string, double> m_Weights;
+            std::unordered_map<std::string, CFairClass> m_Classes;
+            std::unordered_map<CQueueHandler *, std::string> m_Running;
+
+            std::vector<std::string> m_Order;
+            size_t m_Next;
+
+            CFairClass &Class(const std::string &Name);
+
+        public:
+
+            CFairScheduler();
+
+            void Open(const CString &Key, const CString &Weights, int ClassLimit);
+
+            bool Active() const { return m_Active; }
+
+            std::string Classify(const CPayload &Payload) const;
+
+            void Schedule(const CFairQueue &Waiting, const COnFairDispatchEvent &Dispatch);
+
+            void Finished(CQueueHandler *AHandler);
+
+            void Metrics(CString &Output, const CString &Module) const;
+
+        };
+
+    }
+}
+
+using namespace Apostol::Module;
+}
+#endif //APOSTOL_FAIR_SCHEDULER_HPP
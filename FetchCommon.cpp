@@ -27,7 +27,12 @@ Author:
 #include "FetchCommon.hpp"
 //----------------------------------------------------------------------------------------------------------------------
 
+#include <algorithm>
+#include <thread>
+//----------------------------------------------------------------------------------------------------------------------
+
 #define FETCH_TIMEOUT_INTERVAL 60000
+#define FETCH_IO_INTERVAL 5
 //----------------------------------------------------------------------------------------------------------------------
 
 extern "C++" {
@@ -49,6 +54,22 @@ namespace Apostol {
             m_TimeOutInterval = FETCH_TIMEOUT_INTERVAL;
 
             m_RequestId = RequestId;
+
+            m_Created = Now();
+            m_Started = 0;
+            m_Deadline = 0;
+
+            m_Requested = 0;
+
+            m_Journaled = false;
+            m_Placed = false;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        CObjectPool &CFetchHandler::Pool() {
+            // Never destroyed: handlers can still be released while static objects are torn down at exit.
+            static auto pPool = new CObjectPool(sizeof(CFetchHandler));
+            return *pPool;
         }
 
         //--------------------------------------------------------------------------------------------------------------
@@ -58,12 +79,195 @@ namespace Apostol {
         //--------------------------------------------------------------------------------------------------------------
 
         CFetchCommon::CFetchCommon(CModuleProcess *AProcess, const CString &ModuleName, const CString &SectionName):
-                CQueueCollection(Config()->PostgresPollMax()), CApostolModule(AProcess, ModuleName, SectionName) {
+                CQueueCollection(Config()->PostgresPollMax()), CApostolModule(AProcess, ModuleName, SectionName), m_HTTPCache(m_IO),
+                m_Latency({lsQueue, lsUpstream, lsWriteBack}) {
 
             m_Headers.Add("Authorization");
 
             m_Progress = 0;
             m_TimeOut = 0;
+
+            m_MaxDepth = 0;
+            m_MaxAge = 0;
+
+            m_Shed = 0;
+            m_Expired = 0;
+
+            m_Holds = 0;
+            m_Reload = false;
+
+            m_Coalesce = false;
+            m_Coalesced = 0;
+
+            m_StreamBatchSize = 64 * 1024;
+            m_StreamBatchDelay = 0;
+            m_StreamBuffered = 0;
+            m_StreamFlushing = false;
+            m_StreamFlushes = 0;
+
+            m_pTimer = nullptr;
+            m_TimerActive = false;
+
+            m_Parked = 0;
+
+            CFetchHandler::Pool().Claim(ModuleName);
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CFetchCommon::Initialization(CModuleProcess *AProcess) {
+            m_MaxDepth = Config()->IniFile().ReadInteger(SectionName().c_str(), "queue_max_depth", 0);
+            m_MaxAge = (CDateTime) Config()->IniFile().ReadInteger(SectionName().c_str(), "queue_max_age", 0) / SecsPerDay;
+
+            m_Coalesce = Config()->IniFile().ReadBool(SectionName().c_str(), "coalesce", false);
+            m_CoalesceMethods = "," + std::string(Config()->IniFile().ReadString(SectionName().c_str(), "coalesce_methods", "GET,HEAD").c_str()) + ",";
+            std::transform(m_CoalesceMethods.begin(), m_CoalesceMethods.end(), m_CoalesceMethods.begin(), ::toupper);
+
+            // SQL readers of http.response cannot decode zstd or lz4, so the body goes encoded only to consumers that
+            // asked for it; column compression (ALTER TABLE ... SET COMPRESSION lz4) is the transparent alternative.
+            const auto &caCompression = Config()->IniFile().ReadString(SectionName().c_str(), "compression", "");
+            if (!caCompression.IsEmpty()) {
+                if (!Config()->IniFile().ReadBool(SectionName().c_str(), "compression_encoded", false)) {
+                    Log()->Notice("[%s] Compression \"%s\" is ignored without compression_encoded: SQL readers would get encoded bodies.",
+                                  ModuleName().c_str(), caCompression.c_str());
+                } else if (!m_Compressor.Open(caCompression,
+                                              Config()->IniFile().ReadInteger(SectionName().c_str(), "compression_level", 3),
+                                              Config()->IniFile().ReadInteger(SectionName().c_str(), "compression_threshold", 4096),
+                                              Config()->IniFile().ReadString(SectionName().c_str(), "compression_types", COMPRESSOR_DEFAULT_TYPES))) {
+                    Log()->Notice("[%s] Compression codec \"%s\" is not available, bodies are stored as is.", ModuleName().c_str(), caCompression.c_str());
+                }
+            }
+
+            m_StreamBatchSize = Config()->IniFile().ReadInteger(SectionName().c_str(), "stream_batch_size", 64 * 1024);
+            m_StreamBatchDelay = (CDateTime) Config()->IniFile().ReadInteger(SectionName().c_str(), "stream_batch_delay", 200) / MSecsPerDay;
+
+            if (Config()->IniFile().ReadBool(SectionName().c_str(), "http_cache", false)) {
+                CString Path(Config()->IniFile().ReadString(SectionName().c_str(), "http_cache_path", ""));
+
+                if (!Path.IsEmpty() && !path_separator(Path.front())) {
+                    Path = Config()->Prefix() + Path;
+                }
+
+                // The disk tier is read and written on its own threads, never on the event loop.
+                if (!Path.IsEmpty()) {
+                    const auto ioThreads = Config()->IniFile().ReadInteger(SectionName().c_str(), "http_cache_io_threads", 2);
+
+                    if (ioThreads > 0) {
+                        m_IO.Start(ioThreads, Config()->IniFile().ReadInteger(SectionName().c_str(), "http_cache_io_queue", 1024));
+
+                        m_pTimer = CEPollTimer::CreateTimer(CLOCK_MONOTONIC, TFD_NONBLOCK);
+                        m_pTimer->AllocateTimer(Server().EventHandlers(), 0, 0);
+#if defined(_GLIBCXX_RELEASE) && (_GLIBCXX_RELEASE >= 9)
+                        m_pTimer->OnTimer([this](auto &&AHandler) { DoTimer(AHandler); });
+#else
+                        m_pTimer->OnTimer(std::bind(&CFetchCommon::DoTimer, this, _1));
+#endif
+                    }
+                }
+
+                m_HTTPCache.Open((size_t) Config()->IniFile().ReadInteger(SectionName().c_str(), "http_cache_memory", 64) * 1024 * 1024,
+                                 (size_t) Config()->IniFile().ReadInteger(SectionName().c_str(), "http_cache_max_entry", 1024) * 1024,
+                                 Path,
+                                 (size_t) Config()->IniFile().ReadInteger(SectionName().c_str(), "http_cache_disk", 1024) * 1024 * 1024);
+
+                UpdateTimer();
+            }
+
+            m_Scheduler.Open(Config()->IniFile().ReadString(SectionName().c_str(), "fair_key", ""),
+                             Config()->IniFile().ReadString(SectionName().c_str(), "fair_weights", ""),
+                             Config()->IniFile().ReadInteger(SectionName().c_str(), "fair_class_max", 0));
+
+            if (Config()->IniFile().ReadBool(SectionName().c_str(), "adaptive_limit", false)) {
+                m_Limit.Open(Config()->IniFile().ReadInteger(SectionName().c_str(), "adaptive_min_limit", 2),
+                             Config()->PostgresPollMax(),
+                             Config()->IniFile().ReadInteger(SectionName().c_str(), "adaptive_window", 20),
+                             Config()->IniFile().ReadInteger(SectionName().c_str(), "adaptive_smoothing", 20) / 100.0);
+            }
+
+            if (Config()->IniFile().ReadBool(SectionName().c_str(), "journal", false)) {
+                if (!CanRecover()) {
+                    Log()->Warning("[%s] Queue journal is disabled: the module does not implement DoRecover.", ModuleName().c_str());
+                } else {
+                    CString FileName(Config()->IniFile().ReadString(SectionName().c_str(), "journal_file", ""));
+                    const auto bSlots = FileName.IsEmpty();
+
+                    if (bSlots) {
+                        FileName.Format("journal/%s", ModuleName().c_str());
+                    }
+
+                    if (!path_separator(FileName.front())) {
+                        FileName = Config()->Prefix() + FileName;
+                    }
+
+                    ForceDirectories(FileName.substr(0, FileName.rfind('/') + 1).c_str(), 0755);
+
+                    const auto size = (size_t) Config()->IniFile().ReadInteger(SectionName().c_str(), "journal_size", 64) * 1024 * 1024;
+                    const auto slots = Config()->IniFile().ReadInteger(SectionName().c_str(), "journal_slots", std::max(1, (int) std::thread::hardware_concurrency()));
+
+                    // Without an explicit file every worker gets its own journal slot.
+                    const auto bOpened = bSlots ? m_Journal.Acquire(FileName, slots, size) : m_Journal.Open(FileName, size);
+
+                    if (bOpened) {
+                        Log()->Notice("[%s] Queue journal: %s", ModuleName().c_str(), m_Journal.FileName().c_str());
+                    } else if (errno == EWOULDBLOCK) {
+                        Log()->Error(APP_LOG_ERR, 0, "[%s] Queue journal is disabled: every journal file is locked by another worker (%s).", ModuleName().c_str(), FileName.c_str());
+                    } else {
+                        Log()->Error(APP_LOG_ERR, errno, "[%s] Could not open queue journal: %s", ModuleName().c_str(), FileName.c_str());
+                    }
+
+                    m_JournalCheck = Config()->IniFile().ReadString(SectionName().c_str(), "journal_check", "");
+                }
+            }
+
+            if (Config()->IniFile().ReadBool(SectionName().c_str(), "shard", false)) {
+                if (!CanRecover()) {
+                    // A peer could never turn a forwarded entry back into a handler.
+                    Log()->Warning("[%s] Shard queue is disabled: the module does not implement DoRecover.", ModuleName().c_str());
+                } else {
+                    // Sibling workers share the master's pid, so they meet in the same segment.
+                    const auto &caName = CString().Format("/apostol.%s.%d", ModuleName().c_str(), (int) getppid());
+
+                    if (!m_Shard.Open(caName,
+                                      Config()->IniFile().ReadInteger(SectionName().c_str(), "shard_workers", std::max(1, (int) std::thread::hardware_concurrency())),
+                                      Config()->IniFile().ReadInteger(SectionName().c_str(), "shard_ring", 256),
+                                      Config()->IniFile().ReadInteger(SectionName().c_str(), "shard_entry_size", 4) * 1024)) {
+                        Log()->Error(APP_LOG_ERR, errno, "[%s] Could not open shard queue: %s", ModuleName().c_str(), caName.c_str());
+                    }
+                }
+            }
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        CFetchCommon::~CFetchCommon() {
+            m_Shard.Close();
+            m_Journal.Close();
+            m_IO.Stop();
+            delete m_pTimer;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CFetchCommon::UpdateTimer() {
+            const auto active = m_IO.Pending() != 0;
+
+            if (m_pTimer != nullptr && m_TimerActive != active) {
+                m_TimerActive = active;
+                m_pTimer->SetTimer(active ? FETCH_IO_INTERVAL : 0, active ? FETCH_IO_INTERVAL : 0);
+            }
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CFetchCommon::DoTimer(CPollEventHandler *AHandler) {
+            uint64_t exp;
+
+            auto pTimer = dynamic_cast<CEPollTimer *> (AHandler->Binding());
+            pTimer->Read(&exp, sizeof(uint64_t));
+
+            try {
+                m_IO.Dispatch();
+            } catch (Delphi::Exception::Exception &E) {
+                DoError(E);
+            }
+
+            UpdateTimer();
         }
         //--------------------------------------------------------------------------------------------------------------
 
@@ -160,6 +364,36 @@ namespace Apostol {
         void CFetchCommon::DeleteHandler(CQueueHandler *AHandler) {
             const auto pHandler = dynamic_cast<CFetchHandler *> (AHandler);
             if (Assigned(pHandler)) {
+                if (m_Limit.Active() && pHandler->Started() != 0) {
+                    m_Limit.Sample((Now() - pHandler->Started()) * MSecsPerDay, m_Progress);
+                    m_MaxQueue = m_Limit.Limit();
+                }
+
+                m_Scheduler.Finished(AHandler);
+
+                if (pHandler->Journaled()) {
+                    m_Journal.Removed(pHandler->RequestId());
+                }
+
+                if (pHandler->Forwarded()) {
+                    m_Parked--;
+                }
+
+                m_Lookups.erase(AHandler);
+                m_Loading.erase(AHandler);
+                m_StreamWaiting.erase(AHandler);
+
+                const auto stream = m_Streams.find(AHandler);
+                if (stream != m_Streams.end()) {
+                    m_StreamBuffered -= stream->second.Data.Size();
+                    m_Streams.erase(stream);
+                }
+
+                // A leader that goes away without a reply hands its followers back to the queue.
+                for (auto pFollower : Release(AHandler)) {
+                    pFollower->Allow(true);
+                }
+
                 CQueueCollection::DeleteHandler(AHandler);
             }
         }
@@ -268,7 +502,55 @@ namespace Apostol {
 
         void CFetchCommon::DoDone(CFetchHandler *AHandler, const CHTTPReply &Reply) {
 
-            auto OnExecuted = [this](CPQPollQuery *APollQuery) {
+            // Only requests that went upstream are stamped; cache refreshes and stream waits come back here a second time.
+            if (AHandler->Requested() != 0) {
+                m_Latency.Record(lsUpstream, CLatencyHistogram::Clock() - AHandler->Requested());
+                AHandler->Requested() = 0;
+            }
+
+            const auto lookup = m_Lookups.find(AHandler);
+            if (lookup != m_Lookups.end()) {
+                const auto caKey = lookup->second;
+                const auto now = time(nullptr);
+
+                m_Lookups.erase(lookup);
+
+                if (Reply.Status == CHTTPReply::not_modified) {
+                    const auto pEntry = m_HTTPCache.Refresh(caKey, Reply, now);
+
+                    UpdateTimer();
+
+                    if (pEntry != nullptr) {
+                        CHTTPReply Cached;
+                        CHTTPCache::ToReply(*pEntry, now, Cached);
+                        DoDone(AHandler, Cached);
+                        return;
+                    }
+
+                    // The 304 answers our validators, not the caller: without the stored body it must not be passed on.
+                    Revalidate(AHandler);
+                    return;
+                }
+
+                // The stored entry was stale and the origin sent a new body.
+                if (AHandler->Conditional().Count() != 0) {
+                    AHandler->Conditional().Clear();
+                    m_HTTPCache.Miss();
+                }
+
+                m_HTTPCache.Store(caKey, RequestHeaders(AHandler->Payload()), Reply, now);
+
+                UpdateTimer();
+            }
+
+            if (StreamPending(AHandler)) {
+                const auto pReply = std::make_shared<CHTTPReply>(Reply);
+                m_StreamWaiting.emplace(AHandler, [this, AHandler, pReply]() { DoDone(AHandler, *pReply); });
+                return;
+            }
+
+            auto OnExecuted = [this, start = CLatencyHistogram::Clock()](CPQPollQuery *APollQuery) {
+                m_Latency.Record(lsWriteBack, CLatencyHistogram::Clock() - start);
                 const auto pHandler = dynamic_cast<CFetchHandler *> (APollQuery->Binding());
                 DeleteHandler(pHandler);
             };
@@ -281,11 +563,24 @@ namespace Apostol {
 
             const auto &caPayload = AHandler->Payload();
 
-            const auto &caHeaders = PQQuoteLiteral(HeadersToJson(Reply.Headers).ToString());
-            const auto &caContent = PQQuoteLiteral(base64_encode(Reply.Content));
+            CString Compressed;
+
+            const auto bCompressed = m_Compressor.Eligible(Reply.Headers["Content-Type"], Reply.Headers["Content-Encoding"], Reply.Content.Size()) &&
+                                     m_Compressor.Compress(Reply.Content, Compressed);
+
+            // Serialised straight into the buffer: no CJSON tree and no copy of the reply headers.
+            CString Headers;
+            if (bCompressed) {
+                CJSONWriter::Headers(EncodedHeaders(Reply.Headers, Compressed.Size(), Reply.Content.Size()), Headers);
+            } else {
+                CJSONWriter::Headers(Reply.Headers, Headers);
+            }
+
+            const auto &caHeaders = PQQuoteLiteral(Headers);
+            const auto &caContent = PQQuoteLiteral(base64_encode(bCompressed ? Compressed : Reply.Content));
 
-            const auto &caRequest = caPayload["id"].AsString();
-            const auto &caDone = caPayload["done"];
+            const auto &caRequest = caPayload.String("id");
+            const auto &caDone = caPayload.String("done");
 
             CStringList SQL;
 
@@ -299,21 +594,39 @@ namespace Apostol {
                                     caContent.c_str()
                             ));
 
-            if (!caDone.IsNull()) {
-                SQL.Add(CString().Format("SELECT %s(%s::uuid);", caDone.AsString().c_str(), PQQuoteLiteral(caRequest).c_str()));
+            if (!caDone.IsEmpty()) {
+                SQL.Add(CString().Format("SELECT %s(%s::uuid);", caDone.c_str(), PQQuoteLiteral(caRequest).c_str()));
             }
 
+            TakeStream(SQL, AHandler);
+
+            const auto &Followers = Release(AHandler);
+
+            Hold();
+
             try {
                 ExecSQL(SQL, AHandler, OnExecuted, OnException);
             } catch (Delphi::Exception::Exception &E) {
                 DeleteHandler(AHandler);
                 DoError(E);
             }
+
+            for (auto pFollower : Followers) {
+                DoDone(pFollower, Reply);
+            }
+
+            Resume();
         }
         //--------------------------------------------------------------------------------------------------------------
 
         void CFetchCommon::DoFail(CFetchHandler *AHandler, const CString &Message) {
 
+            if (StreamPending(AHandler)) {
+                const CString caMessage(Message);
+                m_StreamWaiting.emplace(AHandler, [this, AHandler, caMessage]() { DoFail(AHandler, caMessage); });
+                return;
+            }
+
             auto OnExecuted = [this](CPQPollQuery *APollQuery) {
                 const auto pHandler = dynamic_cast<CFetchHandler *> (APollQuery->Binding());
                 DeleteHandler(pHandler);
@@ -326,8 +639,8 @@ namespace Apostol {
             };
 
             const auto &caPayload = AHandler->Payload();
-            const auto &caRequest = caPayload["id"].AsString();
-            const auto &caFail = caPayload["fail"];
+            const auto &caRequest = caPayload.String("id");
+            const auto &caFail = caPayload.String("fail");
 
             CStringList SQL;
 
@@ -338,21 +651,266 @@ namespace Apostol {
                                     PQQuoteLiteral(Message).c_str()
                             ));
 
-            if (!caFail.IsNull()) {
-                SQL.Add(CString().Format("SELECT %s(%s::uuid);", caFail.AsString().c_str(), PQQuoteLiteral(caRequest).c_str()));
+            if (!caFail.IsEmpty()) {
+                SQL.Add(CString().Format("SELECT %s(%s::uuid);", caFail.c_str(), PQQuoteLiteral(caRequest).c_str()));
             }
 
+            TakeStream(SQL, AHandler);
+
+            const auto &Followers = Release(AHandler);
+
+            Hold();
+
             try {
                 ExecSQL(SQL, AHandler, OnExecuted, OnException);
             } catch (Delphi::Exception::Exception &E) {
                 DeleteHandler(AHandler);
                 DoError(E);
             }
+
+            for (auto pFollower : Followers) {
+                DoFail(pFollower, Message);
+            }
+
+            Resume();
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        CString CFetchCommon::StreamStatement(const CFetchStream &Stream) {
+            return CString()
+                    .MaxFormatSize(256 + Stream.Request.Size() + Stream.Data.Size())
+                    .Format("SELECT %s(%s::uuid, %s);",
+                            Stream.Callback.c_str(),
+                            PQQuoteLiteral(Stream.Request).c_str(),
+                            PQQuoteLiteral(Stream.Data).c_str()
+                    );
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CFetchCommon::TakeStream(CStringList &SQL, CQueueHandler *AHandler) {
+            const auto it = m_Streams.find(AHandler);
+            if (it == m_Streams.end())
+                return;
+
+            // The remaining chunks go in front of the final statements, so they are stored before the response.
+            SQL.Insert(0, StreamStatement(it->second));
+
+            m_StreamBuffered -= it->second.Data.Size();
+            m_Streams.erase(it);
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        bool CFetchCommon::StreamPending(CQueueHandler *AHandler) const {
+            // Chunks of this handler are still being written, the final statements must not overtake them.
+            return m_StreamInFlight.find(AHandler) != m_StreamInFlight.end();
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CFetchCommon::FlushStreams(bool Force) {
+            if (m_Streams.empty() || m_StreamFlushing)
+                return;
+
+            if (!Force && m_StreamBuffered < m_StreamBatchSize) {
+                const auto now = Now();
+
+                bool expired = false;
+                for (const auto &it : m_Streams) {
+                    if (now - it.second.First >= m_StreamBatchDelay) {
+                        expired = true;
+                        break;
+                    }
+                }
+
+                if (!expired)
+                    return;
+            }
+
+            auto OnFlushed = [this]() {
+                m_StreamFlushing = false;
+                m_StreamInFlight.clear();
+
+                std::map<CQueueHandler *, std::function<void ()>> Waiting;
+                Waiting.swap(m_StreamWaiting);
+
+                // A finished handler must not unload the queue while the rest of the map is still to be called.
+                Hold();
+                for (auto &it : Waiting) {
+                    it.second();
+                }
+                Resume();
+
+                FlushStreams(false);
+            };
+
+            const auto pBatch = std::make_shared<CFetchStreamBatch>();
+
+            auto OnExecuted = [OnFlushed](CPQPollQuery *APollQuery) {
+                OnFlushed();
+            };
+
+            auto OnException = [this, pBatch, OnFlushed](CPQPollQuery *APollQuery, const Delphi::Exception::Exception &E) {
+                DoError(E);
+                RetryStreams(pBatch, OnFlushed);
+            };
+
+            CStringList SQL;
+
+            for (const auto &it : m_Streams) {
+                pBatch->emplace_back(it.first, StreamStatement(it.second));
+                SQL.Add(pBatch->back().second);
+                m_StreamInFlight.insert(it.first);
+            }
+
+            m_Streams.clear();
+            m_StreamBuffered = 0;
+
+            m_StreamFlushing = true;
+            m_StreamFlushes++;
+
+            try {
+                ExecSQL(SQL, nullptr, OnExecuted, OnException);
+            } catch (Delphi::Exception::Exception &E) {
+                DoError(E);
+                RetryStreams(pBatch, OnFlushed);
+            }
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CFetchCommon::RetryStreams(const std::shared_ptr<CFetchStreamBatch> &Batch, const std::function<void ()> &Done) {
+            // The batch is one transaction: a single bad chunk rolled back everyone's, so each is sent again on its own.
+            if (Batch->size() < 2) {
+                Done();
+                return;
+            }
+
+            const auto pLeft = std::make_shared<size_t>(Batch->size());
+
+            auto Finish = [pLeft, Done]() {
+                if (--*pLeft == 0)
+                    Done();
+            };
+
+            for (const auto &Item : *Batch) {
+                auto OnExecuted = [Finish](CPQPollQuery *APollQuery) {
+                    Finish();
+                };
+
+                auto OnException = [this, Finish](CPQPollQuery *APollQuery, const Delphi::Exception::Exception &E) {
+                    DoError(E);
+                    Finish();
+                };
+
+                CStringList SQL;
+                SQL.Add(Item.second);
+
+                try {
+                    ExecSQL(SQL, nullptr, OnExecuted, OnException);
+                } catch (Delphi::Exception::Exception &E) {
+                    DoError(E);
+                    Finish();
+                }
+            }
         }
         //--------------------------------------------------------------------------------------------------------------
 
         void CFetchCommon::DoStream(CFetchHandler *AHandler, const CString &Data) {
 
+            const auto &caPayload = AHandler->Payload();
+            const auto &caStream = caPayload.String("stream");
+
+            if (caStream.IsEmpty())
+                return;
+
+            auto &Stream = m_Streams[AHandler];
+
+            if (Stream.Callback.IsEmpty()) {
+                Stream.Callback = caStream;
+                Stream.Request = caPayload.String("id");
+                Stream.First = Now();
+            }
+
+            // Consecutive chunks of one handler are joined, several handlers share one round-trip.
+            Stream.Data += Data;
+            m_StreamBuffered += Data.Size();
+
+            FlushStreams(m_StreamBatchSize == 0);
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CFetchCommon::Reject(CStringList &SQL, const std::vector<CFetchHandler *> &Handlers, const CString &Message) {
+            for (auto pHandler : Handlers) {
+                const auto &caPayload = pHandler->Payload();
+                const auto &caRequest = caPayload.String("id");
+                const auto &caFail = caPayload.String("fail");
+
+                SQL.Add(CString().Format("SELECT http.fail(%s::uuid, %s);", PQQuoteLiteral(caRequest).c_str(), PQQuoteLiteral(Message).c_str()));
+
+                if (!caFail.IsEmpty()) {
+                    SQL.Add(CString().Format("SELECT %s(%s::uuid);", caFail.c_str(), PQQuoteLiteral(caRequest).c_str()));
+                }
+
+                DeleteHandler(pHandler);
+            }
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CFetchCommon::Shed(CDateTime Now) {
+            const auto index = m_Queue.IndexOf(this);
+            if (index == -1)
+                return;
+
+            Hold();
+
+            const auto pQueue = m_Queue[index];
+
+            std::vector<CFetchHandler *> Waiting;
+            std::vector<CFetchHandler *> Rejected;
+            std::vector<CFetchHandler *> Expired;
+
+            for (int i = 0; i < pQueue->Count(); ++i) {
+                const auto pHandler = static_cast<CFetchHandler *> (pQueue->Item(i));
+                if (pHandler != nullptr && pHandler->Allow()) {
+                    if (m_Shard.Active() && !pHandler->Placed()) {
+                        pHandler->Placed() = true;
+                        if (Place(pHandler)) {
+                            pHandler->Allow(false);
+                            m_Parked++;
+                            continue;
+                        }
+                    }
+
+                    // The payload is assigned after the handler is created, so the deadline is read on first sight.
+                    if (pHandler->Deadline() == 0) {
+                        pHandler->Deadline() = CDeadline::FromPayload(pHandler->Payload(), Now);
+                    }
+
+                    if (m_Journal.Active() && !pHandler->Journaled() && !pHandler->Payload().IsEmpty()) {
+                        m_Journal.Queued(pHandler->RequestId(), pHandler->Payload().Raw());
+                        pHandler->Journaled() = true;
+                    }
+
+                    if (CDeadline::Expired(pHandler->Deadline(), Now)) {
+                        Expired.push_back(pHandler);
+                    } else if (pHandler->Started() == 0) {
+                        if (m_MaxAge > 0 && Now - pHandler->Created() >= m_MaxAge) {
+                            Rejected.push_back(pHandler);
+                        } else {
+                            Waiting.push_back(pHandler);
+                        }
+                    }
+                }
+            }
+
+            // The newest arrivals are rejected first, so the work that already waited keeps its place.
+            if (m_MaxDepth > 0 && Waiting.size() > (size_t) m_MaxDepth) {
+                Rejected.insert(Rejected.end(), Waiting.begin() + m_MaxDepth, Waiting.end());
+            }
+
+            if (Rejected.empty() && Expired.empty()) {
+                Resume();
+                return;
+            }
+
             auto OnExecuted = [](CPQPollQuery *APollQuery) {
 
             };
@@ -361,63 +919,656 @@ namespace Apostol {
                 DoError(E);
             };
 
-            const auto &caPayload = AHandler->Payload();
-            const auto &caRequest = caPayload["id"].AsString();
-            const auto &caStream = caPayload["stream"];
+            CStringList SQL;
+
+            if (!Rejected.empty()) {
+                Reject(SQL, Rejected, "Service unavailable: queue is full");
+                m_Shed += Rejected.size();
+                Log()->Warning("[%s] Queue overloaded, rejected: %d", ModuleName().c_str(), (int) Rejected.size());
+            }
+
+            if (!Expired.empty()) {
+                Reject(SQL, Expired, "Deadline exceeded");
+                m_Expired += Expired.size();
+                Log()->Notice("[%s] Deadline exceeded, dropped: %d", ModuleName().c_str(), (int) Expired.size());
+            }
+
+            try {
+                ExecSQL(SQL, nullptr, OnExecuted, OnException);
+            } catch (Delphi::Exception::Exception &E) {
+                DoError(E);
+            }
+
+            Resume();
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        CHeaders CFetchCommon::EncodedHeaders(const CHeaders &Headers, size_t Size, size_t Original) const {
+            CHeaders Result;
+
+            for (int i = 0; i < Headers.Count(); i++) {
+                const auto &caHeader = Headers[i];
+                if (strcasecmp(caHeader.Name().c_str(), "Content-Length") != 0 && strcasecmp(caHeader.Name().c_str(), "Content-Encoding") != 0)
+                    Result.AddPair(caHeader.Name(), caHeader.Value());
+            }
+
+            // Readers decode the stored body by Content-Encoding, the original size is kept for preallocation.
+            Result.AddPair("Content-Encoding", m_Compressor.Encoding());
+            Result.AddPair("Content-Length", CString::ToString(Size));
+            Result.AddPair("X-Original-Content-Length", CString::ToString(Original));
+
+            return Result;
+        }
+        //--------------------------------------------------------------------------------------------------------------
 
-            if (caStream.IsNull())
+        CHeaders CFetchCommon::RequestHeaders(const CPayload &Payload) {
+            CHeaders Headers;
+
+            if (Payload.IsNull("headers"))
+                return Headers;
+
+            const auto &caHeaders = Payload.Json()["headers"];
+            if (caHeaders.IsObject()) {
+                const auto &Object = caHeaders.Object();
+                for (int i = 0; i < Object.Count(); i++) {
+                    const auto &Member = Object.Members(i);
+                    Headers.AddPair(Member.String(), Member.Value().AsString());
+                }
+            }
+
+            return Headers;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        bool CFetchCommon::Lookup(CFetchHandler *AHandler) {
+            if (m_Lookups.find(AHandler) != m_Lookups.end())
+                return false;
+
+            auto &Payload = AHandler->Payload();
+
+            if (!Payload.IsNull("stream"))
+                return false;
+
+            const auto &caMethod = Payload.String("method");
+            if (!caMethod.IsEmpty() && strcasecmp(caMethod.c_str(), "GET") != 0)
+                return false;
+
+            const auto &Headers = RequestHeaders(Payload);
+            if (!CHTTPCache::Cacheable(Headers))
+                return false;
+
+            const auto &caKey = CHTTPCache::Key("GET", Payload.String("resource"), Headers);
+            const auto now = time(nullptr);
+
+            const auto pEntry = m_HTTPCache.Find(caKey, Headers);
+
+            // Only on disk: the handler waits off the queue while the entry is read, then the lookup runs again.
+            if (pEntry == nullptr && m_HTTPCache.OnDisk(caKey)) {
+                AHandler->Allow(false);
+                m_Loading.insert(AHandler);
+
+                m_HTTPCache.Load(caKey, [this, AHandler]() {
+                    if (m_Loading.erase(AHandler) != 0) {
+                        AHandler->Allow(true);
+                        UnloadQueue();
+                    }
+                });
+
+                UpdateTimer();
+
+                return true;
+            }
+
+            if (pEntry != nullptr && pEntry->Fresh(now)) {
+                m_HTTPCache.Hit();
+
+                CHTTPReply Reply;
+                CHTTPCache::ToReply(*pEntry, now, Reply);
+
+                AHandler->Allow(false);
+                DoDone(AHandler, Reply);
+
+                return true;
+            }
+
+            auto &Conditional = AHandler->Conditional();
+
+            Conditional.Clear();
+
+            // Stale, but the origin can confirm the stored body with a 304 instead of sending it again.
+            if (pEntry != nullptr) {
+                const auto &caETag = pEntry->Headers["ETag"];
+                if (!caETag.IsEmpty())
+                    Conditional.AddPair("If-None-Match", caETag);
+
+                const auto &caModified = pEntry->Headers["Last-Modified"];
+                if (!caModified.IsEmpty())
+                    Conditional.AddPair("If-Modified-Since", caModified);
+            }
+
+            // Without validators the origin sends the body again, which is a miss; a revalidation is counted on its 304.
+            if (Conditional.Count() == 0) {
+                m_HTTPCache.Miss();
+            }
+
+            m_Lookups[AHandler] = caKey;
+
+            UpdateTimer();
+
+            return false;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CFetchCommon::Revalidate(CFetchHandler *AHandler) {
+            AHandler->Conditional().Clear();
+
+            Log()->Notice("[%s] HTTP cache: entry for %s is gone, fetching it again.", ModuleName().c_str(), AHandler->RequestId().c_str());
+
+            m_Scheduler.Finished(AHandler);
+
+            AHandler->Allow(true);
+
+            UnloadQueue();
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        CString CFetchCommon::Fingerprint(const CPayload &Payload) const {
+            // Streamed replies are delivered to a single request and cannot be shared.
+            if (!Payload.IsNull("stream"))
+                return {};
+
+            std::string Method(Payload.String("method").c_str());
+            if (Method.empty())
+                Method = "GET";
+
+            std::transform(Method.begin(), Method.end(), Method.begin(), ::toupper);
+
+            if (m_CoalesceMethods.find("," + Method + ",") == std::string::npos)
+                return {};
+
+            // The payload comes from jsonb, so the raw headers text already has a canonical key order.
+            CString Request;
+
+            Request = Method.c_str();
+            Request += '\n';
+            Request += Payload.String("type");
+            Request += '\n';
+            Request += Payload.String("resource");
+            Request += '\n';
+            Request += Payload.Text("headers");
+            Request += '\n';
+            Request += Payload.String("content");
+
+            return SHA256(Request, true);
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        bool CFetchCommon::Coalesce(CFetchHandler *AHandler) {
+            const auto member = m_Members.find(AHandler);
+            if (member != m_Members.end())
+                return m_Groups[member->second].Leader != AHandler;
+
+            const std::string caFingerprint(Fingerprint(AHandler->Payload()).c_str());
+            if (caFingerprint.empty())
+                return false;
+
+            auto &Group = m_Groups[caFingerprint];
+            m_Members[AHandler] = caFingerprint;
+
+            if (Group.Leader == nullptr) {
+                Group.Leader = AHandler;
+                return false;
+            }
+
+            Group.Followers.push_back(AHandler);
+            AHandler->Allow(false);
+
+            m_Coalesced++;
+
+            return true;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        std::vector<CFetchHandler *> CFetchCommon::Release(CQueueHandler *AHandler) {
+            std::vector<CFetchHandler *> Followers;
+
+            const auto member = m_Members.find(AHandler);
+            if (member == m_Members.end())
+                return Followers;
+
+            const auto group = m_Groups.find(member->second);
+            m_Members.erase(member);
+
+            if (group == m_Groups.end())
+                return Followers;
+
+            auto &Group = group->second;
+
+            if (Group.Leader == AHandler) {
+                Followers.swap(Group.Followers);
+                for (auto pFollower : Followers) {
+                    m_Members.erase(pFollower);
+                }
+                m_Groups.erase(group);
+            } else {
+                Group.Followers.erase(std::remove(Group.Followers.begin(), Group.Followers.end(), AHandler), Group.Followers.end());
+            }
+
+            return Followers;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        bool CFetchCommon::Dispatch(CFetchHandler *AHandler, CDateTime Now) {
+            if (AHandler->Started() == 0) {
+                m_Limit.Queued((Now - AHandler->Created()) * MSecsPerDay);
+                m_Latency.Record(lsQueue, AHandler->Created(), Now);
+            }
+
+            AHandler->Started() = Now;
+
+            if (AHandler->Journaled()) {
+                m_Journal.Started(AHandler->RequestId());
+            }
+
+            // Client timeouts armed by the handler itself must not outlive the caller.
+            if (AHandler->Deadline() != 0) {
+                AHandler->TimeOutInterval(std::min<long>(FETCH_TIMEOUT_INTERVAL, CDeadline::Remaining(AHandler->Deadline(), Now)));
+                AHandler->TimeOut(AHandler->Deadline());
+            }
+
+            // A fresh cached reply completes the request without going upstream.
+            if (m_HTTPCache.Active() && Lookup(AHandler))
+                return m_Progress < m_MaxQueue;
+
+            // An identical request is already upstream: wait for its reply instead of sending another one.
+            if (m_Coalesce && Coalesce(AHandler))
+                return m_Progress < m_MaxQueue;
+
+            AHandler->Requested() = CLatencyHistogram::Clock();
+            AHandler->Handler();
+
+            if (m_Progress >= m_MaxQueue) {
+                Log()->Warning("[%s] [%d] [%d] Queued is full.", ModuleName().c_str(), m_Progress, m_MaxQueue);
+                return false;
+            }
+
+            return true;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        CString CFetchCommon::Idempotent(const CQueueJournalEntry &Entry) {
+            if (!Entry.Started)
+                return Entry.Data;
+
+            // The request may have reached the upstream before the restart: let it recognise the retry.
+            CJSON Json(Entry.Data);
+            if (Json.HasOwnProperty("headers") && Json["headers"].IsObject()) {
+                Json["headers"].Object().AddPair("Idempotency-Key", Entry.Key);
+                return Json.ToString();
+            }
+
+            return Entry.Data;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CFetchCommon::Restore(const CQueueJournalEntry &Entry) {
+            CQueueJournalEntry Request(Entry);
+            Request.Data = Idempotent(Entry);
+
+            if (!DoRecover(Request)) {
+                Log()->Notice("[%s] Journal: request %s was not recovered.", ModuleName().c_str(), Entry.Key.c_str());
+                m_Journal.Removed(Entry.Key);
+            }
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CFetchCommon::Recover() {
+            auto Entries = m_Journal.TakeRecovered();
+            if (Entries.empty())
                 return;
 
+            // Requests the database has already handed back to the module are queued again by now.
+            std::set<std::string> Queued;
+
+            const auto index = m_Queue.IndexOf(this);
+            if (index != -1) {
+                const auto pQueue = m_Queue[index];
+                for (int i = 0; i < pQueue->Count(); ++i) {
+                    const auto pHandler = static_cast<CFetchHandler *> (pQueue->Item(i));
+                    if (pHandler != nullptr) {
+                        Queued.insert(pHandler->RequestId().c_str());
+                    }
+                }
+            }
+
+            std::vector<CQueueJournalEntry> Pending;
+            for (auto &Entry : Entries) {
+                if (Queued.count(Entry.Key.c_str()) == 0) {
+                    Pending.push_back(std::move(Entry));
+                }
+            }
+
+            if (Pending.empty())
+                return;
+
+            Log()->Notice("[%s] Journal: recovering %d request(s).", ModuleName().c_str(), (int) Pending.size());
+
+            if (m_JournalCheck.IsEmpty()) {
+                for (const auto &Entry : Pending) {
+                    Restore(Entry);
+                }
+                return;
+            }
+
+            auto OnExecuted = [this, Pending](CPQPollQuery *APollQuery) {
+                std::set<std::string> Alive;
+
+                const auto pResult = APollQuery->Results(0);
+                if (pResult->ExecStatus() == PGRES_TUPLES_OK) {
+                    for (int row = 0; row < pResult->nTuples(); ++row) {
+                        Alive.insert(pResult->GetValue(row, 0));
+                    }
+                } else {
+                    Log()->Error(APP_LOG_ERR, 0, "[%s] Journal: %s", ModuleName().c_str(), pResult->GetErrorMessage());
+                    for (const auto &Entry : Pending) {
+                        Alive.insert(Entry.Key.c_str());
+                    }
+                }
+
+                // Whatever the database no longer lists as pending was finished before the restart.
+                for (const auto &Entry : Pending) {
+                    if (Alive.count(Entry.Key.c_str()) != 0) {
+                        Restore(Entry);
+                    } else {
+                        m_Journal.Removed(Entry.Key);
+                    }
+                }
+            };
+
+            auto OnException = [this, Pending](CPQPollQuery *APollQuery, const Delphi::Exception::Exception &E) {
+                DoError(E);
+                for (const auto &Entry : Pending) {
+                    Restore(Entry);
+                }
+            };
+
+            CString Keys;
+            for (const auto &Entry : Pending) {
+                if (!Keys.IsEmpty())
+                    Keys += ", ";
+                Keys += PQQuoteLiteral(Entry.Key);
+            }
+
+            CStringList SQL;
+            SQL.Add(CString().Format("SELECT * FROM %s(ARRAY[%s]::text[]);", m_JournalCheck.c_str(), Keys.c_str()));
+
+            try {
+                ExecSQL(SQL, nullptr, OnExecuted, OnException);
+            } catch (Delphi::Exception::Exception &E) {
+                DoError(E);
+                for (const auto &Entry : Pending) {
+                    Restore(Entry);
+                }
+            }
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        bool CFetchCommon::Place(CFetchHandler *AHandler) {
+            // Adopted work stays where it landed, or it would bounce back to a busy owner.
+            if (m_Adopted.erase(AHandler->RequestId().c_str()) != 0)
+                return false;
+
+            if (AHandler->Started() != 0 || AHandler->Payload().IsEmpty())
+                return false;
+
+            return m_Shard.Forward(AHandler->RequestId(), AHandler->Payload().Raw(), AHandler->Ticket());
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CFetchCommon::Settle() {
+            std::vector<CFetchHandler *> Taken;
+
+            const auto index = m_Queue.IndexOf(this);
+            if (index != -1) {
+                const auto pQueue = m_Queue[index];
+                for (int i = 0; i < pQueue->Count(); ++i) {
+                    const auto pHandler = static_cast<CFetchHandler *> (pQueue->Item(i));
+                    if (pHandler != nullptr && pHandler->Forwarded() && m_Shard.Taken(pHandler->Ticket())) {
+                        Taken.push_back(pHandler);
+                    }
+                }
+            }
+
+            // The owner has the request now and replies for it.
+            for (auto pHandler : Taken) {
+                DeleteHandler(pHandler);
+            }
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CFetchCommon::Abandon(const CQueueJournalEntry &Entry) {
+            Log()->Error(APP_LOG_ERR, 0, "[%s] Shard: request %s was not adopted.", ModuleName().c_str(), Entry.Key.c_str());
+
+            const CPayload Payload(Entry.Data);
+
+            const auto &caRequest = Payload.Has("id") ? Payload.String("id") : Entry.Key;
+            const auto &caFail = Payload.String("fail");
+            const CString caMessage("Shard: request was not adopted");
+
             CStringList SQL;
 
             SQL.Add(CString()
-                            .MaxFormatSize(256 + caRequest.Size() + Data.Size())
-                            .Format("SELECT %s(%s::uuid, %s);",
-                                    caStream.AsString().c_str(),
+                            .MaxFormatSize(256 + caRequest.Size() + caMessage.Size())
+                            .Format("SELECT http.fail(%s::uuid, %s);",
                                     PQQuoteLiteral(caRequest).c_str(),
-                                    PQQuoteLiteral(Data).c_str()
+                                    PQQuoteLiteral(caMessage).c_str()
                             ));
 
+            if (!caFail.IsEmpty()) {
+                SQL.Add(CString().Format("SELECT %s(%s::uuid);", caFail.c_str(), PQQuoteLiteral(caRequest).c_str()));
+            }
+
+            auto OnExecuted = [](CPQPollQuery *APollQuery) {
+
+            };
+
+            auto OnException = [this](CPQPollQuery *APollQuery, const Delphi::Exception::Exception &E) {
+                DoError(E);
+            };
+
             try {
                 ExecSQL(SQL, nullptr, OnExecuted, OnException);
             } catch (Delphi::Exception::Exception &E) {
-                DeleteHandler(AHandler);
                 DoError(E);
             }
         }
         //--------------------------------------------------------------------------------------------------------------
 
+        void CFetchCommon::Adopt() {
+            m_Shard.Beat();
+
+            if (m_Parked > 0) {
+                Settle();
+            }
+
+            int waiting = 0;
+
+            const auto index = m_Queue.IndexOf(this);
+            if (index != -1) {
+                const auto pQueue = m_Queue[index];
+                for (int i = 0; i < pQueue->Count(); ++i) {
+                    const auto pHandler = static_cast<CFetchHandler *> (pQueue->Item(i));
+                    if (pHandler != nullptr && pHandler->Allow() && pHandler->Started() == 0) {
+                        waiting++;
+                    }
+                }
+            }
+
+            // Take only what can start right away; the rest is left for idle peers to steal.
+            auto budget = m_MaxQueue - m_Progress - waiting;
+
+            std::vector<CQueueJournalEntry> Failed;
+
+            CQueueJournalEntry Entry;
+            while (budget > 0 && m_Shard.Take(Entry)) {
+                m_Adopted.insert(Entry.Key.c_str());
+
+                if (!DoRecover(Entry)) {
+                    m_Adopted.erase(Entry.Key.c_str());
+                    Failed.push_back(Entry);
+                }
+
+                budget--;
+            }
+
+            // Pushed back after the loop, or this pass would take them straight away again.
+            for (const auto &Item : Failed) {
+                if (!m_Shard.Return(Item)) {
+                    Abandon(Item);
+                }
+            }
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CFetchCommon::Resume() {
+            if (--m_Holds > 0 || !m_Reload)
+                return;
+
+            m_Reload = false;
+            UnloadQueue();
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
         void CFetchCommon::UnloadQueue() {
+            // DeleteHandler() unloads the queue again: a nested call only asks the outer one for another pass.
+            if (m_Holds > 0) {
+                m_Reload = true;
+                return;
+            }
+
+            Hold();
+
+            try {
+                do {
+                    m_Reload = false;
+                    Unload(Now());
+                } while (m_Reload);
+            } catch (...) {
+                m_Holds--;
+                throw;
+            }
+
+            m_Holds--;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CFetchCommon::Unload(CDateTime Now) {
+            if (m_Journal.Active()) {
+                Recover();
+            }
+
+            if (m_Shard.Active()) {
+                Adopt();
+            }
+
+            Shed(Now);
+
             const auto index = m_Queue.IndexOf(this);
             if (index != -1) {
                 const auto pQueue = m_Queue[index];
+
+                if (m_Scheduler.Active()) {
+                    CFairQueue Waiting;
+
+                    for (int i = 0; i < pQueue->Count(); ++i) {
+                        const auto pHandler = static_cast<CFetchHandler *> (pQueue->Item(i));
+                        if (pHandler != nullptr && pHandler->Allow()) {
+                            Waiting.emplace_back(m_Scheduler.Classify(pHandler->Payload()), pHandler);
+                        }
+                    }
+
+                    m_Scheduler.Schedule(Waiting, [this, Now](CQueueHandler *AHandler) {
+                        return Dispatch(static_cast<CFetchHandler *> (AHandler), Now);
+                    });
+
+                    return;
+                }
+
                 for (int i = 0; i < pQueue->Count(); ++i) {
                     const auto pHandler = static_cast<CFetchHandler *> (pQueue->Item(i));
                     if (pHandler != nullptr && pHandler->Allow()) {
-                        pHandler->Handler();
-                        if (m_Progress >= m_MaxQueue) {
-                            Log()->Warning("[%s] [%d] [%d] Queued is full.", ModuleName().c_str(), m_Progress, m_MaxQueue);
+                        if (!Dispatch(pHandler, Now))
                             break;
-                        }
                     }
                 }
             }
         }
         //--------------------------------------------------------------------------------------------------------------
 
+        void CFetchCommon::Metrics(CString &Output) const {
+            m_Limit.Metrics(Output, ModuleName());
+            m_Scheduler.Metrics(Output, ModuleName());
+            m_HTTPCache.Metrics(Output, ModuleName());
+            m_IO.Metrics(Output, ModuleName());
+            m_Compressor.Metrics(Output, ModuleName());
+            CFetchHandler::Pool().Metrics(Output, ModuleName(), "fetch_handler");
+            m_Journal.Metrics(Output, ModuleName());
+            m_Shard.Metrics(Output, ModuleName());
+            m_Latency.Metrics(Output, ModuleName());
+
+            Output += CString().Format("# TYPE apostol_queue_shed_total counter\n"
+                                       "apostol_queue_shed_total{module=\"%s\"} %llu\n",
+                                       ModuleName().c_str(), (unsigned long long) m_Shed);
+            Output += CString().Format("# TYPE apostol_fetch_stream_flushes_total counter\n"
+                                       "apostol_fetch_stream_flushes_total{module=\"%s\"} %llu\n",
+                                       ModuleName().c_str(), (unsigned long long) m_StreamFlushes);
+            Output += CString().Format("# TYPE apostol_fetch_coalesced_total counter\n"
+                                       "apostol_fetch_coalesced_total{module=\"%s\"} %llu\n",
+                                       ModuleName().c_str(), (unsigned long long) m_Coalesced);
+            Output += CString().Format("# TYPE apostol_deadline_expired_total counter\n"
+                                       "apostol_deadline_expired_total{module=\"%s\"} %llu\n",
+                                       ModuleName().c_str(), (unsigned long long) m_Expired);
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CFetchCommon::SendMetrics(CHTTPServerConnection *AConnection) const {
+            auto &Reply = AConnection->Reply();
+
+            Reply.Content.Clear();
+            Metrics(Reply.Content);
+
+            AConnection->SendReply(CHTTPReply::ok, "text/plain; version=0.0.4; charset=utf-8", true);
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
         void CFetchCommon::CheckTimeOut(CDateTime Now) {
+            FlushStreams(false);
+
+            Hold();
+
+            Shed(Now);
+
             const auto index = m_Queue.IndexOf(this);
             if (index != -1) {
                 const auto pQueue = m_Queue[index];
                 for (int i = pQueue->Count() - 1; i >= 0; i--) {
                     const auto pHandler = static_cast<CFetchHandler *> (pQueue->Item(i));
-                    if (pHandler != nullptr && !pHandler->Allow()) {
+                    if (pHandler != nullptr && !pHandler->Allow() && !pHandler->Forwarded()) {
                         if ((pHandler->TimeOut() != INFINITE) && (Now >= pHandler->TimeOut())) {
                             DoFail(pHandler, "Connection timed out");
                         }
                     }
                 }
             }
+
+            Resume();
+
+            if (m_Shard.Active()) {
+                m_Shard.Beat();
+                if (m_Shard.Pending() || m_Parked > 0) {
+                    UnloadQueue();
+                }
+            }
         }
         //--------------------------------------------------------------------------------------------------------------
 
@@ -25,6 +25,54 @@ Author:
 #define APOSTOL_FETCH_COMMON_HPP
 //----------------------------------------------------------------------------------------------------------------------
 
+#include <set>
+//----------------------------------------------------------------------------------------------------------------------
+
+#ifndef APOSTOL_CONCURRENCY_LIMIT_HPP
+#include "ConcurrencyLimit.hpp"
+#endif
+
+#ifndef APOSTOL_OBJECT_POOL_HPP
+#include "ObjectPool.hpp"
+#endif
+
+#ifndef APOSTOL_PAYLOAD_HPP
+#include "Payload.hpp"
+#endif
+
+#ifndef APOSTOL_FAIR_SCHEDULER_HPP
+#include "FairScheduler.hpp"
+#endif
+
+#ifndef APOSTOL_DEADLINE_HPP
+#include "Deadline.hpp"
+#endif
+
+#ifndef APOSTOL_HTTP_CACHE_HPP
+#include "HTTPCache.hpp"
+#endif
+
+#ifndef APOSTOL_COMPRESSOR_HPP
+#include "Compressor.hpp"
+#endif
+
+#ifndef APOSTOL_JSON_WRITER_HPP
+#include "JSONWriter.hpp"
+#endif
+
+#ifndef APOSTOL_QUEUE_JOURNAL_HPP
+#include "QueueJournal.hpp"
+#endif
+
+#ifndef APOSTOL_SHARD_QUEUE_HPP
+#include "ShardQueue.hpp"
+#endif
+
+#ifndef APOSTOL_LATENCY_HISTOGRAM_HPP
+#include "LatencyHistogram.hpp"
+#endif
+//----------------------------------------------------------------------------------------------------------------------
+
 extern "C++" {
 
 namespace Apostol {
@@ -35,6 +83,24 @@ namespace Apostol {
 
         //--------------------------------------------------------------------------------------------------------------
 
+        class CFetchHandler;
+
+        typedef struct fetch_stream_s {
+            CString Callback;
+            CString Request;
+            CString Data;
+            CDateTime First = 0;
+        } CFetchStream;
+
+        typedef std::vector<std::pair<CQueueHandler *, CString>> CFetchStreamBatch;
+
+        typedef struct fetch_group_s {
+            CFetchHandler *Leader = nullptr;
+            std::vector<CFetchHandler *> Followers;
+        } CFetchGroup;
+
+        //--------------------------------------------------------------------------------------------------------------
+
         //-- CFetchHandler ---------------------------------------------------------------------------------------------
 
         //--------------------------------------------------------------------------------------------------------------
@@ -44,7 +110,20 @@ namespace Apostol {
 
             CString m_RequestId;
 
-            CJSON m_Payload;
+            CPayload m_Payload;
+
+            CHeaders m_Conditional;
+
+            CDateTime m_Created;
+            CDateTime m_Started;
+            CDateTime m_Deadline;
+
+            uint64_t m_Requested;
+
+            bool m_Journaled;
+            bool m_Placed;
+
+            CShardTicket m_Ticket;
 
         public:
 
@@ -52,10 +131,42 @@ namespace Apostol {
 
             ~CFetchHandler() override = default;
 
+            static void *operator new(size_t Size) { return Pool().Allocate(Size); }
+            static void operator delete(void *Ptr, size_t Size) { Pool().Deallocate(Ptr, Size); }
+
+            static CObjectPool &Pool();
+
             const CString &RequestId() const { return m_RequestId; }
 
-            CJSON &Payload() { return m_Payload; }
-            const CJSON &Payload() const { return m_Payload; }
+            CPayload &Payload() { return m_Payload; }
+            const CPayload &Payload() const { return m_Payload; }
+
+            // Validators of a stale cache entry: the module adds them to the upstream request next to the payload headers.
+            CHeaders &Conditional() { return m_Conditional; }
+            const CHeaders &Conditional() const { return m_Conditional; }
+
+            CDateTime Created() const { return m_Created; }
+
+            CDateTime &Started() { return m_Started; }
+            CDateTime Started() const { return m_Started; }
+
+            CDateTime &Deadline() { return m_Deadline; }
+            CDateTime Deadline() const { return m_Deadline; }
+
+            uint64_t &Requested() { return m_Requested; }
+            uint64_t Requested() const { return m_Requested; }
+
+            bool &Journaled() { return m_Journaled; }
+            bool Journaled() const { return m_Journaled; }
+
+            bool &Placed() { return m_Placed; }
+            bool Placed() const { return m_Placed; }
+
+            CShardTicket &Ticket() { return m_Ticket; }
+            const CShardTicket &Ticket() const { return m_Ticket; }
+
+            // Parked here until the owner takes the forwarded entry from its inbox.
+            bool Forwarded() const { return m_Ticket.Owner != -1; }
 
         };
 
@@ -68,6 +179,101 @@ namespace Apostol {
         class CFetchCommon: public CQueueCollection, public CApostolModule {
         private:
 
+            CConcurrencyLimit m_Limit;
+
+            CFairScheduler m_Scheduler;
+
+            int m_MaxDepth;
+            CDateTime m_MaxAge;
+
+            uint64_t m_Shed;
+            uint64_t m_Expired;
+
+            bool m_Coalesce;
+            std::string m_CoalesceMethods;
+
+            std::map<std::string, CFetchGroup> m_Groups;
+            std::map<CQueueHandler *, std::string> m_Members;
+
+            uint64_t m_Coalesced;
+
+            CWorkerPool m_IO;
+
+            CEPollTimer *m_pTimer;
+            bool m_TimerActive;
+
+            void UpdateTimer();
+            void DoTimer(CPollEventHandler *AHandler);
+
+            CHTTPCache m_HTTPCache;
+            std::map<CQueueHandler *, CString> m_Lookups;
+            std::set<CQueueHandler *> m_Loading;
+
+            bool Lookup(CFetchHandler *AHandler);
+            void Revalidate(CFetchHandler *AHandler);
+
+            size_t m_StreamBatchSize;
+            CDateTime m_StreamBatchDelay;
+
+            size_t m_StreamBuffered;
+            bool m_StreamFlushing;
+
+            std::map<CQueueHandler *, CFetchStream> m_Streams;
+            std::set<CQueueHandler *> m_StreamInFlight;
+            std::map<CQueueHandler *, std::function<void ()>> m_StreamWaiting;
+
+            uint64_t m_StreamFlushes;
+
+            static CString StreamStatement(const CFetchStream &Stream);
+
+            void FlushStreams(bool Force);
+            void RetryStreams(const std::shared_ptr<CFetchStreamBatch> &Batch, const std::function<void ()> &Done);
+            void TakeStream(CStringList &SQL, CQueueHandler *AHandler);
+            bool StreamPending(CQueueHandler *AHandler) const;
+
+            static CHeaders RequestHeaders(const CPayload &Payload);
+
+            CCompressor m_Compressor;
+
+            CHeaders EncodedHeaders(const CHeaders &Headers, size_t Size, size_t Original) const;
+
+            CString Fingerprint(const CPayload &Payload) const;
+
+            bool Coalesce(CFetchHandler *AHandler);
+            std::vector<CFetchHandler *> Release(CQueueHandler *AHandler);
+
+            void Shed(CDateTime Now);
+            void Reject(CStringList &SQL, const std::vector<CFetchHandler *> &Handlers, const CString &Message);
+
+            bool Dispatch(CFetchHandler *AHandler, CDateTime Now);
+
+            int m_Holds;
+            bool m_Reload;
+
+            void Hold() { m_Holds++; };
+            void Resume();
+
+            void Unload(CDateTime Now);
+
+            CQueueJournal m_Journal;
+            CString m_JournalCheck;
+
+            void Recover();
+            void Restore(const CQueueJournalEntry &Entry);
+
+            static CString Idempotent(const CQueueJournalEntry &Entry);
+
+            CShardQueue m_Shard;
+            std::set<std::string> m_Adopted;
+            int m_Parked;
+
+            bool Place(CFetchHandler *AHandler);
+            void Adopt();
+            void Settle();
+            void Abandon(const CQueueJournalEntry &Entry);
+
+            CLatencyHistograms m_Latency;
+
         protected:
 
             int m_TimeOut;
@@ -92,6 +298,11 @@ namespace Apostol {
             void DoFail(CFetchHandler *AHandler, const CString &Message);
             void DoStream(CFetchHandler *AHandler, const CString &Data);
 
+            // Handlers are built by the concrete module, so only it can rebuild one from a journal or shard entry.
+            // Override both: the journal and the shard queue stay off while CanRecover() is false.
+            virtual bool CanRecover() const { return false; };
+            virtual bool DoRecover(const CQueueJournalEntry &Entry) { return false; };
+
             void DoPostgresQueryExecuted(CPQPollQuery *APollQuery) override;
             void DoPostgresQueryException(CPQPollQuery *APollQuery, const Delphi::Exception::Exception &E) override;
 
@@ -102,10 +313,15 @@ namespace Apostol {
 
             explicit CFetchCommon(CModuleProcess *AProcess, const CString &ModuleName, const CString &SectionName);
 
-            ~CFetchCommon() override = default;
+            ~CFetchCommon() override;
+
+            void Initialization(CModuleProcess *AProcess) override;
 
             void UnloadQueue() override;
 
+            void Metrics(CString &Output) const;
+            void SendMetrics(CHTTPServerConnection *AConnection) const;
+
         };
 
     }
@@ -0,0 +1,807 @@
+/*++
+
+Program name:
+
+  Apostol CRM
+
+Module Name:
+
+  FileCache.cpp
+
+Notices:
+
+  Module: File Cache
+
+Author:
+
+  Copyright (c) Prepodobny Alen
+
+  mailto: alienufo@inbox.ru
+  mailto: ufocomp@gmail.com
+
+--*/
+
+//----------------------------------------------------------------------------------------------------------------------
+
+#include "Core.hpp"
+#include "FileCache.hpp"
+//----------------------------------------------------------------------------------------------------------------------
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <vector>
+//----------------------------------------------------------------------------------------------------------------------
+
+#define FILE_CACHE_CHECK_INTERVAL 5
+#define FILE_CACHE_LOCK_NAME ".cache.lock"
+#define FILE_CACHE_EVENTS_NAME ".cache.events"
+#define FILE_CACHE_MAX_EVENTS 65536
+#define FILE_CACHE_LAYOUT_NAME ".layout"
+#define FILE_CACHE_LOW_WATERMARK 90
+#define FILE_CACHE_MAX_LEVELS 4
+//----------------------------------------------------------------------------------------------------------------------
+
+extern "C++" {
+
+namespace Apostol {
+
+    namespace Module {
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        //-- CFileCache ------------------------------------------------------------------------------------------------
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        CFileCache::CFileCache(): m_MaxSize(0), m_MaxFiles(0), m_Policy(fcpLRU), m_ScanInterval(0), m_Levels(0), m_Migrate(false), m_Migrated(true), m_Size(0),
+                m_Active(false), m_Pending(false), m_LockFd(-1), m_Leader(false), m_Terminated(false),
+                m_Hits(0), m_Misses(0), m_Evictions(0), m_EvictedBytes(0) {
+
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        CFileCache::~CFileCache() {
+            Close();
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        CFileCachePolicy CFileCache::StringToPolicy(const CString &Value) {
+            if (Value == "lfu")
+                return fcpLFU;
+            return fcpLRU;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        bool CFileCache::Ignored(const char *Name) {
+            const auto pBase = strrchr(Name, '/');
+            const auto caBase = pBase == nullptr ? Name : pBase + 1;
+
+            // Lock files and the temporary files of saves in progress are not cached content.
+            if (caBase[0] == '.')
+                return true;
+
+            const auto length = strlen(caBase);
+            for (const auto caSuffix : {".~part", ".~tmp", ".tmp"}) {
+                const auto size = strlen(caSuffix);
+                if (length > size && strcmp(caBase + length - size, caSuffix) == 0)
+                    return true;
+            }
+
+            return false;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        static std::string ShardPrefix(const std::string &Base, int Levels) {
+            uint32_t hash = 2166136261u;
+            for (const auto ch : Base) {
+                hash ^= (uint8_t) ch;
+                hash *= 16777619u;
+            }
+
+            TCHAR szHash[9] = {0};
+            snprintf(szHash, sizeof(szHash), "%08x", hash);
+
+            std::string Shard;
+            for (int i = 0; i < Levels && i < FILE_CACHE_MAX_LEVELS; ++i) {
+                Shard.append(szHash + i * 2, 2);
+                Shard.push_back('/');
+            }
+
+            return Shard;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        CString CFileCache::ShardName(const CString &Path, const CString &FileName, int Levels) {
+            if (Levels <= 0 || FileName.Size() <= Path.Size() || strncmp(FileName.c_str(), Path.c_str(), Path.Size()) != 0)
+                return FileName;
+
+            const std::string caName(FileName.c_str(), FileName.Size());
+
+            const auto pos = caName.rfind('/');
+            const auto &caDir = caName.substr(0, pos + 1);
+            const auto &caBase = caName.substr(pos + 1);
+
+            const auto &Shard = ShardPrefix(caBase, Levels);
+
+            if (caDir.size() >= Path.Size() + Shard.size() && caDir.compare(caDir.size() - Shard.size(), Shard.size(), Shard) == 0)
+                return FileName;
+
+            return CString((caDir + Shard + caBase).c_str());
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        CString CFileCache::FlatName(const CString &Path, const CString &FileName, int Levels) {
+            if (Levels <= 0 || FileName.Size() <= Path.Size() || strncmp(FileName.c_str(), Path.c_str(), Path.Size()) != 0)
+                return FileName;
+
+            const std::string caName(FileName.c_str(), FileName.Size());
+
+            const auto pos = caName.rfind('/');
+            const auto &caDir = caName.substr(0, pos + 1);
+            const auto &caBase = caName.substr(pos + 1);
+
+            const auto &Shard = ShardPrefix(caBase, Levels);
+
+            // Only the components the given layout added are stripped; a user directory is never mistaken for one.
+            if (caDir.size() < Path.Size() + Shard.size() || caDir.compare(caDir.size() - Shard.size(), Shard.size(), Shard) != 0)
+                return FileName;
+
+            return CString((caDir.substr(0, caDir.size() - Shard.size()) + caBase).c_str());
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CFileCache::Open(const CString &Path, uint64_t MaxSize, uint64_t MaxFiles, CFileCachePolicy Policy, int ScanInterval) {
+            Close();
+
+            m_Path = Path;
+            m_MaxSize = MaxSize;
+            m_MaxFiles = MaxFiles;
+            m_Policy = Policy;
+            m_ScanInterval = ScanInterval;
+
+            m_Index.clear();
+            m_Touched.clear();
+            m_Events.clear();
+            m_Size = 0;
+
+            m_Leader = false;
+            m_Migrated = !m_Migrate || ReadLayout() == m_Levels;
+            m_Terminated = false;
+            m_Pending = false;
+            m_Active = true;
+
+            m_Thread = std::thread(&CFileCache::Execute, this);
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CFileCache::Close() {
+            if (!m_Active)
+                return;
+
+            {
+                std::lock_guard<std::mutex> Lock(m_Lock);
+                m_Terminated = true;
+            }
+
+            m_Signal.notify_one();
+
+            if (m_Thread.joinable())
+                m_Thread.join();
+
+            if (m_LockFd != -1) {
+                close(m_LockFd);
+                m_LockFd = -1;
+            }
+
+            m_Leader = false;
+            m_Active = false;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        bool CFileCache::Overflow() const {
+            return (m_MaxSize != 0 && m_Size > m_MaxSize) || (m_MaxFiles != 0 && m_Index.size() > m_MaxFiles);
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CFileCache::Add(const CString &FileName, uint64_t Size) {
+            if (!m_Active)
+                return;
+
+            // Only the leader keeps the index; the other workers hand it what they saved through the event file.
+            if (!m_Leader) {
+                Event('A', std::string(FileName.c_str(), FileName.Size()), Size);
+                return;
+            }
+
+            bool bOverflow;
+
+            {
+                std::lock_guard<std::mutex> Lock(m_Lock);
+
+                auto &Entry = m_Index[std::string(FileName.c_str(), FileName.Size())];
+
+                m_Size -= Entry.Size;
+                m_Size += Size;
+
+                Entry.Size = Size;
+                Entry.Access = time(nullptr);
+                Entry.Hits++;
+
+                bOverflow = Overflow();
+                if (bOverflow)
+                    m_Pending = true;
+            }
+
+            if (bOverflow)
+                m_Signal.notify_one();
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CFileCache::Remove(const CString &FileName) {
+            if (!m_Active)
+                return;
+
+            if (!m_Leader) {
+                Event('R', std::string(FileName.c_str(), FileName.Size()));
+                return;
+            }
+
+            std::lock_guard<std::mutex> Lock(m_Lock);
+
+            const auto it = m_Index.find(std::string(FileName.c_str(), FileName.Size()));
+            if (it != m_Index.end()) {
+                m_Size -= it->second.Size;
+                m_Index.erase(it);
+            }
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CFileCache::Hit(const CString &FileName) {
+            m_Hits++;
+
+            if (!m_Active)
+                return;
+
+            std::lock_guard<std::mutex> Lock(m_Lock);
+
+            const std::string caName(FileName.c_str(), FileName.Size());
+
+            // The access time on disk is what another worker sees after it takes over the leadership.
+            m_Touched.insert(caName);
+
+            if (!m_Leader) {
+                if ((m_MaxSize != 0 || m_MaxFiles != 0) && m_Events.size() < FILE_CACHE_MAX_EVENTS)
+                    m_Events.push_back(std::string("H ") + caName);
+                return;
+            }
+
+            const auto it = m_Index.find(caName);
+            if (it != m_Index.end()) {
+                it->second.Access = time(nullptr);
+                it->second.Hits++;
+            }
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        uint64_t CFileCache::Size() const {
+            std::lock_guard<std::mutex> Lock(m_Lock);
+            return m_Size;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        uint64_t CFileCache::Count() const {
+            std::lock_guard<std::mutex> Lock(m_Lock);
+            return m_Index.size();
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        bool CFileCache::Elect() {
+            if (m_LockFd == -1) {
+                const auto &caName = m_Path + FILE_CACHE_LOCK_NAME;
+                m_LockFd = open(caName.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+                if (m_LockFd == -1)
+                    return false;
+            }
+
+            // Every worker shares the directory: one of them holds the budget, the others retry while it lives.
+            if (flock(m_LockFd, LOCK_EX | LOCK_NB) != 0)
+                return false;
+
+            m_Leader = true;
+
+            return true;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CFileCache::Touch() {
+            std::unordered_set<std::string> Touched;
+
+            {
+                std::lock_guard<std::mutex> Lock(m_Lock);
+                Touched.swap(m_Touched);
+            }
+
+            struct timespec Times[2];
+
+            Times[0].tv_sec = 0;
+            Times[0].tv_nsec = UTIME_NOW;
+            Times[1].tv_sec = 0;
+            Times[1].tv_nsec = UTIME_OMIT;
+
+            for (const auto &Name : Touched) {
+                utimensat(AT_FDCWD, Name.c_str(), Times, 0);
+            }
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CFileCache::Event(char Type, const std::string &Name, uint64_t Size) {
+            // Without a budget the leader does not keep an index, so there is nothing to tell it.
+            if (m_MaxSize == 0 && m_MaxFiles == 0)
+                return;
+
+            std::lock_guard<std::mutex> Lock(m_Lock);
+
+            // A leader that stops collecting must not grow this worker's memory; its next scan covers what is dropped.
+            if (m_Events.size() >= FILE_CACHE_MAX_EVENTS)
+                return;
+
+            if (Type == 'A') {
+                m_Events.push_back(std::string("A ") + std::to_string(Size) + " " + Name);
+            } else {
+                m_Events.push_back(std::string(1, Type) + " " + Name);
+            }
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CFileCache::Publish() {
+            std::vector<std::string> Events;
+
+            {
+                std::lock_guard<std::mutex> Lock(m_Lock);
+                Events.swap(m_Events);
+            }
+
+            if (Events.empty())
+                return;
+
+            std::string Buffer;
+            for (const auto &Line : Events) {
+                Buffer.append(Line);
+                Buffer.push_back('\n');
+            }
+
+            const auto &caName = m_Path + FILE_CACHE_EVENTS_NAME;
+
+            // One O_APPEND write per batch: the batches of several workers never interleave.
+            const auto fd = open(caName.c_str(), O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+            if (fd == -1)
+                return;
+
+            if (write(fd, Buffer.data(), Buffer.size()) < 0) {
+                // Lost events only delay the index until the next scan.
+            }
+
+            close(fd);
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CFileCache::Apply(const char *Line) {
+            if (Line[0] == 0 || Line[1] != ' ')
+                return;
+
+            const auto now = time(nullptr);
+
+            if (Line[0] == 'A') {
+                char *pEnd = nullptr;
+                const auto size = strtoull(Line + 2, &pEnd, 10);
+                if (pEnd == nullptr || *pEnd != ' ')
+                    return;
+
+                auto &Entry = m_Index[std::string(pEnd + 1)];
+
+                m_Size -= Entry.Size;
+                m_Size += size;
+
+                Entry.Size = size;
+                Entry.Access = now;
+                Entry.Hits++;
+            } else if (Line[0] == 'H') {
+                const auto it = m_Index.find(std::string(Line + 2));
+                if (it != m_Index.end()) {
+                    it->second.Access = now;
+                    it->second.Hits++;
+                }
+            } else if (Line[0] == 'R') {
+                const auto it = m_Index.find(std::string(Line + 2));
+                if (it != m_Index.end()) {
+                    m_Size -= it->second.Size;
+                    m_Index.erase(it);
+                }
+            }
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CFileCache::Collect() {
+            const auto &caName = m_Path + FILE_CACHE_EVENTS_NAME;
+            const auto &caOld = caName + ".old";
+
+            // The file renamed on the previous pass is read now: a worker that opened it just before the rename
+            // has long finished its single write.
+            FILE *pFile = fopen(caOld.c_str(), "r");
+            if (pFile != nullptr) {
+                char *pLine = nullptr;
+                size_t size = 0;
+                ssize_t length;
+
+                std::unique_lock<std::mutex> Lock(m_Lock);
+
+                while ((length = getline(&pLine, &size, pFile)) > 0) {
+                    if (pLine[length - 1] == '\n')
+                        pLine[length - 1] = 0;
+                    Apply(pLine);
+                }
+
+                if (Overflow())
+                    m_Pending = true;
+
+                Lock.unlock();
+
+                free(pLine);
+                fclose(pFile);
+
+                unlink(caOld.c_str());
+            }
+
+            rename(caName.c_str(), caOld.c_str());
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        int CFileCache::ReadLayout() const {
+            const auto &caName = m_Path + FILE_CACHE_LAYOUT_NAME;
+
+            FILE *pFile = fopen(caName.c_str(), "r");
+            if (pFile == nullptr)
+                return -1;
+
+            int levels = -1;
+            if (fscanf(pFile, "%d", &levels) != 1)
+                levels = -1;
+
+            fclose(pFile);
+
+            return levels;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CFileCache::WriteLayout() const {
+            const auto &caName = m_Path + FILE_CACHE_LAYOUT_NAME;
+            const auto &caTemp = caName + ".tmp";
+
+            FILE *pFile = fopen(caTemp.c_str(), "w");
+            if (pFile == nullptr)
+                return;
+
+            fprintf(pFile, "%d\n", m_Levels);
+
+            if (fclose(pFile) == 0) {
+                rename(caTemp.c_str(), caName.c_str());
+            } else {
+                unlink(caTemp.c_str());
+            }
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CFileCache::Execute() {
+            time_t scanned = 0;
+
+            std::unique_lock<std::mutex> Lock(m_Lock);
+
+            while (!m_Terminated) {
+                Lock.unlock();
+
+                if (!m_Leader && Elect()) {
+                    // What this worker still had for the old leader is covered by the scan that follows.
+                    std::lock_guard<std::mutex> Guard(m_Lock);
+                    m_Events.clear();
+                }
+
+                // The layout marker makes the migration a one-time job of the leader; the others wait for it.
+                if (!m_Migrated) {
+                    if (m_Leader) {
+                        Migrate();
+                    } else {
+                        m_Migrated = ReadLayout() == m_Levels;
+                    }
+                }
+
+                Touch();
+
+                if (!m_Leader) {
+                    Publish();
+                } else if (m_MaxSize != 0 || m_MaxFiles != 0) {
+                    // One full scan when the leadership is taken; after that the event file keeps the index current.
+                    if (scanned == 0 || (m_ScanInterval > 0 && time(nullptr) - scanned >= m_ScanInterval)) {
+                        Rebuild();
+                        scanned = time(nullptr);
+                    }
+
+                    Collect();
+                }
+
+                Lock.lock();
+
+                if (m_Leader && (m_Pending || Overflow())) {
+                    m_Pending = false;
+                    Lock.unlock();
+                    Evict();
+                    Lock.lock();
+                    continue;
+                }
+
+                m_Signal.wait_for(Lock, std::chrono::seconds(FILE_CACHE_CHECK_INTERVAL));
+            }
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CFileCache::Migrate() {
+            std::vector<std::string> Directories;
+            std::vector<std::string> Files;
+
+            const auto levels = ReadLayout();
+
+            if (levels == m_Levels) {
+                m_Migrated = true;
+                return;
+            }
+
+            Directories.emplace_back(m_Path.c_str());
+
+            while (!Directories.empty() && !m_Terminated) {
+                const auto Directory = Directories.back();
+                Directories.pop_back();
+
+                DIR *pDir = opendir(Directory.c_str());
+                if (pDir == nullptr)
+                    continue;
+
+                struct dirent *pEntry;
+                struct stat st = {};
+
+                while ((pEntry = readdir(pDir)) != nullptr) {
+                    if (strcmp(pEntry->d_name, ".") == 0 || strcmp(pEntry->d_name, "..") == 0)
+                        continue;
+
+                    std::string Name(Directory);
+                    if (Name.back() != '/')
+                        Name.push_back('/');
+                    Name.append(pEntry->d_name);
+
+                    if (lstat(Name.c_str(), &st) != 0)
+                        continue;
+
+                    if (S_ISDIR(st.st_mode)) {
+                        Directories.push_back(Name);
+                    } else if (S_ISREG(st.st_mode) && !Ignored(Name.c_str())) {
+                        Files.push_back(Name);
+                    }
+                }
+
+                closedir(pDir);
+            }
+
+            for (const auto &Name : Files) {
+                if (m_Terminated)
+                    break;
+
+                // Strip the previous layout first, so a change of shard_levels does not nest the old shards.
+                const auto &caFlat = FlatName(m_Path, Name.c_str(), levels);
+                const auto &caTarget = ShardName(m_Path, caFlat, m_Levels);
+                if (Name == caTarget.c_str())
+                    continue;
+
+                const std::string Target(caTarget.c_str(), caTarget.Size());
+                ForceDirectories(Target.substr(0, Target.rfind('/') + 1).c_str(), 0755);
+
+                // A file that was already downloaded into the sharded layout is newer than the flat one.
+                if (access(Target.c_str(), F_OK) == 0) {
+                    unlink(Name.c_str());
+                } else {
+                    rename(Name.c_str(), Target.c_str());
+                }
+            }
+
+            if (m_Terminated)
+                return;
+
+            WriteLayout();
+            m_Migrated = true;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CFileCache::Rebuild() {
+            std::unordered_map<std::string, CFileCacheEntry> Index;
+            std::vector<std::string> Directories;
+
+            const auto started = time(nullptr);
+
+            Directories.emplace_back(m_Path.c_str());
+
+            while (!Directories.empty() && !m_Terminated) {
+                const auto Directory = Directories.back();
+                Directories.pop_back();
+
+                DIR *pDir = opendir(Directory.c_str());
+                if (pDir == nullptr)
+                    continue;
+
+                struct dirent *pEntry;
+                struct stat st = {};
+
+                while ((pEntry = readdir(pDir)) != nullptr) {
+                    if (strcmp(pEntry->d_name, ".") == 0 || strcmp(pEntry->d_name, "..") == 0)
+                        continue;
+
+                    std::string Name(Directory);
+                    if (Name.back() != '/')
+                        Name.push_back('/');
+                    Name.append(pEntry->d_name);
+
+                    if (lstat(Name.c_str(), &st) != 0)
+                        continue;
+
+                    if (S_ISDIR(st.st_mode)) {
+                        Directories.push_back(Name);
+                    } else if (S_ISREG(st.st_mode) && !Ignored(Name.c_str())) {
+                        auto &Entry = Index[Name];
+                        Entry.Size = st.st_size;
+                        Entry.Access = st.st_atime > st.st_mtime ? st.st_atime : st.st_mtime;
+                    }
+                }
+
+                closedir(pDir);
+            }
+
+            if (m_Terminated)
+                return;
+
+            std::lock_guard<std::mutex> Lock(m_Lock);
+
+            // The scan is the truth for files of other workers; what this one saved or read meanwhile is kept.
+            for (const auto &Item : m_Index) {
+                const auto it = Index.find(Item.first);
+                if (it != Index.end()) {
+                    it->second.Access = std::max(it->second.Access, Item.second.Access);
+                    it->second.Hits = Item.second.Hits;
+                } else if (Item.second.Access >= started) {
+                    Index.emplace(Item.first, Item.second);
+                }
+            }
+
+            m_Index.swap(Index);
+
+            m_Size = 0;
+            for (const auto &Item : m_Index) {
+                m_Size += Item.second.Size;
+            }
+
+            m_Pending = Overflow();
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CFileCache::Evict() {
+            typedef std::pair<std::string, CFileCacheEntry> CVictim;
+
+            std::vector<CVictim> Victims;
+
+            {
+                std::lock_guard<std::mutex> Lock(m_Lock);
+
+                if (!Overflow())
+                    return;
+
+                const auto maxSize = m_MaxSize / 100 * FILE_CACHE_LOW_WATERMARK;
+                const auto maxFiles = m_MaxFiles / 100 * FILE_CACHE_LOW_WATERMARK;
+
+                Victims.reserve(m_Index.size());
+                for (const auto &Item : m_Index) {
+                    Victims.emplace_back(Item.first, Item.second);
+                }
+
+                if (m_Policy == fcpLFU) {
+                    std::sort(Victims.begin(), Victims.end(), [](const CVictim &A, const CVictim &B) {
+                        return A.second.Hits == B.second.Hits ? A.second.Access < B.second.Access : A.second.Hits < B.second.Hits;
+                    });
+                } else {
+                    std::sort(Victims.begin(), Victims.end(), [](const CVictim &A, const CVictim &B) {
+                        return A.second.Access < B.second.Access;
+                    });
+                }
+
+                uint64_t size = m_Size;
+                uint64_t count = m_Index.size();
+                size_t index = 0;
+
+                while (index < Victims.size() && ((m_MaxSize != 0 && size > maxSize) || (m_MaxFiles != 0 && count > maxFiles))) {
+                    size -= Victims[index].second.Size;
+                    count--;
+                    index++;
+                }
+
+                Victims.resize(index);
+
+                if (m_Policy == fcpLFU) {
+                    for (auto &Item : m_Index) {
+                        Item.second.Hits >>= 1;
+                    }
+                }
+            }
+
+            for (const auto &Victim : Victims) {
+                if (m_Terminated)
+                    break;
+
+                CFileCacheEntry Entry;
+
+                {
+                    std::lock_guard<std::mutex> Lock(m_Lock);
+
+                    // The event loop may have touched or re-saved the file since the victims were chosen.
+                    const auto it = m_Index.find(Victim.first);
+                    if (it == m_Index.end() || it->second.Access != Victim.second.Access)
+                        continue;
+
+                    Entry = it->second;
+                    m_Size -= Entry.Size;
+                    m_Index.erase(it);
+                }
+
+                // The unlink runs unlocked, so Hit() and Add() on the event loop never wait for the disk.
+                if (unlink(Victim.first.c_str()) == 0 || errno == ENOENT) {
+                    m_Evictions++;
+                    m_EvictedBytes += Entry.Size;
+                    continue;
+                }
+
+                std::lock_guard<std::mutex> Lock(m_Lock);
+                if (m_Index.find(Victim.first) == m_Index.end()) {
+                    m_Index.emplace(Victim.first, Entry);
+                    m_Size += Entry.Size;
+                }
+            }
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CFileCache::Metrics(CString &Output, const CString &Module) const {
+            const auto size = Size();
+            const auto count = Count();
+
+            Output += CString().Format("# TYPE apostol_file_cache_hits_total counter\n"
+                                       "apostol_file_cache_hits_total{module=\"%s\"} %llu\n",
+                                       Module.c_str(), (unsigned long long) m_Hits.load());
+            Output += CString().Format("# TYPE apostol_file_cache_misses_total counter\n"
+                                       "apostol_file_cache_misses_total{module=\"%s\"} %llu\n",
+                                       Module.c_str(), (unsigned long long) m_Misses.load());
+            Output += CString().Format("# TYPE apostol_file_cache_evictions_total counter\n"
+                                       "apostol_file_cache_evictions_total{module=\"%s\"} %llu\n",
+                                       Module.c_str(), (unsigned long long) m_Evictions.load());
+            Output += CString().Format("# TYPE apostol_file_cache_evicted_bytes_total counter\n"
+                                       "apostol_file_cache_evicted_bytes_total{module=\"%s\"} %llu\n",
+                                       Module.c_str(), (unsigned long long) m_EvictedBytes.load());
+            Output += CString().Format("# TYPE apostol_file_cache_bytes gauge\n"
+                                       "apostol_file_cache_bytes{module=\"%s\"} %llu\n",
+                                       Module.c_str(), (unsigned long long) size);
+            Output += CString().Format("# TYPE apostol_file_cache_files gauge\n"
+                                       "apostol_file_cache_files{module=\"%s\"} %llu\n",
+                                       Module.c_str(), (unsigned long long) count);
+            Output += CString().Format("# TYPE apostol_file_cache_leader gauge\n"
+                                       "apostol_file_cache_leader{module=\"%s\"} %d\n",
+                                       Module.c_str(), m_Leader ? 1 : 0);
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+    }
+}
+}
@@ -0,0 +1,161 @@
+/*++
+
+Program name:
+
+  Apostol CRM
+
+Module Name:
+
+  FileCache.hpp
+
+Notices:
+
+  Module: File Cache
+
+Author:
+
+  Copyright (c) Prepodobny Alen
+
+  mailto: alienufo@inbox.ru
+  mailto: ufocomp@gmail.com
+
+--*/
+
+#ifndef APOSTOL_FILE_CACHE_HPP
+#define APOSTOL_FILE_CACHE_HPP
+//----------------------------------------------------------------------------------------------------------------------
+
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+//----------------------------------------------------------------------------------------------------------------------
+
+extern "C++" {
+
+namespace Apostol {
+
+    namespace Module {
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        //-- CFileCache ------------------------------------------------------------------------------------------------
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        typedef enum file_cache_policy_e {
+            fcpLRU = 0, fcpLFU
+        } CFileCachePolicy;
+        //--------------------------------------------------------------------------------------------------------------
+
+        typedef struct file_cache_entry_s {
+            uint64_t Size = 0;
+            time_t Access = 0;
+            uint32_t Hits = 0;
+        } CFileCacheEntry;
+        //--------------------------------------------------------------------------------------------------------------
+
+        class CFileCache {
+        private:
+
+            CString m_Path;
+
+            uint64_t m_MaxSize;
+            uint64_t m_MaxFiles;
+
+            CFileCachePolicy m_Policy;
+
+            int m_ScanInterval;
+
+            int m_Levels;
+            bool m_Migrate;
+
+            std::atomic<bool> m_Migrated;
+
+            std::unordered_map<std::string, CFileCacheEntry> m_Index;
+
+            uint64_t m_Size;
+
+            bool m_Active;
+            bool m_Pending;
+
+            int m_LockFd;
+            std::atomic<bool> m_Leader;
+
+            std::unordered_set<std::string> m_Touched;
+            std::vector<std::string> m_Events;
+
+            std::atomic<bool> m_Terminated;
+
+            mutable std::mutex m_Lock;
+            std::condition_variable m_Signal;
+            std::thread m_Thread;
+
+            std::atomic<uint64_t> m_Hits;
+            std::atomic<uint64_t> m_Misses;
+            std::atomic<uint64_t> m_Evictions;
+            std::atomic<uint64_t> m_EvictedBytes;
+
+            void Execute();
+
+            bool Elect();
+            void Touch();
+
+            void Event(char Type, const std::string &Name, uint64_t Size = 0);
+            void Publish();
+            void Collect();
+            void Apply(const char *Line);
+
+            int ReadLayout() const;
+            void WriteLayout() const;
+
+            void Migrate();
+            void Rebuild();
+            void Evict();
+
+            bool Overflow() const;
+
+        public:
+
+            CFileCache();
+
+            ~CFileCache();
+
+            void Open(const CString &Path, uint64_t MaxSize, uint64_t MaxFiles, CFileCachePolicy Policy, int ScanInterval = 0);
+            void Close();
+
+            bool Active() const { return m_Active; }
+            bool Leader() const { return m_Leader; }
+            bool Migrated() const { return m_Migrated; }
+
+            void Layout(int Levels, bool Migrate) { m_Levels = Levels; m_Migrate = Migrate; }
+
+            void Add(const CString &FileName, uint64_t Size);
+            void Remove(const CString &FileName);
+
+            void Hit(const CString &FileName);
+            void Miss() { m_Misses++; }
+
+            uint64_t Size() const;
+            uint64_t Count() const;
+
+            void Metrics(CString &Output, const CString &Module) const;
+
+            static CFileCachePolicy StringToPolicy(const CString &Value);
+
+            static bool Ignored(const char *Name);
+
+            static CString ShardName(const CString &Path, const CString &FileName, int Levels);
+            static CString FlatName(const CString &Path, const CString &FileName, int Levels);
+
+        };
+
+    }
+}
+
+using namespace Apostol::Module;
+}
+#endif //APOSTOL_FILE_CACHE_HPP
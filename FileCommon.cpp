@@ -28,6 +28,14 @@ Author:
 #include "FileCommon.hpp"
 //----------------------------------------------------------------------------------------------------------------------
 
+#include <algorithm>
+#include <thread>
+#include <ifaddrs.h>
+#include <net/if.h>
+#include <arpa/inet.h>
+#include <openssl/evp.h>
+//----------------------------------------------------------------------------------------------------------------------
+
 #define API_BOT_USERNAME "apibot"
 #define PG_CONFIG_NAME "helper"
 
@@ -35,6 +43,10 @@ Author:
 #define QUERY_INDEX_DATA     1
 
 #define FILE_SERVER_ERROR_MESSAGE "[%s] Error: %s"
+
+#define FILE_COMMON_IO_INTERVAL 5
+#define FILE_COMMON_READ_BUFFER (1024 * 1024)
+#define FILE_COMMON_SEGMENT_FLUSH (1024 * 1024)
 //----------------------------------------------------------------------------------------------------------------------
 
 extern "C++" {
@@ -54,16 +66,20 @@ namespace Apostol {
 
             m_Payload = Data;
 
-            m_Session = m_Payload["session"].AsString();
-            m_Operation = m_Payload["operation"].AsString();
-            m_FileId = m_Payload["id"].AsString();
-            m_Type = m_Payload["type"].AsString();
-            m_Path = m_Payload["path"].AsString();
-            m_Name = m_Payload["name"].AsString();
-            m_Hash = m_Payload["hash"].AsString();
-
             m_pConnection = nullptr;
 
+            m_Attempt = 0;
+            m_RetryAt = 0;
+
+            m_Created = Now();
+            m_Started = 0;
+            m_Deadline = CDeadline::FromPayload(m_Payload, m_Created);
+
+            m_Requested = 0;
+
+            m_Journaled = false;
+            m_Placed = false;
+
             m_TimeOutInterval = 30 * 60 * 1000;
 
             UpdateTimeOut(Now());
@@ -75,11 +91,19 @@ namespace Apostol {
         }
         //--------------------------------------------------------------------------------------------------------------
 
+        CObjectPool &CFileHandler::Pool() {
+            // Never destroyed: handlers can still be released while static objects are torn down at exit.
+            static auto pPool = new CObjectPool(sizeof(CFileHandler));
+            return *pPool;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
         void CFileHandler::SetConnection(CHTTPServerConnection *AConnection) {
             if (m_pConnection != AConnection) {
                 if (AConnection != nullptr) {
                     AConnection->Binding(this);
                     AConnection->TimeOut(INFINITE);
+                    m_Deadline = CDeadline::Earliest(m_Deadline, CDeadline::FromHeaders(AConnection->Request().Headers, Now()));
                 } else {
                     if (m_pConnection != nullptr) {
                         m_pConnection->TimeOutInterval(5 * 1000);
@@ -100,15 +124,48 @@ namespace Apostol {
         //--------------------------------------------------------------------------------------------------------------
 
         CFileCommon::CFileCommon(CModuleProcess *AProcess, const CString &ModuleName, const CString &SectionName):
-                CQueueCollection(Config()->PostgresPollMax()), CApostolModule(AProcess, ModuleName, SectionName) {
+                CQueueCollection(Config()->PostgresPollMax()), CApostolModule(AProcess, ModuleName, SectionName), m_DNS(m_IO) {
 
             m_Headers.Add("Authorization");
 
             m_Agent = CString().Format("%s (%s)", GApplication->Title().c_str(), ModuleName.c_str());
-            m_Host = CApostolModule::GetIPByHostName(CApostolModule::GetHostName());
+            m_AuthPending = false;
 
             m_TimeOut = 0;
             m_AuthDate = 0;
+            m_ShardLevels = 0;
+
+            m_SegmentThreshold = 0;
+            m_Segments = 4;
+            m_SegmentRetries = 3;
+
+            m_FetchTicket = 0;
+
+            m_RetryMax = 0;
+            m_RetryBase = 500;
+            m_RetryCap = 10000;
+
+            m_MaxDepth = 0;
+            m_MaxAge = 0;
+            m_RetryAfter = 5;
+
+            m_Shed = 0;
+
+            m_Holds = 0;
+            m_Reload = false;
+            m_Expired = 0;
+
+            m_Random.seed(std::random_device()());
+
+            m_pTimer = nullptr;
+            m_TimerActive = false;
+
+            m_Parked = 0;
+
+            CFileHandler::Pool().Claim(ModuleName);
+
+            m_pRingHandler = nullptr;
+            m_pHTTP2Handler = nullptr;
 
             m_Client.AllocateEventHandlers(Server());
 #if defined(_GLIBCXX_RELEASE) && (_GLIBCXX_RELEASE >= 9)
@@ -119,6 +176,18 @@ namespace Apostol {
         }
         //--------------------------------------------------------------------------------------------------------------
 
+        CFileCommon::~CFileCommon() {
+            m_Shard.Close();
+            m_Journal.Close();
+            delete m_pHTTP2Handler;
+            m_HTTP2.Close();
+            delete m_pRingHandler;
+            m_Ring.Close();
+            m_IO.Stop();
+            delete m_pTimer;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
         CPQPollQuery *CFileCommon::GetQuery(CPollConnection *AConnection, const CString &ConfName) {
             return CApostolModule::GetQuery(AConnection, PG_CONFIG_NAME);
         }
@@ -145,12 +214,25 @@ namespace Apostol {
                 DeleteHandler(pHandler);
             };
 
-            return ExecSQL(SQL, AHandler, OnExecuted, OnException);
+            if (AHandler == nullptr || AHandler->Deadline() == 0)
+                return ExecSQL(SQL, AHandler, OnExecuted, OnException);
+
+            CStringList Statements;
+            Statements.Assign(SQL);
+            CDeadline::StatementTimeout(Statements, AHandler->Deadline(), Now());
+
+            return ExecSQL(Statements, AHandler, OnExecuted, OnException);
         }
         //--------------------------------------------------------------------------------------------------------------
 
         void CFileCommon::Authentication() {
 
+            // The session is bound to this host's address: log in once ResolveHost() has it.
+            if (m_Host.IsEmpty()) {
+                m_AuthPending = true;
+                return;
+            }
+
             auto OnExecuted = [this](CPQPollQuery *APollQuery) {
                 CStringList SQL;
 
@@ -206,385 +288,2158 @@ namespace Apostol {
         }
         //--------------------------------------------------------------------------------------------------------------
 
-        void CFileCommon::SendFile(CHTTPServerConnection *AConnection, const CString &FileName) {
-            if (AConnection != nullptr && AConnection->Connected()) {
-                auto &Reply = AConnection->Reply();
+        void CFileCommon::ResolveHost() {
+            const std::string caHost(CApostolModule::GetHostName().c_str());
 
-                CString sFileExt;
-                TCHAR szBuffer[MAX_BUFFER_SIZE + 1] = {0};
+            auto OnResolved = [this](int Error, const std::vector<std::string> &Addresses) {
+                if (Error == 0 && !Addresses.empty()) {
+                    const auto it = std::find_if(Addresses.begin(), Addresses.end(), [](const std::string &Address) {
+                        return Address.find(':') == std::string::npos;
+                    });
 
-                const auto sModified = StrWebTime(FileAge(FileName.c_str()), szBuffer, sizeof(szBuffer));
-                if (sModified != nullptr) {
-                    AConnection->Reply().AddHeader(_T("Last-Modified"), sModified);
+                    m_Host = it == Addresses.end() ? Addresses.front().c_str() : it->c_str();
+                } else {
+                    m_Host = LocalAddress();
                 }
 
-                sFileExt = ExtractFileExt(szBuffer, FileName.c_str());
+                if (m_AuthPending) {
+                    m_AuthPending = false;
+                    Authentication();
+                }
+            };
 
-#if (APOSTOL_USE_SEND_FILE)
-    #if (OPENSSL_VERSION_NUMBER >= 0x30000000L) && defined(BIO_get_ktls_send)
-                AConnection->SendFileReply(FileName.c_str(), Mapping::ExtToType(sFileExt.c_str()));
-    #else
-                if (AConnection->IOHandler()->UsedSSL()) {
-                    if (Reply.Content.IsEmpty()) {
-                        Reply.Content.LoadFromFile(FileName.c_str());
-                    }
+            // getaddrinfo may block for seconds: it runs on the pool, and without one the interfaces are asked instead.
+            if (m_IO.Active()) {
+                const auto pAddresses = std::make_shared<std::vector<std::string>>();
+                const auto pError = std::make_shared<int>(0);
 
-                    AConnection->SendReply(CHTTPReply::ok, Mapping::ExtToType(sFileExt.c_str()), true);
-                } else {
-                    AConnection->SendFileReply(FileName.c_str(), Mapping::ExtToType(sFileExt.c_str()));
-                }
-    #endif
-#else
-                if (Reply.Content.IsEmpty()) {
-                    Reply.Content.LoadFromFile(FileName.c_str());
-                }
+                auto Work = [caHost, pAddresses, pError]() {
+                    *pError = CDNSCache::Lookup(caHost, *pAddresses);
+                };
 
-                AConnection->SendReply(CHTTPReply::ok, Mapping::ExtToType(sFileExt.c_str()), true);
-#endif
+                auto Done = [OnResolved, pAddresses, pError]() {
+                    OnResolved(*pError, *pAddresses);
+                };
+
+                if (Post(caHost.c_str(), std::move(Work), std::move(Done)))
+                    return;
             }
+
+            OnResolved(EAI_AGAIN, std::vector<std::string>());
         }
         //--------------------------------------------------------------------------------------------------------------
 
-        void CFileCommon::DeleteFile(const CString &FileName) {
-            if (FileExists(FileName.c_str())) {
-                CApplication::DeleteFile(FileName);
+        CString CFileCommon::LocalAddress() {
+            struct ifaddrs *pList = nullptr;
+
+            CString Result("127.0.0.1");
+
+            if (getifaddrs(&pList) != 0)
+                return Result;
+
+            char szAddress[INET_ADDRSTRLEN];
+
+            for (auto pItem = pList; pItem != nullptr; pItem = pItem->ifa_next) {
+                if (pItem->ifa_addr == nullptr || pItem->ifa_addr->sa_family != AF_INET)
+                    continue;
+
+                if ((pItem->ifa_flags & IFF_UP) == 0 || (pItem->ifa_flags & IFF_LOOPBACK) != 0)
+                    continue;
+
+                const auto pAddress = reinterpret_cast<struct sockaddr_in *> (pItem->ifa_addr);
+                if (inet_ntop(AF_INET, &pAddress->sin_addr, szAddress, sizeof(szAddress)) != nullptr) {
+                    Result = szAddress;
+                    break;
+                }
             }
+
+            freeifaddrs(pList);
+
+            return Result;
         }
         //--------------------------------------------------------------------------------------------------------------
 
-        void CFileCommon::DoError(const Delphi::Exception::Exception &E) const {
-            Log()->Error(APP_LOG_ERR, 0, FILE_SERVER_ERROR_MESSAGE, ModuleName().c_str(), E.what());
+        CString CFileCommon::AbsoluteName(const CString &FileName) const {
+            return CFileCache::ShardName(m_Path, FileName, m_ShardLevels);
         }
         //--------------------------------------------------------------------------------------------------------------
 
-        void CFileCommon::DoError(CQueueHandler *AHandler, const CString &Message) {
-            Log()->Error(APP_LOG_ERR, 0, FILE_SERVER_ERROR_MESSAGE, ModuleName().c_str(), Message.c_str());
-            DeleteHandler(AHandler);
+        bool CFileCommon::Migrating(const CString &FileName) const {
+            return !m_Cache.Migrated() && AbsoluteName(FileName) != FileName;
         }
         //--------------------------------------------------------------------------------------------------------------
 
-        void CFileCommon::DoCurlException(CCURLClient *Sender, const Delphi::Exception::Exception &E) const {
-            DoError(E);
+        CString CFileCommon::LocateFile(const CString &FileName) const {
+            const auto &caFileName = AbsoluteName(FileName);
+
+            // Until the one-time migration has finished a file may still be at its previous place. Stats the disk:
+            // called from the I/O pool only.
+            if (Migrating(FileName) && !FileExists(caFileName.c_str()) && FileExists(FileName.c_str()))
+                return FileName;
+
+            return caFileName;
         }
         //--------------------------------------------------------------------------------------------------------------
 
-        void CFileCommon::DeleteHandler(CQueueHandler *AHandler) {
-            if (Assigned(AHandler)) {
-                CQueueCollection::DeleteHandler(AHandler);
+        void CFileCommon::PrepareFile(CFileHandler *AHandler) {
+            AHandler->AbsoluteName() = AbsoluteName(AHandler->AbsoluteName());
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        bool CFileCommon::DirectoryReady(const CString &FileName) {
+            if (m_ShardLevels <= 0)
+                return true;
+
+            const std::string caName(FileName.c_str(), FileName.Size());
+
+            std::lock_guard<std::mutex> Lock(m_DirectoryLock);
+            return m_Directories.count(caName.substr(0, caName.rfind('/') + 1)) != 0;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CFileCommon::ForceDirectory(const CString &FileName) {
+            if (m_ShardLevels <= 0)
+                return;
+
+            const std::string caName(FileName.c_str(), FileName.Size());
+            const auto &caDir = caName.substr(0, caName.rfind('/') + 1);
+
+            {
+                std::lock_guard<std::mutex> Lock(m_DirectoryLock);
+                if (m_Directories.count(caDir) != 0)
+                    return;
+            }
+
+            // Called from the I/O pool: the shard directories are created once and remembered, never on the loop.
+            ForceDirectories(caDir.c_str(), 0755);
+
+            if (access(caDir.c_str(), F_OK) == 0) {
+                std::lock_guard<std::mutex> Lock(m_DirectoryLock);
+                m_Directories.insert(caDir);
             }
         }
         //--------------------------------------------------------------------------------------------------------------
 
-        void CFileCommon::DoFetch(CFileHandler *AHandler) {
+        void CFileCommon::ArmDeadline(CFileHandler *AHandler) {
+            if (AHandler->Deadline() != 0 && AHandler->TimeOut() > AHandler->Deadline()) {
+                AHandler->TimeOut(AHandler->Deadline());
+            }
+        }
+        //--------------------------------------------------------------------------------------------------------------
 
-            auto OnRequest = [AHandler](CHTTPClient *Sender, CHTTPRequest &Request) {
-                if (Assigned(AHandler)) {
-                    CHTTPRequest::Prepare(Request, "GET", AHandler->URI().href().c_str());
-                }
+        void CFileCommon::SendFile(CHTTPServerConnection *AConnection, const CString &FileName) {
+            const auto bMigrating = Migrating(FileName);
+            const auto pLocated = std::make_shared<CString>(AbsoluteName(FileName));
 
-                DebugRequest(Request);
-            };
-            //----------------------------------------------------------------------------------------------------------
+            if (AConnection == nullptr || !AConnection->Connected()) {
+                m_Cache.Hit(*pLocated);
+                return;
+            }
 
-            auto OnExecute = [this, AHandler](CTCPConnection *Sender) {
-                const auto pConnection = dynamic_cast<CHTTPClientConnection *> (Sender);
-                const auto &Reply = pConnection->Reply();
+            const auto &caFileName = *pLocated;
 
-                DebugReply(Reply);
+            const auto bLoad = LoadRequired(AConnection) && AConnection->Reply().Content.IsEmpty();
+            const auto bEncoded = m_Compressor.Active();
+            const auto bVary = m_Precompressor.Eligible(caFileName);
+            const auto caAccept = AConnection->Request().Headers["Accept-Encoding"];
+            const auto bVariants = bVary && !caAccept.IsEmpty();
+            const auto pResult = std::make_shared<CFileSaveResult>();
+            const auto pContent = std::make_shared<CString>();
+            const auto pVariant = std::make_shared<CString>();
 
-                if (Assigned(AHandler)) {
-                    const auto pHandlerConnection = AHandler->Connection();
+            auto Work = [this, FileName, bMigrating, pLocated, bLoad, bEncoded, bVariants, caAccept, pResult, pContent, pVariant]() {
+                if (bMigrating) {
+                    *pLocated = LocateFile(FileName);
+                }
 
-                    if (Reply.Status == CHTTPReply::ok) {
-                        try {
-                            Reply.Content.SaveToFile(AHandler->AbsoluteName().c_str());
-                            SendFile(pHandlerConnection, AHandler->AbsoluteName());
-                        } catch (Delphi::Exception::Exception &E) {
-                            DoError(E);
-                        }
+                const auto &caFileName = *pLocated;
 
-                        DoDone(AHandler, Reply);
-                    } else {
-                        const CString Message("Not found");
+                pResult->Modified = FileAge(caFileName.c_str());
 
-                        if (Server().IndexOfConnection(pHandlerConnection) != -1) {
-                            ReplyError(pHandlerConnection, CHTTPReply::not_found, Message);
-                        }
+                // A stored body is sent encoded when the client accepts it and decoded otherwise.
+                const auto &caEncoding = bEncoded ? CCompressor::FileEncoding(caFileName) : CString();
+                const auto bDecode = !caEncoding.IsEmpty() && !CCompressor::Accepts(caAccept, caEncoding);
 
-                        DoFail(AHandler, Message);
+                if (bVariants && caEncoding.IsEmpty()) {
+                    pResult->Encoding = m_Precompressor.Negotiate(caFileName, caAccept, *pVariant);
+                }
+
+                if (bLoad || bDecode) {
+                    try {
+                        pContent->LoadFromFile(pVariant->IsEmpty() ? caFileName.c_str() : pVariant->c_str());
+                    } catch (std::exception &e) {
+                        pResult->Error = e.what();
+                        return;
                     }
                 }
 
-                return true;
+                if (bDecode) {
+                    CString Decoded;
+                    if (!CCompressor::Decompress(caEncoding, *pContent, Decoded)) {
+                        pResult->Error = CString().Format("Could not decode \"%s\" (%s)", caFileName.c_str(), caEncoding.c_str());
+                        return;
+                    }
+                    *pContent = std::move(Decoded);
+                } else if (!caEncoding.IsEmpty()) {
+                    pResult->Encoding = caEncoding;
+                }
             };
-            //----------------------------------------------------------------------------------------------------------
 
-            auto OnException = [this, AHandler](CTCPConnection *Sender, const Delphi::Exception::Exception &E) {
-                const auto pConnection = dynamic_cast<CHTTPClientConnection *> (Sender);
-                DebugReply(pConnection->Reply());
+            auto Done = [this, AConnection, pLocated, bVary, pResult, pContent, pVariant]() {
+                const auto &caFileName = *pLocated;
 
-                if (Assigned(AHandler)) {
-                    const auto pHandlerConnection = AHandler->Connection();
+                m_Cache.Hit(caFileName);
 
-                    if (Server().IndexOfConnection(pConnection) != -1) {
-                        const CString Message("Not found");
-                        ReplyError(pHandlerConnection, CHTTPReply::not_found, Message);
-                    }
+                if (Server().IndexOfConnection(AConnection) == -1)
+                    return;
 
-                    DoFail(AHandler, E.what());
+                if (!pResult->Error.IsEmpty()) {
+                    ReplyError(AConnection, CHTTPReply::internal_server_error, pResult->Error);
+                    return;
                 }
 
-                DoError(E);
+                if (!pContent->IsEmpty()) {
+                    AConnection->Reply().Content = std::move(*pContent);
+                }
+
+                // The identity response must vary as well, or a shared cache would hand it to every client.
+                if (bVary && pResult->Encoding.IsEmpty()) {
+                    AConnection->Reply().AddHeader(_T("Vary"), _T("Accept-Encoding"));
+                }
+
+                DoSendFile(AConnection, caFileName, pResult->Modified, pResult->Encoding, *pVariant);
             };
-            //----------------------------------------------------------------------------------------------------------
 
-            if (AHandler == nullptr)
-                return;
+            if (!bLoad && !bEncoded && !bVariants && !bMigrating && m_Ring.Active()) {
+                auto OnStat = [Done, pResult, caFileName](int Error, time_t Modified) {
+                    if (Error != 0) {
+                        pResult->Error = CString().Format("Could not stat file \"%s\": %s", caFileName.c_str(), strerror(Error));
+                    }
+                    pResult->Modified = Modified;
+                    Done();
+                };
 
-            AHandler->Allow(false);
+                if (m_Ring.Stat(caFileName, std::move(OnStat))) {
+                    UpdateTimer();
+                    return;
+                }
+            }
 
-            if (m_TimeOut > 0) {
-                AHandler->TimeOut(0);
-                AHandler->TimeOutInterval(m_TimeOut * 1000);
-                AHandler->UpdateTimeOut(Now());
+            if (!Post(caFileName, std::move(Work), std::move(Done))) {
+                Work();
+                Done();
             }
+        }
+        //--------------------------------------------------------------------------------------------------------------
 
-            auto pClient = GetClient(AHandler->URI().hostname, AHandler->URI().port);
-#if defined(_GLIBCXX_RELEASE) && (_GLIBCXX_RELEASE >= 9)
-            pClient->OnConnected([this](auto &&Sender) { DoClientConnected(Sender); });
-            pClient->OnDisconnected([this](auto &&Sender) { DoClientDisconnected(Sender); });
+        bool CFileCommon::LoadRequired(CHTTPServerConnection *AConnection) {
+#if (APOSTOL_USE_SEND_FILE)
+    #if (OPENSSL_VERSION_NUMBER >= 0x30000000L) && defined(BIO_get_ktls_send)
+            return false;
+    #else
+            return AConnection->IOHandler()->UsedSSL();
+    #endif
 #else
-            pClient->OnConnected(std::bind(&CFileCommon::DoClientConnected, this, _1));
-            pClient->OnDisconnected(std::bind(&CFileCommon::DoClientDisconnected, this, _1));
+            return true;
 #endif
+        }
+        //--------------------------------------------------------------------------------------------------------------
 
-            pClient->OnRequest(OnRequest);
-            pClient->OnExecute(OnExecute);
-            pClient->OnException(OnException);
-
-            try {
-                pClient->AutoFree(true);
-                pClient->Active(true);
-            } catch (std::exception &e) {
-                DoFail(AHandler, e.what());
-            }
+        void CFileCommon::DoSendFile(CHTTPServerConnection *AConnection, const CString &FileName) {
+            DoSendFile(AConnection, FileName, FileAge(FileName.c_str()));
         }
         //--------------------------------------------------------------------------------------------------------------
 
-        void CFileCommon::DoCURL(CFileHandler *AHandler) {
+        void CFileCommon::DoSendFile(CHTTPServerConnection *AConnection, const CString &FileName, time_t Modified,
+                const CString &Encoding, const CString &Variant) {
 
-            auto OnDone = [this, AHandler](CCurlFetch *Sender, CURLcode code, const CString &Error) {
-                const auto http_code = Sender->GetResponseCode();
-                CHTTPReply Reply;
+            if (AConnection != nullptr && AConnection->Connected()) {
+                auto &Reply = AConnection->Reply();
 
-                Reply.Headers.Clear();
-                for (int i = 1; i < Sender->Headers().Count(); i++) {
-                    const auto &Header = Sender->Headers()[i];
-                    Reply.AddHeader(Header.Name(), Header.Value());
-                }
+                CString sFileExt;
+                TCHAR szBuffer[MAX_BUFFER_SIZE + 1] = {0};
 
-                Reply.StatusString = http_code;
-                Reply.StatusText = Reply.StatusString;
+                const auto sModified = StrWebTime(Modified, szBuffer, sizeof(szBuffer));
+                if (sModified != nullptr) {
+                    AConnection->Reply().AddHeader(_T("Last-Modified"), sModified);
+                }
 
-                Reply.StringToStatus();
+                sFileExt = ExtractFileExt(szBuffer, FileName.c_str());
 
-                const auto pConnection = AHandler->Connection();
+                if (!Encoding.IsEmpty()) {
+                    Reply.AddHeader(_T("Content-Encoding"), Encoding);
+                    Reply.AddHeader(_T("Vary"), _T("Accept-Encoding"));
+                }
 
-                if (http_code == 200) {
-                    DeleteFile(AHandler->AbsoluteName());
+                // A precompressed variant supplies the bytes, the original name keeps the content type.
+                const auto &caSource = Variant.IsEmpty() ? FileName : Variant;
 
-                    Reply.Content = Sender->Result();
-                    Reply.ContentLength = Reply.Content.Length();
+                if (LoadRequired(AConnection) || !Reply.Content.IsEmpty()) {
+                    if (Reply.Content.IsEmpty()) {
+                        Reply.Content.LoadFromFile(caSource.c_str());
+                    }
 
-                    Reply.DelHeader("Transfer-Encoding");
-                    Reply.DelHeader("Content-Encoding");
-                    Reply.DelHeader("Content-Length");
+                    AConnection->SendReply(CHTTPReply::ok, Mapping::ExtToType(sFileExt.c_str()), true);
+                } else {
+                    AConnection->SendFileReply(caSource.c_str(), Mapping::ExtToType(sFileExt.c_str()));
+                }
+            }
+        }
+        //--------------------------------------------------------------------------------------------------------------
 
-                    Reply.AddHeader("Content-Length", CString::ToString(Reply.ContentLength));
+        void CFileCommon::DeleteFile(const CString &FileName) {
+            const auto &caFileName = AbsoluteName(FileName);
 
-                    Reply.Content.SaveToFile(AHandler->AbsoluteName().c_str());
+            m_Cache.Remove(caFileName);
 
-                    SendFile(pConnection, AHandler->AbsoluteName());
+            const auto &caSidecars = m_Precompressor.Sidecars(caFileName);
+            for (const auto &caSidecar : caSidecars) {
+                m_Cache.Remove(caSidecar);
+            }
 
-                    DoDone(AHandler, Reply);
-                } else {
-                    const CString Message("Not found");
+            // While the migration runs the file may be at either place; both are removed.
+            const auto &caFlatName = Migrating(FileName) ? FileName : CString();
 
-                    if (Server().IndexOfConnection(pConnection) != -1) {
-                        ReplyError(pConnection, CHTTPReply::not_found, Message);
-                    }
+            auto Work = [caFileName, caFlatName, caSidecars]() {
+                if (FileExists(caFileName.c_str())) {
+                    unlink(caFileName.c_str());
+                }
 
-                    DoFail(AHandler, Message);
+                if (!caFlatName.IsEmpty()) {
+                    unlink(caFlatName.c_str());
                 }
-            };
-            //----------------------------------------------------------------------------------------------------------
 
-            auto OnFail = [this, AHandler](CCurlFetch *Sender, CURLcode code, const CString &Error) {
-                Log()->Warning("[%s] [CURL] %d (%s)", ModuleName().c_str(), (int) code, Error.c_str());
-                const auto pConnection = AHandler->Connection();
-                if (Server().IndexOfConnection(pConnection) != -1) {
-                    ReplyError(pConnection, CHTTPReply::bad_request, Error);
+                for (const auto &caSidecar : caSidecars) {
+                    unlink(caSidecar.c_str());
                 }
-                DoFail(AHandler, Error);
             };
-            //----------------------------------------------------------------------------------------------------------
 
-            AHandler->Allow(false);
+            if (caFlatName.IsEmpty() && m_Ring.Active() && m_Ring.Unlink(caFileName, nullptr)) {
+                for (const auto &caSidecar : caSidecars) {
+                    m_Ring.Unlink(caSidecar, nullptr);
+                }
 
-            if (m_TimeOut > 0) {
-                AHandler->TimeOut(0);
-                AHandler->TimeOutInterval((m_TimeOut + 10) * 1000);
-                AHandler->UpdateTimeOut(Now());
+                UpdateTimer();
+                return;
             }
 
-            try {
-                m_Client.Get(AHandler->URI(), CHeaders(), OnDone, OnFail);
-            } catch (std::exception &e) {
-                DoFail(AHandler, e.what());
+            if (!Post(caFileName, std::move(Work), nullptr)) {
+                Work();
             }
         }
         //--------------------------------------------------------------------------------------------------------------
 
-        void CFileCommon::DoDone(CFileHandler *AHandler, const CHTTPReply &Reply) {
-
-            auto OnExecuted = [this](CPQPollQuery *APollQuery) {
-                const auto pHandler = dynamic_cast<CFileHandler *> (APollQuery->Binding());
-                DeleteHandler(pHandler);
-            };
+        bool CFileCommon::Post(const CString &Key, COnWorkerJobEvent &&Work, COnWorkerJobEvent &&Done, bool Defer) {
+            // Only a pool that was never started makes the caller run the job inline.
+            if (!m_IO.Active())
+                return false;
 
-            auto OnException = [this](CPQPollQuery *APollQuery, const Delphi::Exception::Exception &E) {
-                const auto pHandler = dynamic_cast<CFileHandler *> (APollQuery->Binding());
-                DoError(pHandler, E.Message());
-            };
+            const std::string key(Key.c_str(), Key.Size());
 
-            if (AHandler->Done().IsEmpty()) {
-                DeleteHandler(AHandler);
-                return;
+            // A key with deferred jobs keeps deferring, or a later job would overtake an earlier one on its lane.
+            if (m_BacklogKeys.count(key) == 0 && m_IO.Post(Key, std::move(Work), std::move(Done))) {
+                UpdateTimer();
+                return true;
             }
 
-            const auto &caFileId = PQQuoteLiteral(AHandler->FileId());
-            const auto &caAbsoluteName = PQQuoteLiteral(AHandler->AbsoluteName());
-            const auto &caHash = SHA256(Reply.Content.IsEmpty() ? "" : Reply.Content, true);
-            const auto &caContentType = PQQuoteLiteral(Reply.Headers["Content-Type"]);
+            if (!Defer)
+                return true;
 
-            CStringList SQL;
+            m_Backlog.push_back({Key, std::move(Work), std::move(Done)});
+            m_BacklogKeys[key]++;
 
-            SQL.Add(CString()
-                            .MaxFormatSize(256 + caFileId.Size() + caAbsoluteName.Size() + caHash.Size() + caContentType.Size())
-                            .Format("SELECT %s(%s::uuid, %s, %d, '%s', %s);",
-                                    AHandler->Done().c_str(),
-                                    caFileId.c_str(),
-                                    caAbsoluteName.c_str(),
-                                    Reply.ContentLength,
-                                    caHash.c_str(),
-                                    caContentType.c_str()
-                            ));
+            UpdateTimer();
 
-            try {
-                ExecSQL(SQL, AHandler, OnExecuted, OnException);
-            } catch (Delphi::Exception::Exception &E) {
-                DoError(AHandler, E.Message());
-            }
+            return true;
         }
         //--------------------------------------------------------------------------------------------------------------
 
-        void CFileCommon::DoFail(CFileHandler *AHandler, const CString &Message) {
+        void CFileCommon::Drain() {
+            while (!m_Backlog.empty()) {
+                auto &Job = m_Backlog.front();
 
-            auto OnExecuted = [this](CPQPollQuery *APollQuery) {
-                const auto pHandler = dynamic_cast<CFileHandler *> (APollQuery->Binding());
-                DeleteHandler(pHandler);
-            };
+                if (!m_IO.Post(Job.Key, std::move(Job.Work), std::move(Job.Done)))
+                    break;
+
+                const auto it = m_BacklogKeys.find(std::string(Job.Key.c_str(), Job.Key.Size()));
+                if (it != m_BacklogKeys.end() && --it->second == 0)
+                    m_BacklogKeys.erase(it);
+
+                m_Backlog.pop_front();
+            }
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CFileCommon::UpdateTimer() {
+            // With an eventfd the ring needs no polling: what was queued goes to the kernel now, completions wake the loop.
+            if (m_pRingHandler != nullptr)
+                m_Ring.Submit();
+
+            const auto bRing = m_pRingHandler == nullptr && m_Ring.Pending() != 0;
+            const auto bHTTP2 = m_pHTTP2Handler == nullptr && m_HTTP2.Pending() != 0;
+            const auto active = m_IO.Pending() != 0 || !m_Backlog.empty() || m_DNS.Pending() != 0 || bRing || bHTTP2;
+
+            if (m_pTimer != nullptr && m_TimerActive != active) {
+                m_TimerActive = active;
+                m_pTimer->SetTimer(active ? FILE_COMMON_IO_INTERVAL : 0, active ? FILE_COMMON_IO_INTERVAL : 0);
+            }
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CFileCommon::DoTimer(CPollEventHandler *AHandler) {
+            uint64_t exp;
+
+            auto pTimer = dynamic_cast<CEPollTimer *> (AHandler->Binding());
+            pTimer->Read(&exp, sizeof(uint64_t));
+
+            try {
+                m_IO.Dispatch();
+
+                Drain();
+
+                if (m_DNS.Pending() != 0) {
+                    m_DNS.Flush();
+                }
+
+                if (m_Ring.Active() && m_pRingHandler == nullptr) {
+                    do {
+                        m_Ring.Submit();
+                    } while (m_Ring.Reap() != 0);
+                }
+
+                if (m_pHTTP2Handler == nullptr) {
+                    m_HTTP2.Perform();
+                }
+            } catch (Delphi::Exception::Exception &E) {
+                DoError(E);
+            }
+
+            UpdateTimer();
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CFileCommon::DoHTTP2(CPollEventHandler *AHandler) {
+            try {
+                m_HTTP2.Perform();
+            } catch (Delphi::Exception::Exception &E) {
+                DoError(E);
+            }
+
+            UpdateTimer();
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CFileCommon::DoRing(CPollEventHandler *AHandler) {
+            m_Ring.Drain();
+
+            try {
+                do {
+                    m_Ring.Submit();
+                } while (m_Ring.Reap() != 0);
+            } catch (Delphi::Exception::Exception &E) {
+                DoError(E);
+            }
+
+            UpdateTimer();
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CFileCommon::DoSave(CFileHandler *AHandler, const std::shared_ptr<CHTTPReply> &Reply) {
+            const auto caFileName = AHandler->AbsoluteName();
+            const auto pResult = std::make_shared<CFileSaveResult>();
+
+            if (AHandler->Requested() != 0) {
+                m_Latency.Record(lsUpstream, CLatencyHistogram::Clock() - AHandler->Requested());
+                AHandler->Requested() = 0;
+            }
+
+            // The handler must outlive the job: CheckTimeOut() skips handlers with an infinite timeout.
+            AHandler->TimeOut(INFINITE);
+
+            const auto bCompress = m_Compressor.Eligible(Reply->Headers["Content-Type"], Reply->Headers["Content-Encoding"], Reply->Content.Size());
+
+            // The ring cannot create directories, a new shard directory goes through the pool once.
+            if (!bCompress && m_Ring.Active() && DirectoryReady(caFileName)) {
+                auto OnSaved = [this, AHandler, Reply, caFileName, pResult, start = CLatencyHistogram::Clock()](int Error, time_t Modified) {
+                    m_Latency.Record(lsSave, CLatencyHistogram::Clock() - start);
+
+                    if (Error != 0)
+                        pResult->Error = strerror(Error);
+
+                    pResult->Modified = Modified;
+
+                    auto Work = [this, Reply, pResult]() {
+                        if (pResult->Error.IsEmpty()) {
+                            const auto hash = CLatencyHistogram::Clock();
+                            pResult->Hash = SHA256(Reply->Content.IsEmpty() ? "" : Reply->Content, true);
+                            m_Latency.Record(lsHash, CLatencyHistogram::Clock() - hash);
+                        }
+                    };
+
+                    auto Done = [this, AHandler, Reply, caFileName, pResult]() {
+                        DoSaved(AHandler, Reply, caFileName, pResult);
+                    };
+
+                    if (!Post(caFileName, std::move(Work), std::move(Done))) {
+                        Work();
+                        Done();
+                    }
+                };
+
+                if (m_Ring.Save(caFileName, Reply->Content.c_str(), Reply->Content.Size(), std::move(OnSaved))) {
+                    UpdateTimer();
+                    return;
+                }
+            }
+
+            auto Work = [this, Reply, caFileName, pResult, bCompress]() {
+                try {
+                    const auto start = CLatencyHistogram::Clock();
+
+                    ForceDirectory(caFileName);
+
+                    // Written and tagged under a temporary name, as the ring does: a reader never sees the
+                    // compressed bytes before their encoding attribute.
+                    const auto &caTempName = caFileName + ".~tmp";
+
+                    CString Compressed;
+                    if (bCompress && m_Compressor.Compress(Reply->Content, Compressed)) {
+                        Compressed.SaveToFile(caTempName.c_str());
+                        // Without the encoding attribute readers could not tell, so the body is stored as is.
+                        if (CCompressor::FileEncoding(caTempName, m_Compressor.Encoding())) {
+                            pResult->Encoding = m_Compressor.Encoding();
+                            pResult->Stored = Compressed.Size();
+                        } else {
+                            Reply->Content.SaveToFile(caTempName.c_str());
+                        }
+                    } else {
+                        Reply->Content.SaveToFile(caTempName.c_str());
+                    }
+
+                    if (rename(caTempName.c_str(), caFileName.c_str()) != 0) {
+                        pResult->Error = CString().Format("Could not rename file \"%s\": %s", caTempName.c_str(), strerror(errno));
+                        unlink(caTempName.c_str());
+                        return;
+                    }
+
+                    pResult->Modified = FileAge(caFileName.c_str());
+
+                    const auto hash = CLatencyHistogram::Clock();
+                    m_Latency.Record(lsSave, hash - start);
+
+                    pResult->Hash = SHA256(Reply->Content.IsEmpty() ? "" : Reply->Content, true);
+                    m_Latency.Record(lsHash, CLatencyHistogram::Clock() - hash);
+                } catch (std::exception &e) {
+                    pResult->Error = e.what();
+                }
+            };
+
+            auto Done = [this, AHandler, Reply, caFileName, pResult]() {
+                DoSaved(AHandler, Reply, caFileName, pResult);
+            };
+
+            if (!Post(caFileName, std::move(Work), std::move(Done))) {
+                Work();
+                Done();
+            }
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CFileCommon::DoSaved(CFileHandler *AHandler, const std::shared_ptr<CHTTPReply> &Reply, const CString &FileName,
+                const std::shared_ptr<CFileSaveResult> &Result) {
+
+            const auto pConnection = AHandler->Connection();
+
+            if (!Result->Error.IsEmpty()) {
+                Log()->Error(APP_LOG_ERR, 0, FILE_SERVER_ERROR_MESSAGE, ModuleName().c_str(), Result->Error.c_str());
+
+                if (Server().IndexOfConnection(pConnection) != -1) {
+                    ReplyError(pConnection, CHTTPReply::internal_server_error, Result->Error);
+                }
+
+                DoFail(AHandler, Result->Error);
+                return;
+            }
+
+            const auto Size = Reply->Content.IsEmpty() ? Reply->ContentLength : Reply->Content.Size();
+
+            // The cache budget is about disk usage: an encoded file is charged what it takes on disk.
+            m_Cache.Add(FileName, Result->Encoding.IsEmpty() ? Size : Result->Stored);
+
+            CString Encoding(Result->Encoding);
+
+            if (Encoding.IsEmpty()) {
+                Precompress(FileName, Size);
+            }
+
+            if (Server().IndexOfConnection(pConnection) != -1) {
+                if (LoadRequired(pConnection) || (!Encoding.IsEmpty() && !CCompressor::Accepts(pConnection->Request().Headers["Accept-Encoding"], Encoding))) {
+                    // A segmented download leaves Reply empty; its body was already loaded on the pool.
+                    if (!Reply->Content.IsEmpty()) {
+                        pConnection->Reply().Content = Reply->Content;
+                    }
+                    Encoding.Clear();
+                }
+
+                if (Encoding.IsEmpty() && m_Precompressor.Eligible(FileName)) {
+                    pConnection->Reply().AddHeader(_T("Vary"), _T("Accept-Encoding"));
+                }
+            }
+
+            DoSendFile(pConnection, FileName, Result->Modified, Encoding);
+            DoDone(AHandler, *Reply, Result->Hash);
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CFileCommon::Precompress(const CString &FileName, size_t Size) {
+            if (!m_Precompressor.Eligible(FileName, Size))
+                return;
+
+            const auto pVariants = std::make_shared<std::vector<CPrecompressorVariant>>();
+
+            auto Work = [this, FileName, pVariants]() {
+                // Variants written before a failure are complete and still reported.
+                try {
+                    m_Precompressor.Generate(FileName, *pVariants);
+                } catch (std::exception &) {
+                }
+            };
+
+            auto Done = [this, pVariants]() {
+                for (const auto &Variant : *pVariants) {
+                    m_Cache.Add(Variant.FileName, Variant.Size);
+                }
+            };
+
+            // Variants are only an optimisation: with the I/O queue full they are skipped, not deferred or built inline.
+            Post(FileName, std::move(Work), std::move(Done), false);
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CFileCommon::Metrics(CString &Output) const {
+            m_Cache.Metrics(Output, ModuleName());
+            m_IO.Metrics(Output, ModuleName());
+            m_Ring.Metrics(Output, ModuleName());
+            m_Pool.Metrics(Output, ModuleName());
+            m_HTTP2.Metrics(Output, ModuleName());
+            m_DNS.Metrics(Output, ModuleName());
+            m_Breaker.Metrics(Output, ModuleName());
+            m_Limit.Metrics(Output, ModuleName());
+            m_Scheduler.Metrics(Output, ModuleName());
+            m_Compressor.Metrics(Output, ModuleName());
+            m_Precompressor.Metrics(Output, ModuleName());
+            CFileHandler::Pool().Metrics(Output, ModuleName(), "file_handler");
+            m_Journal.Metrics(Output, ModuleName());
+            m_Shard.Metrics(Output, ModuleName());
+            m_Latency.Metrics(Output, ModuleName());
+
+            Output += CString().Format("# TYPE apostol_worker_pool_backlog gauge\n"
+                                       "apostol_worker_pool_backlog{module=\"%s\"} %llu\n",
+                                       ModuleName().c_str(), (unsigned long long) m_Backlog.size());
+            Output += CString().Format("# TYPE apostol_queue_shed_total counter\n"
+                                       "apostol_queue_shed_total{module=\"%s\"} %llu\n",
+                                       ModuleName().c_str(), (unsigned long long) m_Shed);
+            Output += CString().Format("# TYPE apostol_deadline_expired_total counter\n"
+                                       "apostol_deadline_expired_total{module=\"%s\"} %llu\n",
+                                       ModuleName().c_str(), (unsigned long long) m_Expired);
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CFileCommon::DoError(const Delphi::Exception::Exception &E) const {
+            Log()->Error(APP_LOG_ERR, 0, FILE_SERVER_ERROR_MESSAGE, ModuleName().c_str(), E.what());
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CFileCommon::DoError(CQueueHandler *AHandler, const CString &Message) {
+            Log()->Error(APP_LOG_ERR, 0, FILE_SERVER_ERROR_MESSAGE, ModuleName().c_str(), Message.c_str());
+            DeleteHandler(AHandler);
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CFileCommon::DoCurlException(CCURLClient *Sender, const Delphi::Exception::Exception &E) const {
+            DoError(E);
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CFileCommon::SendMetrics(CHTTPServerConnection *AConnection) const {
+            auto &Reply = AConnection->Reply();
+
+            Reply.Content.Clear();
+            Metrics(Reply.Content);
+
+            AConnection->SendReply(CHTTPReply::ok, "text/plain; version=0.0.4; charset=utf-8", true);
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CFileCommon::DeleteHandler(CQueueHandler *AHandler) {
+            if (Assigned(AHandler)) {
+                const auto pHandler = static_cast<CFileHandler *> (AHandler);
+                if (m_Limit.Active() && pHandler->Started() != 0) {
+                    m_Limit.Sample((Now() - pHandler->Started()) * MSecsPerDay, m_Progress);
+                    m_MaxQueue = m_Limit.Limit();
+                }
+
+                m_Scheduler.Finished(AHandler);
+
+                if (pHandler->Journaled()) {
+                    m_Journal.Removed(pHandler->FileId());
+                }
+
+                if (pHandler->Forwarded()) {
+                    m_Parked--;
+                }
+
+                const auto it = m_Downloads.find(AHandler);
+                if (it != m_Downloads.end()) {
+                    CloseDownload(it->second, true);
+                }
+
+                const auto fetch = m_Fetches.find(AHandler);
+                if (fetch != m_Fetches.end()) {
+                    // No client yet means the fetch was waiting for DNS with a reserved slot.
+                    if (fetch->second.Client == nullptr) {
+                        m_Pool.Cancel(CHTTPClientPool::Key(pHandler->URI()));
+                    } else {
+                        m_Pool.Release(fetch->second.Client, nullptr, false);
+                    }
+                    m_Fetches.erase(fetch);
+                }
+
+                CQueueCollection::DeleteHandler(AHandler);
+            }
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        bool CFileCommon::DoRetry(CFileHandler *AHandler, const CString &Message) {
+            m_Breaker.Failure(AHandler->URI().hostname);
+
+            if (AHandler->Attempt() >= m_RetryMax)
+                return false;
+
+            // Full jitter: a uniform delay in [0, min(cap, base * 2^attempt)].
+            const auto ceiling = std::min<uint64_t>(m_RetryCap, (uint64_t) m_RetryBase << std::min(AHandler->Attempt(), 20));
+            const auto delay = std::uniform_int_distribution<uint64_t>(0, ceiling)(m_Random);
+
+            AHandler->Attempt()++;
+            AHandler->RetryAt() = Now() + (CDateTime) delay / MSecsPerDay;
+
+            Log()->Warning("[%s] Retry %d of %d in %llu ms: %s (%s)", ModuleName().c_str(), AHandler->Attempt(), m_RetryMax,
+                           (unsigned long long) delay, AHandler->URI().href().c_str(), Message.c_str());
+
+            m_Scheduler.Finished(AHandler);
+
+            AHandler->Allow(true);
+
+            return true;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CFileCommon::DoRejected(CFileHandler *AHandler) {
+            const auto &caMessage = CString().Format("Circuit open for host: %s", AHandler->URI().hostname.c_str());
+            const auto pConnection = AHandler->Connection();
+
+            if (Server().IndexOfConnection(pConnection) != -1) {
+                ReplyError(pConnection, CHTTPReply::service_unavailable, caMessage);
+            }
+
+            DoFail(AHandler, caMessage);
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CFileCommon::DoFetch(CFileHandler *AHandler) {
+
+            if (AHandler == nullptr)
+                return;
+
+            if (!m_Breaker.Allow(AHandler->URI().hostname)) {
+                DoRejected(AHandler);
+                return;
+            }
+
+            const auto pItem = std::make_shared<CHTTPPoolConnection>();
+            const auto &caKey = CHTTPClientPool::Key(AHandler->URI());
+
+            if (m_Pool.Active() && !m_Pool.Checkout(caKey, *pItem) && !m_Pool.Acquire(caKey)) {
+                // All connections to this origin are busy: the handler waits in the queue as not started,
+                // so max_age and max_depth still apply to it.
+                AHandler->Started() = 0;
+                return;
+            }
+
+            Begin(AHandler);
+
+            PrepareFile(AHandler);
+
+            if (m_TimeOut > 0) {
+                AHandler->TimeOut(0);
+                AHandler->TimeOutInterval(m_TimeOut * 1000);
+                AHandler->UpdateTimeOut(Now());
+            }
+
+            ArmDeadline(AHandler);
+
+            // The native TLS client sends SNI for and verifies the name it connects to, so https keeps the host name.
+            if (pItem->Client != nullptr || !m_DNS.Active() || AHandler->URI().protocol == "https") {
+                DoFetchStart(AHandler, pItem, AHandler->URI().hostname);
+                return;
+            }
+
+            const auto caHost = AHandler->URI().hostname;
+            const auto ticket = ++m_FetchTicket;
+
+            auto OnResolved = [this, AHandler, pItem, caHost, ticket](int Error, const std::vector<std::string> &Addresses) {
+                const auto it = m_Fetches.find(AHandler);
+                if (it == m_Fetches.end() || it->second.Ticket != ticket)
+                    return;
+
+                m_Fetches.erase(it);
+
+                if (Error != 0) {
+                    m_Pool.Cancel(CHTTPClientPool::Key(AHandler->URI()));
+
+                    const auto &caMessage = CString().Format("Could not resolve host \"%s\": %s", caHost.c_str(), gai_strerror(Error));
+                    const auto pConnection = AHandler->Connection();
+
+                    if (Server().IndexOfConnection(pConnection) != -1) {
+                        ReplyError(pConnection, CHTTPReply::bad_request, caMessage);
+                    }
+
+                    DoFail(AHandler, caMessage);
+                    return;
+                }
+
+                DoFetchStart(AHandler, pItem, Addresses.front().c_str(), std::vector<std::string>(Addresses.begin() + 1, Addresses.end()));
+            };
+
+            m_Fetches[AHandler] = {nullptr, ticket};
+
+            m_DNS.Resolve(caHost, OnResolved);
+
+            UpdateTimer();
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CFileCommon::DoFetchStart(CFileHandler *AHandler, const std::shared_ptr<CHTTPPoolConnection> &Item, const CString &Address,
+                const std::vector<std::string> &Fallback) {
+
+            const auto pItem = Item;
+            const auto &caKey = CHTTPClientPool::Key(AHandler->URI());
+
+            auto OnRequest = [this, AHandler](CHTTPClient *Sender, CHTTPRequest &Request) {
+                if (Assigned(AHandler)) {
+                    CHTTPRequest::Prepare(Request, "GET", AHandler->URI().href().c_str(), nullptr, m_Pool.Active() ? "keep-alive" : "close");
+
+                    // The client may be connected to a cached address: the origin still has to see its own name.
+                    const auto &URI = AHandler->URI();
+                    const auto index = Request.Headers.IndexOfName("Host");
+                    if (index != -1) {
+                        Request.Headers.Delete(index);
+                    }
+
+                    Request.AddHeader("Host", URI.port == 80 || URI.port == 0 ? URI.hostname : CString().Format("%s:%d", URI.hostname.c_str(), URI.port));
+                }
+
+                DebugRequest(Request);
+            };
+            //----------------------------------------------------------------------------------------------------------
+
+            auto OnExecute = [this, AHandler, pItem](CTCPConnection *Sender) {
+                const auto pConnection = dynamic_cast<CHTTPClientConnection *> (Sender);
+                const auto &Reply = pConnection->Reply();
+
+                DebugReply(Reply);
+
+                if (m_Pool.Active()) {
+                    const auto keepAlive = strcasecmp(Reply.Headers["Connection"].c_str(), "close") != 0;
+                    pConnection->CloseConnection(!keepAlive);
+                    m_Fetches.erase(AHandler);
+                    m_Pool.Release(pItem->Client, pConnection, keepAlive);
+                }
+
+                if (Assigned(AHandler)) {
+                    const auto pHandlerConnection = AHandler->Connection();
+                    const auto status = (int) Reply.Status;
+
+                    if (status >= 500 && DoRetry(AHandler, CString().Format("HTTP %d", status)))
+                        return true;
+
+                    if (status < 500) {
+                        m_Breaker.Success(AHandler->URI().hostname);
+                    }
+
+                    if (Reply.Status == CHTTPReply::ok) {
+                        DoSave(AHandler, std::make_shared<CHTTPReply>(Reply));
+                    } else {
+                        const CString Message("Not found");
+
+                        if (Server().IndexOfConnection(pHandlerConnection) != -1) {
+                            ReplyError(pHandlerConnection, CHTTPReply::not_found, Message);
+                        }
+
+                        DoFail(AHandler, Message);
+                    }
+                }
+
+                return true;
+            };
+            //----------------------------------------------------------------------------------------------------------
+
+            auto OnException = [this, AHandler, pItem, Address, Fallback](CTCPConnection *Sender, const Delphi::Exception::Exception &E) {
+                const auto pConnection = dynamic_cast<CHTTPClientConnection *> (Sender);
+                DebugReply(pConnection->Reply());
+
+                if (m_Pool.Active()) {
+                    m_Fetches.erase(AHandler);
+                    m_Pool.Release(pItem->Client, pConnection, false);
+                }
+
+                // A fresh connection that failed moves on to the next resolved address before it counts as a failure.
+                if (Assigned(AHandler) && pItem->Connection == nullptr && !Fallback.empty()) {
+                    const auto &caKey = CHTTPClientPool::Key(AHandler->URI());
+
+                    if (!m_Pool.Active() || m_Pool.Acquire(caKey)) {
+                        Log()->Warning("[%s] Address %s of \"%s\" failed, trying %s: %s", ModuleName().c_str(), Address.c_str(),
+                                       AHandler->URI().hostname.c_str(), Fallback.front().c_str(), E.what());
+
+                        DoFetchStart(AHandler, std::make_shared<CHTTPPoolConnection>(), Fallback.front().c_str(),
+                                     std::vector<std::string>(Fallback.begin() + 1, Fallback.end()));
+                        return;
+                    }
+                }
+
+                if (Assigned(AHandler) && DoRetry(AHandler, E.what())) {
+                    DoError(E);
+                    return;
+                }
+
+                if (Assigned(AHandler)) {
+                    const auto pHandlerConnection = AHandler->Connection();
+
+                    if (Server().IndexOfConnection(pConnection) != -1) {
+                        const CString Message("Not found");
+                        ReplyError(pHandlerConnection, CHTTPReply::not_found, Message);
+                    }
+
+                    DoFail(AHandler, E.what());
+                }
+
+                DoError(E);
+            };
+            //----------------------------------------------------------------------------------------------------------
+
+            auto OnDisconnected = [this](CObject *Sender) {
+                m_Pool.Remove(Sender);
+                DoClientDisconnected(Sender);
+            };
+            //----------------------------------------------------------------------------------------------------------
+
+            if (pItem->Client == nullptr) {
+                pItem->Client = GetClient(Address, AHandler->URI().port);
+#if defined(_GLIBCXX_RELEASE) && (_GLIBCXX_RELEASE >= 9)
+                pItem->Client->OnConnected([this](auto &&Sender) { DoClientConnected(Sender); });
+#else
+                pItem->Client->OnConnected(std::bind(&CFileCommon::DoClientConnected, this, _1));
+#endif
+                pItem->Client->OnDisconnected(OnDisconnected);
+
+                if (m_Pool.Active()) {
+                    m_Pool.Attach(caKey, pItem->Client);
+                }
+            }
+
+            const auto pClient = pItem->Client;
+
+            pClient->OnRequest(OnRequest);
+            pClient->OnExecute(OnExecute);
+            pClient->OnException(OnException);
+
+            if (m_Pool.Active()) {
+                m_Fetches[AHandler] = {pClient, 0};
+            }
+
+            try {
+                if (pItem->Connection != nullptr) {
+                    auto &Request = pItem->Connection->Request();
+
+                    Request.Clear();
+                    pItem->Connection->Reply().Clear();
+
+                    OnRequest(pClient, Request);
+
+                    pItem->Connection->SendRequest(true);
+                } else {
+                    pClient->AutoFree(!m_Pool.Active());
+                    pClient->Active(true);
+                }
+            } catch (std::exception &e) {
+                if (m_Pool.Active()) {
+                    m_Fetches.erase(AHandler);
+                    m_Pool.Release(pClient, pItem->Connection, false);
+                }
+
+                DoFail(AHandler, e.what());
+            }
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CFileCommon::CurlToReply(CCurlFetch *Sender, CHTTPReply &Reply) {
+            Reply.Headers.Clear();
+            for (int i = 1; i < Sender->Headers().Count(); i++) {
+                const auto &Header = Sender->Headers()[i];
+                Reply.AddHeader(Header.Name(), Header.Value());
+            }
+
+            Reply.StatusString = Sender->GetResponseCode();
+            Reply.StatusText = Reply.StatusString;
+
+            Reply.StringToStatus();
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        bool CFileCommon::ParseContentRange(const CString &Value, uint64_t &From, uint64_t &To, uint64_t &Size) {
+            unsigned long long from = 0, to = 0, size = 0;
+
+            if (sscanf(Value.c_str(), "bytes %llu-%llu/%llu", &from, &to, &size) != 3 || from > to || to >= size)
+                return false;
+
+            From = from;
+            To = to;
+            Size = size;
+
+            return true;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        CString CFileCommon::FileSHA256(const CString &FileName) {
+            CString Result;
+
+            const auto fd = open(FileName.c_str(), O_RDONLY | O_CLOEXEC);
+            if (fd == -1)
+                throw EOSError(errno, _T("Could not open file: \"%s\" error: "), FileName.c_str());
+
+            auto pContext = EVP_MD_CTX_new();
+            EVP_DigestInit_ex(pContext, EVP_sha256(), nullptr);
+
+            std::vector<unsigned char> Buffer(FILE_COMMON_READ_BUFFER);
+
+            ssize_t count;
+            while ((count = read(fd, Buffer.data(), Buffer.size())) > 0) {
+                EVP_DigestUpdate(pContext, Buffer.data(), count);
+            }
+
+            close(fd);
+
+            unsigned char szDigest[EVP_MAX_MD_SIZE];
+            unsigned int length = 0;
+
+            EVP_DigestFinal_ex(pContext, szDigest, &length);
+            EVP_MD_CTX_free(pContext);
+
+            if (count < 0)
+                throw EOSError(errno, _T("Could not read file: \"%s\" error: "), FileName.c_str());
+
+            TCHAR szHex[3] = {0};
+            for (unsigned int i = 0; i < length; ++i) {
+                snprintf(szHex, sizeof(szHex), "%02x", szDigest[i]);
+                Result += szHex;
+            }
+
+            return Result;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CFileCommon::DoCURL(CFileHandler *AHandler) {
+
+            if (!m_Breaker.Allow(AHandler->URI().hostname)) {
+                DoRejected(AHandler);
+                return;
+            }
+
+            Begin(AHandler);
+
+            PrepareFile(AHandler);
+
+            if (m_TimeOut > 0) {
+                AHandler->TimeOut(0);
+                AHandler->TimeOutInterval((m_TimeOut + 10) * 1000);
+                AHandler->UpdateTimeOut(Now());
+            }
+
+            ArmDeadline(AHandler);
+
+            CHeaders Headers;
+
+            if (m_SegmentThreshold > 0) {
+                Headers.AddPair("Range", CString().Format("bytes=0-%llu", (unsigned long long) m_SegmentThreshold - 1));
+            }
+
+            DoGet(AHandler, Headers);
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CFileCommon::CurlGet(const CLocation &URI, const CHeaders &Headers, CDateTime Deadline, COnFileFetchEvent &&OnDone, COnFileFetchErrorEvent &&OnFail,
+                COnFileFetchDataEvent &&OnData) {
+
+            const auto timeout = Deadline == 0 ? 0 : std::max<long>(1, CDeadline::Remaining(Deadline, Now()));
+
+            if (m_HTTP2.Active()) {
+                COnHTTP2DataEvent Data = nullptr;
+                if (OnData) {
+                    Data = [OnData](CHTTP2Transfer *Transfer, const char *Buffer, size_t Size) {
+                        return OnData((int) Transfer->Code, Buffer, Size);
+                    };
+                }
+
+                auto Done = [OnDone, OnFail](CHTTP2Transfer *Transfer, CURLcode Result, const CString &Error) {
+                    if (Result != CURLE_OK) {
+                        OnFail(Error);
+                        return;
+                    }
+
+                    CHTTPReply Reply;
+
+                    for (int i = 0; i < Transfer->Headers.Count(); i++) {
+                        const auto &Header = Transfer->Headers[i];
+                        Reply.AddHeader(Header.Name(), Header.Value());
+                    }
+
+                    Reply.StatusString = (int) Transfer->Code;
+                    Reply.StatusText = Reply.StatusString;
+
+                    Reply.StringToStatus();
+
+                    OnDone((int) Transfer->Code, Reply, Transfer->Body);
+                };
+
+                if (m_DNS.Active()) {
+                    auto OnResolved = [this, URI, Headers, timeout, Done, Data, OnFail](int Error, const std::vector<std::string> &Addresses) {
+                        if (Error != 0) {
+                            OnFail(CString().Format("Could not resolve host \"%s\": %s", URI.hostname.c_str(), gai_strerror(Error)));
+                            return;
+                        }
+
+                        CString Resolve;
+
+                        Resolve.Format("%s:%d:", URI.hostname.c_str(), URI.port);
+                        for (size_t i = 0; i < Addresses.size(); ++i) {
+                            if (i > 0)
+                                Resolve += ",";
+                            if (Addresses[i].find(':') != std::string::npos) {
+                                Resolve += "[";
+                                Resolve += Addresses[i].c_str();
+                                Resolve += "]";
+                            } else {
+                                Resolve += Addresses[i].c_str();
+                            }
+                        }
+
+                        auto Transfer = Done;
+                        auto Sink = Data;
+                        if (!m_HTTP2.Get(URI.href(), Headers, std::move(Transfer), Resolve, timeout, std::move(Sink))) {
+                            OnFail("Could not start transfer");
+                            return;
+                        }
+
+                        UpdateTimer();
+                    };
+
+                    m_DNS.Resolve(URI.hostname, OnResolved);
+
+                    UpdateTimer();
+                    return;
+                }
+
+                if (m_HTTP2.Get(URI.href(), Headers, std::move(Done), CString(), timeout, std::move(Data))) {
+                    UpdateTimer();
+                    return;
+                }
+            }
+
+            auto Done = [OnDone, OnData, OnFail](CCurlFetch *Sender, CURLcode code, const CString &Error) {
+                CHTTPReply Reply;
+                CurlToReply(Sender, Reply);
+
+                // This client only delivers whole bodies: the data handler gets it in one piece.
+                if (OnData) {
+                    const auto &caResult = Sender->Result();
+                    if (!OnData((int) Sender->GetResponseCode(), caResult.c_str(), caResult.Size())) {
+                        OnFail("Body refused by the data handler");
+                        return;
+                    }
+                    OnDone((int) Sender->GetResponseCode(), Reply, CString());
+                    return;
+                }
+
+                OnDone((int) Sender->GetResponseCode(), Reply, Sender->Result());
+            };
+
+            auto Fail = [OnFail](CCurlFetch *Sender, CURLcode code, const CString &Error) {
+                OnFail(Error);
+            };
+
+            m_Client.Get(URI, Headers, Done, Fail);
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CFileCommon::DoGet(CFileHandler *AHandler, const CHeaders &Headers) {
+
+            auto OnDone = [this, AHandler](int Code, CHTTPReply &Reply, const CString &Content) {
+                const auto pConnection = AHandler->Connection();
+
+                if (Code >= 500 && DoRetry(AHandler, CString().Format("HTTP %d", Code)))
+                    return;
+
+                if (Code < 500) {
+                    m_Breaker.Success(AHandler->URI().hostname);
+                }
+
+                if (Code == 206) {
+                    uint64_t From, To, Size;
+
+                    if (!ParseContentRange(Reply.Headers["Content-Range"], From, To, Size) || From != 0) {
+                        DoGet(AHandler, CHeaders());
+                        return;
+                    }
+
+                    // The first range is written at offset zero as is: a body that does not match it would corrupt the file.
+                    if (To >= Size || Content.Size() != To + 1) {
+                        const auto caMessage = CString().Format("Unexpected body of %llu bytes for range 0-%llu/%llu",
+                                (unsigned long long) Content.Size(), (unsigned long long) To, (unsigned long long) Size);
+
+                        if (DoRetry(AHandler, caMessage))
+                            return;
+
+                        if (Server().IndexOfConnection(pConnection) != -1) {
+                            ReplyError(pConnection, CHTTPReply::bad_gateway, caMessage);
+                        }
+
+                        DoFail(AHandler, caMessage);
+                        return;
+                    }
+
+                    if (To + 1 < Size) {
+                        DoSegments(AHandler, Content, std::make_shared<CHTTPReply>(std::move(Reply)), Size);
+                        return;
+                    }
+
+                    Reply.DelHeader("Content-Range");
+                }
+
+                if (Code == 200 || Code == 206) {
+                    Reply.Content = Content;
+                    Reply.ContentLength = Reply.Content.Length();
+
+                    Reply.DelHeader("Transfer-Encoding");
+                    Reply.DelHeader("Content-Encoding");
+                    Reply.DelHeader("Content-Length");
+
+                    Reply.AddHeader("Content-Length", CString::ToString(Reply.ContentLength));
+
+                    DoSave(AHandler, std::make_shared<CHTTPReply>(std::move(Reply)));
+                } else {
+                    const CString Message("Not found");
+
+                    if (Server().IndexOfConnection(pConnection) != -1) {
+                        ReplyError(pConnection, CHTTPReply::not_found, Message);
+                    }
+
+                    DoFail(AHandler, Message);
+                }
+            };
+            //----------------------------------------------------------------------------------------------------------
+
+            auto OnFail = [this, AHandler](const CString &Error) {
+                Log()->Warning("[%s] [CURL] %s", ModuleName().c_str(), Error.c_str());
+
+                if (DoRetry(AHandler, Error))
+                    return;
+
+                const auto pConnection = AHandler->Connection();
+                if (Server().IndexOfConnection(pConnection) != -1) {
+                    ReplyError(pConnection, CHTTPReply::bad_request, Error);
+                }
+                DoFail(AHandler, Error);
+            };
+            //----------------------------------------------------------------------------------------------------------
+
+            try {
+                CurlGet(AHandler->URI(), Headers, AHandler->Deadline(), OnDone, OnFail);
+            } catch (std::exception &e) {
+                DoFail(AHandler, e.what());
+            }
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CFileCommon::DoSegments(CFileHandler *AHandler, const CString &Content, const std::shared_ptr<CHTTPReply> &Reply, uint64_t Size) {
+            auto pDownload = std::make_shared<CFileDownload>();
+
+            pDownload->Handler = AHandler;
+            pDownload->FileName = AHandler->AbsoluteName();
+            pDownload->TempName = pDownload->FileName + ".~part";
+            pDownload->Reply = Reply;
+            pDownload->Size = Size;
+
+            Reply->DelHeader("Content-Range");
+            Reply->DelHeader("Transfer-Encoding");
+            Reply->DelHeader("Content-Encoding");
+            Reply->DelHeader("Content-Length");
+
+            Reply->ContentLength = Size;
+            Reply->AddHeader("Content-Length", CString::ToString(Size));
+
+            const uint64_t from = Content.Size();
+            const uint64_t count = std::max<uint64_t>(1, std::min<uint64_t>(m_Segments, (Size - from + m_SegmentThreshold - 1) / m_SegmentThreshold));
+            const uint64_t length = (Size - from + count - 1) / count;
+
+            for (uint64_t offset = from; offset < Size; offset += length) {
+                CFileSegment Segment;
+                Segment.From = offset;
+                Segment.To = std::min(offset + length, Size) - 1;
+                Segment.Offset = offset;
+                pDownload->Segments.push_back(Segment);
+            }
+
+            pDownload->Active = pDownload->Segments.size();
+
+            m_Downloads[AHandler] = pDownload;
+
+            const auto pContent = std::make_shared<CString>(Content);
+            const auto pError = std::make_shared<CString>();
+
+            // Everything that touches the file runs in the pool, keyed by the temporary name so it stays in order.
+            auto Work = [this, pDownload, pContent, pError]() {
+                ForceDirectory(pDownload->FileName);
+
+                const auto fd = open(pDownload->TempName.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+                if (fd == -1) {
+                    *pError = CString().Format("Could not create file \"%s\": %s", pDownload->TempName.c_str(), strerror(errno));
+                    return;
+                }
+
+                pDownload->Fd = fd;
+
+                const auto error = posix_fallocate(fd, 0, (off_t) pDownload->Size);
+                if (error != 0 && error != EOPNOTSUPP && error != EINVAL) {
+                    *pError = CString().Format("Could not allocate %llu bytes: %s", (unsigned long long) pDownload->Size, strerror(error));
+                    return;
+                }
+
+                if (!WriteSegment(fd, *pContent, 0)) {
+                    *pError = CString().Format("Could not write file \"%s\": %s", pDownload->TempName.c_str(), strerror(errno));
+                }
+            };
+
+            auto Done = [this, pDownload, pError]() {
+                if (pDownload->Cancelled)
+                    return;
+
+                if (!pError->IsEmpty()) {
+                    DoSegmentsAbort(pDownload, *pError);
+                    return;
+                }
+
+                for (size_t i = 0; i < pDownload->Segments.size(); ++i) {
+                    DoSegment(pDownload, i);
+                }
+            };
+
+            if (!Post(pDownload->TempName, std::move(Work), std::move(Done))) {
+                Work();
+                Done();
+            }
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CFileCommon::DoSegment(const std::shared_ptr<CFileDownload> &Download, size_t Index) {
+
+            if (Download->Cancelled)
+                return;
+
+            auto OnData = [this, Download, Index](int Code, const char *Buffer, size_t Size) {
+                if (Download->Cancelled)
+                    return false;
+
+                auto &Segment = Download->Segments[Index];
+
+                if (Code != 206 || Segment.Offset + Segment.Buffer.Size() + Size > Segment.To + 1)
+                    return false;
+
+                Segment.Buffer.Append(Buffer, Size);
+
+                if (Segment.Buffer.Size() >= FILE_COMMON_SEGMENT_FLUSH) {
+                    FlushSegment(Download, Index);
+                }
+
+                return true;
+            };
+            //----------------------------------------------------------------------------------------------------------
+
+            auto OnDone = [this, Download, Index](int Code, CHTTPReply &Reply, const CString &Content) {
+                if (Download->Cancelled)
+                    return;
+
+                const auto &Segment = Download->Segments[Index];
+
+                if (Code != 206 || Segment.Offset + Segment.Buffer.Size() != Segment.To + 1) {
+                    DoSegmentFail(Download, Index, CString().Format("Unexpected reply for range %llu-%llu: %d",
+                            (unsigned long long) Segment.From, (unsigned long long) Segment.To, Code));
+                    return;
+                }
+
+                FlushSegment(Download, Index);
+
+                if (Download->Cancelled)
+                    return;
+
+                if (--Download->Active == 0 && Download->Writes == 0) {
+                    DoSegmentsDone(Download);
+                }
+            };
+            //----------------------------------------------------------------------------------------------------------
+
+            auto OnFail = [this, Download, Index](const CString &Error) {
+                if (Download->Cancelled)
+                    return;
+
+                DoSegmentFail(Download, Index, Error);
+            };
+            //----------------------------------------------------------------------------------------------------------
+
+            const auto &Segment = Download->Segments[Index];
+
+            // A retry resumes after the bytes that already arrived.
+            CHeaders Headers;
+            Headers.AddPair("Range", CString().Format("bytes=%llu-%llu", (unsigned long long) (Segment.Offset + Segment.Buffer.Size()),
+                    (unsigned long long) Segment.To));
+
+            try {
+                CurlGet(Download->Handler->URI(), Headers, Download->Handler->Deadline(), OnDone, OnFail, OnData);
+            } catch (std::exception &e) {
+                DoSegmentsAbort(Download, e.what());
+            }
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CFileCommon::FlushSegment(const std::shared_ptr<CFileDownload> &Download, size_t Index) {
+            auto &Segment = Download->Segments[Index];
+
+            if (Segment.Buffer.IsEmpty())
+                return;
+
+            const auto pBuffer = std::make_shared<CString>(std::move(Segment.Buffer));
+            const auto offset = Segment.Offset;
+            const auto pError = std::make_shared<int>(0);
+
+            Segment.Buffer.Clear();
+            Segment.Offset += pBuffer->Size();
+
+            Download->Writes++;
+
+            auto Work = [Download, pBuffer, offset, pError]() {
+                const auto fd = Download->Fd.load();
+
+                if (fd == -1) {
+                    *pError = EBADF;
+                } else if (!WriteSegment(fd, *pBuffer, offset)) {
+                    *pError = errno;
+                }
+            };
+
+            auto Done = [this, Download, pError]() {
+                Download->Writes--;
+
+                if (Download->Cancelled)
+                    return;
+
+                if (*pError != 0) {
+                    DoSegmentsAbort(Download, CString().Format("Could not write file \"%s\": %s", Download->TempName.c_str(), strerror(*pError)));
+                    return;
+                }
+
+                if (Download->Active == 0 && Download->Writes == 0) {
+                    DoSegmentsDone(Download);
+                }
+            };
+
+            if (!Post(Download->TempName, std::move(Work), std::move(Done))) {
+                Work();
+                Done();
+            }
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CFileCommon::DoSegmentFail(const std::shared_ptr<CFileDownload> &Download, size_t Index, const CString &Message) {
+            auto &Segment = Download->Segments[Index];
+
+            Log()->Warning("[%s] [CURL] Segment %llu-%llu of \"%s\" failed (attempt %d): %s", ModuleName().c_str(),
+                           (unsigned long long) Segment.From, (unsigned long long) Segment.To, Download->FileName.c_str(),
+                           Segment.Attempts + 1, Message.c_str());
+
+            if (++Segment.Attempts <= m_SegmentRetries) {
+                DoSegment(Download, Index);
+            } else {
+                DoSegmentsAbort(Download, Message);
+            }
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CFileCommon::DoSegmentsDone(const std::shared_ptr<CFileDownload> &Download) {
+            const auto pHandler = Download->Handler;
+            const auto caFileName = Download->FileName;
+            const auto pReply = Download->Reply;
+
+            Download->Cancelled = true;
+            m_Downloads.erase(pHandler);
+
+            if (pHandler->Requested() != 0) {
+                m_Latency.Record(lsUpstream, CLatencyHistogram::Clock() - pHandler->Requested());
+                pHandler->Requested() = 0;
+            }
+
+            const auto pResult = std::make_shared<CFileSaveResult>();
+            const auto pContent = std::make_shared<CString>();
+
+            // A client that cannot take sendfile gets the body loaded here rather than by DoSendFile on the loop.
+            const auto pConnection = pHandler->Connection();
+            const auto bLoad = Server().IndexOfConnection(pConnection) != -1 && LoadRequired(pConnection);
+
+            auto Work = [this, Download, caFileName, bLoad, pResult, pContent]() {
+                try {
+                    const auto fd = Download->Fd.exchange(-1);
+                    if (fd != -1) {
+                        close(fd);
+                    }
+
+                    if (rename(Download->TempName.c_str(), caFileName.c_str()) != 0) {
+                        pResult->Error = CString().Format("Could not rename file \"%s\": %s", Download->TempName.c_str(), strerror(errno));
+                        unlink(Download->TempName.c_str());
+                        return;
+                    }
+
+                    pResult->Modified = FileAge(caFileName.c_str());
+
+                    const auto hash = CLatencyHistogram::Clock();
+                    pResult->Hash = FileSHA256(caFileName);
+                    m_Latency.Record(lsHash, CLatencyHistogram::Clock() - hash);
+
+                    if (bLoad) {
+                        pContent->LoadFromFile(caFileName.c_str());
+                    }
+                } catch (std::exception &e) {
+                    pResult->Error = e.what();
+                }
+            };
+
+            auto Done = [this, pHandler, pReply, caFileName, pResult, pContent]() {
+                const auto pConnection = pHandler->Connection();
+
+                if (!pContent->IsEmpty() && Server().IndexOfConnection(pConnection) != -1) {
+                    pConnection->Reply().Content = std::move(*pContent);
+                }
+
+                DoSaved(pHandler, pReply, caFileName, pResult);
+            };
+
+            pHandler->TimeOut(INFINITE);
+
+            if (!Post(Download->TempName, std::move(Work), std::move(Done))) {
+                Work();
+                Done();
+            }
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CFileCommon::DoSegmentsAbort(const std::shared_ptr<CFileDownload> &Download, const CString &Message) {
+            const auto pHandler = Download->Handler;
+            CloseDownload(Download, true);
+            DoSegmentsFail(pHandler, Message);
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CFileCommon::DoSegmentsFail(CFileHandler *AHandler, const CString &Message) {
+            Log()->Error(APP_LOG_ERR, 0, FILE_SERVER_ERROR_MESSAGE, ModuleName().c_str(), Message.c_str());
+
+            const auto pConnection = AHandler->Connection();
+            if (Server().IndexOfConnection(pConnection) != -1) {
+                ReplyError(pConnection, CHTTPReply::bad_request, Message);
+            }
+
+            DoFail(AHandler, Message);
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CFileCommon::CloseDownload(const std::shared_ptr<CFileDownload> &Download, bool Remove) {
+            Download->Cancelled = true;
+
+            m_Downloads.erase(Download->Handler);
+
+            // Queued behind the writes of this download, so the descriptor is never closed under them.
+            auto Work = [Download, Remove]() {
+                const auto fd = Download->Fd.exchange(-1);
+                if (fd != -1) {
+                    close(fd);
+                }
+
+                if (Remove) {
+                    unlink(Download->TempName.c_str());
+                }
+            };
+
+            if (!Post(Download->TempName, std::move(Work), nullptr)) {
+                Work();
+            }
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        bool CFileCommon::WriteSegment(int Fd, const CString &Content, uint64_t Offset) {
+            const auto pBuffer = Content.c_str();
+            const auto size = Content.Size();
+
+            size_t written = 0;
+
+            while (written < size) {
+                const auto count = pwrite(Fd, pBuffer + written, size - written, (off_t) (Offset + written));
+                if (count < 0) {
+                    if (errno == EINTR)
+                        continue;
+                    return false;
+                }
+                written += count;
+            }
+
+            return true;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CFileCommon::DoDone(CFileHandler *AHandler, const CHTTPReply &Reply) {
+            const auto start = CLatencyHistogram::Clock();
+            const auto &caHash = SHA256(Reply.Content.IsEmpty() ? "" : Reply.Content, true);
+            m_Latency.Record(lsHash, CLatencyHistogram::Clock() - start);
+
+            DoDone(AHandler, Reply, caHash);
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CFileCommon::DoDone(CFileHandler *AHandler, const CHTTPReply &Reply, const CString &Hash) {
+
+            auto OnExecuted = [this, start = CLatencyHistogram::Clock()](CPQPollQuery *APollQuery) {
+                m_Latency.Record(lsWriteBack, CLatencyHistogram::Clock() - start);
+                const auto pHandler = dynamic_cast<CFileHandler *> (APollQuery->Binding());
+                DeleteHandler(pHandler);
+            };
+
+            auto OnException = [this](CPQPollQuery *APollQuery, const Delphi::Exception::Exception &E) {
+                const auto pHandler = dynamic_cast<CFileHandler *> (APollQuery->Binding());
+                DoError(pHandler, E.Message());
+            };
+
+            if (AHandler->Done().IsEmpty()) {
+                DeleteHandler(AHandler);
+                return;
+            }
+
+            const auto &caFileId = PQQuoteLiteral(AHandler->FileId());
+            const auto &caAbsoluteName = PQQuoteLiteral(AHandler->AbsoluteName());
+            const auto &caHash = Hash;
+            const auto &caContentType = PQQuoteLiteral(Reply.Headers["Content-Type"]);
+
+            CStringList SQL;
+
+            SQL.Add(CString()
+                            .MaxFormatSize(256 + caFileId.Size() + caAbsoluteName.Size() + caHash.Size() + caContentType.Size())
+                            .Format("SELECT %s(%s::uuid, %s, %llu, '%s', %s);",
+                                    AHandler->Done().c_str(),
+                                    caFileId.c_str(),
+                                    caAbsoluteName.c_str(),
+                                    (unsigned long long) Reply.ContentLength,
+                                    caHash.c_str(),
+                                    caContentType.c_str()
+                            ));
+
+            try {
+                ExecSQL(SQL, AHandler, OnExecuted, OnException);
+            } catch (Delphi::Exception::Exception &E) {
+                DoError(AHandler, E.Message());
+            }
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CFileCommon::DoFail(CFileHandler *AHandler, const CString &Message) {
+
+            auto OnExecuted = [this](CPQPollQuery *APollQuery) {
+                const auto pHandler = dynamic_cast<CFileHandler *> (APollQuery->Binding());
+                DeleteHandler(pHandler);
+            };
 
             auto OnException = [this](CPQPollQuery *APollQuery, const Delphi::Exception::Exception &E) {
                 const auto pHandler = dynamic_cast<CFileHandler *> (APollQuery->Binding());
                 DoError(pHandler, E.Message());
             };
 
-            if (AHandler->Fail().IsEmpty()) {
-                DeleteHandler(AHandler);
-                return;
+            if (AHandler->Fail().IsEmpty()) {
+                DeleteHandler(AHandler);
+                return;
+            }
+
+            const auto &caFileId = PQQuoteLiteral(AHandler->FileId());
+            const auto &caMessage = PQQuoteLiteral(Message);
+
+            CStringList SQL;
+
+            SQL.Add(CString()
+                            .MaxFormatSize(256 + caFileId.Size() + caMessage.Size())
+                            .Format("SELECT %s(%s::uuid, %s);",
+                                    AHandler->Fail().c_str(),
+                                    caFileId.c_str(),
+                                    caMessage.c_str()
+                            ));
+
+            try {
+                ExecSQL(SQL, AHandler, OnExecuted, OnException);
+            } catch (Delphi::Exception::Exception &E) {
+                DoError(AHandler, E.Message());
+            }
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CFileCommon::DoPostgresQueryExecuted(CPQPollQuery *APollQuery) {
+            try {
+                for (int i = 0; i < APollQuery->Count(); i++) {
+                    const auto pResult = APollQuery->Results(i);
+                    if (pResult->ExecStatus() != PGRES_TUPLES_OK)
+                        throw Delphi::Exception::EDBError("%s", pResult->GetErrorMessage());
+                }
+            } catch (Delphi::Exception::Exception &E) {
+                DoError(E);
+            }
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CFileCommon::DoPostgresQueryException(CPQPollQuery *APollQuery, const Delphi::Exception::Exception &E) {
+            DoError(E);
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CFileCommon::DoClientConnected(CObject *Sender) const {
+            const auto pConnection = dynamic_cast<CHTTPClientConnection *>(Sender);
+            if (Assigned(pConnection)) {
+                const auto pSocket = pConnection->Socket();
+                if (pSocket != nullptr) {
+                    const auto pHandle = pSocket->Binding();
+                    if (pHandle != nullptr) {
+                        Log()->Notice(_T("[%s] [%s:%d] Client connected."), ModuleName().c_str(), pHandle->PeerIP(), pHandle->PeerPort());
+                    }
+                }
+            }
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CFileCommon::DoClientDisconnected(CObject *Sender) const {
+            const auto pConnection = dynamic_cast<CHTTPClientConnection *>(Sender);
+            if (Assigned(pConnection)) {
+                const auto pSocket = pConnection->Socket();
+                if (pSocket != nullptr) {
+                    const auto pHandle = pSocket->Binding();
+                    if (pHandle != nullptr) {
+                        Log()->Notice(_T("[%s] [%s:%d] Client disconnected."), ModuleName().c_str(), pHandle->PeerIP(), pHandle->PeerPort());
+                    }
+                } else {
+                    Log()->Notice(_T("[%s] Client disconnected."), ModuleName().c_str());
+                }
+            }
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CFileCommon::Reject(CStringList &SQL, const std::vector<CFileHandler *> &Handlers, CHTTPReply::CStatusType Status, const CString &Message) {
+            const auto &caMessage = PQQuoteLiteral(Message);
+
+            for (auto pHandler : Handlers) {
+                const auto pConnection = pHandler->Connection();
+
+                if (Server().IndexOfConnection(pConnection) != -1) {
+                    if (Status == CHTTPReply::service_unavailable) {
+                        pConnection->Reply().AddHeader("Retry-After", CString::ToString(m_RetryAfter));
+                    }
+                    ReplyError(pConnection, Status, Message);
+                }
+
+                if (!pHandler->Fail().IsEmpty()) {
+                    SQL.Add(CString().Format("SELECT %s(%s::uuid, %s);", pHandler->Fail().c_str(), PQQuoteLiteral(pHandler->FileId()).c_str(), caMessage.c_str()));
+                }
+
+                DeleteHandler(pHandler);
+            }
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CFileCommon::Shed(CDateTime Now) {
+            const auto index = m_Queue.IndexOf(this);
+            if (index == -1)
+                return;
+
+            Hold();
+
+            const auto pQueue = m_Queue[index];
+
+            std::vector<CFileHandler *> Waiting;
+            std::vector<CFileHandler *> Rejected;
+            std::vector<CFileHandler *> Expired;
+
+            for (int i = 0; i < pQueue->Count(); ++i) {
+                const auto pHandler = static_cast<CFileHandler *> (pQueue->Item(i));
+                if (pHandler != nullptr && pHandler->Allow()) {
+                    if (m_Shard.Active() && !pHandler->Placed()) {
+                        pHandler->Placed() = true;
+                        if (Place(pHandler)) {
+                            pHandler->Allow(false);
+                            m_Parked++;
+                            continue;
+                        }
+                    }
+
+                    if (m_Journal.Active() && !pHandler->Journaled() && !pHandler->Payload().IsEmpty()) {
+                        m_Journal.Queued(pHandler->FileId(), pHandler->Payload().Raw());
+                        pHandler->Journaled() = true;
+                    }
+
+                    if (CDeadline::Expired(pHandler->Deadline(), Now)) {
+                        Expired.push_back(pHandler);
+                    } else if (pHandler->Started() == 0) {
+                        if (m_MaxAge > 0 && Now - pHandler->Created() >= m_MaxAge) {
+                            Rejected.push_back(pHandler);
+                        } else {
+                            Waiting.push_back(pHandler);
+                        }
+                    }
+                }
+            }
+
+            // The newest arrivals are rejected first, so the work that already waited keeps its place.
+            if (m_MaxDepth > 0 && Waiting.size() > (size_t) m_MaxDepth) {
+                Rejected.insert(Rejected.end(), Waiting.begin() + m_MaxDepth, Waiting.end());
+            }
+
+            if (Rejected.empty() && Expired.empty()) {
+                Resume();
+                return;
+            }
+
+            auto OnExecuted = [](CPQPollQuery *APollQuery) {
+
+            };
+
+            auto OnException = [this](CPQPollQuery *APollQuery, const Delphi::Exception::Exception &E) {
+                DoError(E);
+            };
+
+            CStringList SQL;
+
+            if (!Rejected.empty()) {
+                Reject(SQL, Rejected, CHTTPReply::service_unavailable, "Service unavailable: queue is full");
+                m_Shed += Rejected.size();
+                Log()->Warning("[%s] Queue overloaded, rejected: %d", ModuleName().c_str(), (int) Rejected.size());
             }
 
-            const auto &caFileId = PQQuoteLiteral(AHandler->FileId());
-            const auto &caMessage = PQQuoteLiteral(Message);
+            if (!Expired.empty()) {
+                Reject(SQL, Expired, CHTTPReply::gateway_timeout, "Deadline exceeded");
+                m_Expired += Expired.size();
+                Log()->Notice("[%s] Deadline exceeded, dropped: %d", ModuleName().c_str(), (int) Expired.size());
+            }
 
-            CStringList SQL;
+            if (SQL.Count() != 0) {
+                try {
+                    ExecSQL(SQL, nullptr, OnExecuted, OnException);
+                } catch (Delphi::Exception::Exception &E) {
+                    DoError(E);
+                }
+            }
 
-            SQL.Add(CString()
-                            .MaxFormatSize(256 + caFileId.Size() + caMessage.Size())
-                            .Format("SELECT %s(%s::uuid, %s);",
-                                    AHandler->Fail().c_str(),
-                                    caFileId.c_str(),
-                                    caMessage.c_str()
-                            ));
+            Resume();
+        }
+        //--------------------------------------------------------------------------------------------------------------
 
-            try {
-                ExecSQL(SQL, AHandler, OnExecuted, OnException);
-            } catch (Delphi::Exception::Exception &E) {
-                DoError(AHandler, E.Message());
+        void CFileCommon::Begin(CFileHandler *AHandler) {
+            // The queue wait ends when the fetch really starts, not when a refused dispatch was tried.
+            if (AHandler->Attempt() == 0) {
+                const auto now = Now();
+                m_Limit.Queued((now - AHandler->Created()) * MSecsPerDay);
+                m_Latency.Record(lsQueue, AHandler->Created(), now);
             }
+
+            AHandler->Allow(false);
+            AHandler->Requested() = CLatencyHistogram::Clock();
+            m_Cache.Miss();
         }
         //--------------------------------------------------------------------------------------------------------------
 
-        void CFileCommon::DoPostgresQueryExecuted(CPQPollQuery *APollQuery) {
-            try {
-                for (int i = 0; i < APollQuery->Count(); i++) {
-                    const auto pResult = APollQuery->Results(i);
-                    if (pResult->ExecStatus() != PGRES_TUPLES_OK)
-                        throw Delphi::Exception::EDBError("%s", pResult->GetErrorMessage());
+        bool CFileCommon::Dispatch(CFileHandler *AHandler, CDateTime Now) {
+            AHandler->Started() = Now;
+
+            if (AHandler->Journaled()) {
+                m_Journal.Started(AHandler->FileId());
+            }
+
+            AHandler->Handler();
+
+            return m_Progress < m_MaxQueue;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CFileCommon::Restore(const CQueueJournalEntry &Entry) {
+            if (!DoRecover(Entry)) {
+                Log()->Notice("[%s] Journal: file %s was not recovered.", ModuleName().c_str(), Entry.Key.c_str());
+                m_Journal.Removed(Entry.Key);
+            }
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CFileCommon::Recover() {
+            auto Entries = m_Journal.TakeRecovered();
+            if (Entries.empty())
+                return;
+
+            // Requests the database has already handed back to the module are queued again by now.
+            std::set<std::string> Queued;
+
+            const auto index = m_Queue.IndexOf(this);
+            if (index != -1) {
+                const auto pQueue = m_Queue[index];
+                for (int i = 0; i < pQueue->Count(); ++i) {
+                    const auto pHandler = static_cast<CFileHandler *> (pQueue->Item(i));
+                    if (pHandler != nullptr) {
+                        Queued.insert(pHandler->FileId().c_str());
+                    }
+                }
+            }
+
+            std::vector<CQueueJournalEntry> Pending;
+            for (auto &Entry : Entries) {
+                if (Queued.count(Entry.Key.c_str()) == 0) {
+                    Pending.push_back(std::move(Entry));
+                }
+            }
+
+            if (Pending.empty())
+                return;
+
+            Log()->Notice("[%s] Journal: recovering %d file request(s).", ModuleName().c_str(), (int) Pending.size());
+
+            if (m_JournalCheck.IsEmpty()) {
+                for (const auto &Entry : Pending) {
+                    Restore(Entry);
+                }
+                return;
+            }
+
+            auto OnExecuted = [this, Pending](CPQPollQuery *APollQuery) {
+                std::set<std::string> Alive;
+
+                const auto pResult = APollQuery->Results(0);
+                if (pResult->ExecStatus() == PGRES_TUPLES_OK) {
+                    for (int row = 0; row < pResult->nTuples(); ++row) {
+                        Alive.insert(pResult->GetValue(row, 0));
+                    }
+                } else {
+                    Log()->Error(APP_LOG_ERR, 0, FILE_SERVER_ERROR_MESSAGE, ModuleName().c_str(), pResult->GetErrorMessage());
+                    for (const auto &Entry : Pending) {
+                        Alive.insert(Entry.Key.c_str());
+                    }
+                }
+
+                // Whatever the database no longer lists as pending was finished before the restart.
+                for (const auto &Entry : Pending) {
+                    if (Alive.count(Entry.Key.c_str()) != 0) {
+                        Restore(Entry);
+                    } else {
+                        m_Journal.Removed(Entry.Key);
+                    }
+                }
+            };
+
+            auto OnException = [this, Pending](CPQPollQuery *APollQuery, const Delphi::Exception::Exception &E) {
+                DoError(E);
+                for (const auto &Entry : Pending) {
+                    Restore(Entry);
                 }
+            };
+
+            CString Keys;
+            for (const auto &Entry : Pending) {
+                if (!Keys.IsEmpty())
+                    Keys += ", ";
+                Keys += PQQuoteLiteral(Entry.Key);
+            }
+
+            CStringList SQL;
+            SQL.Add(CString().Format("SELECT * FROM %s(ARRAY[%s]::text[]);", m_JournalCheck.c_str(), Keys.c_str()));
+
+            try {
+                ExecSQL(SQL, nullptr, OnExecuted, OnException);
             } catch (Delphi::Exception::Exception &E) {
                 DoError(E);
+                for (const auto &Entry : Pending) {
+                    Restore(Entry);
+                }
             }
         }
         //--------------------------------------------------------------------------------------------------------------
 
-        void CFileCommon::DoPostgresQueryException(CPQPollQuery *APollQuery, const Delphi::Exception::Exception &E) {
-            DoError(E);
+        bool CFileCommon::Place(CFileHandler *AHandler) {
+            // Adopted work stays where it landed, or it would bounce back to a busy owner.
+            if (m_Adopted.erase(AHandler->FileId().c_str()) != 0)
+                return false;
+
+            // A client waiting on this process for the reply pins the request here.
+            if (AHandler->Connection() != nullptr || AHandler->Started() != 0 || AHandler->Payload().IsEmpty())
+                return false;
+
+            return m_Shard.Forward(AHandler->FileId(), AHandler->Payload().Raw(), AHandler->Ticket());
         }
         //--------------------------------------------------------------------------------------------------------------
 
-        void CFileCommon::DoClientConnected(CObject *Sender) const {
-            const auto pConnection = dynamic_cast<CHTTPClientConnection *>(Sender);
-            if (Assigned(pConnection)) {
-                const auto pSocket = pConnection->Socket();
-                if (pSocket != nullptr) {
-                    const auto pHandle = pSocket->Binding();
-                    if (pHandle != nullptr) {
-                        Log()->Notice(_T("[%s] [%s:%d] Client connected."), ModuleName().c_str(), pHandle->PeerIP(), pHandle->PeerPort());
+        void CFileCommon::Settle() {
+            std::vector<CFileHandler *> Taken;
+
+            const auto index = m_Queue.IndexOf(this);
+            if (index != -1) {
+                const auto pQueue = m_Queue[index];
+                for (int i = 0; i < pQueue->Count(); ++i) {
+                    const auto pHandler = static_cast<CFileHandler *> (pQueue->Item(i));
+                    if (pHandler != nullptr && pHandler->Forwarded() && m_Shard.Taken(pHandler->Ticket())) {
+                        Taken.push_back(pHandler);
                     }
                 }
             }
+
+            // The owner has the file now and replies for it.
+            for (auto pHandler : Taken) {
+                DeleteHandler(pHandler);
+            }
         }
         //--------------------------------------------------------------------------------------------------------------
 
-        void CFileCommon::DoClientDisconnected(CObject *Sender) const {
-            const auto pConnection = dynamic_cast<CHTTPClientConnection *>(Sender);
-            if (Assigned(pConnection)) {
-                const auto pSocket = pConnection->Socket();
-                if (pSocket != nullptr) {
-                    const auto pHandle = pSocket->Binding();
-                    if (pHandle != nullptr) {
-                        Log()->Notice(_T("[%s] [%s:%d] Client disconnected."), ModuleName().c_str(), pHandle->PeerIP(), pHandle->PeerPort());
+        void CFileCommon::Abandon(const CQueueJournalEntry &Entry) {
+            // The fail callback is set by the concrete module on the handler it builds, so without one it is logged only.
+            Log()->Error(APP_LOG_ERR, 0, "[%s] Shard: file %s was not adopted after %d attempt(s) and is dropped.",
+                         ModuleName().c_str(), Entry.Key.c_str(), Entry.Attempt + 1);
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CFileCommon::Adopt() {
+            m_Shard.Beat();
+
+            if (m_Parked > 0) {
+                Settle();
+            }
+
+            int waiting = 0;
+
+            const auto index = m_Queue.IndexOf(this);
+            if (index != -1) {
+                const auto pQueue = m_Queue[index];
+                for (int i = 0; i < pQueue->Count(); ++i) {
+                    const auto pHandler = static_cast<CFileHandler *> (pQueue->Item(i));
+                    if (pHandler != nullptr && pHandler->Allow() && pHandler->Started() == 0) {
+                        waiting++;
                     }
-                } else {
-                    Log()->Notice(_T("[%s] Client disconnected."), ModuleName().c_str());
                 }
             }
+
+            // Take only what can start right away; the rest is left for idle peers to steal.
+            auto budget = m_MaxQueue - m_Progress - waiting;
+
+            std::vector<CQueueJournalEntry> Failed;
+
+            CQueueJournalEntry Entry;
+            while (budget > 0 && m_Shard.Take(Entry)) {
+                m_Adopted.insert(Entry.Key.c_str());
+
+                if (!DoRecover(Entry)) {
+                    m_Adopted.erase(Entry.Key.c_str());
+                    Failed.push_back(Entry);
+                }
+
+                budget--;
+            }
+
+            // Pushed back after the loop, or this pass would take them straight away again.
+            for (const auto &Item : Failed) {
+                if (!m_Shard.Return(Item)) {
+                    Abandon(Item);
+                }
+            }
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CFileCommon::Resume() {
+            if (--m_Holds > 0 || !m_Reload)
+                return;
+
+            m_Reload = false;
+            UnloadQueue();
         }
         //--------------------------------------------------------------------------------------------------------------
 
         void CFileCommon::UnloadQueue() {
+            // DeleteHandler() unloads the queue again: a nested call only asks the outer one for another pass.
+            if (m_Holds > 0) {
+                m_Reload = true;
+                return;
+            }
+
+            Hold();
+
+            try {
+                do {
+                    m_Reload = false;
+                    Unload(Now());
+                } while (m_Reload);
+            } catch (...) {
+                m_Holds--;
+                throw;
+            }
+
+            m_Holds--;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CFileCommon::Unload(CDateTime Now) {
+            if (m_Journal.Active()) {
+                Recover();
+            }
+
+            if (m_Shard.Active()) {
+                Adopt();
+            }
+
+            Shed(Now);
+
             const auto index = m_Queue.IndexOf(this);
             if (index != -1) {
                 const auto pQueue = m_Queue[index];
+
+                if (m_Scheduler.Active()) {
+                    CFairQueue Waiting;
+
+                    for (int i = 0; i < pQueue->Count(); ++i) {
+                        const auto pHandler = static_cast<CFileHandler *> (pQueue->Item(i));
+                        if (pHandler != nullptr && pHandler->Allow() && pHandler->RetryAt() <= Now) {
+                            Waiting.emplace_back(m_Scheduler.Classify(pHandler->Payload()), pHandler);
+                        }
+                    }
+
+                    m_Scheduler.Schedule(Waiting, [this, Now](CQueueHandler *AHandler) {
+                        return Dispatch(static_cast<CFileHandler *> (AHandler), Now);
+                    });
+
+                    return;
+                }
+
                 for (int i = 0; i < pQueue->Count(); ++i) {
                     const auto pHandler = static_cast<CFileHandler *> (pQueue->Item(i));
-                    if (pHandler != nullptr && pHandler->Allow()) {
-                        pHandler->Handler();
-                        if (m_Progress >= m_MaxQueue) {
+                    if (pHandler != nullptr && pHandler->Allow() && pHandler->RetryAt() <= Now) {
+                        if (!Dispatch(pHandler, Now))
                             break;
-                        }
                     }
                 }
             }
@@ -592,18 +2447,45 @@ namespace Apostol {
         //--------------------------------------------------------------------------------------------------------------
 
         void CFileCommon::CheckTimeOut(CDateTime Now) {
+            if (m_Pool.Active()) {
+                m_Pool.Expire(Now);
+            }
+
+            if (m_DNS.Active()) {
+                m_DNS.Expire(Now);
+            }
+
+            Hold();
+
+            Shed(Now);
+
+            bool retry = false;
+
             const auto index = m_Queue.IndexOf(this);
             if (index != -1) {
                 const auto pQueue = m_Queue[index];
                 for (int i = pQueue->Count() - 1; i >= 0; i--) {
                     const auto pHandler = static_cast<CFileHandler *> (pQueue->Item(i));
-                    if (pHandler != nullptr && !pHandler->Allow()) {
+                    if (pHandler != nullptr && pHandler->Allow() && pHandler->RetryAt() != 0 && Now >= pHandler->RetryAt()) {
+                        retry = true;
+                    } else if (pHandler != nullptr && !pHandler->Allow() && !pHandler->Forwarded()) {
                         if ((pHandler->TimeOut() != INFINITE) && (Now >= pHandler->TimeOut())) {
                             DoFail(pHandler, CString().Format("[%s] Killed by timeout: %s", ModuleName().c_str(), pHandler->AbsoluteName().c_str()));
                         }
                     }
                 }
             }
+
+            Resume();
+
+            if (m_Shard.Active()) {
+                m_Shard.Beat();
+                retry = retry || m_Shard.Pending() || m_Parked > 0;
+            }
+
+            if (retry) {
+                UnloadQueue();
+            }
         }
         //--------------------------------------------------------------------------------------------------------------
 
@@ -611,9 +2493,22 @@ namespace Apostol {
             m_Path = Config()->IniFile().ReadString(SectionName().c_str(), "path", "files/");
             m_Type = Config()->IniFile().ReadString(SectionName().c_str(), "type", "curl");
             m_TimeOut = Config()->IniFile().ReadInteger(SectionName().c_str(), "timeout", 60);
+            m_ShardLevels = Config()->IniFile().ReadInteger(SectionName().c_str(), "shard_levels", 0);
+
+            m_SegmentThreshold = (uint64_t) Config()->IniFile().ReadInteger(SectionName().c_str(), "segment_threshold", 0) * 1024 * 1024;
+            m_Segments = Config()->IniFile().ReadInteger(SectionName().c_str(), "segments", 4);
+            m_SegmentRetries = Config()->IniFile().ReadInteger(SectionName().c_str(), "segment_retries", 3);
+
+            if (m_Segments < 1)
+                m_Segments = 1;
 
             m_Client.TimeOut(m_TimeOut);
 
+            if (Config()->IniFile().ReadBool(SectionName().c_str(), "keep_alive", true)) {
+                m_Pool.Open(Config()->IniFile().ReadInteger(SectionName().c_str(), "keep_alive_max", 8),
+                            Config()->IniFile().ReadInteger(SectionName().c_str(), "keep_alive_timeout", 30));
+            }
+
             if (!path_separator(m_Path.front())) {
                 m_Path = Config()->Prefix() + m_Path;
             }
@@ -623,6 +2518,198 @@ namespace Apostol {
             }
 
             ForceDirectories(m_Path.c_str(), 0755);
+
+            const auto cacheSize = Config()->IniFile().ReadInteger(SectionName().c_str(), "cache_size", 0);
+            const auto cacheFiles = Config()->IniFile().ReadInteger(SectionName().c_str(), "cache_files", 0);
+            const auto &cachePolicy = Config()->IniFile().ReadString(SectionName().c_str(), "cache_policy", "lru");
+
+            const auto shardMigrate = Config()->IniFile().ReadBool(SectionName().c_str(), "shard_migrate", false);
+
+            if (cacheSize > 0 || cacheFiles > 0 || shardMigrate) {
+                m_Cache.Layout(m_ShardLevels, shardMigrate);
+                m_Cache.Open(m_Path, (uint64_t) cacheSize * 1024 * 1024, cacheFiles, CFileCache::StringToPolicy(cachePolicy),
+                             Config()->IniFile().ReadInteger(SectionName().c_str(), "cache_scan_interval", 0));
+            }
+
+            const auto ioThreads = Config()->IniFile().ReadInteger(SectionName().c_str(), "io_threads", 4);
+            const auto ioQueue = Config()->IniFile().ReadInteger(SectionName().c_str(), "io_queue", 1024);
+
+#if (APOSTOL_USE_IO_URING)
+            if (Config()->IniFile().ReadBool(SectionName().c_str(), "io_uring", true)) {
+                if (!m_Ring.Open(Config()->IniFile().ReadInteger(SectionName().c_str(), "io_uring_entries", 256))) {
+                    Log()->Notice("[%s] io_uring is not supported by the kernel, using the regular file I/O path.", ModuleName().c_str());
+                } else if (m_Ring.EventFd() != -1) {
+                    m_pRingHandler = Server().EventHandlers()->Add(m_Ring.EventFd());
+    #if defined(_GLIBCXX_RELEASE) && (_GLIBCXX_RELEASE >= 9)
+                    m_pRingHandler->OnReadEvent([this](auto &&AHandler) { DoRing(AHandler); });
+    #else
+                    m_pRingHandler->OnReadEvent(std::bind(&CFileCommon::DoRing, this, _1));
+    #endif
+                    m_pRingHandler->Start(etIO);
+                }
+            }
+#else
+            if (Config()->IniFile().ReadBool(SectionName().c_str(), "io_uring", false)) {
+                Log()->Notice("[%s] io_uring is enabled in the configuration, but the module was built without it.", ModuleName().c_str());
+            }
+#endif
+
+            const auto &caCompression = Config()->IniFile().ReadString(SectionName().c_str(), "compression", "");
+            if (!caCompression.IsEmpty()) {
+                if (!m_Compressor.Open(caCompression,
+                                       Config()->IniFile().ReadInteger(SectionName().c_str(), "compression_level", 3),
+                                       Config()->IniFile().ReadInteger(SectionName().c_str(), "compression_threshold", 4096),
+                                       Config()->IniFile().ReadString(SectionName().c_str(), "compression_types", COMPRESSOR_DEFAULT_TYPES))) {
+                    Log()->Notice("[%s] Compression codec \"%s\" is not available, files are stored as is.", ModuleName().c_str(), caCompression.c_str());
+                }
+            }
+
+            if (Config()->IniFile().ReadBool(SectionName().c_str(), "precompress", false)) {
+                if (!m_Precompressor.Open(Config()->IniFile().ReadString(SectionName().c_str(), "precompress_encodings", PRECOMPRESSOR_DEFAULT_ENCODINGS),
+                                          Config()->IniFile().ReadInteger(SectionName().c_str(), "precompress_threshold", 1024),
+                                          (size_t) Config()->IniFile().ReadInteger(SectionName().c_str(), "precompress_max_size", 64) * 1024 * 1024,
+                                          Config()->IniFile().ReadString(SectionName().c_str(), "precompress_types", PRECOMPRESSOR_DEFAULT_TYPES))) {
+                    Log()->Notice("[%s] No precompression encoding is available, files are sent as is.", ModuleName().c_str());
+                }
+            }
+
+            m_MaxDepth = Config()->IniFile().ReadInteger(SectionName().c_str(), "queue_max_depth", 0);
+            m_MaxAge = (CDateTime) Config()->IniFile().ReadInteger(SectionName().c_str(), "queue_max_age", 0) / SecsPerDay;
+            m_RetryAfter = Config()->IniFile().ReadInteger(SectionName().c_str(), "queue_retry_after", 5);
+
+            m_Scheduler.Open(Config()->IniFile().ReadString(SectionName().c_str(), "fair_key", ""),
+                             Config()->IniFile().ReadString(SectionName().c_str(), "fair_weights", ""),
+                             Config()->IniFile().ReadInteger(SectionName().c_str(), "fair_class_max", 0));
+
+            if (Config()->IniFile().ReadBool(SectionName().c_str(), "adaptive_limit", false)) {
+                m_Limit.Open(Config()->IniFile().ReadInteger(SectionName().c_str(), "adaptive_min_limit", 2),
+                             Config()->PostgresPollMax(),
+                             Config()->IniFile().ReadInteger(SectionName().c_str(), "adaptive_window", 20),
+                             Config()->IniFile().ReadInteger(SectionName().c_str(), "adaptive_smoothing", 20) / 100.0);
+            }
+
+            if (Config()->IniFile().ReadBool(SectionName().c_str(), "circuit_breaker", false)) {
+                m_Breaker.Open(Config()->IniFile().ReadInteger(SectionName().c_str(), "breaker_window", 10),
+                               Config()->IniFile().ReadInteger(SectionName().c_str(), "breaker_min_requests", 5),
+                               Config()->IniFile().ReadInteger(SectionName().c_str(), "breaker_failure_rate", 50),
+                               Config()->IniFile().ReadInteger(SectionName().c_str(), "breaker_open_time", 30));
+            }
+
+            if (Config()->IniFile().ReadBool(SectionName().c_str(), "journal", false)) {
+                if (!CanRecover()) {
+                    Log()->Warning("[%s] Queue journal is disabled: the module does not implement DoRecover.", ModuleName().c_str());
+                } else {
+                    CString FileName(Config()->IniFile().ReadString(SectionName().c_str(), "journal_file", ""));
+                    const auto bSlots = FileName.IsEmpty();
+
+                    if (bSlots) {
+                        FileName.Format("journal/%s", ModuleName().c_str());
+                    }
+
+                    if (!path_separator(FileName.front())) {
+                        FileName = Config()->Prefix() + FileName;
+                    }
+
+                    ForceDirectories(FileName.substr(0, FileName.rfind('/') + 1).c_str(), 0755);
+
+                    const auto size = (size_t) Config()->IniFile().ReadInteger(SectionName().c_str(), "journal_size", 64) * 1024 * 1024;
+                    const auto slots = Config()->IniFile().ReadInteger(SectionName().c_str(), "journal_slots", std::max(1, (int) std::thread::hardware_concurrency()));
+
+                    // Without an explicit file every worker gets its own journal slot.
+                    const auto bOpened = bSlots ? m_Journal.Acquire(FileName, slots, size) : m_Journal.Open(FileName, size);
+
+                    if (bOpened) {
+                        Log()->Notice("[%s] Queue journal: %s", ModuleName().c_str(), m_Journal.FileName().c_str());
+                    } else if (errno == EWOULDBLOCK) {
+                        Log()->Error(APP_LOG_ERR, 0, "[%s] Queue journal is disabled: every journal file is locked by another worker (%s).", ModuleName().c_str(), FileName.c_str());
+                    } else {
+                        Log()->Error(APP_LOG_ERR, errno, "[%s] Could not open queue journal: %s", ModuleName().c_str(), FileName.c_str());
+                    }
+
+                    m_JournalCheck = Config()->IniFile().ReadString(SectionName().c_str(), "journal_check", "");
+                }
+            }
+
+            if (Config()->IniFile().ReadBool(SectionName().c_str(), "shard", false)) {
+                if (!CanRecover()) {
+                    // A peer could never turn a forwarded entry back into a handler.
+                    Log()->Warning("[%s] Shard queue is disabled: the module does not implement DoRecover.", ModuleName().c_str());
+                } else {
+                    // Sibling workers share the master's pid, so they meet in the same segment.
+                    const auto &caName = CString().Format("/apostol.%s.%d", ModuleName().c_str(), (int) getppid());
+
+                    if (!m_Shard.Open(caName,
+                                      Config()->IniFile().ReadInteger(SectionName().c_str(), "shard_workers", std::max(1, (int) std::thread::hardware_concurrency())),
+                                      Config()->IniFile().ReadInteger(SectionName().c_str(), "shard_ring", 256),
+                                      Config()->IniFile().ReadInteger(SectionName().c_str(), "shard_entry_size", 4) * 1024)) {
+                        Log()->Error(APP_LOG_ERR, errno, "[%s] Could not open shard queue: %s", ModuleName().c_str(), caName.c_str());
+                    }
+                }
+            }
+
+            m_RetryMax = Config()->IniFile().ReadInteger(SectionName().c_str(), "retry_max", 0);
+            m_RetryBase = Config()->IniFile().ReadInteger(SectionName().c_str(), "retry_base", 500);
+            m_RetryCap = Config()->IniFile().ReadInteger(SectionName().c_str(), "retry_cap", 10000);
+
+            // The cache resolves on the I/O pool only, so it needs io_threads.
+            if (Config()->IniFile().ReadBool(SectionName().c_str(), "dns_cache", false)) {
+                if (ioThreads <= 0) {
+                    Log()->Warning("[%s] DNS cache is disabled: it needs io_threads > 0.", ModuleName().c_str());
+                } else {
+                    m_DNS.Open(Config()->IniFile().ReadInteger(SectionName().c_str(), "dns_ttl", 60),
+                               Config()->IniFile().ReadInteger(SectionName().c_str(), "dns_negative_ttl", 5));
+                }
+            }
+
+            const auto http2 = Config()->IniFile().ReadBool(SectionName().c_str(), "http2", false);
+            const auto tlsSessionCache = Config()->IniFile().ReadBool(SectionName().c_str(), "tls_session_cache", false);
+
+            // Segmented downloads stream through the multi client and only it can take cached addresses (CURLOPT_RESOLVE),
+            // so it is opened for those too.
+            if (http2 || tlsSessionCache || m_SegmentThreshold > 0 || m_DNS.Active()) {
+                const auto streams = Config()->IniFile().ReadInteger(SectionName().c_str(), "http2_streams", 100);
+                const auto connections = Config()->IniFile().ReadInteger(SectionName().c_str(), "http2_connections", 4);
+
+                if (!m_HTTP2.Open(http2, streams, connections, m_TimeOut, m_Agent)) {
+                    Log()->Notice("[%s] HTTP/2 is not supported by libcurl, using HTTP/1.1.", ModuleName().c_str());
+                    if (tlsSessionCache || m_SegmentThreshold > 0 || m_DNS.Active()) {
+                        m_HTTP2.Open(false, streams, connections, m_TimeOut, m_Agent);
+                    }
+                }
+
+                // Transfers are driven by socket readiness and curl's own timeout, not by the I/O timer.
+                if (m_HTTP2.Active() && m_pHTTP2Handler == nullptr) {
+                    m_pHTTP2Handler = Server().EventHandlers()->Add(m_HTTP2.Descriptor());
+#if defined(_GLIBCXX_RELEASE) && (_GLIBCXX_RELEASE >= 9)
+                    m_pHTTP2Handler->OnReadEvent([this](auto &&AHandler) { DoHTTP2(AHandler); });
+#else
+                    m_pHTTP2Handler->OnReadEvent(std::bind(&CFileCommon::DoHTTP2, this, _1));
+#endif
+                    m_pHTTP2Handler->Start(etIO);
+                }
+            }
+
+            if (ioThreads > 0 || m_Ring.Active() || m_HTTP2.Active()) {
+                if (ioThreads > 0) {
+                    m_IO.Start(ioThreads, ioQueue);
+                }
+
+                if (m_pTimer == nullptr) {
+                    m_pTimer = CEPollTimer::CreateTimer(CLOCK_MONOTONIC, TFD_NONBLOCK);
+                    m_pTimer->AllocateTimer(Server().EventHandlers(), 0, 0);
+#if defined(_GLIBCXX_RELEASE) && (_GLIBCXX_RELEASE >= 9)
+                    m_pTimer->OnTimer([this](auto &&AHandler) { DoTimer(AHandler); });
+#else
+                    m_pTimer->OnTimer(std::bind(&CFileCommon::DoTimer, this, _1));
+#endif
+                }
+            }
+
+            if (m_Host.IsEmpty()) {
+                ResolveHost();
+            }
+
+            UpdateTimer();
         }
         //--------------------------------------------------------------------------------------------------------------
 
@@ -25,6 +25,83 @@ Author:
 #define APOSTOL_FILE_COMMON_HPP
 //----------------------------------------------------------------------------------------------------------------------
 
+#include <atomic>
+#include <deque>
+#include <mutex>
+#include <random>
+#include <set>
+#include <unordered_set>
+//----------------------------------------------------------------------------------------------------------------------
+
+#ifndef APOSTOL_FILE_CACHE_HPP
+#include "FileCache.hpp"
+#endif
+
+#ifndef APOSTOL_WORKER_POOL_HPP
+#include "WorkerPool.hpp"
+#endif
+
+#ifndef APOSTOL_IO_URING_HPP
+#include "IOUring.hpp"
+#endif
+
+#ifndef APOSTOL_HTTP_CLIENT_POOL_HPP
+#include "HTTPClientPool.hpp"
+#endif
+
+#ifndef APOSTOL_HTTP2_CLIENT_HPP
+#include "HTTP2Client.hpp"
+#endif
+
+#ifndef APOSTOL_DNS_CACHE_HPP
+#include "DNSCache.hpp"
+#endif
+
+#ifndef APOSTOL_CIRCUIT_BREAKER_HPP
+#include "CircuitBreaker.hpp"
+#endif
+
+#ifndef APOSTOL_CONCURRENCY_LIMIT_HPP
+#include "ConcurrencyLimit.hpp"
+#endif
+
+#ifndef APOSTOL_OBJECT_POOL_HPP
+#include "ObjectPool.hpp"
+#endif
+
+#ifndef APOSTOL_PAYLOAD_HPP
+#include "Payload.hpp"
+#endif
+
+#ifndef APOSTOL_FAIR_SCHEDULER_HPP
+#include "FairScheduler.hpp"
+#endif
+
+#ifndef APOSTOL_DEADLINE_HPP
+#include "Deadline.hpp"
+#endif
+
+#ifndef APOSTOL_COMPRESSOR_HPP
+#include "Compressor.hpp"
+#endif
+
+#ifndef APOSTOL_PRECOMPRESSOR_HPP
+#include "Precompressor.hpp"
+#endif
+
+#ifndef APOSTOL_QUEUE_JOURNAL_HPP
+#include "QueueJournal.hpp"
+#endif
+
+#ifndef APOSTOL_SHARD_QUEUE_HPP
+#include "ShardQueue.hpp"
+#endif
+
+#ifndef APOSTOL_LATENCY_HISTOGRAM_HPP
+#include "LatencyHistogram.hpp"
+#endif
+//----------------------------------------------------------------------------------------------------------------------
+
 #define FILE_COMMON_HTTPS "https://"
 #define FILE_COMMON_HTTP "http://"
 
@@ -38,6 +115,65 @@ namespace Apostol {
 
         //--------------------------------------------------------------------------------------------------------------
 
+        typedef struct file_save_result_s {
+            CString Hash;
+            CString Error;
+            CString Encoding;
+            uint64_t Stored = 0;
+            time_t Modified = 0;
+        } CFileSaveResult;
+        //--------------------------------------------------------------------------------------------------------------
+
+        typedef struct file_job_s {
+            CString Key;
+            COnWorkerJobEvent Work;
+            COnWorkerJobEvent Done;
+        } CFileJob;
+        //--------------------------------------------------------------------------------------------------------------
+
+        typedef std::function<void (int Code, CHTTPReply &Reply, const CString &Content)> COnFileFetchEvent;
+        typedef std::function<void (const CString &Error)> COnFileFetchErrorEvent;
+        typedef std::function<bool (int Code, const char *Buffer, size_t Size)> COnFileFetchDataEvent;
+        //--------------------------------------------------------------------------------------------------------------
+
+        typedef struct file_fetch_s {
+            CHTTPClient *Client = nullptr;
+            uint64_t Ticket = 0;
+        } CFileFetch;
+        //--------------------------------------------------------------------------------------------------------------
+
+        typedef struct file_segment_s {
+            uint64_t From = 0;
+            uint64_t To = 0;
+            uint64_t Offset = 0;
+            int Attempts = 0;
+            CString Buffer;
+        } CFileSegment;
+        //--------------------------------------------------------------------------------------------------------------
+
+        class CFileHandler;
+
+        typedef struct file_download_s {
+            CFileHandler *Handler = nullptr;
+
+            CString FileName;
+            CString TempName;
+
+            // Opened, written and closed only by the jobs on the TempName lane.
+            std::atomic<int> Fd {-1};
+
+            uint64_t Size = 0;
+            size_t Active = 0;
+            size_t Writes = 0;
+
+            bool Cancelled = false;
+
+            std::vector<CFileSegment> Segments;
+            std::shared_ptr<CHTTPReply> Reply;
+        } CFileDownload;
+
+        //--------------------------------------------------------------------------------------------------------------
+
         //-- CFileHandler ----------------------------------------------------------------------------------------------
 
         //--------------------------------------------------------------------------------------------------------------
@@ -45,23 +181,30 @@ namespace Apostol {
         class CFileHandler: public CQueueHandler {
         private:
 
-            CJSON m_Payload;
+            CPayload m_Payload;
 
             CLocation m_URI;
 
-            CString m_Session;
-            CString m_FileId;
-            CString m_Operation;
-            CString m_Type;
-            CString m_Path;
-            CString m_Name;
-            CString m_Hash;
             CString m_Done;
             CString m_Fail;
             CString m_AbsoluteName;
 
             CHTTPServerConnection *m_pConnection;
 
+            int m_Attempt;
+            CDateTime m_RetryAt;
+
+            CDateTime m_Created;
+            CDateTime m_Started;
+            CDateTime m_Deadline;
+
+            uint64_t m_Requested;
+
+            bool m_Journaled;
+            bool m_Placed;
+
+            CShardTicket m_Ticket;
+
             void SetConnection(CHTTPServerConnection *AConnection);
 
         public:
@@ -70,15 +213,20 @@ namespace Apostol {
 
             ~CFileHandler() override;
 
-            const CJSON &Payload() const { return m_Payload; }
+            static void *operator new(size_t Size) { return Pool().Allocate(Size); }
+            static void operator delete(void *Ptr, size_t Size) { Pool().Deallocate(Ptr, Size); }
+
+            static CObjectPool &Pool();
+
+            const CPayload &Payload() const { return m_Payload; }
 
-            const CString &Session() const { return m_Session; }
-            const CString &Operation() const { return m_Operation; }
-            const CString &FileId() const { return m_FileId; }
-            const CString &Type() const { return m_Type; }
-            const CString &Path() const { return m_Path; }
-            const CString &Name() const { return m_Name; }
-            const CString &Hash() const { return m_Hash; }
+            CString Session() const { return m_Payload.String("session"); }
+            CString Operation() const { return m_Payload.String("operation"); }
+            CString FileId() const { return m_Payload.String("id"); }
+            CString Type() const { return m_Payload.String("type"); }
+            CString Path() const { return m_Payload.String("path"); }
+            CString Name() const { return m_Payload.String("name"); }
+            CString Hash() const { return m_Payload.String("hash"); }
 
             CLocation &URI() { return m_URI; }
             const CLocation &URI() const { return m_URI; }
@@ -92,6 +240,34 @@ namespace Apostol {
             CString &Fail() { return m_Fail; }
             const CString &Fail() const { return m_Fail; }
 
+            int &Attempt() { return m_Attempt; }
+            int Attempt() const { return m_Attempt; }
+
+            CDateTime &RetryAt() { return m_RetryAt; }
+            CDateTime RetryAt() const { return m_RetryAt; }
+
+            CDateTime Created() const { return m_Created; }
+
+            CDateTime &Started() { return m_Started; }
+            CDateTime Started() const { return m_Started; }
+
+            CDateTime Deadline() const { return m_Deadline; }
+
+            uint64_t &Requested() { return m_Requested; }
+            uint64_t Requested() const { return m_Requested; }
+
+            bool &Journaled() { return m_Journaled; }
+            bool Journaled() const { return m_Journaled; }
+
+            bool &Placed() { return m_Placed; }
+            bool Placed() const { return m_Placed; }
+
+            CShardTicket &Ticket() { return m_Ticket; }
+            const CShardTicket &Ticket() const { return m_Ticket; }
+
+            // Parked here until the owner takes the forwarded entry from its inbox.
+            bool Forwarded() const { return m_Ticket.Owner != -1; }
+
             CHTTPServerConnection *Connection() const { return m_pConnection; };
             void Connection(CHTTPServerConnection *AConnection) { SetConnection(AConnection); };
 
@@ -109,10 +285,126 @@ namespace Apostol {
             CString m_Agent;
             CString m_Host;
 
+            bool m_AuthPending;
+
             CCURLClient m_Client;
+            CHTTP2Client m_HTTP2;
+
+            CFileCache m_Cache;
+
+            CWorkerPool m_IO;
+            CIOUring m_Ring;
+
+            std::deque<CFileJob> m_Backlog;
+            std::map<std::string, size_t> m_BacklogKeys;
+
+            CDNSCache m_DNS;
+
+            CCircuitBreaker m_Breaker;
+
+            CConcurrencyLimit m_Limit;
+
+            CCompressor m_Compressor;
+            CPrecompressor m_Precompressor;
+
+            CFairScheduler m_Scheduler;
+
+            CQueueJournal m_Journal;
+            CString m_JournalCheck;
+
+            CShardQueue m_Shard;
+            std::set<std::string> m_Adopted;
+            int m_Parked;
+
+            std::mutex m_DirectoryLock;
+            std::unordered_set<std::string> m_Directories;
+
+            CLatencyHistograms m_Latency;
+
+            int m_MaxDepth;
+            CDateTime m_MaxAge;
+            int m_RetryAfter;
+
+            uint64_t m_Shed;
+            uint64_t m_Expired;
+
+            int m_RetryMax;
+            int m_RetryBase;
+            int m_RetryCap;
+
+            std::mt19937 m_Random;
+
+            CEPollTimer *m_pTimer;
+            bool m_TimerActive;
+
+            CPollEventHandler *m_pRingHandler;
+            CPollEventHandler *m_pHTTP2Handler;
+
+            uint64_t m_SegmentThreshold;
+            int m_Segments;
+            int m_SegmentRetries;
+
+            std::map<CQueueHandler *, std::shared_ptr<CFileDownload>> m_Downloads;
+
+            CHTTPClientPool m_Pool;
+            // Handler addresses are reused by the slab pool: a pending lookup matches its fetch by ticket, not by pointer.
+            std::map<CQueueHandler *, CFileFetch> m_Fetches;
+            uint64_t m_FetchTicket;
 
             void SignOut(const CString &Session);
 
+            void ResolveHost();
+
+            void UpdateTimer();
+            void DoTimer(CPollEventHandler *AHandler);
+            void DoRing(CPollEventHandler *AHandler);
+            void DoHTTP2(CPollEventHandler *AHandler);
+
+            bool Post(const CString &Key, COnWorkerJobEvent &&Work, COnWorkerJobEvent &&Done, bool Defer = true);
+            void Drain();
+
+            void DoSave(CFileHandler *AHandler, const std::shared_ptr<CHTTPReply> &Reply);
+            void DoSaved(CFileHandler *AHandler, const std::shared_ptr<CHTTPReply> &Reply, const CString &FileName, const std::shared_ptr<CFileSaveResult> &Result);
+
+            void Precompress(const CString &FileName, size_t Size);
+
+            void Recover();
+            void Restore(const CQueueJournalEntry &Entry);
+
+            bool Place(CFileHandler *AHandler);
+            void Adopt();
+            void Settle();
+            void Abandon(const CQueueJournalEntry &Entry);
+
+            void CurlGet(const CLocation &URI, const CHeaders &Headers, CDateTime Deadline, COnFileFetchEvent &&OnDone, COnFileFetchErrorEvent &&OnFail,
+                COnFileFetchDataEvent &&OnData = nullptr);
+
+            void DoGet(CFileHandler *AHandler, const CHeaders &Headers);
+
+            void DoSegments(CFileHandler *AHandler, const CString &Content, const std::shared_ptr<CHTTPReply> &Reply, uint64_t Size);
+            void DoSegment(const std::shared_ptr<CFileDownload> &Download, size_t Index);
+            void DoSegmentFail(const std::shared_ptr<CFileDownload> &Download, size_t Index, const CString &Message);
+            void FlushSegment(const std::shared_ptr<CFileDownload> &Download, size_t Index);
+            void DoSegmentsDone(const std::shared_ptr<CFileDownload> &Download);
+            void DoSegmentsAbort(const std::shared_ptr<CFileDownload> &Download, const CString &Message);
+            void DoSegmentsFail(CFileHandler *AHandler, const CString &Message);
+
+            void CloseDownload(const std::shared_ptr<CFileDownload> &Download, bool Remove);
+
+            static bool WriteSegment(int Fd, const CString &Content, uint64_t Offset);
+
+            static void CurlToReply(CCurlFetch *Sender, CHTTPReply &Reply);
+            static bool ParseContentRange(const CString &Value, uint64_t &From, uint64_t &To, uint64_t &Size);
+            static CString FileSHA256(const CString &FileName);
+
+            static bool LoadRequired(CHTTPServerConnection *AConnection);
+
+            static CString LocalAddress();
+
+            static void DoSendFile(CHTTPServerConnection *AConnection, const CString &FileName);
+            static void DoSendFile(CHTTPServerConnection *AConnection, const CString &FileName, time_t Modified,
+                const CString &Encoding = CString(), const CString &Variant = CString());
+
         protected:
 
             int m_TimeOut;
@@ -123,6 +415,8 @@ namespace Apostol {
             CString m_Path;
             CString m_Type;
 
+            int m_ShardLevels;
+
             void InitMethods() override {};
 
             void CheckTimeOut(CDateTime Now);
@@ -138,9 +432,41 @@ namespace Apostol {
             void DoError(CQueueHandler *AHandler, const CString &Message);
 
             void DoDone(CFileHandler *AHandler, const CHTTPReply &Reply);
+            void DoDone(CFileHandler *AHandler, const CHTTPReply &Reply, const CString &Hash);
             void DoFail(CFileHandler *AHandler, const CString &Message);
 
+            void PrepareFile(CFileHandler *AHandler);
+
+            bool DirectoryReady(const CString &FileName);
+            void ForceDirectory(const CString &FileName);
+
+            static void ArmDeadline(CFileHandler *AHandler);
+
+            void Shed(CDateTime Now);
+            void Reject(CStringList &SQL, const std::vector<CFileHandler *> &Handlers, CHTTPReply::CStatusType Status, const CString &Message);
+
+            bool Dispatch(CFileHandler *AHandler, CDateTime Now);
+
+            int m_Holds;
+            bool m_Reload;
+
+            void Hold() { m_Holds++; };
+            void Resume();
+
+            void Unload(CDateTime Now);
+            void Begin(CFileHandler *AHandler);
+
+            bool DoRetry(CFileHandler *AHandler, const CString &Message);
+            void DoRejected(CFileHandler *AHandler);
+
+            // Handlers are built by the concrete module, so only it can rebuild one from a journal or shard entry.
+            // Override both: the journal and the shard queue stay off while CanRecover() is false.
+            virtual bool CanRecover() const { return false; };
+            virtual bool DoRecover(const CQueueJournalEntry &Entry) { return false; };
+
             void DoFetch(CFileHandler *AHandler);
+            void DoFetchStart(CFileHandler *AHandler, const std::shared_ptr<CHTTPPoolConnection> &Item, const CString &Address,
+                const std::vector<std::string> &Fallback = std::vector<std::string>());
             void DoCURL(CFileHandler *AHandler);
 
             void DoPostgresQueryExecuted(CPQPollQuery *APollQuery) override;
@@ -155,14 +481,27 @@ namespace Apostol {
 
             explicit CFileCommon(CModuleProcess *AProcess, const CString &ModuleName, const CString &SectionName);
 
-            ~CFileCommon() override = default;
+            ~CFileCommon() override;
 
             void Initialization(CModuleProcess *AProcess) override;
 
             void UnloadQueue() override;
 
-            static void DeleteFile(const CString &FileName);
-            static void SendFile(CHTTPServerConnection *AConnection, const CString &FileName);
+            CString AbsoluteName(const CString &FileName) const;
+
+            // Derived modules must resolve stored names here instead of testing the unsharded path themselves.
+            // LocateFile stats the disk while Migrating() holds: call it from an I/O pool job, not the loop.
+            bool Migrating(const CString &FileName) const;
+            CString LocateFile(const CString &FileName) const;
+
+            void DeleteFile(const CString &FileName);
+            void SendFile(CHTTPServerConnection *AConnection, const CString &FileName);
+
+            CFileCache &Cache() { return m_Cache; }
+            const CFileCache &Cache() const { return m_Cache; }
+
+            void Metrics(CString &Output) const;
+            void SendMetrics(CHTTPServerConnection *AConnection) const;
 
         };
     }
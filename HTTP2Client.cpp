@@ -0,0 +1,438 @@
+/*++
+
+Program name:
+
+  Apostol CRM
+
+Module Name:
+
+  HTTP2Client.cpp
+
+Notices:
+
+  Module: HTTP/2 multiplexing client
+
+Author:
+
+  Copyright (c) Prepodobny Alen
+
+  mailto: alienufo@inbox.ru
+  mailto: ufocomp@gmail.com
+
+--*/
+
+//----------------------------------------------------------------------------------------------------------------------
+
+#include "Core.hpp"
+#include "HTTP2Client.hpp"
+//----------------------------------------------------------------------------------------------------------------------
+
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+//----------------------------------------------------------------------------------------------------------------------
+
+#define HTTP2_CLIENT_EVENTS 64
+#define HTTP2_CLIENT_ROUNDS 16
+//----------------------------------------------------------------------------------------------------------------------
+
+extern "C++" {
+
+namespace Apostol {
+
+    namespace Module {
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        //-- CHTTP2Client ----------------------------------------------------------------------------------------------
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        CHTTP2Client::CHTTP2Client(): m_Handle(nullptr), m_EpollFd(-1), m_TimerFd(-1), m_Multiplex(false), m_TimeOut(0),
+                m_Transfers(0), m_Multiplexed(0), m_Connects(0), m_Handshakes(0), m_Resumed(0) {
+
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        CHTTP2Client::~CHTTP2Client() {
+            Close();
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        bool CHTTP2Client::Open(bool Multiplex, long MaxStreams, long MaxHostConnections, long TimeOut, const CString &Agent) {
+            Close();
+
+            const auto pInfo = curl_version_info(CURLVERSION_NOW);
+            if (Multiplex && (pInfo == nullptr || (pInfo->features & CURL_VERSION_HTTP2) == 0))
+                return false;
+
+            m_Handle = curl_multi_init();
+            if (m_Handle == nullptr)
+                return false;
+
+            CTLSSessionCache::Acquire();
+
+            if (Multiplex) {
+                curl_multi_setopt(m_Handle, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX);
+#if (LIBCURL_VERSION_NUM >= 0x074300)
+                curl_multi_setopt(m_Handle, CURLMOPT_MAX_CONCURRENT_STREAMS, MaxStreams);
+#endif
+            }
+
+            curl_multi_setopt(m_Handle, CURLMOPT_MAX_HOST_CONNECTIONS, MaxHostConnections);
+
+            // curl reports its sockets and timeout to a private epoll set; that one descriptor joins the event loop.
+            m_EpollFd = epoll_create1(EPOLL_CLOEXEC);
+            m_TimerFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+
+            if (m_EpollFd == -1 || m_TimerFd == -1) {
+                Close();
+                return false;
+            }
+
+            struct epoll_event Event = {};
+
+            Event.events = EPOLLIN;
+            Event.data.fd = m_TimerFd;
+
+            if (epoll_ctl(m_EpollFd, EPOLL_CTL_ADD, m_TimerFd, &Event) != 0) {
+                Close();
+                return false;
+            }
+
+            curl_multi_setopt(m_Handle, CURLMOPT_SOCKETFUNCTION, &CHTTP2Client::DoSocket);
+            curl_multi_setopt(m_Handle, CURLMOPT_SOCKETDATA, this);
+            curl_multi_setopt(m_Handle, CURLMOPT_TIMERFUNCTION, &CHTTP2Client::DoTimer);
+            curl_multi_setopt(m_Handle, CURLMOPT_TIMERDATA, this);
+
+            m_Multiplex = Multiplex;
+            m_Agent = Agent;
+            m_TimeOut = TimeOut;
+
+            return true;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CHTTP2Client::Close() {
+            if (m_Handle == nullptr)
+                return;
+
+            for (auto pTransfer : m_Queue) {
+                curl_multi_remove_handle(m_Handle, pTransfer->Handle);
+                curl_easy_cleanup(pTransfer->Handle);
+                curl_slist_free_all(pTransfer->List);
+                curl_slist_free_all(pTransfer->Resolve);
+                delete pTransfer;
+            }
+
+            m_Queue.clear();
+
+            curl_multi_cleanup(m_Handle);
+            m_Handle = nullptr;
+
+            CTLSSessionCache::Release();
+
+            if (m_TimerFd != -1) {
+                close(m_TimerFd);
+                m_TimerFd = -1;
+            }
+
+            if (m_EpollFd != -1) {
+                close(m_EpollFd);
+                m_EpollFd = -1;
+            }
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        size_t CHTTP2Client::DoWrite(char *Buffer, size_t Size, size_t Count, void *Data) {
+            const auto pTransfer = static_cast<CHTTP2Transfer *> (Data);
+            const auto length = Size * Count;
+
+            // A data handler takes the body as it arrives instead of collecting it; refusing a chunk aborts the transfer.
+            if (pTransfer->Data) {
+                if (pTransfer->Code == 0)
+                    curl_easy_getinfo(pTransfer->Handle, CURLINFO_RESPONSE_CODE, &pTransfer->Code);
+                return pTransfer->Data(pTransfer, Buffer, length) ? length : 0;
+            }
+
+            pTransfer->Body.Append(Buffer, length);
+            return length;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        size_t CHTTP2Client::DoHeader(char *Buffer, size_t Size, size_t Count, void *Data) {
+            const auto pTransfer = static_cast<CHTTP2Transfer *> (Data);
+            const auto length = Size * Count;
+
+            size_t size = length;
+            while (size > 0 && (Buffer[size - 1] == '\r' || Buffer[size - 1] == '\n'))
+                size--;
+
+            if (size >= 5 && strncmp(Buffer, "HTTP/", 5) == 0) {
+                if (!pTransfer->Inspected) {
+                    long connects = 0;
+                    curl_easy_getinfo(pTransfer->Handle, CURLINFO_NUM_CONNECTS, &connects);
+                    if (connects > 0)
+                        pTransfer->Handshake = CTLSSessionCache::Inspect(pTransfer->Handle, pTransfer->Resumed);
+                    pTransfer->Inspected = true;
+                }
+
+                pTransfer->Headers.Clear();
+                return length;
+            }
+
+            const auto pDelimiter = static_cast<char *> (memchr(Buffer, ':', size));
+            if (pDelimiter != nullptr) {
+                const std::string Name(Buffer, pDelimiter - Buffer);
+
+                auto pValue = pDelimiter + 1;
+                while (pValue < Buffer + size && *pValue == ' ')
+                    pValue++;
+
+                pTransfer->Headers.AddPair(Name.c_str(), std::string(pValue, Buffer + size - pValue).c_str());
+            }
+
+            return length;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        bool CHTTP2Client::Get(const CString &URL, const CHeaders &Headers, COnHTTP2TransferEvent &&Done, const CString &Resolve, long TimeOut,
+                COnHTTP2DataEvent &&Data) {
+            if (m_Handle == nullptr)
+                return false;
+
+            auto pHandle = curl_easy_init();
+            if (pHandle == nullptr)
+                return false;
+
+            auto pTransfer = new CHTTP2Transfer();
+
+            pTransfer->Handle = pHandle;
+            pTransfer->Done = std::move(Done);
+            pTransfer->Data = std::move(Data);
+
+            for (int i = 0; i < Headers.Count(); i++) {
+                const auto &Header = Headers[i];
+                pTransfer->List = curl_slist_append(pTransfer->List, CString().Format("%s: %s", Header.Name().c_str(), Header.Value().c_str()).c_str());
+            }
+
+            curl_easy_setopt(pHandle, CURLOPT_URL, URL.c_str());
+            if (m_Multiplex) {
+                curl_easy_setopt(pHandle, CURLOPT_HTTP_VERSION, (long) CURL_HTTP_VERSION_2TLS);
+                curl_easy_setopt(pHandle, CURLOPT_PIPEWAIT, 1L);
+            }
+
+            curl_easy_setopt(pHandle, CURLOPT_NOSIGNAL, 1L);
+            curl_easy_setopt(pHandle, CURLOPT_FOLLOWLOCATION, 1L);
+            curl_easy_setopt(pHandle, CURLOPT_PRIVATE, pTransfer);
+            curl_easy_setopt(pHandle, CURLOPT_ERRORBUFFER, pTransfer->Error);
+            curl_easy_setopt(pHandle, CURLOPT_WRITEFUNCTION, &CHTTP2Client::DoWrite);
+            curl_easy_setopt(pHandle, CURLOPT_WRITEDATA, pTransfer);
+            curl_easy_setopt(pHandle, CURLOPT_HEADERFUNCTION, &CHTTP2Client::DoHeader);
+            curl_easy_setopt(pHandle, CURLOPT_HEADERDATA, pTransfer);
+
+            if (pTransfer->List != nullptr)
+                curl_easy_setopt(pHandle, CURLOPT_HTTPHEADER, pTransfer->List);
+
+            if (!Resolve.IsEmpty()) {
+                pTransfer->Resolve = curl_slist_append(nullptr, Resolve.c_str());
+                curl_easy_setopt(pHandle, CURLOPT_RESOLVE, pTransfer->Resolve);
+            }
+
+            if (!m_Agent.IsEmpty())
+                curl_easy_setopt(pHandle, CURLOPT_USERAGENT, m_Agent.c_str());
+
+            if (TimeOut > 0 && (m_TimeOut <= 0 || TimeOut < m_TimeOut * 1000L)) {
+                curl_easy_setopt(pHandle, CURLOPT_TIMEOUT_MS, TimeOut);
+            } else if (m_TimeOut > 0) {
+                curl_easy_setopt(pHandle, CURLOPT_TIMEOUT, m_TimeOut);
+            }
+
+            const auto pShare = CTLSSessionCache::Share();
+            if (pShare != nullptr)
+                curl_easy_setopt(pHandle, CURLOPT_SHARE, pShare);
+
+            curl_easy_setopt(pHandle, CURLOPT_SSL_SESSIONID_CACHE, 1L);
+
+            if (curl_multi_add_handle(m_Handle, pHandle) != CURLM_OK) {
+                curl_slist_free_all(pTransfer->List);
+                curl_slist_free_all(pTransfer->Resolve);
+                curl_easy_cleanup(pHandle);
+                delete pTransfer;
+                return false;
+            }
+
+            m_Queue.insert(pTransfer);
+
+            return true;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CHTTP2Client::Finish(CURL *AHandle, CURLcode Result) {
+            CHTTP2Transfer *pTransfer = nullptr;
+            curl_easy_getinfo(AHandle, CURLINFO_PRIVATE, &pTransfer);
+
+            long connects = 0;
+            long version = 0;
+
+            curl_easy_getinfo(AHandle, CURLINFO_RESPONSE_CODE, &pTransfer->Code);
+            curl_easy_getinfo(AHandle, CURLINFO_NUM_CONNECTS, &connects);
+            curl_easy_getinfo(AHandle, CURLINFO_HTTP_VERSION, &version);
+
+            m_Transfers++;
+            m_Connects += connects;
+
+            if (pTransfer->Handshake) {
+                m_Handshakes++;
+                if (pTransfer->Resumed)
+                    m_Resumed++;
+            }
+
+            if (version == CURL_HTTP_VERSION_2_0 && connects == 0)
+                m_Multiplexed++;
+
+            curl_multi_remove_handle(m_Handle, AHandle);
+            m_Queue.erase(pTransfer);
+
+            const CString Error(pTransfer->Error[0] != 0 ? pTransfer->Error : curl_easy_strerror(Result));
+
+            if (pTransfer->Done) {
+                pTransfer->Done(pTransfer, Result, Error);
+            }
+
+            curl_slist_free_all(pTransfer->List);
+            curl_slist_free_all(pTransfer->Resolve);
+            curl_easy_cleanup(AHandle);
+
+            delete pTransfer;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        int CHTTP2Client::DoSocket(CURL *AHandle, curl_socket_t Socket, int What, void *Data, void *SocketData) {
+            const auto pClient = static_cast<CHTTP2Client *> (Data);
+
+            if (What == CURL_POLL_REMOVE) {
+                epoll_ctl(pClient->m_EpollFd, EPOLL_CTL_DEL, Socket, nullptr);
+                curl_multi_assign(pClient->m_Handle, Socket, nullptr);
+                return 0;
+            }
+
+            struct epoll_event Event = {};
+
+            Event.events = (What & CURL_POLL_IN ? EPOLLIN : 0) | (What & CURL_POLL_OUT ? EPOLLOUT : 0);
+            Event.data.fd = Socket;
+
+            // The socket data marks a descriptor that is already in the set.
+            if (SocketData != nullptr) {
+                epoll_ctl(pClient->m_EpollFd, EPOLL_CTL_MOD, Socket, &Event);
+            } else if (epoll_ctl(pClient->m_EpollFd, EPOLL_CTL_ADD, Socket, &Event) == 0) {
+                curl_multi_assign(pClient->m_Handle, Socket, pClient);
+            }
+
+            return 0;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        int CHTTP2Client::DoTimer(CURLM *AHandle, long TimeOut, void *Data) {
+            const auto pClient = static_cast<CHTTP2Client *> (Data);
+
+            struct itimerspec Spec = {};
+
+            // -1 disarms; zero means "now", which a timerfd only understands as the smallest positive value.
+            if (TimeOut >= 0) {
+                Spec.it_value.tv_sec = TimeOut / 1000;
+                Spec.it_value.tv_nsec = TimeOut == 0 ? 1 : (TimeOut % 1000) * 1000000;
+            }
+
+            timerfd_settime(pClient->m_TimerFd, 0, &Spec, nullptr);
+
+            return 0;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        size_t CHTTP2Client::Collect() {
+            size_t count = 0;
+            int queued = 0;
+
+            CURLMsg *pMessage;
+            while ((pMessage = curl_multi_info_read(m_Handle, &queued)) != nullptr) {
+                if (pMessage->msg == CURLMSG_DONE) {
+                    Finish(pMessage->easy_handle, pMessage->data.result);
+                    count++;
+                }
+            }
+
+            return count;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        size_t CHTTP2Client::Perform() {
+            if (m_Handle == nullptr)
+                return 0;
+
+            struct epoll_event Events[HTTP2_CLIENT_EVENTS];
+
+            size_t count = 0;
+            int running = 0;
+
+            // Bounded, so a socket curl keeps readable cannot hold the loop; the descriptor stays ready for the next call.
+            for (int round = 0; round < HTTP2_CLIENT_ROUNDS; ++round) {
+                const auto ready = epoll_wait(m_EpollFd, Events, HTTP2_CLIENT_EVENTS, 0);
+                if (ready <= 0)
+                    break;
+
+                for (int i = 0; i < ready; ++i) {
+                    if (Events[i].data.fd == m_TimerFd) {
+                        uint64_t expirations;
+                        while (read(m_TimerFd, &expirations, sizeof(expirations)) > 0) {
+                        }
+
+                        curl_multi_socket_action(m_Handle, CURL_SOCKET_TIMEOUT, 0, &running);
+                    } else {
+                        int mask = 0;
+
+                        if (Events[i].events & (EPOLLIN | EPOLLHUP))
+                            mask |= CURL_CSELECT_IN;
+                        if (Events[i].events & EPOLLOUT)
+                            mask |= CURL_CSELECT_OUT;
+                        if (Events[i].events & EPOLLERR)
+                            mask |= CURL_CSELECT_ERR;
+
+                        curl_multi_socket_action(m_Handle, Events[i].data.fd, mask, &running);
+                    }
+                }
+
+                count += Collect();
+            }
+
+            return count;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CHTTP2Client::Metrics(CString &Output, const CString &Module) const {
+            Output += CString().Format("# TYPE apostol_http2_transfers_total counter\n"
+                                       "apostol_http2_transfers_total{module=\"%s\"} %llu\n",
+                                       Module.c_str(), (unsigned long long) m_Transfers);
+            Output += CString().Format("# TYPE apostol_http2_multiplexed_total counter\n"
+                                       "apostol_http2_multiplexed_total{module=\"%s\"} %llu\n",
+                                       Module.c_str(), (unsigned long long) m_Multiplexed);
+            Output += CString().Format("# TYPE apostol_http2_connections_total counter\n"
+                                       "apostol_http2_connections_total{module=\"%s\"} %llu\n",
+                                       Module.c_str(), (unsigned long long) m_Connects);
+            Output += CString().Format("# TYPE apostol_http2_streams_per_connection gauge\n"
+                                       "apostol_http2_streams_per_connection{module=\"%s\"} %.2f\n",
+                                       Module.c_str(), m_Connects == 0 ? 0.0 : (double) m_Transfers / (double) m_Connects);
+            Output += CString().Format("# TYPE apostol_tls_handshakes_total counter\n"
+                                       "apostol_tls_handshakes_total{module=\"%s\"} %llu\n",
+                                       Module.c_str(), (unsigned long long) m_Handshakes);
+            Output += CString().Format("# TYPE apostol_tls_resumed_total counter\n"
+                                       "apostol_tls_resumed_total{module=\"%s\"} %llu\n",
+                                       Module.c_str(), (unsigned long long) m_Resumed);
+            Output += CString().Format("# TYPE apostol_http2_pending gauge\n"
+                                       "apostol_http2_pending{module=\"%s\"} %llu\n",
+                                       Module.c_str(), (unsigned long long) m_Queue.size());
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+    }
+}
+}
@@ -0,0 +1,141 @@
+/*++
+
+Program name:
+
+  Apostol CRM
+
+Module Name:
+
+  HTTP2Client.hpp
+
+Notices:
+
+  Module: HTTP/2 multiplexing client
+
+Author:
+
+  Copyright (c) Prepodobny Alen
+
+  mailto: alienufo@inbox.ru
+  mailto: ufocomp@gmail.com
+
+--*/
+
+#ifndef APOSTOL_HTTP2_CLIENT_HPP
+#define APOSTOL_HTTP2_CLIENT_HPP
+//----------------------------------------------------------------------------------------------------------------------
+
+#include <curl/curl.h>
+#include <functional>
+#include <unordered_set>
+//----------------------------------------------------------------------------------------------------------------------
+
+#ifndef APOSTOL_TLS_SESSION_CACHE_HPP
+#include "TLSSessionCache.hpp"
+#endif
+//----------------------------------------------------------------------------------------------------------------------
+
+extern "C++" {
+
+namespace Apostol {
+
+    namespace Module {
+
+        typedef struct http2_transfer_s CHTTP2Transfer;
+
+        typedef std::function<void (CHTTP2Transfer *Transfer, CURLcode Result, const CString &Error)> COnHTTP2TransferEvent;
+        typedef std::function<bool (CHTTP2Transfer *Transfer, const char *Buffer, size_t Size)> COnHTTP2DataEvent;
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        //-- CHTTP2Transfer --------------------------------------------------------------------------------------------
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        typedef struct http2_transfer_s {
+            CURL *Handle = nullptr;
+            curl_slist *List = nullptr;
+            curl_slist *Resolve = nullptr;
+
+            long Code = 0;
+
+            bool Inspected = false;
+            bool Handshake = false;
+            bool Resumed = false;
+
+            CHeaders Headers;
+            CString Body;
+
+            char Error[CURL_ERROR_SIZE] = {0};
+
+            COnHTTP2TransferEvent Done;
+            COnHTTP2DataEvent Data;
+        } CHTTP2Transfer;
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        //-- CHTTP2Client ----------------------------------------------------------------------------------------------
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        class CHTTP2Client {
+        private:
+
+            CURLM *m_Handle;
+
+            int m_EpollFd;
+            int m_TimerFd;
+
+            bool m_Multiplex;
+
+            CString m_Agent;
+            long m_TimeOut;
+
+            std::unordered_set<CHTTP2Transfer *> m_Queue;
+
+            uint64_t m_Transfers;
+            uint64_t m_Multiplexed;
+            uint64_t m_Connects;
+            uint64_t m_Handshakes;
+            uint64_t m_Resumed;
+
+            void Finish(CURL *AHandle, CURLcode Result);
+            size_t Collect();
+
+            static size_t DoWrite(char *Buffer, size_t Size, size_t Count, void *Data);
+            static size_t DoHeader(char *Buffer, size_t Size, size_t Count, void *Data);
+
+            static int DoSocket(CURL *AHandle, curl_socket_t Socket, int What, void *Data, void *SocketData);
+            static int DoTimer(CURLM *AHandle, long TimeOut, void *Data);
+
+        public:
+
+            CHTTP2Client();
+
+            ~CHTTP2Client();
+
+            bool Open(bool Multiplex, long MaxStreams, long MaxHostConnections, long TimeOut, const CString &Agent);
+            void Close();
+
+            bool Active() const { return m_Handle != nullptr; }
+            bool Multiplex() const { return m_Multiplex; }
+
+            size_t Pending() const { return m_Queue.size(); }
+
+            int Descriptor() const { return m_EpollFd; }
+
+            bool Get(const CString &URL, const CHeaders &Headers, COnHTTP2TransferEvent &&Done, const CString &Resolve = CString(), long TimeOut = 0,
+                COnHTTP2DataEvent &&Data = nullptr);
+
+            size_t Perform();
+
+            void Metrics(CString &Output, const CString &Module) const;
+
+        };
+
+    }
+}
+
+using namespace Apostol::Module;
+}
+#endif //APOSTOL_HTTP2_CLIENT_HPP
@@ -0,0 +1,718 @@
+/*++
+
+Program name:
+
+  Apostol CRM
+
+Module Name:
+
+  HTTPCache.cpp
+
+Notices:
+
+  Module: HTTP response cache
+
+Author:
+
+  Copyright (c) Prepodobny Alen
+
+  mailto: alienufo@inbox.ru
+  mailto: ufocomp@gmail.com
+
+--*/
+
+//----------------------------------------------------------------------------------------------------------------------
+
+#include "Core.hpp"
+#include "HTTPCache.hpp"
+//----------------------------------------------------------------------------------------------------------------------
+
+#include <algorithm>
+#include <dirent.h>
+//----------------------------------------------------------------------------------------------------------------------
+
+#define HTTP_CACHE_HEURISTIC_MAX 86400
+//----------------------------------------------------------------------------------------------------------------------
+
+extern "C++" {
+
+namespace Apostol {
+
+    namespace Module {
+
+        static std::string Trim(const std::string &Value) {
+            const auto first = Value.find_first_not_of(" \t");
+            if (first == std::string::npos)
+                return {};
+            const auto last = Value.find_last_not_of(" \t");
+            return Value.substr(first, last - first + 1);
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        static std::vector<std::string> Tokens(const CString &Value) {
+            std::vector<std::string> Result;
+            std::string caValue(Value.c_str());
+
+            std::transform(caValue.begin(), caValue.end(), caValue.begin(), ::tolower);
+
+            size_t pos = 0;
+            while (pos <= caValue.size()) {
+                auto end = caValue.find(',', pos);
+                if (end == std::string::npos)
+                    end = caValue.size();
+
+                const auto &Token = Trim(caValue.substr(pos, end - pos));
+                if (!Token.empty())
+                    Result.push_back(Token);
+
+                pos = end + 1;
+            }
+
+            return Result;
+        }
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        //-- CHTTPCache ------------------------------------------------------------------------------------------------
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        CHTTPCache::CHTTPCache(CWorkerPool &Pool): m_Pool(Pool), m_Active(false), m_MaxMemory(0), m_MaxEntry(0), m_Memory(0),
+                m_MaxDisk(0), m_Disk(0), m_Hits(0), m_Revalidated(0), m_Misses(0), m_Stores(0), m_DiskEvictions(0) {
+
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CHTTPCache::Open(size_t MaxMemory, size_t MaxEntry, const CString &Path, size_t MaxDisk) {
+            m_MaxMemory = MaxMemory;
+            m_MaxEntry = MaxEntry;
+            m_MaxDisk = MaxDisk;
+
+            m_Path = Path;
+            if (!m_Path.IsEmpty()) {
+                if (!path_separator(m_Path.back()))
+                    m_Path = m_Path + "/";
+                ForceDirectories(m_Path.c_str(), 0755);
+            }
+
+            m_Active = true;
+
+            Scan();
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        CString CHTTPCache::Key(const CString &Method, const CString &URL, const CHeaders &Request) {
+            CString Data(Method);
+            Data += ' ';
+            Data += URL;
+
+            // A reply to a credentialed request is only ever served to the same credentials.
+            if (Credentials(Request)) {
+                Data += '\n';
+                Data += Request["Authorization"];
+                Data += '\n';
+                Data += Request["Cookie"];
+            }
+
+            return SHA256(Data, true);
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        bool CHTTPCache::Cacheable(const CHeaders &Request) {
+            // Conditional and partial requests belong to the caller, not to the cache.
+            if (!Request["If-None-Match"].IsEmpty() || !Request["If-Modified-Since"].IsEmpty() || !Request["Range"].IsEmpty())
+                return false;
+
+            const auto &caDirectives = Tokens(Request["Cache-Control"]);
+            return std::find(caDirectives.begin(), caDirectives.end(), "no-store") == caDirectives.end();
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        bool CHTTPCache::Credentials(const CHeaders &Request) {
+            return !Request["Authorization"].IsEmpty() || !Request["Cookie"].IsEmpty();
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        time_t CHTTPCache::ParseDate(const CString &Value) {
+            if (Value.IsEmpty())
+                return 0;
+
+            struct tm tm = {};
+            if (strptime(Value.c_str(), "%a, %d %b %Y %H:%M:%S", &tm) == nullptr)
+                return 0;
+
+            return timegm(&tm);
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        time_t CHTTPCache::Lifetime(const CHeaders &Headers, time_t Now, bool &NoStore) {
+            NoStore = false;
+
+            bool noCache = false;
+            long maxAge = -1;
+            long sharedMaxAge = -1;
+
+            // This is a shared cache (RFC 9111, 3): "private" replies are never stored, "s-maxage" wins over "max-age".
+            for (const auto &Directive : Tokens(Headers["Cache-Control"])) {
+                if (Directive == "no-store" || Directive == "private") {
+                    NoStore = true;
+                } else if (Directive == "no-cache") {
+                    noCache = true;
+                } else if (Directive.compare(0, 8, "max-age=") == 0) {
+                    maxAge = strtol(Directive.c_str() + 8, nullptr, 10);
+                } else if (Directive.compare(0, 9, "s-maxage=") == 0) {
+                    sharedMaxAge = strtol(Directive.c_str() + 9, nullptr, 10);
+                }
+            }
+
+            if (NoStore || noCache)
+                return 0;
+
+            if (sharedMaxAge >= 0)
+                maxAge = sharedMaxAge;
+
+            auto date = ParseDate(Headers["Date"]);
+            if (date == 0)
+                date = Now;
+
+            time_t lifetime = 0;
+
+            if (maxAge >= 0) {
+                lifetime = maxAge;
+            } else if (!Headers["Expires"].IsEmpty()) {
+                const auto expires = ParseDate(Headers["Expires"]);
+                lifetime = expires > date ? expires - date : 0;
+            } else {
+                // Heuristic freshness (RFC 9111, 4.2.2): a tenth of the time since the last modification.
+                const auto modified = ParseDate(Headers["Last-Modified"]);
+                if (modified > 0 && modified < date) {
+                    lifetime = std::min<time_t>((date - modified) / 10, HTTP_CACHE_HEURISTIC_MAX);
+                }
+            }
+
+            lifetime -= strtol(Headers["Age"].c_str(), nullptr, 10);
+
+            return lifetime > 0 ? lifetime : 0;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        bool CHTTPCache::Matches(const CHTTPCacheEntry &Entry, const CHeaders &Request) {
+            for (const auto &Vary : Entry.Vary) {
+                if (Vary.second != Request[Vary.first.c_str()].c_str())
+                    return false;
+            }
+            return true;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CHTTPCache::Put(const std::string &Key, const CHTTPCacheEntryPtr &Entry) {
+            Remove(Key);
+
+            m_LRU.push_front(Key);
+            m_Entries[Key] = CLRUItem(Entry, m_LRU.begin());
+            m_Memory += Entry->Size();
+
+            while (m_Memory > m_MaxMemory && !m_LRU.empty()) {
+                const auto it = m_Entries.find(m_LRU.back());
+                m_Memory -= it->second.first->Size();
+                m_Entries.erase(it);
+                m_LRU.pop_back();
+            }
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CHTTPCache::Remove(const std::string &Key) {
+            const auto it = m_Entries.find(Key);
+            if (it == m_Entries.end())
+                return;
+
+            m_Memory -= it->second.first->Size();
+            m_LRU.erase(it->second.second);
+            m_Entries.erase(it);
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CHTTPCache::Index(const std::string &Key, size_t Size) {
+            const auto it = m_DiskEntries.find(Key);
+            if (it != m_DiskEntries.end()) {
+                m_Disk -= it->second.first;
+                m_DiskLRU.erase(it->second.second);
+                m_DiskEntries.erase(it);
+            }
+
+            m_DiskLRU.push_front(Key);
+            m_DiskEntries[Key] = CDiskItem(Size, m_DiskLRU.begin());
+            m_Disk += Size;
+
+            while (m_MaxDisk != 0 && m_Disk > m_MaxDisk && m_DiskLRU.size() > 1) {
+                const auto caVictim = m_DiskLRU.back();
+                Forget(caVictim);
+                m_DiskEvictions++;
+            }
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CHTTPCache::Forget(const std::string &Key) {
+            const auto it = m_DiskEntries.find(Key);
+            if (it == m_DiskEntries.end())
+                return;
+
+            m_Disk -= it->second.first;
+            m_DiskLRU.erase(it->second.second);
+            m_DiskEntries.erase(it);
+
+            Run(Key, [caFileName = FileName(Key)]() { unlink(caFileName.c_str()); }, nullptr);
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CHTTPCache::Erase(const std::string &Key) {
+            Remove(Key);
+            Forget(Key);
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CHTTPCache::Run(const std::string &Key, COnWorkerJobEvent &&Work, COnWorkerJobEvent &&Done) {
+            // Jobs of one key share a lane, so a save, a load and an unlink of the same file keep their order.
+            if (!m_Pool.Post(Key.c_str(), std::move(Work), std::move(Done))) {
+                Work();
+                if (Done)
+                    Done();
+            }
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CHTTPCache::Scan() {
+            if (m_Path.IsEmpty())
+                return;
+
+            typedef std::vector<std::pair<time_t, std::pair<std::string, size_t>>> CFiles;
+
+            const auto pFiles = std::make_shared<CFiles>();
+
+            auto Work = [pFiles, caPath = std::string(m_Path.c_str())]() {
+                DIR *pDir = opendir(caPath.c_str());
+                if (pDir == nullptr)
+                    return;
+
+                struct dirent *pEntry;
+                struct stat st = {};
+
+                while ((pEntry = readdir(pDir)) != nullptr) {
+                    // Entries are named by their SHA-256 key; anything else (".", "..", temporaries) is not ours.
+                    if (strlen(pEntry->d_name) != 64)
+                        continue;
+
+                    if (stat((caPath + pEntry->d_name).c_str(), &st) != 0 || !S_ISREG(st.st_mode))
+                        continue;
+
+                    pFiles->emplace_back(st.st_mtime, std::make_pair(std::string(pEntry->d_name), (size_t) st.st_size));
+                }
+
+                closedir(pDir);
+            };
+
+            auto Done = [this, pFiles]() {
+                // Newest first: what was stored since the scan started is already at the head and is kept there.
+                std::sort(pFiles->begin(), pFiles->end(), [](const CFiles::value_type &A, const CFiles::value_type &B) {
+                    return A.first > B.first;
+                });
+
+                for (const auto &File : *pFiles) {
+                    const auto &Key = File.second.first;
+                    if (m_DiskEntries.find(Key) != m_DiskEntries.end())
+                        continue;
+
+                    m_DiskLRU.push_back(Key);
+                    m_DiskEntries[Key] = CDiskItem(File.second.second, std::prev(m_DiskLRU.end()));
+                    m_Disk += File.second.second;
+                }
+
+                while (m_MaxDisk != 0 && m_Disk > m_MaxDisk && m_DiskLRU.size() > 1) {
+                    const auto caVictim = m_DiskLRU.back();
+                    Forget(caVictim);
+                    m_DiskEvictions++;
+                }
+            };
+
+            Run(m_Path.c_str(), std::move(Work), std::move(Done));
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        CString CHTTPCache::FileName(const std::string &Key) const {
+            CString Result(m_Path);
+            Result += Key.c_str();
+            return Result;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        CString CHTTPCache::Serialize(const CHTTPCacheEntry &Entry) {
+            CString Data;
+
+            Data.Format("%d %lld %lld\n", Entry.Status, (long long) Entry.Stored, (long long) Entry.Expires);
+            Data += Entry.StatusText;
+            Data += '\n';
+
+            for (const auto &Vary : Entry.Vary) {
+                Data += "V ";
+                Data += Vary.first.c_str();
+                Data += '\t';
+                Data += Vary.second.c_str();
+                Data += '\n';
+            }
+
+            for (int i = 0; i < Entry.Headers.Count(); i++) {
+                const auto &Header = Entry.Headers[i];
+                Data += "H ";
+                Data += Header.Name();
+                Data += ": ";
+                Data += Header.Value();
+                Data += '\n';
+            }
+
+            Data += '\n';
+            Data += Entry.Body;
+
+            return Data;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        CHTTPCacheEntryPtr CHTTPCache::Parse(const CString &Data) {
+            const std::string caData(Data.c_str(), Data.Size());
+
+            auto pos = caData.find('\n');
+            if (pos == std::string::npos)
+                return nullptr;
+
+            const auto pEntry = std::make_shared<CHTTPCacheEntry>();
+
+            long long stored = 0, expires = 0;
+            if (sscanf(caData.c_str(), "%d %lld %lld", &pEntry->Status, &stored, &expires) != 3)
+                return nullptr;
+
+            pEntry->Stored = (time_t) stored;
+            pEntry->Expires = (time_t) expires;
+
+            size_t start = pos + 1;
+            pos = caData.find('\n', start);
+            if (pos == std::string::npos)
+                return nullptr;
+
+            pEntry->StatusText = caData.substr(start, pos - start).c_str();
+
+            for (start = pos + 1; start < caData.size(); start = pos + 1) {
+                pos = caData.find('\n', start);
+                if (pos == std::string::npos)
+                    return nullptr;
+
+                if (pos == start) {
+                    pEntry->Body.Append(caData.data() + pos + 1, caData.size() - pos - 1);
+                    return pEntry;
+                }
+
+                const auto &caLine = caData.substr(start, pos - start);
+
+                if (caLine.compare(0, 2, "V ") == 0) {
+                    const auto tab = caLine.find('\t');
+                    if (tab != std::string::npos)
+                        pEntry->Vary.emplace_back(caLine.substr(2, tab - 2), caLine.substr(tab + 1));
+                } else if (caLine.compare(0, 2, "H ") == 0) {
+                    const auto colon = caLine.find(": ");
+                    if (colon != std::string::npos)
+                        pEntry->Headers.AddPair(caLine.substr(2, colon - 2).c_str(), caLine.substr(colon + 2).c_str());
+                }
+            }
+
+            return nullptr;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        bool CHTTPCache::SaveFile(const CString &FileName, const CString &Data) {
+            const auto &caTempName = FileName + ".tmp";
+
+            try {
+                Data.SaveToFile(caTempName.c_str());
+                if (rename(caTempName.c_str(), FileName.c_str()) == 0)
+                    return true;
+            } catch (std::exception &e) {
+            }
+
+            unlink(caTempName.c_str());
+
+            return false;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        CHTTPCacheEntryPtr CHTTPCache::LoadFile(const CString &FileName) {
+            if (!FileExists(FileName.c_str()))
+                return nullptr;
+
+            CString Data;
+
+            try {
+                Data.LoadFromFile(FileName.c_str());
+            } catch (std::exception &e) {
+                return nullptr;
+            }
+
+            return Parse(Data);
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CHTTPCache::Save(const std::string &Key, const CHTTPCacheEntry &Entry) {
+            if (m_Path.IsEmpty())
+                return;
+
+            const auto pData = std::make_shared<CString>(Serialize(Entry));
+            const auto pSaved = std::make_shared<bool>(false);
+
+            auto Work = [pData, pSaved, caFileName = FileName(Key)]() {
+                *pSaved = SaveFile(caFileName, *pData);
+            };
+
+            auto Done = [this, Key, pData, pSaved]() {
+                if (*pSaved)
+                    Index(Key, pData->Size());
+            };
+
+            Run(Key, std::move(Work), std::move(Done));
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        bool CHTTPCache::OnDisk(const CString &Key) const {
+            const std::string caKey(Key.c_str());
+            return m_Entries.find(caKey) == m_Entries.end() && m_DiskEntries.find(caKey) != m_DiskEntries.end();
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CHTTPCache::Load(const CString &Key, COnWorkerJobEvent &&Done) {
+            const std::string caKey(Key.c_str());
+
+            auto &Waiters = m_Loading[caKey];
+
+            Waiters.push_back(std::move(Done));
+            if (Waiters.size() > 1)
+                return;
+
+            const auto pEntry = std::make_shared<CHTTPCacheEntryPtr>();
+
+            auto Work = [pEntry, caFileName = FileName(caKey)]() {
+                *pEntry = LoadFile(caFileName);
+            };
+
+            auto Finish = [this, caKey, pEntry]() {
+                if (*pEntry == nullptr) {
+                    // Unreadable: the next lookup goes upstream instead of trying the file again.
+                    Forget(caKey);
+                } else if (m_Entries.find(caKey) == m_Entries.end()) {
+                    Put(caKey, *pEntry);
+
+                    const auto it = m_DiskEntries.find(caKey);
+                    if (it != m_DiskEntries.end())
+                        m_DiskLRU.splice(m_DiskLRU.begin(), m_DiskLRU, it->second.second);
+                }
+
+                std::vector<COnWorkerJobEvent> Callbacks;
+
+                const auto it = m_Loading.find(caKey);
+                if (it != m_Loading.end()) {
+                    Callbacks.swap(it->second);
+                    m_Loading.erase(it);
+                }
+
+                for (auto &Callback : Callbacks) {
+                    Callback();
+                }
+            };
+
+            Run(caKey, std::move(Work), std::move(Finish));
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        CHTTPCacheEntryPtr CHTTPCache::Find(const CString &Key, const CHeaders &Request) {
+            const std::string caKey(Key.c_str());
+
+            // Memory only: an entry that lives on disk alone is brought in by Load() on the I/O pool.
+            const auto it = m_Entries.find(caKey);
+            if (it == m_Entries.end())
+                return nullptr;
+
+            const auto pEntry = it->second.first;
+            m_LRU.splice(m_LRU.begin(), m_LRU, it->second.second);
+
+            if (!pEntry->Fresh(time(nullptr)) && !pEntry->Validators()) {
+                Erase(caKey);
+                return nullptr;
+            }
+
+            return Matches(*pEntry, Request) ? pEntry : nullptr;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        bool CHTTPCache::Store(const CString &Key, const CHeaders &Request, const CHTTPReply &Reply, time_t Now) {
+            switch ((int) Reply.Status) {
+                case 200:
+                case 203:
+                case 204:
+                case 300:
+                case 301:
+                case 404:
+                case 410:
+                    break;
+
+                default:
+                    return false;
+            }
+
+            if (Reply.Content.Size() > m_MaxEntry)
+                return false;
+
+            // RFC 9111, 3.5: a reply to an authorized request is stored only when the origin explicitly allows it.
+            if (Credentials(Request)) {
+                const auto &caDirectives = Tokens(Reply.Headers["Cache-Control"]);
+                const auto allowed = std::any_of(caDirectives.begin(), caDirectives.end(), [](const std::string &Directive) {
+                    return Directive == "public" || Directive.compare(0, 9, "s-maxage=") == 0;
+                });
+                if (!allowed)
+                    return false;
+            }
+
+            bool noStore = false;
+            const auto lifetime = Lifetime(Reply.Headers, Now, noStore);
+
+            if (noStore)
+                return false;
+
+            const auto &caVary = Tokens(Reply.Headers["Vary"]);
+            if (std::find(caVary.begin(), caVary.end(), "*") != caVary.end())
+                return false;
+
+            const auto pEntry = std::make_shared<CHTTPCacheEntry>();
+
+            pEntry->Status = (int) Reply.Status;
+            pEntry->StatusText = Reply.StatusText;
+
+            for (int i = 0; i < Reply.Headers.Count(); i++) {
+                const auto &Header = Reply.Headers[i];
+                pEntry->Headers.AddPair(Header.Name(), Header.Value());
+            }
+
+            if (lifetime == 0 && !pEntry->Validators())
+                return false;
+
+            pEntry->Body = Reply.Content;
+
+            for (const auto &Name : caVary) {
+                pEntry->Vary.emplace_back(Name, Request[Name.c_str()].c_str());
+            }
+
+            pEntry->Stored = Now;
+            pEntry->Expires = Now + lifetime;
+
+            const std::string caKey(Key.c_str());
+
+            Put(caKey, pEntry);
+            Save(caKey, *pEntry);
+
+            m_Stores++;
+
+            return true;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        CHTTPCacheEntryPtr CHTTPCache::Refresh(const CString &Key, const CHTTPReply &Reply, time_t Now) {
+            const std::string caKey(Key.c_str());
+
+            // The stale entry was loaded before the conditional request went out; if it was evicted since, the caller
+            // has nothing to refresh and must fetch the body again.
+            const auto it = m_Entries.find(caKey);
+            if (it == m_Entries.end())
+                return nullptr;
+
+            const auto pStale = it->second.first;
+
+            // RFC 9111, 4.3.4: the stored headers are updated with those of the 304 response.
+            const auto pEntry = std::make_shared<CHTTPCacheEntry>(*pStale);
+
+            pEntry->Headers.Clear();
+
+            for (int i = 0; i < pStale->Headers.Count(); i++) {
+                const auto &Header = pStale->Headers[i];
+                if (Reply.Headers[Header.Name()].IsEmpty())
+                    pEntry->Headers.AddPair(Header.Name(), Header.Value());
+            }
+
+            for (int i = 0; i < Reply.Headers.Count(); i++) {
+                const auto &Header = Reply.Headers[i];
+                if (strcasecmp(Header.Name().c_str(), "Content-Length") != 0 && strcasecmp(Header.Name().c_str(), "Connection") != 0)
+                    pEntry->Headers.AddPair(Header.Name(), Header.Value());
+            }
+
+            bool noStore = false;
+            const auto lifetime = Lifetime(pEntry->Headers, Now, noStore);
+
+            if (noStore) {
+                Erase(caKey);
+                return pEntry;
+            }
+
+            pEntry->Stored = Now;
+            pEntry->Expires = Now + lifetime;
+
+            Put(caKey, pEntry);
+            Save(caKey, *pEntry);
+
+            m_Revalidated++;
+
+            return pEntry;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CHTTPCache::ToReply(const CHTTPCacheEntry &Entry, time_t Now, CHTTPReply &Reply) {
+            Reply.StatusString = CString().Format("%d", Entry.Status);
+            Reply.StatusText = Entry.StatusText;
+
+            Reply.StringToStatus();
+
+            for (int i = 0; i < Entry.Headers.Count(); i++) {
+                const auto &Header = Entry.Headers[i];
+                if (strcasecmp(Header.Name().c_str(), "Age") != 0)
+                    Reply.AddHeader(Header.Name(), Header.Value());
+            }
+
+            Reply.AddHeader("Age", CString::ToString((int) std::max<time_t>(0, Now - Entry.Stored)));
+
+            Reply.Content = Entry.Body;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CHTTPCache::Metrics(CString &Output, const CString &Module) const {
+            if (!m_Active)
+                return;
+
+            Output += CString().Format("# TYPE apostol_http_cache_hits_total counter\n"
+                                       "apostol_http_cache_hits_total{module=\"%s\"} %llu\n",
+                                       Module.c_str(), (unsigned long long) m_Hits);
+            Output += CString().Format("# TYPE apostol_http_cache_revalidated_total counter\n"
+                                       "apostol_http_cache_revalidated_total{module=\"%s\"} %llu\n",
+                                       Module.c_str(), (unsigned long long) m_Revalidated);
+            Output += CString().Format("# TYPE apostol_http_cache_misses_total counter\n"
+                                       "apostol_http_cache_misses_total{module=\"%s\"} %llu\n",
+                                       Module.c_str(), (unsigned long long) m_Misses);
+            Output += CString().Format("# TYPE apostol_http_cache_stores_total counter\n"
+                                       "apostol_http_cache_stores_total{module=\"%s\"} %llu\n",
+                                       Module.c_str(), (unsigned long long) m_Stores);
+            Output += CString().Format("# TYPE apostol_http_cache_memory_bytes gauge\n"
+                                       "apostol_http_cache_memory_bytes{module=\"%s\"} %llu\n",
+                                       Module.c_str(), (unsigned long long) m_Memory);
+            Output += CString().Format("# TYPE apostol_http_cache_disk_bytes gauge\n"
+                                       "apostol_http_cache_disk_bytes{module=\"%s\"} %llu\n",
+                                       Module.c_str(), (unsigned long long) m_Disk);
+            Output += CString().Format("# TYPE apostol_http_cache_disk_evictions_total counter\n"
+                                       "apostol_http_cache_disk_evictions_total{module=\"%s\"} %llu\n",
+                                       Module.c_str(), (unsigned long long) m_DiskEvictions);
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+    }
+}
+}
@@ -0,0 +1,174 @@
+/*++
+
+Program name:
+
+  Apostol CRM
+
+Module Name:
+
+  HTTPCache.hpp
+
+Notices:
+
+  Module: HTTP response cache
+
+Author:
+
+  Copyright (c) Prepodobny Alen
+
+  mailto: alienufo@inbox.ru
+  mailto: ufocomp@gmail.com
+
+--*/
+
+#ifndef APOSTOL_HTTP_CACHE_HPP
+#define APOSTOL_HTTP_CACHE_HPP
+//----------------------------------------------------------------------------------------------------------------------
+
+#include <list>
+#include <memory>
+#include <string>
+#include <vector>
+#include <unordered_map>
+//----------------------------------------------------------------------------------------------------------------------
+
+#ifndef APOSTOL_WORKER_POOL_HPP
+#include "WorkerPool.hpp"
+#endif
+//----------------------------------------------------------------------------------------------------------------------
+
+extern "C++" {
+
+namespace Apostol {
+
+    namespace Module {
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        //-- CHTTPCacheEntry -------------------------------------------------------------------------------------------
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        typedef struct http_cache_entry_s {
+            int Status = 0;
+            CString StatusText;
+
+            CHeaders Headers;
+            CString Body;
+
+            std::vector<std::pair<std::string, std::string>> Vary;
+
+            time_t Stored = 0;
+            time_t Expires = 0;
+
+            bool Fresh(time_t Now) const { return Now < Expires; }
+            bool Validators() const { return !Headers["ETag"].IsEmpty() || !Headers["Last-Modified"].IsEmpty(); }
+
+            size_t Size() const { return Body.Size() + 512; }
+        } CHTTPCacheEntry;
+
+        typedef std::shared_ptr<CHTTPCacheEntry> CHTTPCacheEntryPtr;
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        //-- CHTTPCache ------------------------------------------------------------------------------------------------
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        class CHTTPCache {
+        private:
+
+            typedef std::list<std::string> CLRUList;
+            typedef std::pair<CHTTPCacheEntryPtr, CLRUList::iterator> CLRUItem;
+            typedef std::pair<size_t, CLRUList::iterator> CDiskItem;
+
+            CWorkerPool &m_Pool;
+
+            bool m_Active;
+
+            CString m_Path;
+
+            size_t m_MaxMemory;
+            size_t m_MaxEntry;
+            size_t m_Memory;
+
+            size_t m_MaxDisk;
+            size_t m_Disk;
+
+            CLRUList m_LRU;
+            std::unordered_map<std::string, CLRUItem> m_Entries;
+
+            CLRUList m_DiskLRU;
+            std::unordered_map<std::string, CDiskItem> m_DiskEntries;
+
+            std::unordered_map<std::string, std::vector<COnWorkerJobEvent>> m_Loading;
+
+            uint64_t m_Hits;
+            uint64_t m_Revalidated;
+            uint64_t m_Misses;
+            uint64_t m_Stores;
+            uint64_t m_DiskEvictions;
+
+            void Put(const std::string &Key, const CHTTPCacheEntryPtr &Entry);
+            void Remove(const std::string &Key);
+
+            void Index(const std::string &Key, size_t Size);
+            void Forget(const std::string &Key);
+            void Erase(const std::string &Key);
+
+            void Scan();
+
+            CString FileName(const std::string &Key) const;
+
+            void Run(const std::string &Key, COnWorkerJobEvent &&Work, COnWorkerJobEvent &&Done);
+
+            void Save(const std::string &Key, const CHTTPCacheEntry &Entry);
+
+            static CString Serialize(const CHTTPCacheEntry &Entry);
+            static CHTTPCacheEntryPtr Parse(const CString &Data);
+
+            static bool SaveFile(const CString &FileName, const CString &Data);
+            static CHTTPCacheEntryPtr LoadFile(const CString &FileName);
+
+            static bool Matches(const CHTTPCacheEntry &Entry, const CHeaders &Request);
+
+            static time_t Lifetime(const CHeaders &Headers, time_t Now, bool &NoStore);
+
+        public:
+
+            explicit CHTTPCache(CWorkerPool &Pool);
+
+            void Open(size_t MaxMemory, size_t MaxEntry, const CString &Path, size_t MaxDisk);
+
+            bool Active() const { return m_Active; }
+
+            CHTTPCacheEntryPtr Find(const CString &Key, const CHeaders &Request);
+
+            bool OnDisk(const CString &Key) const;
+            void Load(const CString &Key, COnWorkerJobEvent &&Done);
+
+            bool Store(const CString &Key, const CHeaders &Request, const CHTTPReply &Reply, time_t Now);
+            CHTTPCacheEntryPtr Refresh(const CString &Key, const CHTTPReply &Reply, time_t Now);
+
+            void Hit() { m_Hits++; }
+            void Miss() { m_Misses++; }
+
+            void Metrics(CString &Output, const CString &Module) const;
+
+            static CString Key(const CString &Method, const CString &URL, const CHeaders &Request);
+
+            static bool Cacheable(const CHeaders &Request);
+            static bool Credentials(const CHeaders &Request);
+
+            static void ToReply(const CHTTPCacheEntry &Entry, time_t Now, CHTTPReply &Reply);
+
+            static time_t ParseDate(const CString &Value);
+
+        };
+
+    }
+}
+
+using namespace Apostol::Module;
+}
+#endif //APOSTOL_HTTP_CACHE_HPP
@@ -0,0 +1,234 @@
+/*++
+
+Program name:
+
+  Apostol CRM
+
+Module Name:
+
+  HTTPClientPool.cpp
+
+Notices:
+
+  Module: HTTP client connection pool
+
+Author:
+
+  Copyright (c) Prepodobny Alen
+
+  mailto: alienufo@inbox.ru
+  mailto: ufocomp@gmail.com
+
+--*/
+
+//----------------------------------------------------------------------------------------------------------------------
+
+#include "Core.hpp"
+#include "HTTPClientPool.hpp"
+//----------------------------------------------------------------------------------------------------------------------
+
+extern "C++" {
+
+namespace Apostol {
+
+    namespace Module {
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        //-- CHTTPClientPool -------------------------------------------------------------------------------------------
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        CHTTPClientPool::CHTTPClientPool(): m_Active(false), m_MaxPerHost(0), m_IdleTimeOut(0),
+                m_Created(0), m_Reused(0), m_Closed(0) {
+
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        CHTTPClientPool::~CHTTPClientPool() {
+            Close();
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CHTTPClientPool::Open(size_t MaxPerHost, int IdleTimeOut) {
+            m_MaxPerHost = MaxPerHost;
+            m_IdleTimeOut = (CDateTime) IdleTimeOut / SecsPerDay;
+            m_Active = true;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CHTTPClientPool::Close() {
+            for (auto &it : m_Idle) {
+                for (auto &Item : it.second) {
+                    m_Garbage.push_back(Item.Client);
+                }
+            }
+
+            for (auto &it : m_Busy) {
+                m_Garbage.push_back(it.first);
+            }
+
+            m_Idle.clear();
+            m_Busy.clear();
+            m_Count.clear();
+
+            for (auto pClient : m_Garbage) {
+                pClient->Active(false);
+                delete pClient;
+            }
+
+            m_Garbage.clear();
+
+            m_Active = false;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        std::string CHTTPClientPool::Key(const CLocation &URI) {
+            return std::string(URI.protocol.c_str()) + "://" + URI.hostname.c_str() + ":" + std::to_string(URI.port);
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        bool CHTTPClientPool::Checkout(const std::string &Key, CHTTPPoolConnection &Item) {
+            const auto it = m_Idle.find(Key);
+            if (it == m_Idle.end() || it->second.empty())
+                return false;
+
+            Item = it->second.back();
+            it->second.pop_back();
+
+            m_Busy[Item.Client] = Key;
+            m_Reused++;
+
+            return true;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        bool CHTTPClientPool::Acquire(const std::string &Key) {
+            auto &count = m_Count[Key];
+
+            if (m_MaxPerHost != 0 && count >= m_MaxPerHost)
+                return false;
+
+            // The slot is taken now, not at Attach(): a fetch waiting for DNS counts against the cap too.
+            count++;
+
+            return true;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CHTTPClientPool::Cancel(const std::string &Key) {
+            auto it = m_Count.find(Key);
+            if (it != m_Count.end() && --it->second == 0) {
+                m_Count.erase(it);
+            }
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CHTTPClientPool::Attach(const std::string &Key, CHTTPClient *AClient) {
+            m_Busy[AClient] = Key;
+            m_Created++;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CHTTPClientPool::Discard(const std::string &Key, CHTTPClient *AClient) {
+            auto it = m_Count.find(Key);
+            if (it != m_Count.end() && --it->second == 0) {
+                m_Count.erase(it);
+            }
+
+            // The client may be inside its own event callback here, so it is freed later by Expire().
+            m_Garbage.push_back(AClient);
+            m_Closed++;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CHTTPClientPool::Release(CHTTPClient *AClient, CHTTPClientConnection *AConnection, bool KeepAlive) {
+            const auto it = m_Busy.find(AClient);
+            if (it == m_Busy.end())
+                return;
+
+            const auto caKey = it->second;
+            m_Busy.erase(it);
+
+            if (KeepAlive && m_Active && AConnection != nullptr) {
+                CHTTPPoolConnection Item;
+
+                Item.Client = AClient;
+                Item.Connection = AConnection;
+                Item.Idle = Now();
+
+                m_Idle[caKey].push_back(Item);
+            } else {
+                Discard(caKey, AClient);
+            }
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CHTTPClientPool::Remove(CObject *AConnection) {
+            for (auto it = m_Idle.begin(); it != m_Idle.end(); ++it) {
+                auto &Items = it->second;
+                for (auto item = Items.begin(); item != Items.end(); ++item) {
+                    if (item->Connection == AConnection) {
+                        const auto pClient = item->Client;
+                        Items.erase(item);
+                        Discard(it->first, pClient);
+                        return;
+                    }
+                }
+            }
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CHTTPClientPool::Expire(CDateTime Now) {
+            for (auto pClient : m_Garbage) {
+                pClient->Active(false);
+                delete pClient;
+            }
+
+            m_Garbage.clear();
+
+            for (auto it = m_Idle.begin(); it != m_Idle.end(); ) {
+                auto &Items = it->second;
+
+                while (!Items.empty() && Now - Items.front().Idle >= m_IdleTimeOut) {
+                    Discard(it->first, Items.front().Client);
+                    Items.pop_front();
+                }
+
+                if (Items.empty()) {
+                    it = m_Idle.erase(it);
+                } else {
+                    ++it;
+                }
+            }
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        size_t CHTTPClientPool::IdleCount() const {
+            size_t count = 0;
+            for (const auto &it : m_Idle) {
+                count += it.second.size();
+            }
+            return count;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CHTTPClientPool::Metrics(CString &Output, const CString &Module) const {
+            Output += CString().Format("# TYPE apostol_http_pool_connections_total counter\n"
+                                       "apostol_http_pool_connections_total{module=\"%s\"} %llu\n",
+                                       Module.c_str(), (unsigned long long) m_Created);
+            Output += CString().Format("# TYPE apostol_http_pool_reused_total counter\n"
+                                       "apostol_http_pool_reused_total{module=\"%s\"} %llu\n",
+                                       Module.c_str(), (unsigned long long) m_Reused);
+            Output += CString().Format("# TYPE apostol_http_pool_closed_total counter\n"
+                                       "apostol_http_pool_closed_total{module=\"%s\"} %llu\n",
+                                       Module.c_str(), (unsigned long long) m_Closed);
+            Output += CString().Format("# TYPE apostol_http_pool_idle gauge\n"
+                                       "apostol_http_pool_idle{module=\"%s\"} %llu\n",
+                                       Module.c_str(), (unsigned long long) IdleCount());
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+    }
+}
+}
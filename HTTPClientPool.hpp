@@ -0,0 +1,112 @@
+/*++
+
+Program name:
+
+  Apostol CRM
+
+Module Name:
+
+  HTTPClientPool.hpp
+
+Notices:
+
+  Module: HTTP client connection pool
+
+Author:
+
+  Copyright (c) Prepodobny Alen
+
+  mailto: alienufo@inbox.ru
+  mailto: ufocomp@gmail.com
+
+--*/
+
+#ifndef APOSTOL_HTTP_CLIENT_POOL_HPP
+#define APOSTOL_HTTP_CLIENT_POOL_HPP
+//----------------------------------------------------------------------------------------------------------------------
+
+#include <deque>
+#include <vector>
+#include <unordered_map>
+//----------------------------------------------------------------------------------------------------------------------
+
+extern "C++" {
+
+namespace Apostol {
+
+    namespace Module {
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        //-- CHTTPPoolConnection ---------------------------------------------------------------------------------------
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        typedef struct http_pool_connection_s {
+            CHTTPClient *Client = nullptr;
+            CHTTPClientConnection *Connection = nullptr;
+            CDateTime Idle = 0;
+        } CHTTPPoolConnection;
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        //-- CHTTPClientPool -------------------------------------------------------------------------------------------
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        class CHTTPClientPool {
+        private:
+
+            bool m_Active;
+
+            size_t m_MaxPerHost;
+            CDateTime m_IdleTimeOut;
+
+            std::unordered_map<std::string, std::deque<CHTTPPoolConnection>> m_Idle;
+            std::unordered_map<CHTTPClient *, std::string> m_Busy;
+            std::unordered_map<std::string, size_t> m_Count;
+
+            std::vector<CHTTPClient *> m_Garbage;
+
+            uint64_t m_Created;
+            uint64_t m_Reused;
+            uint64_t m_Closed;
+
+            void Discard(const std::string &Key, CHTTPClient *AClient);
+
+        public:
+
+            CHTTPClientPool();
+
+            ~CHTTPClientPool();
+
+            void Open(size_t MaxPerHost, int IdleTimeOut);
+            void Close();
+
+            bool Active() const { return m_Active; }
+
+            bool Checkout(const std::string &Key, CHTTPPoolConnection &Item);
+            bool Acquire(const std::string &Key);
+            void Cancel(const std::string &Key);
+
+            void Attach(const std::string &Key, CHTTPClient *AClient);
+            void Release(CHTTPClient *AClient, CHTTPClientConnection *AConnection, bool KeepAlive);
+
+            void Remove(CObject *AConnection);
+
+            void Expire(CDateTime Now);
+
+            size_t IdleCount() const;
+
+            void Metrics(CString &Output, const CString &Module) const;
+
+            static std::string Key(const CLocation &URI);
+
+        };
+
+    }
+}
+
+using namespace Apostol::Module;
+}
+#endif //APOSTOL_HTTP_CLIENT_POOL_HPP
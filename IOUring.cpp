@@ -0,0 +1,470 @@
+/*++
+
+Program name:
+
+  Apostol CRM
+
+Module Name:
+
+  IOUring.cpp
+
+Notices:
+
+  Module: io_uring file I/O
+
+Author:
+
+  Copyright (c) Prepodobny Alen
+
+  mailto: alienufo@inbox.ru
+  mailto: ufocomp@gmail.com
+
+--*/
+
+//----------------------------------------------------------------------------------------------------------------------
+
+#include "Core.hpp"
+#include "IOUring.hpp"
+//----------------------------------------------------------------------------------------------------------------------
+
+#include <algorithm>
+#include <sys/eventfd.h>
+//----------------------------------------------------------------------------------------------------------------------
+
+#define IO_URING_MAX_WRITE (1024 * 1024 * 1024)
+
+#define IO_URING_SAVE_OPEN    0
+#define IO_URING_SAVE_WRITE   1
+#define IO_URING_SAVE_CLOSE   2
+#define IO_URING_SAVE_RENAME  3
+#define IO_URING_SAVE_STAT    4
+#define IO_URING_SAVE_CLEANUP 5
+
+// The step of a linked operation travels in the low bits of the user data; requests are at least 8-byte aligned.
+#define IO_URING_STEP_MASK    7
+//----------------------------------------------------------------------------------------------------------------------
+
+extern "C++" {
+
+namespace Apostol {
+
+    namespace Module {
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        //-- CIOUring --------------------------------------------------------------------------------------------------
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        CIOUring::CIOUring(): m_Active(false), m_EventFd(-1), m_Pending(0), m_Queued(0), m_Requests(0), m_Operations(0), m_Submits(0) {
+#if (APOSTOL_USE_IO_URING)
+            memset(&m_Ring, 0, sizeof(m_Ring));
+#endif
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        CIOUring::~CIOUring() {
+            Close();
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        bool CIOUring::Open(unsigned Entries) {
+#if (APOSTOL_USE_IO_URING)
+            Close();
+
+            if (io_uring_queue_init(Entries, &m_Ring, 0) != 0)
+                return false;
+
+            auto pProbe = io_uring_get_probe_ring(&m_Ring);
+
+            m_Active = pProbe != nullptr &&
+                    io_uring_opcode_supported(pProbe, IORING_OP_OPENAT) &&
+                    io_uring_opcode_supported(pProbe, IORING_OP_WRITE) &&
+                    io_uring_opcode_supported(pProbe, IORING_OP_CLOSE) &&
+                    io_uring_opcode_supported(pProbe, IORING_OP_RENAMEAT) &&
+                    io_uring_opcode_supported(pProbe, IORING_OP_UNLINKAT) &&
+                    io_uring_opcode_supported(pProbe, IORING_OP_STATX);
+
+            if (pProbe != nullptr)
+                io_uring_free_probe(pProbe);
+
+            if (!m_Active) {
+                io_uring_queue_exit(&m_Ring);
+                return false;
+            }
+
+            // Completions wake the event loop through this descriptor instead of a polling timer.
+            m_EventFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+            if (m_EventFd != -1 && io_uring_register_eventfd(&m_Ring, m_EventFd) != 0) {
+                close(m_EventFd);
+                m_EventFd = -1;
+            }
+
+            return true;
+#else
+            return false;
+#endif
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CIOUring::Close() {
+            if (!m_Active)
+                return;
+#if (APOSTOL_USE_IO_URING)
+            io_uring_queue_exit(&m_Ring);
+#endif
+            if (m_EventFd != -1) {
+                close(m_EventFd);
+                m_EventFd = -1;
+            }
+
+            for (auto &File : m_Files) {
+                for (auto pRequest : File.second) {
+                    if (pRequest->Fd != -1)
+                        close(pRequest->Fd);
+                    delete pRequest;
+                }
+            }
+
+            m_Files.clear();
+            m_Backlog.clear();
+
+            m_Pending = 0;
+            m_Queued = 0;
+            m_Active = false;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CIOUring::Drain() const {
+            uint64_t value;
+
+            if (m_EventFd != -1) {
+                while (read(m_EventFd, &value, sizeof(value)) > 0) {
+                }
+            }
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        bool CIOUring::Enqueue(CIOUringRequest *ARequest) {
+            if (!m_Active) {
+                delete ARequest;
+                return false;
+            }
+
+            m_Pending++;
+            m_Requests++;
+
+            // Requests for the same file run one after another, in the order they were made.
+            auto &Queue = m_Files[ARequest->FileName];
+            Queue.push_back(ARequest);
+
+            if (Queue.size() == 1 && !Prepare(ARequest)) {
+                m_Backlog.push_back(ARequest);
+            }
+
+            return true;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        bool CIOUring::Prepare(CIOUringRequest *ARequest) {
+#if (APOSTOL_USE_IO_URING)
+            const auto bChain = ARequest->Operation == iuoSave && ARequest->Error == 0 &&
+                    (ARequest->Step == IO_URING_SAVE_WRITE || ARequest->Step == IO_URING_SAVE_CLOSE || ARequest->Step == IO_URING_SAVE_RENAME);
+
+            size_t writes = 0;
+            if (bChain && ARequest->Step == IO_URING_SAVE_WRITE) {
+                writes = (ARequest->Size - ARequest->Offset + IO_URING_MAX_WRITE - 1) / IO_URING_MAX_WRITE;
+            }
+
+            // Write, close, rename and stat go in as one linked chain: the kernel runs them back to back.
+            const size_t count = bChain ? writes + (ARequest->Step == IO_URING_SAVE_RENAME ? 2 : 3) : 1;
+
+            if (io_uring_sq_space_left(&m_Ring) < count)
+                return false;
+
+            auto Push = [this, ARequest](int Step, bool Link, size_t Offset) {
+                auto pSQE = io_uring_get_sqe(&m_Ring);
+
+                switch (ARequest->Operation) {
+                    case iuoSave:
+                        switch (Step) {
+                            case IO_URING_SAVE_OPEN:
+                                io_uring_prep_openat(pSQE, AT_FDCWD, ARequest->TempName.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+                                break;
+
+                            case IO_URING_SAVE_WRITE:
+                                io_uring_prep_write(pSQE, ARequest->Fd, ARequest->Buffer + Offset,
+                                                    std::min(ARequest->Size - Offset, (size_t) IO_URING_MAX_WRITE), Offset);
+                                break;
+
+                            case IO_URING_SAVE_CLOSE:
+                                io_uring_prep_close(pSQE, ARequest->Fd);
+                                break;
+
+                            case IO_URING_SAVE_RENAME:
+                                io_uring_prep_renameat(pSQE, AT_FDCWD, ARequest->TempName.c_str(), AT_FDCWD, ARequest->FileName.c_str(), 0);
+                                break;
+
+                            case IO_URING_SAVE_STAT:
+                                io_uring_prep_statx(pSQE, AT_FDCWD, ARequest->FileName.c_str(), 0, STATX_MTIME, &ARequest->Stat);
+                                break;
+
+                            default:
+                                io_uring_prep_unlinkat(pSQE, AT_FDCWD, ARequest->TempName.c_str(), 0);
+                                break;
+                        }
+                        break;
+
+                    case iuoStat:
+                        io_uring_prep_statx(pSQE, AT_FDCWD, ARequest->FileName.c_str(), 0, STATX_MTIME, &ARequest->Stat);
+                        break;
+
+                    case iuoUnlink:
+                        io_uring_prep_unlinkat(pSQE, AT_FDCWD, ARequest->FileName.c_str(), 0);
+                        break;
+                }
+
+                if (Link)
+                    pSQE->flags |= IOSQE_IO_LINK;
+
+                io_uring_sqe_set_data(pSQE, (void *) ((uintptr_t) ARequest | (uintptr_t) Step));
+
+                m_Queued++;
+                m_Operations++;
+            };
+
+            if (!bChain) {
+                Push(ARequest->Operation == iuoSave ? ARequest->Step : 0, false, 0);
+                ARequest->Linked = 1;
+                return true;
+            }
+
+            for (size_t i = 0; i < writes; ++i) {
+                Push(IO_URING_SAVE_WRITE, true, ARequest->Offset + i * IO_URING_MAX_WRITE);
+            }
+
+            if (ARequest->Step != IO_URING_SAVE_RENAME)
+                Push(IO_URING_SAVE_CLOSE, true, 0);
+
+            Push(IO_URING_SAVE_RENAME, true, 0);
+            Push(IO_URING_SAVE_STAT, false, 0);
+
+            ARequest->Linked = (int) count;
+
+            return true;
+#else
+            return false;
+#endif
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CIOUring::Complete(CIOUringRequest *ARequest, int Step, int Result) {
+            if (ARequest->Operation != iuoSave) {
+                if (Result < 0 && !(ARequest->Operation == iuoUnlink && Result == -ENOENT))
+                    ARequest->Error = -Result;
+                Finish(ARequest);
+                return;
+            }
+
+            // A broken link cancels the rest of the chain; only the operation that actually failed sets the error.
+            const auto bCancelled = Result == -ECANCELED;
+
+            switch (Step) {
+                case IO_URING_SAVE_OPEN:
+                    if (Result < 0) {
+                        ARequest->Error = -Result;
+                    } else {
+                        ARequest->Fd = Result;
+                        ARequest->Opened = true;
+                    }
+                    break;
+
+                case IO_URING_SAVE_WRITE:
+                    if (Result > 0) {
+                        ARequest->Offset += Result;
+                    } else if (!bCancelled && ARequest->Error == 0) {
+                        ARequest->Error = Result < 0 ? -Result : EIO;
+                    }
+                    break;
+
+                case IO_URING_SAVE_CLOSE:
+                    if (!bCancelled) {
+                        ARequest->Fd = -1;
+                        if (Result < 0 && ARequest->Error == 0)
+                            ARequest->Error = -Result;
+                    }
+                    break;
+
+                case IO_URING_SAVE_RENAME:
+                    if (Result == 0) {
+                        ARequest->Renamed = true;
+                    } else if (!bCancelled && ARequest->Error == 0) {
+                        ARequest->Error = -Result;
+                    }
+                    break;
+
+                case IO_URING_SAVE_STAT:
+                    if (Result < 0 && !bCancelled && ARequest->Error == 0)
+                        ARequest->Error = -Result;
+                    break;
+
+                default:
+                    break;
+            }
+
+            if (--ARequest->Linked > 0)
+                return;
+
+            Advance(ARequest);
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CIOUring::Advance(CIOUringRequest *ARequest) {
+            if (ARequest->Renamed || ARequest->Step == IO_URING_SAVE_CLEANUP || !ARequest->Opened) {
+                Finish(ARequest);
+                return;
+            }
+
+            if (ARequest->Error != 0) {
+                ARequest->Step = ARequest->Fd != -1 ? IO_URING_SAVE_CLOSE : IO_URING_SAVE_CLEANUP;
+            } else if (ARequest->Fd != -1) {
+                // A short write breaks the chain without an error: the rest is queued again from where it stopped.
+                ARequest->Step = ARequest->Offset < ARequest->Size ? IO_URING_SAVE_WRITE : IO_URING_SAVE_CLOSE;
+            } else {
+                ARequest->Step = IO_URING_SAVE_RENAME;
+            }
+
+            if (!Prepare(ARequest)) {
+                m_Backlog.push_back(ARequest);
+            }
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CIOUring::Finish(CIOUringRequest *ARequest) {
+            time_t Modified = 0;
+#if (APOSTOL_USE_IO_URING)
+            Modified = ARequest->Stat.stx_mtime.tv_sec;
+#endif
+            m_Pending--;
+
+            const auto it = m_Files.find(ARequest->FileName);
+            if (it != m_Files.end()) {
+                auto &Queue = it->second;
+                Queue.pop_front();
+                if (Queue.empty()) {
+                    m_Files.erase(it);
+                } else if (!Prepare(Queue.front())) {
+                    m_Backlog.push_back(Queue.front());
+                }
+            }
+
+            if (ARequest->Done)
+                ARequest->Done(ARequest->Error, Modified);
+
+            delete ARequest;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        bool CIOUring::Save(const CString &FileName, const char *Buffer, size_t Size, COnIOUringEvent &&Done) {
+            auto pRequest = new CIOUringRequest();
+
+            pRequest->Operation = iuoSave;
+            pRequest->FileName = FileName.c_str();
+            pRequest->TempName = pRequest->FileName + ".~tmp";
+            pRequest->Buffer = Buffer;
+            pRequest->Size = Size;
+            pRequest->Done = std::move(Done);
+
+            return Enqueue(pRequest);
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        bool CIOUring::Stat(const CString &FileName, COnIOUringEvent &&Done) {
+            auto pRequest = new CIOUringRequest();
+
+            pRequest->Operation = iuoStat;
+            pRequest->FileName = FileName.c_str();
+            pRequest->Done = std::move(Done);
+
+            return Enqueue(pRequest);
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        bool CIOUring::Unlink(const CString &FileName, COnIOUringEvent &&Done) {
+            auto pRequest = new CIOUringRequest();
+
+            pRequest->Operation = iuoUnlink;
+            pRequest->FileName = FileName.c_str();
+            pRequest->Done = std::move(Done);
+
+            return Enqueue(pRequest);
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        size_t CIOUring::Submit() {
+#if (APOSTOL_USE_IO_URING)
+            size_t submitted = 0;
+
+            while (m_Queued != 0) {
+                const auto count = io_uring_submit(&m_Ring);
+                if (count <= 0)
+                    break;
+
+                m_Submits++;
+                m_Queued -= std::min((size_t) count, m_Queued);
+                submitted += count;
+
+                while (!m_Backlog.empty() && Prepare(m_Backlog.front())) {
+                    m_Backlog.pop_front();
+                }
+            }
+
+            return submitted;
+#else
+            return 0;
+#endif
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        size_t CIOUring::Reap() {
+#if (APOSTOL_USE_IO_URING)
+            size_t count = 0;
+            struct io_uring_cqe *pCQE = nullptr;
+
+            while (io_uring_peek_cqe(&m_Ring, &pCQE) == 0 && pCQE != nullptr) {
+                const auto data = (uintptr_t) io_uring_cqe_get_data(pCQE);
+                const auto pRequest = reinterpret_cast<CIOUringRequest *> (data & ~(uintptr_t) IO_URING_STEP_MASK);
+                const auto result = pCQE->res;
+
+                io_uring_cqe_seen(&m_Ring, pCQE);
+
+                Complete(pRequest, (int) (data & IO_URING_STEP_MASK), result);
+                count++;
+            }
+
+            return count;
+#else
+            return 0;
+#endif
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CIOUring::Metrics(CString &Output, const CString &Module) const {
+            Output += CString().Format("# TYPE apostol_io_uring_requests_total counter\n"
+                                       "apostol_io_uring_requests_total{module=\"%s\"} %llu\n",
+                                       Module.c_str(), (unsigned long long) m_Requests);
+            Output += CString().Format("# TYPE apostol_io_uring_operations_total counter\n"
+                                       "apostol_io_uring_operations_total{module=\"%s\"} %llu\n",
+                                       Module.c_str(), (unsigned long long) m_Operations);
+            Output += CString().Format("# TYPE apostol_io_uring_submits_total counter\n"
+                                       "apostol_io_uring_submits_total{module=\"%s\"} %llu\n",
+                                       Module.c_str(), (unsigned long long) m_Submits);
+            Output += CString().Format("# TYPE apostol_io_uring_pending gauge\n"
+                                       "apostol_io_uring_pending{module=\"%s\"} %llu\n",
+                                       Module.c_str(), (unsigned long long) m_Pending);
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+    }
+}
+}
@@ -0,0 +1,143 @@
+/*++
+
+Program name:
+
+  Apostol CRM
+
+Module Name:
+
+  IOUring.hpp
+
+Notices:
+
+  Module: io_uring file I/O
+
+Author:
+
+  Copyright (c) Prepodobny Alen
+
+  mailto: alienufo@inbox.ru
+  mailto: ufocomp@gmail.com
+
+--*/
+
+#ifndef APOSTOL_IO_URING_HPP
+#define APOSTOL_IO_URING_HPP
+//----------------------------------------------------------------------------------------------------------------------
+
+#if (APOSTOL_USE_IO_URING)
+#include <liburing.h>
+#endif
+
+#include <deque>
+#include <functional>
+#include <unordered_map>
+//----------------------------------------------------------------------------------------------------------------------
+
+extern "C++" {
+
+namespace Apostol {
+
+    namespace Module {
+
+        typedef std::function<void (int Error, time_t Modified)> COnIOUringEvent;
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        //-- CIOUringRequest -------------------------------------------------------------------------------------------
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        typedef enum io_uring_operation_e {
+            iuoSave = 0, iuoStat, iuoUnlink
+        } CIOUringOperation;
+        //--------------------------------------------------------------------------------------------------------------
+
+        typedef struct io_uring_request_s {
+            CIOUringOperation Operation = iuoSave;
+
+            int Step = 0;
+            int Fd = -1;
+            int Error = 0;
+
+            int Linked = 0;
+            bool Opened = false;
+            bool Renamed = false;
+
+            std::string FileName;
+            std::string TempName;
+
+            const char *Buffer = nullptr;
+            size_t Size = 0;
+            size_t Offset = 0;
+#if (APOSTOL_USE_IO_URING)
+            struct statx Stat = {};
+#endif
+            COnIOUringEvent Done;
+        } CIOUringRequest;
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        //-- CIOUring --------------------------------------------------------------------------------------------------
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        class CIOUring {
+        private:
+#if (APOSTOL_USE_IO_URING)
+            struct io_uring m_Ring;
+#endif
+            bool m_Active;
+
+            int m_EventFd;
+
+            size_t m_Pending;
+            size_t m_Queued;
+
+            std::unordered_map<std::string, std::deque<CIOUringRequest *>> m_Files;
+            std::deque<CIOUringRequest *> m_Backlog;
+
+            uint64_t m_Requests;
+            uint64_t m_Operations;
+            uint64_t m_Submits;
+
+            bool Enqueue(CIOUringRequest *ARequest);
+            bool Prepare(CIOUringRequest *ARequest);
+
+            void Complete(CIOUringRequest *ARequest, int Step, int Result);
+            void Advance(CIOUringRequest *ARequest);
+            void Finish(CIOUringRequest *ARequest);
+
+        public:
+
+            CIOUring();
+
+            ~CIOUring();
+
+            bool Open(unsigned Entries);
+            void Close();
+
+            bool Active() const { return m_Active; }
+
+            int EventFd() const { return m_EventFd; }
+            void Drain() const;
+
+            size_t Pending() const { return m_Pending; }
+
+            bool Save(const CString &FileName, const char *Buffer, size_t Size, COnIOUringEvent &&Done);
+            bool Stat(const CString &FileName, COnIOUringEvent &&Done);
+            bool Unlink(const CString &FileName, COnIOUringEvent &&Done);
+
+            size_t Submit();
+            size_t Reap();
+
+            void Metrics(CString &Output, const CString &Module) const;
+
+        };
+
+    }
+}
+
+using namespace Apostol::Module;
+}
+#endif //APOSTOL_IO_URING_HPP
@@ -0,0 +1,223 @@
+/*++
+
+Program name:
+
+  Apostol CRM
+
+Module Name:
+
+  JSONWriter.cpp
+
+Notices:
+
+  Module: Streaming JSON writer
+
+Author:
+
+  Copyright (c) Prepodobny Alen
+
+  mailto: alienufo@inbox.ru
+  mailto: ufocomp@gmail.com
+
+--*/
+
+//----------------------------------------------------------------------------------------------------------------------
+
+#include "Core.hpp"
+#include "JSONWriter.hpp"
+//----------------------------------------------------------------------------------------------------------------------
+
+extern "C++" {
+
+namespace Apostol {
+
+    namespace Module {
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        //-- CJSONWriter -----------------------------------------------------------------------------------------------
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        CJSONWriter::CJSONWriter(CString &Output): m_Output(Output), m_Key(false) {
+
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CJSONWriter::Separator() {
+            // A value right after its key takes no comma.
+            if (m_Key) {
+                m_Key = false;
+                return;
+            }
+
+            if (!m_First.empty()) {
+                if (m_First.back()) {
+                    m_First.back() = false;
+                } else {
+                    m_Output += ',';
+                }
+            }
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        CJSONWriter &CJSONWriter::BeginObject() {
+            Separator();
+            m_Output += '{';
+            m_First.push_back(true);
+            return *this;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        CJSONWriter &CJSONWriter::EndObject() {
+            m_First.pop_back();
+            m_Output += '}';
+            return *this;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        CJSONWriter &CJSONWriter::BeginArray() {
+            Separator();
+            m_Output += '[';
+            m_First.push_back(true);
+            return *this;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        CJSONWriter &CJSONWriter::EndArray() {
+            m_First.pop_back();
+            m_Output += ']';
+            return *this;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        CJSONWriter &CJSONWriter::Key(const CString &Name) {
+            Separator();
+            Escape(Name.c_str(), Name.Size(), m_Output);
+            m_Output += ':';
+            m_Key = true;
+            return *this;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        CJSONWriter &CJSONWriter::Value(const CString &Value) {
+            return this->Value(Value.c_str(), Value.Size());
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        CJSONWriter &CJSONWriter::Value(const char *Value, size_t Size) {
+            Separator();
+            Escape(Value, Size, m_Output);
+            return *this;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        CJSONWriter &CJSONWriter::Value(long long Value) {
+            char szBuffer[32];
+            const auto size = snprintf(szBuffer, sizeof(szBuffer), "%lld", Value);
+
+            Separator();
+            m_Output.Append(szBuffer, (size_t) size);
+            return *this;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        CJSONWriter &CJSONWriter::Bool(bool Value) {
+            Separator();
+            if (Value) {
+                m_Output.Append("true", 4);
+            } else {
+                m_Output.Append("false", 5);
+            }
+            return *this;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        CJSONWriter &CJSONWriter::Null() {
+            Separator();
+            m_Output.Append("null", 4);
+            return *this;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CJSONWriter::Escape(const char *Value, size_t Size, CString &Output) {
+            static const char Hex[] = "0123456789abcdef";
+
+            Output += '"';
+
+            // Plain runs are copied in one piece; only quotes, backslashes and control characters are rewritten.
+            size_t start = 0;
+            for (size_t i = 0; i < Size; ++i) {
+                const auto ch = (unsigned char) Value[i];
+
+                if (ch >= 0x20 && ch != '"' && ch != '\\')
+                    continue;
+
+                if (i > start)
+                    Output.Append(Value + start, i - start);
+
+                switch (ch) {
+                    case '"':
+                        Output.Append("\\\"", 2);
+                        break;
+                    case '\\':
+                        Output.Append("\\\\", 2);
+                        break;
+                    case '\b':
+                        Output.Append("\\b", 2);
+                        break;
+                    case '\f':
+                        Output.Append("\\f", 2);
+                        break;
+                    case '\n':
+                        Output.Append("\\n", 2);
+                        break;
+                    case '\r':
+                        Output.Append("\\r", 2);
+                        break;
+                    case '\t':
+                        Output.Append("\\t", 2);
+                        break;
+                    default: {
+                        const char szCode[] = {'\\', 'u', '0', '0', Hex[ch >> 4], Hex[ch & 0x0F]};
+                        Output.Append(szCode, sizeof(szCode));
+                        break;
+                    }
+                }
+
+                start = i + 1;
+            }
+
+            if (Size > start)
+                Output.Append(Value + start, Size - start);
+
+            Output += '"';
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CJSONWriter::Headers(const CHeaders &Headers, CString &Output) {
+            CJSONWriter Writer(Output);
+
+            Writer.BeginObject();
+            for (int i = 0; i < Headers.Count(); i++) {
+                const auto &caHeader = Headers[i];
+                Writer.Pair(caHeader.Name(), caHeader.Value());
+            }
+            Writer.EndObject();
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CJSONWriter::Params(const CStringList &Params, CString &Output) {
+            CJSONWriter Writer(Output);
+
+            Writer.BeginObject();
+            for (int i = 0; i < Params.Count(); i++) {
+                Writer.Pair(Params.Names(i), Params.Values(i));
+            }
+            Writer.EndObject();
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+    }
+}
+}
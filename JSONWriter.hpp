@@ -0,0 +1,85 @@
+/*++
+
+Program name:
+
+  Apostol CRM
+
+Module Name:
+
+  JSONWriter.hpp
+
+Notices:
+
+  Module: Streaming JSON writer
+
+Author:
+
+  Copyright (c) Prepodobny Alen
+
+  mailto: alienufo@inbox.ru
+  mailto: ufocomp@gmail.com
+
+--*/
+
+#ifndef APOSTOL_JSON_WRITER_HPP
+#define APOSTOL_JSON_WRITER_HPP
+//----------------------------------------------------------------------------------------------------------------------
+
+#include <vector>
+//----------------------------------------------------------------------------------------------------------------------
+
+extern "C++" {
+
+namespace Apostol {
+
+    namespace Module {
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        //-- CJSONWriter -----------------------------------------------------------------------------------------------
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        class CJSONWriter {
+        private:
+
+            CString &m_Output;
+
+            std::vector<bool> m_First;
+            bool m_Key;
+
+            void Separator();
+
+        public:
+
+            explicit CJSONWriter(CString &Output);
+
+            CJSONWriter &BeginObject();
+            CJSONWriter &EndObject();
+
+            CJSONWriter &BeginArray();
+            CJSONWriter &EndArray();
+
+            CJSONWriter &Key(const CString &Name);
+
+            CJSONWriter &Value(const CString &Value);
+            CJSONWriter &Value(const char *Value, size_t Size);
+            CJSONWriter &Value(long long Value);
+            CJSONWriter &Bool(bool Value);
+            CJSONWriter &Null();
+
+            CJSONWriter &Pair(const CString &Name, const CString &Value) { return Key(Name).Value(Value); }
+
+            static void Escape(const char *Value, size_t Size, CString &Output);
+
+            static void Headers(const CHeaders &Headers, CString &Output);
+            static void Params(const CStringList &Params, CString &Output);
+
+        };
+
+    }
+}
+
+using namespace Apostol::Module;
+}
+#endif //APOSTOL_JSON_WRITER_HPP
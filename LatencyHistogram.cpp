@@ -0,0 +1,193 @@
+/*++
+
+Program name:
+
+  Apostol CRM
+
+Module Name:
+
+  LatencyHistogram.cpp
+
+Notices:
+
+  Module: Latency histograms
+
+Author:
+
+  Copyright (c) Prepodobny Alen
+
+  mailto: alienufo@inbox.ru
+  mailto: ufocomp@gmail.com
+
+--*/
+
+//----------------------------------------------------------------------------------------------------------------------
+
+#include "Core.hpp"
+#include "LatencyHistogram.hpp"
+//----------------------------------------------------------------------------------------------------------------------
+
+#include <chrono>
+//----------------------------------------------------------------------------------------------------------------------
+
+// Exposed bucket bounds: powers of four from 128 us to about nine minutes, all of them exact bucket edges.
+#define LATENCY_HISTOGRAM_FIRST_BOUND 7
+#define LATENCY_HISTOGRAM_LAST_BOUND 29
+//----------------------------------------------------------------------------------------------------------------------
+
+extern "C++" {
+
+namespace Apostol {
+
+    namespace Module {
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        //-- CLatencyHistogram -----------------------------------------------------------------------------------------
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        CLatencyHistogram::CLatencyHistogram() {
+            for (auto &Count : m_Counts) {
+                Count.store(0, std::memory_order_relaxed);
+            }
+            m_Sum.store(0, std::memory_order_relaxed);
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        uint64_t CLatencyHistogram::Clock() {
+            return (uint64_t) std::chrono::duration_cast<std::chrono::microseconds>(
+                    std::chrono::steady_clock::now().time_since_epoch()).count();
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        size_t CLatencyHistogram::Index(uint64_t Micros) {
+            const auto sub = (uint64_t) 1 << LATENCY_HISTOGRAM_SUB_BITS;
+
+            if (Micros < sub)
+                return (size_t) Micros;
+
+            // Log-linear buckets: each power of two is split into eight, so the error stays under 12.5%.
+            const auto exponent = 63 - __builtin_clzll(Micros);
+            const auto mantissa = (Micros >> (exponent - LATENCY_HISTOGRAM_SUB_BITS)) & (sub - 1);
+            const auto index = (size_t) (exponent - LATENCY_HISTOGRAM_SUB_BITS + 1) * sub + mantissa;
+
+            return index < LATENCY_HISTOGRAM_BUCKETS ? index : LATENCY_HISTOGRAM_BUCKETS - 1;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        uint64_t CLatencyHistogram::Upper(size_t Index) {
+            const auto sub = (size_t) 1 << LATENCY_HISTOGRAM_SUB_BITS;
+
+            if (Index < sub)
+                return Index + 1;
+
+            const auto exponent = Index / sub + LATENCY_HISTOGRAM_SUB_BITS - 1;
+            const auto mantissa = Index % sub;
+
+            return (uint64_t) (sub + mantissa + 1) << (exponent - LATENCY_HISTOGRAM_SUB_BITS);
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CLatencyHistogram::Record(uint64_t Micros) {
+            m_Counts[Index(Micros)].fetch_add(1, std::memory_order_relaxed);
+            m_Sum.fetch_add(Micros, std::memory_order_relaxed);
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CLatencyHistogram::Record(CDateTime Start, CDateTime Stop) {
+            if (Start == 0 || Stop < Start)
+                return;
+
+            Record((uint64_t) ((Stop - Start) * MSecsPerDay * 1000));
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CLatencyHistogram::Metrics(CString &Output, const CString &Module, const char *Stage) const {
+            uint64_t Counts[LATENCY_HISTOGRAM_BUCKETS];
+
+            // A scrape racing a record may be off by one sample; that is fine for a histogram.
+            uint64_t total = 0;
+            for (size_t i = 0; i < LATENCY_HISTOGRAM_BUCKETS; ++i) {
+                Counts[i] = m_Counts[i].load(std::memory_order_relaxed);
+                total += Counts[i];
+            }
+
+            uint64_t cumulative = 0;
+            size_t index = 0;
+
+            for (int bound = LATENCY_HISTOGRAM_FIRST_BOUND; bound <= LATENCY_HISTOGRAM_LAST_BOUND; bound += 2) {
+                const auto limit = (uint64_t) 1 << bound;
+
+                while (index < LATENCY_HISTOGRAM_BUCKETS && Upper(index) <= limit) {
+                    cumulative += Counts[index++];
+                }
+
+                Output += CString().Format("apostol_handler_latency_seconds_bucket{module=\"%s\",stage=\"%s\",le=\"%g\"} %llu\n",
+                                           Module.c_str(), Stage, (double) limit / 1000000, (unsigned long long) cumulative);
+            }
+
+            Output += CString().Format("apostol_handler_latency_seconds_bucket{module=\"%s\",stage=\"%s\",le=\"+Inf\"} %llu\n",
+                                       Module.c_str(), Stage, (unsigned long long) total);
+            Output += CString().Format("apostol_handler_latency_seconds_sum{module=\"%s\",stage=\"%s\"} %.6f\n",
+                                       Module.c_str(), Stage, (double) m_Sum.load(std::memory_order_relaxed) / 1000000);
+            Output += CString().Format("apostol_handler_latency_seconds_count{module=\"%s\",stage=\"%s\"} %llu\n",
+                                       Module.c_str(), Stage, (unsigned long long) total);
+        }
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        //-- CLatencyHistograms ----------------------------------------------------------------------------------------
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        CLatencyHistograms::CLatencyHistograms() {
+            for (auto &Exposed : m_Exposed) {
+                Exposed = true;
+            }
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        CLatencyHistograms::CLatencyHistograms(std::initializer_list<CLatencyStage> Stages) {
+            for (auto &Exposed : m_Exposed) {
+                Exposed = false;
+            }
+
+            for (auto Stage : Stages) {
+                m_Exposed[Stage] = true;
+            }
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        const char *CLatencyHistograms::StageName(CLatencyStage Stage) {
+            switch (Stage) {
+                case lsQueue:
+                    return "queue";
+                case lsUpstream:
+                    return "upstream";
+                case lsSave:
+                    return "save";
+                case lsHash:
+                    return "hash";
+                case lsWriteBack:
+                    return "writeback";
+                default:
+                    return "unknown";
+            }
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CLatencyHistograms::Metrics(CString &Output, const CString &Module) const {
+            Output += "# TYPE apostol_handler_latency_seconds histogram\n";
+
+            for (int i = 0; i < lsCount; ++i) {
+                if (m_Exposed[i]) {
+                    m_Stages[i].Metrics(Output, Module, StageName((CLatencyStage) i));
+                }
+            }
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+    }
+}
+}
@@ -0,0 +1,112 @@
+/*++
+
+Program name:
+
+  Apostol CRM
+
+Module Name:
+
+  LatencyHistogram.hpp
+
+Notices:
+
+  Module: Latency histograms
+
+Author:
+
+  Copyright (c) Prepodobny Alen
+
+  mailto: alienufo@inbox.ru
+  mailto: ufocomp@gmail.com
+
+--*/
+
+#ifndef APOSTOL_LATENCY_HISTOGRAM_HPP
+#define APOSTOL_LATENCY_HISTOGRAM_HPP
+//----------------------------------------------------------------------------------------------------------------------
+
+#include <atomic>
+#include <initializer_list>
+//----------------------------------------------------------------------------------------------------------------------
+
+#define LATENCY_HISTOGRAM_SUB_BITS 3
+#define LATENCY_HISTOGRAM_BUCKETS 320
+//----------------------------------------------------------------------------------------------------------------------
+
+extern "C++" {
+
+namespace Apostol {
+
+    namespace Module {
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        //-- CLatencyHistogram -----------------------------------------------------------------------------------------
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        typedef enum latency_stage_e {
+            lsQueue = 0, lsUpstream, lsSave, lsHash, lsWriteBack, lsCount
+        } CLatencyStage;
+        //--------------------------------------------------------------------------------------------------------------
+
+        class CLatencyHistogram {
+        private:
+
+            std::atomic<uint64_t> m_Counts[LATENCY_HISTOGRAM_BUCKETS];
+            std::atomic<uint64_t> m_Sum;
+
+            static size_t Index(uint64_t Micros);
+            static uint64_t Upper(size_t Index);
+
+        public:
+
+            CLatencyHistogram();
+
+            CLatencyHistogram(const CLatencyHistogram &) = delete;
+            CLatencyHistogram &operator=(const CLatencyHistogram &) = delete;
+
+            void Record(uint64_t Micros);
+            void Record(CDateTime Start, CDateTime Stop);
+
+            void Metrics(CString &Output, const CString &Module, const char *Stage) const;
+
+            static uint64_t Clock();
+
+        };
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        //-- CLatencyHistograms ----------------------------------------------------------------------------------------
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        class CLatencyHistograms {
+        private:
+
+            CLatencyHistogram m_Stages[lsCount];
+
+            bool m_Exposed[lsCount];
+
+        public:
+
+            CLatencyHistograms();
+
+            // Only the listed stages are exported; a module that never runs a stage should not report it as empty.
+            explicit CLatencyHistograms(std::initializer_list<CLatencyStage> Stages);
+
+            void Record(CLatencyStage Stage, uint64_t Micros) { m_Stages[Stage].Record(Micros); }
+            void Record(CLatencyStage Stage, CDateTime Start, CDateTime Stop) { m_Stages[Stage].Record(Start, Stop); }
+
+            void Metrics(CString &Output, const CString &Module) const;
+
+            static const char *StageName(CLatencyStage Stage);
+
+        };
+
+    }
+}
+
+using namespace Apostol::Module;
+}
+#endif //APOSTOL_LATENCY_HISTOGRAM_HPP
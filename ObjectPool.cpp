@@ -0,0 +1,190 @@
+/*++
+
+Program name:
+
+  Apostol CRM
+
+Module Name:
+
+  ObjectPool.cpp
+
+Notices:
+
+  Module: Slab object pool
+
+Author:
+
+  Copyright (c) Prepodobny Alen
+
+  mailto: alienufo@inbox.ru
+  mailto: ufocomp@gmail.com
+
+--*/
+
+//----------------------------------------------------------------------------------------------------------------------
+
+#include "Core.hpp"
+#include "ObjectPool.hpp"
+//----------------------------------------------------------------------------------------------------------------------
+
+#include <cstddef>
+//----------------------------------------------------------------------------------------------------------------------
+
+extern "C++" {
+
+namespace Apostol {
+
+    namespace Module {
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        //-- CObjectPool -----------------------------------------------------------------------------------------------
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        CObjectPool::CObjectPool(size_t Size, size_t SlabSlots, size_t KeepSlabs): m_SlabSlots(SlabSlots == 0 ? 1 : SlabSlots),
+                m_KeepSlabs(KeepSlabs), m_Used(0), m_Empty(0), m_Allocated(0), m_Fallback(0), m_Released(0) {
+
+            // Every slot must be able to hold the free-list link and keep the object aligned.
+            const auto align = alignof(std::max_align_t);
+            m_Size = ((Size < sizeof(void *) ? sizeof(void *) : Size) + align - 1) / align * align;
+
+            m_Current = m_Slabs.end();
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        CObjectPool::~CObjectPool() {
+            // Slots still in use would dangle; an owner that outlives the pool keeps its memory instead.
+            if (m_Used != 0)
+                return;
+
+            for (const auto &Slab : m_Slabs) {
+                ::operator delete(Slab.first);
+            }
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CObjectPool::Grow() {
+            auto pSlab = static_cast<char *> (::operator new(m_Size * m_SlabSlots));
+
+            CObjectSlab Slab = {nullptr, 0};
+            for (size_t i = m_SlabSlots; i > 0; --i) {
+                auto pSlot = pSlab + (i - 1) * m_Size;
+                *reinterpret_cast<void **> (pSlot) = Slab.Free;
+                Slab.Free = pSlot;
+            }
+
+            m_Current = m_Slabs.emplace(pSlab, Slab).first;
+            m_Empty++;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CObjectPool::Release(std::map<char *, CObjectSlab>::iterator Slab) {
+            if (Slab == m_Current)
+                m_Current = m_Slabs.end();
+
+            ::operator delete(Slab->first);
+            m_Slabs.erase(Slab);
+
+            m_Empty--;
+            m_Released++;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void *CObjectPool::Allocate(size_t Size) {
+            // A derived class larger than the slot goes to the general allocator.
+            if (Size > m_Size) {
+                std::lock_guard<std::mutex> Lock(m_Lock);
+                m_Fallback++;
+                return ::operator new(Size);
+            }
+
+            std::lock_guard<std::mutex> Lock(m_Lock);
+
+            if (m_Current == m_Slabs.end() || m_Current->second.Free == nullptr) {
+                // Fill the lowest slab with room first: live objects gather at the bottom and the top slabs drain.
+                m_Current = m_Slabs.begin();
+                while (m_Current != m_Slabs.end() && m_Current->second.Free == nullptr)
+                    ++m_Current;
+
+                if (m_Current == m_Slabs.end())
+                    Grow();
+            }
+
+            auto &Slab = m_Current->second;
+
+            auto pSlot = Slab.Free;
+            Slab.Free = *static_cast<void **> (pSlot);
+
+            if (Slab.Used++ == 0)
+                m_Empty--;
+
+            m_Used++;
+            m_Allocated++;
+
+            return pSlot;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CObjectPool::Deallocate(void *Ptr, size_t Size) {
+            if (Ptr == nullptr)
+                return;
+
+            if (Size > m_Size) {
+                ::operator delete(Ptr);
+                return;
+            }
+
+            std::lock_guard<std::mutex> Lock(m_Lock);
+
+            auto Slab = --m_Slabs.upper_bound(static_cast<char *> (Ptr));
+
+            *static_cast<void **> (Ptr) = Slab->second.Free;
+            Slab->second.Free = Ptr;
+
+            m_Used--;
+
+            // A few empty slabs stay for the next burst; any beyond that go back to the allocator, so RSS follows the load.
+            if (--Slab->second.Used == 0 && ++m_Empty > m_KeepSlabs)
+                Release(Slab);
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        bool CObjectPool::Claim(const CString &Module) {
+            std::lock_guard<std::mutex> Lock(m_Lock);
+
+            // The pool is shared by every module of the process: the first module to claim it is the one that reports it.
+            if (m_Owner.IsEmpty())
+                m_Owner = Module;
+
+            return m_Owner == Module;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CObjectPool::Metrics(CString &Output, const CString &Module, const char *Name) const {
+            std::lock_guard<std::mutex> Lock(m_Lock);
+
+            if (Module != m_Owner)
+                return;
+
+            Output += CString().Format("# TYPE apostol_object_pool_in_use gauge\n"
+                                       "apostol_object_pool_in_use{module=\"%s\",pool=\"%s\"} %llu\n",
+                                       Module.c_str(), Name, (unsigned long long) m_Used);
+            Output += CString().Format("# TYPE apostol_object_pool_bytes gauge\n"
+                                       "apostol_object_pool_bytes{module=\"%s\",pool=\"%s\"} %llu\n",
+                                       Module.c_str(), Name, (unsigned long long) (m_Slabs.size() * m_SlabSlots * m_Size));
+            Output += CString().Format("# TYPE apostol_object_pool_allocations_total counter\n"
+                                       "apostol_object_pool_allocations_total{module=\"%s\",pool=\"%s\"} %llu\n",
+                                       Module.c_str(), Name, (unsigned long long) m_Allocated);
+            Output += CString().Format("# TYPE apostol_object_pool_fallback_total counter\n"
+                                       "apostol_object_pool_fallback_total{module=\"%s\",pool=\"%s\"} %llu\n",
+                                       Module.c_str(), Name, (unsigned long long) m_Fallback);
+            Output += CString().Format("# TYPE apostol_object_pool_released_total counter\n"
+                                       "apostol_object_pool_released_total{module=\"%s\",pool=\"%s\"} %llu\n",
+                                       Module.c_str(), Name, (unsigned long long) m_Released);
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+    }
+}
+}
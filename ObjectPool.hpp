@@ -0,0 +1,102 @@
+/*++
+
+Program name:
+
+  Apostol CRM
+
+Module Name:
+
+  ObjectPool.hpp
+
+Notices:
+
+  Module: Slab object pool
+
+Author:
+
+  Copyright (c) Prepodobny Alen
+
+  mailto: alienufo@inbox.ru
+  mailto: ufocomp@gmail.com
+
+--*/
+
+#ifndef APOSTOL_OBJECT_POOL_HPP
+#define APOSTOL_OBJECT_POOL_HPP
+//----------------------------------------------------------------------------------------------------------------------
+
+#include <map>
+#include <mutex>
+//----------------------------------------------------------------------------------------------------------------------
+
+#define OBJECT_POOL_SLAB_SLOTS 256
+#define OBJECT_POOL_KEEP_SLABS 2
+//----------------------------------------------------------------------------------------------------------------------
+
+extern "C++" {
+
+namespace Apostol {
+
+    namespace Module {
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        //-- CObjectPool -----------------------------------------------------------------------------------------------
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        typedef struct object_slab_s {
+            void *Free;
+            size_t Used;
+        } CObjectSlab;
+        //--------------------------------------------------------------------------------------------------------------
+
+        class CObjectPool {
+        private:
+
+            mutable std::mutex m_Lock;
+
+            size_t m_Size;
+            size_t m_SlabSlots;
+            size_t m_KeepSlabs;
+
+            // Slabs by base address, so a released slot finds its slab with one lookup.
+            std::map<char *, CObjectSlab> m_Slabs;
+            std::map<char *, CObjectSlab>::iterator m_Current;
+
+            size_t m_Used;
+            size_t m_Empty;
+
+            CString m_Owner;
+
+            uint64_t m_Allocated;
+            uint64_t m_Fallback;
+            uint64_t m_Released;
+
+            void Grow();
+            void Release(std::map<char *, CObjectSlab>::iterator Slab);
+
+        public:
+
+            explicit CObjectPool(size_t Size, size_t SlabSlots = OBJECT_POOL_SLAB_SLOTS, size_t KeepSlabs = OBJECT_POOL_KEEP_SLABS);
+
+            ~CObjectPool();
+
+            CObjectPool(const CObjectPool &) = delete;
+            CObjectPool &operator=(const CObjectPool &) = delete;
+
+            void *Allocate(size_t Size);
+            void Deallocate(void *Ptr, size_t Size);
+
+            bool Claim(const CString &Module);
+
+            void Metrics(CString &Output, const CString &Module, const char *Name) const;
+
+        };
+
+    }
+}
+
+using namespace Apostol::Module;
+}
+#endif //APOSTOL_OBJECT_POOL_HPP
@@ -0,0 +1,413 @@
+/*++
+
+Program name:
+
+  Apostol CRM
+
+Module Name:
+
+  Payload.cpp
+
+Notices:
+
+  Module: Lazy JSON payload
+
+Author:
+
+  Copyright (c) Prepodobny Alen
+
+  mailto: alienufo@inbox.ru
+  mailto: ufocomp@gmail.com
+
+--*/
+
+//----------------------------------------------------------------------------------------------------------------------
+
+#include "Core.hpp"
+#include "Payload.hpp"
+//----------------------------------------------------------------------------------------------------------------------
+
+extern "C++" {
+
+namespace Apostol {
+
+    namespace Module {
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        //-- CPayloadValue ---------------------------------------------------------------------------------------------
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        bool CPayloadValue::IsNull() const {
+            return m_Payload.IsNull(m_Key);
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        bool CPayloadValue::IsObject() const {
+            const auto &caText = m_Payload.Text(m_Key);
+            return !caText.IsEmpty() && caText.front() == '{';
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        bool CPayloadValue::IsArray() const {
+            const auto &caText = m_Payload.Text(m_Key);
+            return !caText.IsEmpty() && caText.front() == '[';
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        CString CPayloadValue::AsString() const {
+            return m_Payload.String(m_Key);
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        CString CPayloadValue::ToString() const {
+            return m_Payload.Text(m_Key);
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        CJSON CPayloadValue::Json() const {
+            // Only this field's text is parsed, and the tree belongs to the caller.
+            CJSON Result;
+            Result = m_Payload.Text(m_Key);
+            return Result;
+        }
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        //-- CPayload --------------------------------------------------------------------------------------------------
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        CPayload::CPayload(): m_Scanned(0), m_Complete(false), m_Modified(false) {
+
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        CPayload::CPayload(const CString &Data): CPayload() {
+            m_Raw = Data;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        CPayload &CPayload::operator=(const CString &Data) {
+            m_Raw = Data;
+
+            m_Fields.clear();
+            m_Scanned = 0;
+            m_Complete = false;
+
+            m_Json.reset();
+            m_Modified = false;
+
+            return *this;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        CPayload &CPayload::operator=(const CJSON &Json) {
+            return *this = Json.ToString();
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        size_t CPayload::SkipSpace(const char *Data, size_t Size, size_t Pos) {
+            while (Pos < Size && (Data[Pos] == ' ' || Data[Pos] == '\t' || Data[Pos] == '\r' || Data[Pos] == '\n'))
+                Pos++;
+            return Pos;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        size_t CPayload::SkipString(const char *Data, size_t Size, size_t Pos) {
+            // Pos points at the opening quote; the result is the position right after the closing one.
+            for (Pos++; Pos < Size; Pos++) {
+                if (Data[Pos] == '\\') {
+                    Pos++;
+                } else if (Data[Pos] == '"') {
+                    return Pos + 1;
+                }
+            }
+            return std::string::npos;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        size_t CPayload::SkipValue(const char *Data, size_t Size, size_t Pos) {
+            if (Pos >= Size)
+                return std::string::npos;
+
+            if (Data[Pos] == '"')
+                return SkipString(Data, Size, Pos);
+
+            if (Data[Pos] == '{' || Data[Pos] == '[') {
+                size_t depth = 0;
+                while (Pos < Size) {
+                    switch (Data[Pos]) {
+                        case '"':
+                            Pos = SkipString(Data, Size, Pos);
+                            if (Pos == std::string::npos)
+                                return Pos;
+                            continue;
+                        case '{':
+                        case '[':
+                            depth++;
+                            break;
+                        case '}':
+                        case ']':
+                            if (--depth == 0)
+                                return Pos + 1;
+                            break;
+                        default:
+                            break;
+                    }
+                    Pos++;
+                }
+                return std::string::npos;
+            }
+
+            while (Pos < Size && Data[Pos] != ',' && Data[Pos] != '}' && Data[Pos] != ']' &&
+                   Data[Pos] != ' ' && Data[Pos] != '\t' && Data[Pos] != '\r' && Data[Pos] != '\n')
+                Pos++;
+
+            return Pos;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        bool CPayload::Next(CPayloadField &Field) const {
+            if (m_Complete)
+                return false;
+
+            const auto pData = m_Raw.c_str();
+            const auto size = m_Raw.Size();
+
+            auto pos = SkipSpace(pData, size, m_Scanned);
+
+            if (m_Scanned == 0) {
+                if (pos >= size || pData[pos] != '{') {
+                    m_Complete = true;
+                    return false;
+                }
+                pos = SkipSpace(pData, size, pos + 1);
+            } else if (pos < size && pData[pos] == ',') {
+                pos = SkipSpace(pData, size, pos + 1);
+            }
+
+            // Anything unexpected ends the scan; the fields found so far stay usable.
+            if (pos >= size || pData[pos] != '"') {
+                m_Complete = true;
+                return false;
+            }
+
+            const auto key = pos + 1;
+
+            pos = SkipString(pData, size, pos);
+            if (pos == std::string::npos) {
+                m_Complete = true;
+                return false;
+            }
+
+            Field.Key = (uint32_t) key;
+            Field.KeySize = (uint32_t) (pos - 1 - key);
+
+            pos = SkipSpace(pData, size, pos);
+            if (pos >= size || pData[pos] != ':') {
+                m_Complete = true;
+                return false;
+            }
+
+            pos = SkipSpace(pData, size, pos + 1);
+
+            const auto end = SkipValue(pData, size, pos);
+            if (end == std::string::npos || end == pos) {
+                m_Complete = true;
+                return false;
+            }
+
+            Field.Value = (uint32_t) pos;
+            Field.ValueSize = (uint32_t) (end - pos);
+
+            m_Scanned = end;
+
+            return true;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        const CPayloadField *CPayload::Find(const CString &Key) const {
+            const auto pData = m_Raw.c_str();
+
+            for (const auto &Field : m_Fields) {
+                if (Field.KeySize == Key.Size() && memcmp(pData + Field.Key, Key.c_str(), Key.Size()) == 0)
+                    return &Field;
+            }
+
+            // The index only grows as far as the lookups need it.
+            CPayloadField Field;
+            while (Next(Field)) {
+                m_Fields.push_back(Field);
+                if (Field.KeySize == Key.Size() && memcmp(pData + Field.Key, Key.c_str(), Key.Size()) == 0)
+                    return &m_Fields.back();
+            }
+
+            return nullptr;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        CString CPayload::Decode(const char *Data, size_t Size) {
+            if (memchr(Data, '\\', Size) == nullptr)
+                return CString(Data, Size);
+
+            CString Result;
+
+            size_t start = 0;
+            for (size_t i = 0; i < Size; ++i) {
+                if (Data[i] != '\\')
+                    continue;
+
+                if (i > start)
+                    Result.Append(Data + start, i - start);
+
+                if (++i >= Size)
+                    break;
+
+                switch (Data[i]) {
+                    case 'b':
+                        Result += '\b';
+                        break;
+                    case 'f':
+                        Result += '\f';
+                        break;
+                    case 'n':
+                        Result += '\n';
+                        break;
+                    case 'r':
+                        Result += '\r';
+                        break;
+                    case 't':
+                        Result += '\t';
+                        break;
+                    case 'u': {
+                        if (i + 4 >= Size)
+                            break;
+
+                        auto code = (uint32_t) strtoul(std::string(Data + i + 1, 4).c_str(), nullptr, 16);
+                        i += 4;
+
+                        if (code >= 0xD800 && code <= 0xDBFF && i + 6 < Size && Data[i + 1] == '\\' && Data[i + 2] == 'u') {
+                            const auto low = (uint32_t) strtoul(std::string(Data + i + 3, 4).c_str(), nullptr, 16);
+                            if (low >= 0xDC00 && low <= 0xDFFF) {
+                                code = 0x10000 + ((code - 0xD800) << 10) + (low - 0xDC00);
+                                i += 6;
+                            }
+                        }
+
+                        char szBuffer[4];
+                        size_t length;
+
+                        if (code < 0x80) {
+                            szBuffer[0] = (char) code;
+                            length = 1;
+                        } else if (code < 0x800) {
+                            szBuffer[0] = (char) (0xC0 | (code >> 6));
+                            szBuffer[1] = (char) (0x80 | (code & 0x3F));
+                            length = 2;
+                        } else if (code < 0x10000) {
+                            szBuffer[0] = (char) (0xE0 | (code >> 12));
+                            szBuffer[1] = (char) (0x80 | ((code >> 6) & 0x3F));
+                            szBuffer[2] = (char) (0x80 | (code & 0x3F));
+                            length = 3;
+                        } else {
+                            szBuffer[0] = (char) (0xF0 | (code >> 18));
+                            szBuffer[1] = (char) (0x80 | ((code >> 12) & 0x3F));
+                            szBuffer[2] = (char) (0x80 | ((code >> 6) & 0x3F));
+                            szBuffer[3] = (char) (0x80 | (code & 0x3F));
+                            length = 4;
+                        }
+
+                        Result.Append(szBuffer, length);
+                        break;
+                    }
+                    default:
+                        Result += Data[i];
+                        break;
+                }
+
+                start = i + 1;
+            }
+
+            if (Size > start)
+                Result.Append(Data + start, Size - start);
+
+            return Result;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        bool CPayload::Has(const CString &Key) const {
+            if (m_Modified)
+                return m_Json->HasOwnProperty(Key);
+
+            return Find(Key) != nullptr;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        bool CPayload::IsNull(const CString &Key) const {
+            if (m_Modified)
+                return !m_Json->HasOwnProperty(Key) || (*m_Json)[Key].IsNull();
+
+            const auto pField = Find(Key);
+            return pField == nullptr || (pField->ValueSize == 4 && memcmp(m_Raw.c_str() + pField->Value, "null", 4) == 0);
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        CString CPayload::String(const CString &Key) const {
+            if (m_Modified)
+                return m_Json->HasOwnProperty(Key) ? (*m_Json)[Key].AsString() : CString();
+
+            const auto pField = Find(Key);
+            if (pField == nullptr)
+                return {};
+
+            const auto pValue = m_Raw.c_str() + pField->Value;
+
+            if (*pValue == '"')
+                return Decode(pValue + 1, pField->ValueSize - 2);
+
+            if (pField->ValueSize == 4 && memcmp(pValue, "null", 4) == 0)
+                return {};
+
+            return CString(pValue, pField->ValueSize);
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        CString CPayload::Text(const CString &Key) const {
+            if (m_Modified)
+                return m_Json->HasOwnProperty(Key) ? (*m_Json)[Key].ToString() : CString();
+
+            const auto pField = Find(Key);
+            if (pField == nullptr)
+                return {};
+
+            return CString(m_Raw.c_str() + pField->Value, pField->ValueSize);
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        const CJSON &CPayload::Json() const {
+            if (m_Json == nullptr) {
+                m_Json.reset(new CJSON());
+                *m_Json = m_Raw;
+            }
+            return *m_Json;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        CString CPayload::ToString() const {
+            return m_Modified ? m_Json->ToString() : m_Raw;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        CJSON &CPayload::Json() {
+            // Once the tree may be written to, the raw text and its index are no longer authoritative.
+            static_cast<const CPayload *>(this)->Json();
+            m_Modified = true;
+            return *m_Json;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+    }
+}
+}
@@ -0,0 +1,142 @@
+/*++
+
+Program name:
+
+  Apostol CRM
+
+Module Name:
+
+  Payload.hpp
+
+Notices:
+
+  Module: Lazy JSON payload
+
+Author:
+
+  Copyright (c) Prepodobny Alen
+
+  mailto: alienufo@inbox.ru
+  mailto: ufocomp@gmail.com
+
+--*/
+
+#ifndef APOSTOL_PAYLOAD_HPP
+#define APOSTOL_PAYLOAD_HPP
+//----------------------------------------------------------------------------------------------------------------------
+
+#include <memory>
+#include <utility>
+#include <vector>
+//----------------------------------------------------------------------------------------------------------------------
+
+extern "C++" {
+
+namespace Apostol {
+
+    namespace Module {
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        //-- CPayload --------------------------------------------------------------------------------------------------
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        typedef struct payload_field_s {
+            uint32_t Key = 0;
+            uint32_t KeySize = 0;
+            uint32_t Value = 0;
+            uint32_t ValueSize = 0;
+        } CPayloadField;
+        //--------------------------------------------------------------------------------------------------------------
+
+        class CPayload;
+        //--------------------------------------------------------------------------------------------------------------
+
+        // What operator[] returns: reads the one field through the raw index, the JSON tree is not built for it.
+        class CPayloadValue {
+        private:
+
+            const CPayload &m_Payload;
+            CString m_Key;
+
+        public:
+
+            CPayloadValue(const CPayload &Payload, const CString &Key): m_Payload(Payload), m_Key(Key) {};
+
+            bool IsNull() const;
+            bool IsObject() const;
+            bool IsArray() const;
+
+            CString AsString() const;
+            CString ToString() const;
+
+            CJSON Json() const;
+
+        };
+        //--------------------------------------------------------------------------------------------------------------
+
+        class CPayload {
+        private:
+
+            CString m_Raw;
+
+            mutable std::vector<CPayloadField> m_Fields;
+            mutable size_t m_Scanned;
+            mutable bool m_Complete;
+
+            mutable std::unique_ptr<CJSON> m_Json;
+            bool m_Modified;
+
+            bool Next(CPayloadField &Field) const;
+            const CPayloadField *Find(const CString &Key) const;
+
+            static size_t SkipSpace(const char *Data, size_t Size, size_t Pos);
+            static size_t SkipString(const char *Data, size_t Size, size_t Pos);
+            static size_t SkipValue(const char *Data, size_t Size, size_t Pos);
+
+            static CString Decode(const char *Data, size_t Size);
+
+        public:
+
+            CPayload();
+
+            explicit CPayload(const CString &Data);
+
+            CPayload &operator=(const CString &Data);
+            CPayload &operator=(const CJSON &Json);
+
+            bool IsEmpty() const { return m_Raw.IsEmpty() && m_Json == nullptr; }
+
+            const CString &Raw() const { return m_Raw; }
+
+            bool Has(const CString &Key) const;
+            bool IsNull(const CString &Key) const;
+
+            CString String(const CString &Key) const;
+            CString Text(const CString &Key) const;
+
+            const CJSON &Json() const;
+            CJSON &Json();
+
+            CString ToString() const;
+
+            CPayloadValue operator[](const CString &Key) const { return {*this, Key}; }
+
+            // CJSON-compatible accessors for code written against the former CJSON payload. Object() and the
+            // conversion build the whole tree, the others do not.
+            bool HasOwnProperty(const CString &Key) const { return Has(Key); }
+
+            auto Object() const -> decltype(std::declval<const CJSON &>().Object()) { return Json().Object(); }
+            auto Object() -> decltype(std::declval<CJSON &>().Object()) { return Json().Object(); }
+
+            operator const CJSON &() const { return Json(); }
+
+        };
+
+    }
+}
+
+using namespace Apostol::Module;
+}
+#endif //APOSTOL_PAYLOAD_HPP
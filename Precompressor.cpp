@@ -0,0 +1,301 @@
+/*++
+
+Program name:
+
+  Apostol CRM
+
+Module Name:
+
+  Precompressor.cpp
+
+Notices:
+
+  Module: Precompressed file variants
+
+Author:
+
+  Copyright (c) Prepodobny Alen
+
+  mailto: alienufo@inbox.ru
+  mailto: ufocomp@gmail.com
+
+--*/
+
+//----------------------------------------------------------------------------------------------------------------------
+
+#include "Core.hpp"
+#include "Precompressor.hpp"
+//----------------------------------------------------------------------------------------------------------------------
+
+#if (APOSTOL_USE_ZLIB)
+#include <zlib.h>
+#endif
+
+#if (APOSTOL_USE_BROTLI)
+#include <brotli/encode.h>
+#endif
+
+#include <sys/stat.h>
+//----------------------------------------------------------------------------------------------------------------------
+
+extern "C++" {
+
+namespace Apostol {
+
+    namespace Module {
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        //-- CPrecompressor --------------------------------------------------------------------------------------------
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        CPrecompressor::CPrecompressor(): m_Active(false), m_Threshold(0), m_MaxSize(0), m_Saved(0) {
+            for (size_t i = 0; i < peCount; ++i) {
+                m_Generated[i] = 0;
+                m_Served[i] = 0;
+            }
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        bool CPrecompressor::StringToEncoding(const std::string &Value, CPrecompressorEncoding &Encoding) {
+            if (Value == "gzip") {
+                Encoding = peGzip;
+                return true;
+            }
+
+            if (Value == "br") {
+                Encoding = peBrotli;
+                return true;
+            }
+
+            return false;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        const char *CPrecompressor::EncodingToString(CPrecompressorEncoding Encoding) {
+            switch (Encoding) {
+                case peGzip:
+                    return "gzip";
+                case peBrotli:
+                    return "br";
+                default:
+                    return "";
+            }
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        CString CPrecompressor::Sidecar(const CString &FileName, CPrecompressorEncoding Encoding) {
+            // Not ".gz"/".br": those are ordinary names of stored files, which a variant must never overwrite.
+            return FileName + (Encoding == peBrotli ? ".~br" : ".~gz");
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        bool CPrecompressor::Open(const CString &Encodings, size_t Threshold, size_t MaxSize, const CString &Types) {
+            m_Threshold = Threshold;
+            m_MaxSize = MaxSize;
+
+            m_Types = CCompressor::ParseList(Types);
+
+            // The list order is the server preference used to break ties between equal q-values.
+            m_Encodings.clear();
+            for (const auto &Item : CCompressor::ParseList(Encodings)) {
+                CPrecompressorEncoding Encoding;
+                if (!StringToEncoding(Item, Encoding))
+                    continue;
+#if !(APOSTOL_USE_ZLIB)
+                if (Encoding == peGzip)
+                    continue;
+#endif
+#if !(APOSTOL_USE_BROTLI)
+                if (Encoding == peBrotli)
+                    continue;
+#endif
+                m_Encodings.push_back(Encoding);
+            }
+
+            m_Active = !m_Encodings.empty();
+
+            return m_Active;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        bool CPrecompressor::Eligible(const CString &FileName) const {
+            if (!m_Active)
+                return false;
+
+            CString sFileExt;
+            TCHAR szBuffer[MAX_BUFFER_SIZE + 1] = {0};
+
+            sFileExt = ExtractFileExt(szBuffer, FileName.c_str());
+
+            return CCompressor::MatchType(m_Types, Mapping::ExtToType(sFileExt.c_str()));
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        bool CPrecompressor::Eligible(const CString &FileName, size_t Size) const {
+            return Size >= m_Threshold && (m_MaxSize == 0 || Size <= m_MaxSize) && Eligible(FileName);
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        std::vector<CString> CPrecompressor::Sidecars(const CString &FileName) const {
+            std::vector<CString> Result;
+            for (const auto Encoding : m_Encodings) {
+                Result.push_back(Sidecar(FileName, Encoding));
+            }
+            return Result;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        bool CPrecompressor::Encode(CPrecompressorEncoding Encoding, const CString &Input, CString &Output) {
+            // Off the request path, but every fetched file pays for it: the maximum levels cost several times the CPU
+            // (brotli 11 by far the most) for a few percent of size, so the mid levels are used.
+            switch (Encoding) {
+#if (APOSTOL_USE_ZLIB)
+                case peGzip: {
+                    z_stream Stream = {};
+                    if (deflateInit2(&Stream, PRECOMPRESSOR_GZIP_LEVEL, Z_DEFLATED, MAX_WBITS + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+                        return false;
+
+                    std::string Buffer(deflateBound(&Stream, Input.Size()), '\0');
+
+                    Stream.next_in = (Bytef *) Input.c_str();
+                    Stream.avail_in = (uInt) Input.Size();
+                    Stream.next_out = (Bytef *) &Buffer[0];
+                    Stream.avail_out = (uInt) Buffer.size();
+
+                    const auto result = deflate(&Stream, Z_FINISH);
+                    const auto size = Stream.total_out;
+
+                    deflateEnd(&Stream);
+
+                    if (result != Z_STREAM_END)
+                        return false;
+
+                    Output.Clear();
+                    Output.Append(Buffer.data(), size);
+                    return true;
+                }
+#endif
+#if (APOSTOL_USE_BROTLI)
+                case peBrotli: {
+                    size_t size = BrotliEncoderMaxCompressedSize(Input.Size());
+                    if (size == 0)
+                        return false;
+
+                    std::string Buffer(size, '\0');
+
+                    if (!BrotliEncoderCompress(PRECOMPRESSOR_BROTLI_QUALITY, BROTLI_DEFAULT_WINDOW, BROTLI_MODE_TEXT, Input.Size(),
+                                               (const uint8_t *) Input.c_str(), &size, (uint8_t *) &Buffer[0]))
+                        return false;
+
+                    Output.Clear();
+                    Output.Append(Buffer.data(), size);
+                    return true;
+                }
+#endif
+                default:
+                    return false;
+            }
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        size_t CPrecompressor::Generate(const CString &FileName, std::vector<CPrecompressorVariant> &Variants) {
+            // Bodies stored with a codec of their own are not recompressed.
+            if (!CCompressor::FileEncoding(FileName).IsEmpty())
+                return 0;
+
+            CString Input;
+            Input.LoadFromFile(FileName.c_str());
+
+            for (const auto Encoding : m_Encodings) {
+                const auto &caSidecar = Sidecar(FileName, Encoding);
+
+                CString Output;
+                if (!Encode(Encoding, Input, Output) || Output.Size() >= Input.Size()) {
+                    unlink(caSidecar.c_str());
+                    continue;
+                }
+
+                const auto &caTempName = caSidecar + ".tmp";
+
+                Output.SaveToFile(caTempName.c_str());
+
+                if (rename(caTempName.c_str(), caSidecar.c_str()) != 0) {
+                    unlink(caTempName.c_str());
+                    continue;
+                }
+
+                m_Generated[Encoding]++;
+                m_Saved += Input.Size() - Output.Size();
+
+                Variants.push_back({caSidecar, Output.Size()});
+            }
+
+            return Variants.size();
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        CString CPrecompressor::Negotiate(const CString &FileName, const CString &AcceptEncoding, CString &Variant) {
+            struct stat Source = {};
+            if (stat(FileName.c_str(), &Source) != 0)
+                return {};
+
+            CString Result;
+            double best = 0;
+
+            for (const auto Encoding : m_Encodings) {
+                const auto q = CCompressor::Quality(AcceptEncoding, EncodingToString(Encoding));
+                if (q <= best)
+                    continue;
+
+                const auto &caSidecar = Sidecar(FileName, Encoding);
+
+                // A variant older than its source belongs to a previous version of the file.
+                struct stat Stat = {};
+                if (stat(caSidecar.c_str(), &Stat) != 0)
+                    continue;
+
+                if (Stat.st_mtim.tv_sec < Source.st_mtim.tv_sec ||
+                    (Stat.st_mtim.tv_sec == Source.st_mtim.tv_sec && Stat.st_mtim.tv_nsec < Source.st_mtim.tv_nsec))
+                    continue;
+
+                best = q;
+                Result = EncodingToString(Encoding);
+                Variant = caSidecar;
+            }
+
+            CPrecompressorEncoding Encoding;
+            if (StringToEncoding(Result.c_str(), Encoding)) {
+                m_Served[Encoding]++;
+            }
+
+            return Result;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CPrecompressor::Metrics(CString &Output, const CString &Module) const {
+            if (!m_Active)
+                return;
+
+            Output += "# TYPE apostol_precompress_generated_total counter\n";
+            for (const auto Encoding : m_Encodings) {
+                Output += CString().Format("apostol_precompress_generated_total{module=\"%s\",encoding=\"%s\"} %llu\n",
+                                           Module.c_str(), EncodingToString(Encoding), (unsigned long long) m_Generated[Encoding].load());
+            }
+
+            Output += "# TYPE apostol_precompress_served_total counter\n";
+            for (const auto Encoding : m_Encodings) {
+                Output += CString().Format("apostol_precompress_served_total{module=\"%s\",encoding=\"%s\"} %llu\n",
+                                           Module.c_str(), EncodingToString(Encoding), (unsigned long long) m_Served[Encoding].load());
+            }
+
+            Output += CString().Format("# TYPE apostol_precompress_saved_bytes_total counter\n"
+                                       "apostol_precompress_saved_bytes_total{module=\"%s\"} %llu\n",
+                                       Module.c_str(), (unsigned long long) m_Saved.load());
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+    }
+}
+}
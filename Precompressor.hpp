@@ -0,0 +1,111 @@
+/*++
+
+Program name:
+
+  Apostol CRM
+
+Module Name:
+
+  Precompressor.hpp
+
+Notices:
+
+  Module: Precompressed file variants
+
+Author:
+
+  Copyright (c) Prepodobny Alen
+
+  mailto: alienufo@inbox.ru
+  mailto: ufocomp@gmail.com
+
+--*/
+
+#ifndef APOSTOL_PRECOMPRESSOR_HPP
+#define APOSTOL_PRECOMPRESSOR_HPP
+//----------------------------------------------------------------------------------------------------------------------
+
+#ifndef APOSTOL_COMPRESSOR_HPP
+#include "Compressor.hpp"
+#endif
+//----------------------------------------------------------------------------------------------------------------------
+
+#define PRECOMPRESSOR_DEFAULT_ENCODINGS "br, gzip"
+#define PRECOMPRESSOR_DEFAULT_TYPES "application/json, application/xml, application/javascript, text/, image/svg+xml"
+
+#define PRECOMPRESSOR_GZIP_LEVEL 6
+#define PRECOMPRESSOR_BROTLI_QUALITY 5
+//----------------------------------------------------------------------------------------------------------------------
+
+extern "C++" {
+
+namespace Apostol {
+
+    namespace Module {
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        //-- CPrecompressor --------------------------------------------------------------------------------------------
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        typedef enum precompressor_encoding_e {
+            peGzip = 0, peBrotli, peCount
+        } CPrecompressorEncoding;
+        //--------------------------------------------------------------------------------------------------------------
+
+        typedef struct precompressor_variant_s {
+            CString FileName;
+            size_t Size = 0;
+        } CPrecompressorVariant;
+        //--------------------------------------------------------------------------------------------------------------
+
+        class CPrecompressor {
+        private:
+
+            bool m_Active;
+
+            size_t m_Threshold;
+            size_t m_MaxSize;
+
+            std::vector<CPrecompressorEncoding> m_Encodings;
+            std::vector<std::string> m_Types;
+
+            std::atomic<uint64_t> m_Generated[peCount];
+            std::atomic<uint64_t> m_Served[peCount];
+            std::atomic<uint64_t> m_Saved;
+
+            static bool Encode(CPrecompressorEncoding Encoding, const CString &Input, CString &Output);
+
+        public:
+
+            CPrecompressor();
+
+            bool Open(const CString &Encodings, size_t Threshold, size_t MaxSize, const CString &Types);
+
+            bool Active() const { return m_Active; }
+
+            bool Eligible(const CString &FileName) const;
+            bool Eligible(const CString &FileName, size_t Size) const;
+
+            std::vector<CString> Sidecars(const CString &FileName) const;
+
+            size_t Generate(const CString &FileName, std::vector<CPrecompressorVariant> &Variants);
+
+            CString Negotiate(const CString &FileName, const CString &AcceptEncoding, CString &Variant);
+
+            void Metrics(CString &Output, const CString &Module) const;
+
+            static CString Sidecar(const CString &FileName, CPrecompressorEncoding Encoding);
+
+            static bool StringToEncoding(const std::string &Value, CPrecompressorEncoding &Encoding);
+            static const char *EncodingToString(CPrecompressorEncoding Encoding);
+
+        };
+
+    }
+}
+
+using namespace Apostol::Module;
+}
+#endif //APOSTOL_PRECOMPRESSOR_HPP
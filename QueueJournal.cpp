@@ -0,0 +1,489 @@
+/*++
+
+Program name:
+
+  Apostol CRM
+
+Module Name:
+
+  QueueJournal.cpp
+
+Notices:
+
+  Module: Queue journal
+
+Author:
+
+  Copyright (c) Prepodobny Alen
+
+  mailto: alienufo@inbox.ru
+  mailto: ufocomp@gmail.com
+
+--*/
+
+//----------------------------------------------------------------------------------------------------------------------
+
+#include "Core.hpp"
+#include "QueueJournal.hpp"
+//----------------------------------------------------------------------------------------------------------------------
+
+#include <algorithm>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+//----------------------------------------------------------------------------------------------------------------------
+
+extern "C++" {
+
+namespace Apostol {
+
+    namespace Module {
+
+        typedef struct queue_journal_record_header_s {
+            uint32_t Size;
+            uint32_t Check;
+            uint8_t Type;
+            uint8_t Reserved;
+            uint16_t KeySize;
+            uint32_t DataSize;
+        } CQueueJournalRecordHeader;
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        //-- CQueueJournal ---------------------------------------------------------------------------------------------
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        CQueueJournal::CQueueJournal(): m_Fd(-1), m_pMap(nullptr), m_Capacity(0), m_Records(0), m_Compactions(0),
+                m_Replayed(0) {
+
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        CQueueJournal::~CQueueJournal() {
+            Close();
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        size_t CQueueJournal::RecordSize(size_t KeySize, size_t DataSize) {
+            return (sizeof(CQueueJournalRecordHeader) + KeySize + DataSize + 7) & ~(size_t) 7;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        uint32_t CQueueJournal::Checksum(const char *Data, size_t Size) {
+            uint32_t hash = 2166136261u;
+            for (size_t i = 0; i < Size; ++i) {
+                hash ^= (uint8_t) Data[i];
+                hash *= 16777619u;
+            }
+            return hash;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        uint64_t CQueueJournal::Put(char *AMap, uint64_t Tail, CQueueJournalRecord Type, const char *Key, size_t KeySize,
+                const char *Data, size_t DataSize) {
+
+            const auto size = RecordSize(KeySize, DataSize);
+            const auto pRecord = AMap + Tail;
+
+            CQueueJournalRecordHeader Record = {};
+
+            Record.Size = (uint32_t) size;
+            Record.Type = (uint8_t) Type;
+            Record.KeySize = (uint16_t) KeySize;
+            Record.DataSize = (uint32_t) DataSize;
+
+            memcpy(pRecord, &Record, sizeof(Record));
+            memcpy(pRecord + sizeof(Record), Key, KeySize);
+            if (DataSize != 0)
+                memcpy(pRecord + sizeof(Record) + KeySize, Data, DataSize);
+
+            const auto used = sizeof(Record) + KeySize + DataSize;
+            memset(pRecord + used, 0, size - used);
+
+            // The checksum covers everything after itself, padding included.
+            Record.Check = Checksum(pRecord + 8, size - 8);
+            memcpy(pRecord + 4, &Record.Check, sizeof(Record.Check));
+
+            return Tail + size;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        bool CQueueJournal::Map(int Fd, size_t Capacity, bool Create) {
+            auto pMap = static_cast<char *> (mmap(nullptr, Capacity, PROT_READ | PROT_WRITE, MAP_SHARED, Fd, 0));
+            if (pMap == MAP_FAILED)
+                return false;
+
+            if (Create) {
+                auto pHeader = reinterpret_cast<CQueueJournalHeader *> (pMap);
+                memset(pHeader, 0, sizeof(CQueueJournalHeader));
+                memcpy(pHeader->Magic, QUEUE_JOURNAL_MAGIC, sizeof(pHeader->Magic));
+                pHeader->Tail = sizeof(CQueueJournalHeader);
+            }
+
+            m_Fd = Fd;
+            m_pMap = pMap;
+            m_Capacity = Capacity;
+
+            return true;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        bool CQueueJournal::Open(const CString &FileName, size_t Capacity) {
+            Close();
+
+            m_FileName = FileName;
+
+            const auto fd = open(FileName.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+            if (fd == -1)
+                return false;
+
+            // One writer per file: two workers appending to the same shared map would overwrite each other's records.
+            if (flock(fd, LOCK_EX | LOCK_NB) != 0) {
+                const auto error = errno;
+                close(fd);
+                errno = error;
+                return false;
+            }
+
+            struct stat Stat = {};
+            if (fstat(fd, &Stat) != 0) {
+                close(fd);
+                return false;
+            }
+
+            // A compaction by the previous owner may have renamed a new file over the one just locked.
+            struct stat Path = {};
+            if (stat(FileName.c_str(), &Path) != 0 || Path.st_ino != Stat.st_ino || Path.st_dev != Stat.st_dev) {
+                close(fd);
+                errno = EWOULDBLOCK;
+                return false;
+            }
+
+            const auto size = (size_t) Stat.st_size;
+            const auto capacity = std::max(std::max(Capacity, size), sizeof(CQueueJournalHeader) * 2);
+
+            if (size < capacity && ftruncate(fd, (off_t) capacity) != 0) {
+                close(fd);
+                return false;
+            }
+
+            const auto bValid = size >= sizeof(CQueueJournalHeader);
+
+            if (!Map(fd, capacity, !bValid)) {
+                close(fd);
+                return false;
+            }
+
+            if (bValid && memcmp(Header()->Magic, QUEUE_JOURNAL_MAGIC, sizeof(Header()->Magic)) == 0) {
+                Replay();
+                // Start the new run without the records of requests that already finished.
+                Compact(m_Capacity);
+            } else if (bValid) {
+                memset(m_pMap, 0, sizeof(CQueueJournalHeader));
+                memcpy(Header()->Magic, QUEUE_JOURNAL_MAGIC, sizeof(Header()->Magic));
+                Header()->Tail = sizeof(CQueueJournalHeader);
+            }
+
+            return true;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CQueueJournal::Close() {
+            if (m_pMap != nullptr) {
+                munmap(m_pMap, m_Capacity);
+                m_pMap = nullptr;
+            }
+
+            if (m_Fd != -1) {
+                close(m_Fd);
+                m_Fd = -1;
+            }
+
+            m_Capacity = 0;
+            m_Live.clear();
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        bool CQueueJournal::Acquire(const CString &Prefix, int Slots, size_t Capacity) {
+            // A restarted worker takes the first file no live worker holds, which is the one its predecessor left.
+            for (int slot = 0; slot < Slots; ++slot) {
+                if (Open(CString().Format("%s.%d.journal", Prefix.c_str(), slot), Capacity))
+                    return true;
+
+                if (errno != EWOULDBLOCK)
+                    return false;
+            }
+
+            return false;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CQueueJournal::Replay() {
+            const auto end = std::min<uint64_t>(Header()->Tail, m_Capacity);
+
+            uint64_t pos = sizeof(CQueueJournalHeader);
+
+            // A record cut short by a crash fails its checksum and ends the replay.
+            while (pos + sizeof(CQueueJournalRecordHeader) <= end) {
+                CQueueJournalRecordHeader Record = {};
+                memcpy(&Record, m_pMap + pos, sizeof(Record));
+
+                if (Record.Size < sizeof(Record) || (Record.Size & 7) != 0 || pos + Record.Size > end ||
+                    sizeof(Record) + Record.KeySize + Record.DataSize > Record.Size)
+                    break;
+
+                if (Checksum(m_pMap + pos + 8, Record.Size - 8) != Record.Check)
+                    break;
+
+                const std::string Key(m_pMap + pos + sizeof(Record), Record.KeySize);
+
+                switch (Record.Type) {
+                    case jrQueued:
+                        m_Live[Key] = {pos, false};
+                        break;
+                    case jrStarted: {
+                        const auto it = m_Live.find(Key);
+                        if (it != m_Live.end())
+                            it->second.Started = true;
+                        break;
+                    }
+                    case jrRemoved:
+                        m_Live.erase(Key);
+                        break;
+                    default:
+                        break;
+                }
+
+                pos += Record.Size;
+            }
+
+            Header()->Tail = pos;
+
+            std::vector<std::pair<uint64_t, const std::string *>> Order;
+            for (const auto &Item : m_Live) {
+                Order.emplace_back(Item.second.Offset, &Item.first);
+            }
+
+            std::sort(Order.begin(), Order.end());
+
+            m_Recovered.clear();
+            for (const auto &Item : Order) {
+                CQueueJournalRecordHeader Record = {};
+                memcpy(&Record, m_pMap + Item.first, sizeof(Record));
+
+                CQueueJournalEntry Entry;
+                Entry.Key = Item.second->c_str();
+                Entry.Data = CString(m_pMap + Item.first + sizeof(Record) + Record.KeySize, Record.DataSize);
+                Entry.Started = m_Live[*Item.second].Started;
+
+                m_Recovered.push_back(std::move(Entry));
+            }
+
+            m_Replayed += m_Recovered.size();
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        bool CQueueJournal::Compact(size_t Capacity) {
+            const auto caTempName = m_FileName + ".tmp";
+
+            const auto fd = open(caTempName.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+            if (fd == -1)
+                return false;
+
+            // The lock must be on the new file before it takes the name.
+            if (flock(fd, LOCK_EX | LOCK_NB) != 0) {
+                close(fd);
+                unlink(caTempName.c_str());
+                return false;
+            }
+
+            if (ftruncate(fd, (off_t) Capacity) != 0) {
+                close(fd);
+                unlink(caTempName.c_str());
+                return false;
+            }
+
+            auto pMap = static_cast<char *> (mmap(nullptr, Capacity, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0));
+            if (pMap == MAP_FAILED) {
+                close(fd);
+                unlink(caTempName.c_str());
+                return false;
+            }
+
+            auto pHeader = reinterpret_cast<CQueueJournalHeader *> (pMap);
+            memset(pHeader, 0, sizeof(CQueueJournalHeader));
+            memcpy(pHeader->Magic, QUEUE_JOURNAL_MAGIC, sizeof(pHeader->Magic));
+
+            std::vector<std::pair<uint64_t, CQueueJournalSlot *>> Order;
+            for (auto &Item : m_Live) {
+                Order.emplace_back(Item.second.Offset, &Item.second);
+            }
+
+            std::sort(Order.begin(), Order.end(), [](const auto &A, const auto &B) { return A.first < B.first; });
+
+            uint64_t tail = sizeof(CQueueJournalHeader);
+            std::vector<uint64_t> Offsets;
+
+            for (const auto &Item : Order) {
+                CQueueJournalRecordHeader Record = {};
+                memcpy(&Record, m_pMap + Item.first, sizeof(Record));
+
+                const auto pKey = m_pMap + Item.first + sizeof(Record);
+                const auto pData = pKey + Record.KeySize;
+
+                const auto queued = RecordSize(Record.KeySize, Record.DataSize);
+                const auto started = Item.second->Started ? RecordSize(Record.KeySize, 0) : 0;
+
+                if (tail + queued + started > Capacity) {
+                    munmap(pMap, Capacity);
+                    close(fd);
+                    unlink(caTempName.c_str());
+                    return false;
+                }
+
+                Offsets.push_back(tail);
+
+                tail = Put(pMap, tail, jrQueued, pKey, Record.KeySize, pData, Record.DataSize);
+
+                if (started != 0) {
+                    tail = Put(pMap, tail, jrStarted, pKey, Record.KeySize, nullptr, 0);
+                }
+            }
+
+            pHeader->Tail = tail;
+
+            if (rename(caTempName.c_str(), m_FileName.c_str()) != 0) {
+                munmap(pMap, Capacity);
+                close(fd);
+                unlink(caTempName.c_str());
+                return false;
+            }
+
+            for (size_t i = 0; i < Order.size(); ++i) {
+                Order[i].second->Offset = Offsets[i];
+            }
+
+            munmap(m_pMap, m_Capacity);
+            close(m_Fd);
+
+            m_Fd = fd;
+            m_pMap = pMap;
+            m_Capacity = Capacity;
+
+            m_Compactions++;
+
+            return true;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        bool CQueueJournal::Reserve(size_t Size) {
+            if (Header()->Tail + Size <= m_Capacity)
+                return true;
+
+            if (Compact(m_Capacity) && Header()->Tail + Size <= m_Capacity)
+                return true;
+
+            // Still full after dropping finished requests: the live set itself has outgrown the file.
+            auto capacity = m_Capacity * 2;
+            while (Header()->Tail + Size > capacity)
+                capacity *= 2;
+
+            return Compact(capacity) && Header()->Tail + Size <= m_Capacity;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        uint64_t CQueueJournal::Write(CQueueJournalRecord Type, const CString &Key, const char *Data, size_t Size) {
+            if (Key.Size() > UINT16_MAX || Size > UINT32_MAX)
+                return 0;
+
+            if (!Reserve(RecordSize(Key.Size(), Size)))
+                return 0;
+
+            const auto offset = Header()->Tail;
+
+            // The tail moves only once the record is complete, so a replay never reads half of it.
+            Header()->Tail = Put(m_pMap, offset, Type, Key.c_str(), Key.Size(), Data, Size);
+
+            m_Records++;
+
+            return offset;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        bool CQueueJournal::Contains(const CString &Key) const {
+            return m_Live.find(Key.c_str()) != m_Live.end();
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CQueueJournal::Queued(const CString &Key, const CString &Data) {
+            if (!Active() || Key.IsEmpty() || Contains(Key))
+                return;
+
+            const auto offset = Write(jrQueued, Key, Data.c_str(), Data.Size());
+            if (offset != 0) {
+                m_Live[Key.c_str()] = {offset, false};
+            }
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CQueueJournal::Started(const CString &Key) {
+            if (!Active())
+                return;
+
+            const auto it = m_Live.find(Key.c_str());
+            if (it == m_Live.end() || it->second.Started)
+                return;
+
+            if (Write(jrStarted, Key, nullptr, 0) != 0) {
+                it->second.Started = true;
+            }
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CQueueJournal::Removed(const CString &Key) {
+            if (!Active())
+                return;
+
+            if (m_Live.find(Key.c_str()) == m_Live.end())
+                return;
+
+            if (Write(jrRemoved, Key, nullptr, 0) != 0) {
+                m_Live.erase(Key.c_str());
+            }
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        std::vector<CQueueJournalEntry> CQueueJournal::TakeRecovered() {
+            std::vector<CQueueJournalEntry> Result;
+            Result.swap(m_Recovered);
+            return Result;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CQueueJournal::Metrics(CString &Output, const CString &Module) const {
+            if (!Active())
+                return;
+
+            Output += CString().Format("# TYPE apostol_journal_records_total counter\n"
+                                       "apostol_journal_records_total{module=\"%s\"} %llu\n",
+                                       Module.c_str(), (unsigned long long) m_Records);
+            Output += CString().Format("# TYPE apostol_journal_compactions_total counter\n"
+                                       "apostol_journal_compactions_total{module=\"%s\"} %llu\n",
+                                       Module.c_str(), (unsigned long long) m_Compactions);
+            Output += CString().Format("# TYPE apostol_journal_recovered_total counter\n"
+                                       "apostol_journal_recovered_total{module=\"%s\"} %llu\n",
+                                       Module.c_str(), (unsigned long long) m_Replayed);
+            Output += CString().Format("# TYPE apostol_journal_live gauge\n"
+                                       "apostol_journal_live{module=\"%s\"} %llu\n",
+                                       Module.c_str(), (unsigned long long) m_Live.size());
+            Output += CString().Format("# TYPE apostol_journal_bytes gauge\n"
+                                       "apostol_journal_bytes{module=\"%s\"} %llu\n",
+                                       Module.c_str(), (unsigned long long) Header()->Tail);
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+    }
+}
+}
@@ -0,0 +1,137 @@
+/*++
+
+Program name:
+
+  Apostol CRM
+
+Module Name:
+
+  QueueJournal.hpp
+
+Notices:
+
+  Module: Queue journal
+
+Author:
+
+  Copyright (c) Prepodobny Alen
+
+  mailto: alienufo@inbox.ru
+  mailto: ufocomp@gmail.com
+
+--*/
+
+#ifndef APOSTOL_QUEUE_JOURNAL_HPP
+#define APOSTOL_QUEUE_JOURNAL_HPP
+//----------------------------------------------------------------------------------------------------------------------
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+//----------------------------------------------------------------------------------------------------------------------
+
+#define QUEUE_JOURNAL_MAGIC "APQJRN01"
+//----------------------------------------------------------------------------------------------------------------------
+
+extern "C++" {
+
+namespace Apostol {
+
+    namespace Module {
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        //-- CQueueJournal ---------------------------------------------------------------------------------------------
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        typedef enum queue_journal_record_e {
+            jrQueued = 1, jrStarted, jrRemoved
+        } CQueueJournalRecord;
+        //--------------------------------------------------------------------------------------------------------------
+
+        typedef struct queue_journal_header_s {
+            char Magic[8];
+            uint64_t Tail;
+            uint64_t Reserved[6];
+        } CQueueJournalHeader;
+        //--------------------------------------------------------------------------------------------------------------
+
+        typedef struct queue_journal_entry_s {
+            CString Key;
+            CString Data;
+            bool Started = false;
+            int Attempt = 0;
+        } CQueueJournalEntry;
+        //--------------------------------------------------------------------------------------------------------------
+
+        typedef struct queue_journal_slot_s {
+            uint64_t Offset = 0;
+            bool Started = false;
+        } CQueueJournalSlot;
+        //--------------------------------------------------------------------------------------------------------------
+
+        class CQueueJournal {
+        private:
+
+            CString m_FileName;
+
+            int m_Fd;
+            char *m_pMap;
+            size_t m_Capacity;
+
+            std::unordered_map<std::string, CQueueJournalSlot> m_Live;
+
+            std::vector<CQueueJournalEntry> m_Recovered;
+
+            uint64_t m_Records;
+            uint64_t m_Compactions;
+            uint64_t m_Replayed;
+
+            CQueueJournalHeader *Header() const { return reinterpret_cast<CQueueJournalHeader *> (m_pMap); }
+
+            bool Map(int Fd, size_t Capacity, bool Create);
+            void Replay();
+
+            uint64_t Write(CQueueJournalRecord Type, const CString &Key, const char *Data, size_t Size);
+            bool Reserve(size_t Size);
+            bool Compact(size_t Capacity);
+
+            static uint64_t Put(char *AMap, uint64_t Tail, CQueueJournalRecord Type, const char *Key, size_t KeySize,
+                const char *Data, size_t DataSize);
+
+            static size_t RecordSize(size_t KeySize, size_t DataSize);
+            static uint32_t Checksum(const char *Data, size_t Size);
+
+        public:
+
+            CQueueJournal();
+
+            ~CQueueJournal();
+
+            bool Open(const CString &FileName, size_t Capacity);
+            bool Acquire(const CString &Prefix, int Slots, size_t Capacity);
+            void Close();
+
+            const CString &FileName() const { return m_FileName; }
+
+            bool Active() const { return m_pMap != nullptr; }
+
+            bool Contains(const CString &Key) const;
+
+            void Queued(const CString &Key, const CString &Data);
+            void Started(const CString &Key);
+            void Removed(const CString &Key);
+
+            std::vector<CQueueJournalEntry> TakeRecovered();
+
+            void Metrics(CString &Output, const CString &Module) const;
+
+        };
+
+    }
+}
+
+using namespace Apostol::Module;
+}
+#endif //APOSTOL_QUEUE_JOURNAL_HPP
@@ -0,0 +1,523 @@
+/*++
+
+Program name:
+
+  Apostol CRM
+
+Module Name:
+
+  ShardQueue.cpp
+
+Notices:
+
+  Module: Cross-process shard queue
+
+Author:
+
+  Copyright (c) Prepodobny Alen
+
+  mailto: alienufo@inbox.ru
+  mailto: ufocomp@gmail.com
+
+--*/
+
+//----------------------------------------------------------------------------------------------------------------------
+
+#include "Core.hpp"
+#include "ShardQueue.hpp"
+//----------------------------------------------------------------------------------------------------------------------
+
+#include <fcntl.h>
+#include <sched.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+//----------------------------------------------------------------------------------------------------------------------
+
+#define SHARD_QUEUE_STATE_READY 2
+#define SHARD_QUEUE_SPIN_LIMIT 100000
+//----------------------------------------------------------------------------------------------------------------------
+
+extern "C++" {
+
+namespace Apostol {
+
+    namespace Module {
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        //-- CShardQueue -----------------------------------------------------------------------------------------------
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        CShardQueue::CShardQueue(): m_pMap(nullptr), m_Size(0), m_Slots(0), m_Capacity(0), m_EntrySize(0),
+                m_CellSize(0), m_Index(-1), m_Forwarded(0), m_Received(0), m_Stolen(0), m_Overflow(0), m_Returned(0), m_Skipped(0) {
+
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        CShardQueue::~CShardQueue() {
+            Close();
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        uint64_t CShardQueue::Hash(const char *Data, size_t Size) {
+            uint64_t hash = 14695981039346656037ull;
+            for (size_t i = 0; i < Size; ++i) {
+                hash ^= (uint8_t) Data[i];
+                hash *= 1099511628211ull;
+            }
+            return hash;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        CShardQueueSlot *CShardQueue::Slot(uint32_t Index) const {
+            return reinterpret_cast<CShardQueueSlot *> (m_pMap + sizeof(CShardQueueHeader) + Index * sizeof(CShardQueueSlot));
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        CShardQueueCell *CShardQueue::Cell(uint32_t Index, uint64_t Pos) const {
+            const auto offset = sizeof(CShardQueueHeader) + m_Slots * sizeof(CShardQueueSlot) +
+                    ((size_t) Index * m_Capacity + (Pos & (m_Capacity - 1))) * m_CellSize;
+            return reinterpret_cast<CShardQueueCell *> (m_pMap + offset);
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        bool CShardQueue::Open(const CString &Name, uint32_t Slots, uint32_t Capacity, uint32_t EntrySize) {
+            Close();
+
+            if (Slots == 0 || Capacity == 0 || EntrySize == 0)
+                return false;
+
+            uint32_t capacity = 1;
+            while (capacity < Capacity)
+                capacity <<= 1;
+
+            m_Slots = Slots;
+            m_Capacity = capacity;
+            m_EntrySize = EntrySize;
+            m_CellSize = (sizeof(CShardQueueCell) + EntrySize + 63) & ~(size_t) 63;
+
+            const auto size = sizeof(CShardQueueHeader) + m_Slots * sizeof(CShardQueueSlot) + (size_t) m_Slots * m_Capacity * m_CellSize;
+
+            const auto fd = shm_open(Name.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+            if (fd == -1)
+                return false;
+
+            struct stat Stat = {};
+            if (fstat(fd, &Stat) != 0) {
+                close(fd);
+                return false;
+            }
+
+            // Every worker sizes the segment the same way, so a concurrent allocation is harmless. The pages are
+            // reserved now: a /dev/shm too small for the rings fails here, not with SIGBUS on a later push.
+            if (Stat.st_size == 0) {
+                const auto error = posix_fallocate(fd, 0, (off_t) size);
+                if (error != 0) {
+                    close(fd);
+                    shm_unlink(Name.c_str());
+                    errno = error;
+                    return false;
+                }
+            }
+
+            if (Stat.st_size != 0 && (size_t) Stat.st_size != size) {
+                close(fd);
+                return false;
+            }
+
+            auto pMap = static_cast<char *> (mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0));
+            close(fd);
+
+            if (pMap == MAP_FAILED)
+                return false;
+
+            m_Name = Name;
+            m_pMap = pMap;
+            m_Size = size;
+
+            m_Stalls.assign(m_Slots, CShardQueueStall());
+
+            // The segment is zero-filled: rings start empty, so the first worker only has to stamp the geometry.
+            auto pHeader = Header();
+
+            uint32_t state = 0;
+            if (pHeader->State.compare_exchange_strong(state, 1)) {
+                memcpy(pHeader->Magic, SHARD_QUEUE_MAGIC, sizeof(pHeader->Magic));
+                pHeader->Slots = m_Slots;
+                pHeader->Capacity = m_Capacity;
+                pHeader->EntrySize = m_EntrySize;
+                pHeader->State.store(SHARD_QUEUE_STATE_READY, std::memory_order_release);
+            } else {
+                for (int i = 0; i < SHARD_QUEUE_SPIN_LIMIT && pHeader->State.load(std::memory_order_acquire) != SHARD_QUEUE_STATE_READY; ++i)
+                    sched_yield();
+            }
+
+            if (pHeader->State.load(std::memory_order_acquire) != SHARD_QUEUE_STATE_READY ||
+                memcmp(pHeader->Magic, SHARD_QUEUE_MAGIC, sizeof(pHeader->Magic)) != 0 ||
+                pHeader->Slots != m_Slots || pHeader->Capacity != m_Capacity || pHeader->EntrySize != m_EntrySize || !Claim()) {
+                munmap(m_pMap, m_Size);
+                m_pMap = nullptr;
+                m_Size = 0;
+                return false;
+            }
+
+            Beat();
+
+            return true;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        bool CShardQueue::Claim() {
+            const auto pid = (int32_t) getpid();
+
+            for (uint32_t i = 0; i < m_Slots; ++i) {
+                auto pSlot = Slot(i);
+                auto current = pSlot->Pid.load(std::memory_order_acquire);
+
+                // The slot of a worker that died is taken over together with whatever is left in its inbox.
+                if (current != 0 && (kill(current, 0) == 0 || errno != ESRCH))
+                    continue;
+
+                if (pSlot->Pid.compare_exchange_strong(current, pid)) {
+                    m_Index = (int) i;
+                    return true;
+                }
+            }
+
+            return false;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CShardQueue::Close() {
+            if (m_pMap == nullptr)
+                return;
+
+            bool bLast = true;
+
+            if (m_Index != -1) {
+                Slot(m_Index)->Pid.store(0, std::memory_order_release);
+
+                for (uint32_t i = 0; i < m_Slots; ++i) {
+                    if (Slot(i)->Pid.load(std::memory_order_acquire) != 0 || Depth(i) != 0) {
+                        bLast = false;
+                        break;
+                    }
+                }
+            }
+
+            munmap(m_pMap, m_Size);
+
+            if (bLast) {
+                shm_unlink(m_Name.c_str());
+            }
+
+            m_pMap = nullptr;
+            m_Size = 0;
+            m_Index = -1;
+
+            m_Stalls.clear();
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CShardQueue::Beat() {
+            if (m_Index != -1) {
+                Slot(m_Index)->Beat.store((int64_t) time(nullptr), std::memory_order_relaxed);
+            }
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        bool CShardQueue::Alive(uint32_t Index, int64_t Now) const {
+            const auto pSlot = Slot(Index);
+            return pSlot->Pid.load(std::memory_order_acquire) != 0 &&
+                   Now - pSlot->Beat.load(std::memory_order_relaxed) < SHARD_QUEUE_BEAT_TIMEOUT;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        uint64_t CShardQueue::Depth(uint32_t Index) const {
+            const auto pSlot = Slot(Index);
+            const auto write = pSlot->Write.load(std::memory_order_acquire);
+            const auto read = pSlot->Read.load(std::memory_order_acquire);
+            return write > read ? write - read : 0;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        int CShardQueue::Owner(const CString &Key) const {
+            if (!Active())
+                return -1;
+
+            const auto now = (int64_t) time(nullptr);
+            const auto hash = Hash(Key.c_str(), Key.Size());
+
+            // Rendezvous hashing: a worker that comes or goes moves only the keys it wins or held.
+            int owner = -1;
+            uint64_t best = 0;
+
+            for (uint32_t i = 0; i < m_Slots; ++i) {
+                if ((int) i != m_Index && !Alive(i, now))
+                    continue;
+
+                auto score = hash ^ ((uint64_t) (i + 1) * 0x9E3779B97F4A7C15ull);
+                score ^= score >> 33;
+                score *= 0xFF51AFD7ED558CCDull;
+                score ^= score >> 33;
+
+                if (owner == -1 || score > best) {
+                    owner = (int) i;
+                    best = score;
+                }
+            }
+
+            return owner;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        bool CShardQueue::Push(uint32_t Index, const CQueueJournalEntry &Entry, uint64_t &Position) {
+            auto pSlot = Slot(Index);
+            auto pos = pSlot->Write.load(std::memory_order_relaxed);
+
+            // Bounded MPMC ring. Sequences are stored relative to the cell index, so a zero-filled cell is free for lap one.
+            CShardQueueCell *pCell;
+            for (;;) {
+                pCell = Cell(Index, pos);
+                const auto base = pos & (m_Capacity - 1);
+                const auto diff = (int64_t) (pCell->Sequence.load(std::memory_order_acquire) - (pos - base));
+
+                if (diff == 0) {
+                    if (pSlot->Write.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                        break;
+                } else if (diff < 0) {
+                    return false;
+                } else {
+                    pos = pSlot->Write.load(std::memory_order_relaxed);
+                }
+            }
+
+            auto pData = reinterpret_cast<char *> (pCell) + sizeof(CShardQueueCell);
+
+            pCell->KeySize = (uint16_t) Entry.Key.Size();
+            pCell->DataSize = (uint32_t) Entry.Data.Size();
+            pCell->Started = Entry.Started ? 1 : 0;
+            pCell->Attempt = (uint8_t) Entry.Attempt;
+
+            memcpy(pData, Entry.Key.c_str(), Entry.Key.Size());
+            if (!Entry.Data.IsEmpty())
+                memcpy(pData + Entry.Key.Size(), Entry.Data.c_str(), Entry.Data.Size());
+
+            pCell->Sequence.store(pos + 1 - (pos & (m_Capacity - 1)), std::memory_order_release);
+
+            Position = pos;
+
+            return true;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        bool CShardQueue::Pop(uint32_t Index, CQueueJournalEntry &Entry) {
+            auto pSlot = Slot(Index);
+            auto pos = pSlot->Read.load(std::memory_order_relaxed);
+
+            CShardQueueCell *pCell;
+            for (;;) {
+                pCell = Cell(Index, pos);
+                const auto base = pos & (m_Capacity - 1);
+                const auto diff = (int64_t) (pCell->Sequence.load(std::memory_order_acquire) - (pos + 1 - base));
+
+                if (diff == 0) {
+                    if (pSlot->Read.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                        break;
+                } else if (diff < 0) {
+                    // Empty, or a claimed cell that is not published yet.
+                    if (pSlot->Write.load(std::memory_order_acquire) <= pos || !Skip(Index, pos))
+                        return false;
+                    pos = pSlot->Read.load(std::memory_order_relaxed);
+                } else {
+                    pos = pSlot->Read.load(std::memory_order_relaxed);
+                }
+            }
+
+            m_Stalls[Index].Since = 0;
+
+            const auto pData = reinterpret_cast<const char *> (pCell) + sizeof(CShardQueueCell);
+
+            Entry.Key = CString(pData, pCell->KeySize);
+            Entry.Data = CString(pData + pCell->KeySize, pCell->DataSize);
+            Entry.Started = pCell->Started != 0;
+            Entry.Attempt = pCell->Attempt;
+
+            pCell->Sequence.store(pos + m_Capacity - (pos & (m_Capacity - 1)), std::memory_order_release);
+
+            return true;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        bool CShardQueue::Skip(uint32_t Index, uint64_t Pos) {
+            auto &Stall = m_Stalls[Index];
+            const auto now = (int64_t) time(nullptr);
+
+            if (Stall.Since == 0 || Stall.Position != Pos) {
+                Stall.Position = Pos;
+                Stall.Since = now;
+                return false;
+            }
+
+            if (now - Stall.Since < SHARD_QUEUE_BEAT_TIMEOUT)
+                return false;
+
+            Stall.Since = 0;
+
+            // The producer is taken to be dead: the cell is given up and released for the next lap. One that was only
+            // stopped publishes into a released cell later, which reads as full until it is skipped again.
+            auto pos = Pos;
+            if (!Slot(Index)->Read.compare_exchange_strong(pos, Pos + 1, std::memory_order_relaxed))
+                return true;
+
+            Cell(Index, Pos)->Sequence.store(Pos + m_Capacity - (Pos & (m_Capacity - 1)), std::memory_order_release);
+
+            m_Skipped++;
+
+            return true;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        bool CShardQueue::Forward(const CString &Key, const CString &Data, CShardTicket &Ticket) {
+            if (Key.IsEmpty() || Key.Size() > UINT16_MAX || Key.Size() + Data.Size() > m_EntrySize)
+                return false;
+
+            const auto owner = Owner(Key);
+            if (owner == -1 || owner == m_Index)
+                return false;
+
+            CQueueJournalEntry Entry;
+            Entry.Key = Key;
+            Entry.Data = Data;
+
+            if (!Push((uint32_t) owner, Entry, Ticket.Position)) {
+                m_Overflow++;
+                return false;
+            }
+
+            Ticket.Owner = owner;
+
+            m_Forwarded++;
+
+            return true;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        bool CShardQueue::Return(const CQueueJournalEntry &Entry) {
+            if (!Active() || m_Index == -1 || Entry.Attempt + 1 >= SHARD_QUEUE_ATTEMPTS)
+                return false;
+
+            // Back into our own inbox, where this worker or an idle peer tries it again.
+            CQueueJournalEntry Retry(Entry);
+            Retry.Attempt++;
+
+            uint64_t position;
+            if (!Push((uint32_t) m_Index, Retry, position)) {
+                m_Overflow++;
+                return false;
+            }
+
+            m_Returned++;
+
+            return true;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        bool CShardQueue::Taken(const CShardTicket &Ticket) const {
+            if (!Active() || Ticket.Owner < 0 || (uint32_t) Ticket.Owner >= m_Slots)
+                return true;
+
+            return Slot((uint32_t) Ticket.Owner)->Read.load(std::memory_order_acquire) > Ticket.Position;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        bool CShardQueue::Take(CQueueJournalEntry &Entry) {
+            if (!Active() || m_Index == -1)
+                return false;
+
+            if (Pop((uint32_t) m_Index, Entry)) {
+                m_Received++;
+                return true;
+            }
+
+            // Nothing of our own: steal from the deepest inbox, including those of workers that are gone.
+            int victim = -1;
+            uint64_t deepest = 0;
+
+            for (uint32_t i = 0; i < m_Slots; ++i) {
+                if ((int) i == m_Index)
+                    continue;
+
+                const auto depth = Depth(i);
+                if (depth > deepest) {
+                    victim = (int) i;
+                    deepest = depth;
+                }
+            }
+
+            if (victim != -1 && Pop((uint32_t) victim, Entry)) {
+                m_Stolen++;
+                return true;
+            }
+
+            return false;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        bool CShardQueue::Pending() const {
+            if (!Active())
+                return false;
+
+            for (uint32_t i = 0; i < m_Slots; ++i) {
+                if (Depth(i) != 0)
+                    return true;
+            }
+
+            return false;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CShardQueue::Metrics(CString &Output, const CString &Module) const {
+            if (!Active())
+                return;
+
+            const auto now = (int64_t) time(nullptr);
+
+            uint32_t peers = 0;
+            for (uint32_t i = 0; i < m_Slots; ++i) {
+                if (Alive(i, now))
+                    peers++;
+            }
+
+            Output += CString().Format("# TYPE apostol_shard_forwarded_total counter\n"
+                                       "apostol_shard_forwarded_total{module=\"%s\"} %llu\n",
+                                       Module.c_str(), (unsigned long long) m_Forwarded);
+            Output += CString().Format("# TYPE apostol_shard_received_total counter\n"
+                                       "apostol_shard_received_total{module=\"%s\"} %llu\n",
+                                       Module.c_str(), (unsigned long long) m_Received);
+            Output += CString().Format("# TYPE apostol_shard_stolen_total counter\n"
+                                       "apostol_shard_stolen_total{module=\"%s\"} %llu\n",
+                                       Module.c_str(), (unsigned long long) m_Stolen);
+            Output += CString().Format("# TYPE apostol_shard_overflow_total counter\n"
+                                       "apostol_shard_overflow_total{module=\"%s\"} %llu\n",
+                                       Module.c_str(), (unsigned long long) m_Overflow);
+            Output += CString().Format("# TYPE apostol_shard_returned_total counter\n"
+                                       "apostol_shard_returned_total{module=\"%s\"} %llu\n",
+                                       Module.c_str(), (unsigned long long) m_Returned);
+            Output += CString().Format("# TYPE apostol_shard_skipped_total counter\n"
+                                       "apostol_shard_skipped_total{module=\"%s\"} %llu\n",
+                                       Module.c_str(), (unsigned long long) m_Skipped);
+            Output += CString().Format("# TYPE apostol_shard_peers gauge\n"
+                                       "apostol_shard_peers{module=\"%s\"} %u\n",
+                                       Module.c_str(), peers);
+            Output += CString().Format("# TYPE apostol_shard_inbox gauge\n"
+                                       "apostol_shard_inbox{module=\"%s\"} %llu\n",
+                                       Module.c_str(), (unsigned long long) (m_Index == -1 ? 0 : Depth((uint32_t) m_Index)));
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+    }
+}
+}
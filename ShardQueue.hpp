@@ -0,0 +1,171 @@
+/*++
+
+Program name:
+
+  Apostol CRM
+
+Module Name:
+
+  ShardQueue.hpp
+
+Notices:
+
+  Module: Cross-process shard queue
+
+Author:
+
+  Copyright (c) Prepodobny Alen
+
+  mailto: alienufo@inbox.ru
+  mailto: ufocomp@gmail.com
+
+--*/
+
+#ifndef APOSTOL_SHARD_QUEUE_HPP
+#define APOSTOL_SHARD_QUEUE_HPP
+//----------------------------------------------------------------------------------------------------------------------
+
+#include <atomic>
+#include <vector>
+//----------------------------------------------------------------------------------------------------------------------
+
+#ifndef APOSTOL_QUEUE_JOURNAL_HPP
+#include "QueueJournal.hpp"
+#endif
+//----------------------------------------------------------------------------------------------------------------------
+
+#define SHARD_QUEUE_MAGIC "APSHRD02"
+#define SHARD_QUEUE_BEAT_TIMEOUT 10
+#define SHARD_QUEUE_ATTEMPTS 3
+//----------------------------------------------------------------------------------------------------------------------
+
+extern "C++" {
+
+namespace Apostol {
+
+    namespace Module {
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        //-- CShardQueue -----------------------------------------------------------------------------------------------
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        typedef struct shard_queue_header_s {
+            char Magic[8];
+            std::atomic<uint32_t> State;
+            uint32_t Slots;
+            uint32_t Capacity;
+            uint32_t EntrySize;
+            char Reserved[40];
+        } CShardQueueHeader;
+        //--------------------------------------------------------------------------------------------------------------
+
+        // Each worker owns one slot: its inbox is a bounded MPMC ring that peers push to and idle workers steal from.
+        typedef struct shard_queue_slot_s {
+            alignas(64) std::atomic<int32_t> Pid;
+            std::atomic<int64_t> Beat;
+            alignas(64) std::atomic<uint64_t> Write;
+            alignas(64) std::atomic<uint64_t> Read;
+        } CShardQueueSlot;
+        //--------------------------------------------------------------------------------------------------------------
+
+        typedef struct shard_queue_cell_s {
+            std::atomic<uint64_t> Sequence;
+            uint32_t DataSize;
+            uint16_t KeySize;
+            uint8_t Started;
+            uint8_t Attempt;
+        } CShardQueueCell;
+        //--------------------------------------------------------------------------------------------------------------
+
+        // Where a forwarded entry went: it has been taken once the owner's read position moves past it.
+        typedef struct shard_queue_ticket_s {
+            int Owner = -1;
+            uint64_t Position = 0;
+        } CShardTicket;
+        //--------------------------------------------------------------------------------------------------------------
+
+        // A producer that dies between claiming a cell and publishing it leaves a hole the ring cannot read past.
+        // A reader that finds the same hole for SHARD_QUEUE_BEAT_TIMEOUT seconds skips it.
+        typedef struct shard_queue_stall_s {
+            uint64_t Position = 0;
+            int64_t Since = 0;
+        } CShardQueueStall;
+        //--------------------------------------------------------------------------------------------------------------
+
+        class CShardQueue {
+        private:
+
+            CString m_Name;
+
+            char *m_pMap;
+            size_t m_Size;
+
+            uint32_t m_Slots;
+            uint32_t m_Capacity;
+            uint32_t m_EntrySize;
+            size_t m_CellSize;
+
+            int m_Index;
+
+            std::vector<CShardQueueStall> m_Stalls;
+
+            uint64_t m_Forwarded;
+            uint64_t m_Received;
+            uint64_t m_Stolen;
+            uint64_t m_Overflow;
+            uint64_t m_Returned;
+            uint64_t m_Skipped;
+
+            CShardQueueHeader *Header() const { return reinterpret_cast<CShardQueueHeader *> (m_pMap); }
+            CShardQueueSlot *Slot(uint32_t Index) const;
+            CShardQueueCell *Cell(uint32_t Index, uint64_t Pos) const;
+
+            bool Alive(uint32_t Index, int64_t Now) const;
+            uint64_t Depth(uint32_t Index) const;
+
+            bool Push(uint32_t Index, const CQueueJournalEntry &Entry, uint64_t &Position);
+            bool Pop(uint32_t Index, CQueueJournalEntry &Entry);
+            bool Skip(uint32_t Index, uint64_t Pos);
+
+            bool Claim();
+
+            static uint64_t Hash(const char *Data, size_t Size);
+
+        public:
+
+            CShardQueue();
+
+            ~CShardQueue();
+
+            CShardQueue(const CShardQueue &) = delete;
+            CShardQueue &operator=(const CShardQueue &) = delete;
+
+            bool Open(const CString &Name, uint32_t Slots, uint32_t Capacity, uint32_t EntrySize);
+            void Close();
+
+            bool Active() const { return m_pMap != nullptr; }
+
+            int Owner(const CString &Key) const;
+
+            bool Forward(const CString &Key, const CString &Data, CShardTicket &Ticket);
+            bool Take(CQueueJournalEntry &Entry);
+            bool Return(const CQueueJournalEntry &Entry);
+
+            bool Taken(const CShardTicket &Ticket) const;
+
+            bool Pending() const;
+
+            void Beat();
+
+            void Metrics(CString &Output, const CString &Module) const;
+
+        };
+
+    }
+}
+
+using namespace Apostol::Module;
+}
+#endif //APOSTOL_SHARD_QUEUE_HPP
@@ -0,0 +1,93 @@
+/*++
+
+Program name:
+
+  Apostol CRM
+
+Module Name:
+
+  TLSSessionCache.cpp
+
+Notices:
+
+  Module: TLS session cache
+
+Author:
+
+  Copyright (c) Prepodobny Alen
+
+  mailto: alienufo@inbox.ru
+  mailto: ufocomp@gmail.com
+
+--*/
+
+//----------------------------------------------------------------------------------------------------------------------
+
+#include "Core.hpp"
+#include "TLSSessionCache.hpp"
+//----------------------------------------------------------------------------------------------------------------------
+
+#include <openssl/ssl.h>
+//----------------------------------------------------------------------------------------------------------------------
+
+extern "C++" {
+
+namespace Apostol {
+
+    namespace Module {
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        //-- CTLSSessionCache ------------------------------------------------------------------------------------------
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        CURLSH *CTLSSessionCache::m_Share = nullptr;
+        int CTLSSessionCache::m_References = 0;
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CTLSSessionCache::Acquire() {
+            if (m_References++ > 0)
+                return;
+
+            // Worker processes are single-threaded, so the share needs no lock callbacks.
+            m_Share = curl_share_init();
+            if (m_Share != nullptr) {
+                curl_share_setopt(m_Share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+                curl_share_setopt(m_Share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+            }
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CTLSSessionCache::Release() {
+            if (m_References == 0 || --m_References > 0)
+                return;
+
+            // The last client is gone and its easy handles with it, so the share is no longer referenced.
+            if (m_Share != nullptr) {
+                curl_share_cleanup(m_Share);
+                m_Share = nullptr;
+            }
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        bool CTLSSessionCache::Inspect(CURL *AHandle, bool &Resumed) {
+            struct curl_tlssessioninfo *pInfo = nullptr;
+
+            Resumed = false;
+
+            if (curl_easy_getinfo(AHandle, CURLINFO_TLS_SSL_PTR, &pInfo) != CURLE_OK || pInfo == nullptr)
+                return false;
+
+            if (pInfo->backend != CURLSSLBACKEND_OPENSSL || pInfo->internals == nullptr)
+                return false;
+
+            Resumed = SSL_session_reused(static_cast<SSL *> (pInfo->internals)) != 0;
+
+            return true;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+    }
+}
+}
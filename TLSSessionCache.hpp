@@ -0,0 +1,65 @@
+/*++
+
+Program name:
+
+  Apostol CRM
+
+Module Name:
+
+  TLSSessionCache.hpp
+
+Notices:
+
+  Module: TLS session cache
+
+Author:
+
+  Copyright (c) Prepodobny Alen
+
+  mailto: alienufo@inbox.ru
+  mailto: ufocomp@gmail.com
+
+--*/
+
+#ifndef APOSTOL_TLS_SESSION_CACHE_HPP
+#define APOSTOL_TLS_SESSION_CACHE_HPP
+//----------------------------------------------------------------------------------------------------------------------
+
+#include <curl/curl.h>
+//----------------------------------------------------------------------------------------------------------------------
+
+extern "C++" {
+
+namespace Apostol {
+
+    namespace Module {
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        //-- CTLSSessionCache ------------------------------------------------------------------------------------------
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        class CTLSSessionCache {
+        private:
+
+            static CURLSH *m_Share;
+            static int m_References;
+
+        public:
+
+            static void Acquire();
+            static void Release();
+
+            static CURLSH *Share() { return m_Share; }
+
+            static bool Inspect(CURL *AHandle, bool &Resumed);
+
+        };
+
+    }
+}
+
+using namespace Apostol::Module;
+}
+#endif //APOSTOL_TLS_SESSION_CACHE_HPP
@@ -0,0 +1,191 @@
+/*++
+
+Program name:
+
+  Apostol CRM
+
+Module Name:
+
+  WorkerPool.cpp
+
+Notices:
+
+  Module: Worker Pool
+
+Author:
+
+  Copyright (c) Prepodobny Alen
+
+  mailto: alienufo@inbox.ru
+  mailto: ufocomp@gmail.com
+
+--*/
+
+//----------------------------------------------------------------------------------------------------------------------
+
+#include "Core.hpp"
+#include "WorkerPool.hpp"
+//----------------------------------------------------------------------------------------------------------------------
+
+extern "C++" {
+
+namespace Apostol {
+
+    namespace Module {
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        //-- CWorkerPool -----------------------------------------------------------------------------------------------
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        CWorkerPool::CWorkerPool(): m_MaxJobs(0), m_Next(0), m_Pending(0), m_Terminated(false),
+                m_Posted(0), m_Rejected(0) {
+
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        CWorkerPool::~CWorkerPool() {
+            Stop();
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CWorkerPool::Start(size_t Threads, size_t MaxJobs) {
+            Stop();
+
+            m_MaxJobs = MaxJobs;
+            m_Terminated = false;
+
+            for (size_t i = 0; i < Threads; ++i) {
+                auto pQueue = new CWorkerQueue();
+                m_Queues.push_back(pQueue);
+                pQueue->Thread = std::thread(&CWorkerPool::Execute, this, pQueue);
+            }
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CWorkerPool::Stop() {
+            if (m_Queues.empty())
+                return;
+
+            m_Terminated = true;
+
+            for (auto pQueue : m_Queues) {
+                {
+                    std::lock_guard<std::mutex> Lock(pQueue->Lock);
+                    pQueue->Jobs.clear();
+                }
+                pQueue->Signal.notify_one();
+            }
+
+            for (auto pQueue : m_Queues) {
+                if (pQueue->Thread.joinable())
+                    pQueue->Thread.join();
+                delete pQueue;
+            }
+
+            m_Queues.clear();
+
+            std::lock_guard<std::mutex> Lock(m_Lock);
+            m_Completions.clear();
+            m_Pending = 0;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CWorkerPool::Execute(CWorkerQueue *AQueue) {
+            while (!m_Terminated) {
+                CWorkerJob Job;
+
+                {
+                    std::unique_lock<std::mutex> Lock(AQueue->Lock);
+
+                    AQueue->Signal.wait(Lock, [this, AQueue]() { return m_Terminated || !AQueue->Jobs.empty(); });
+
+                    if (m_Terminated)
+                        break;
+
+                    Job = std::move(AQueue->Jobs.front());
+                    AQueue->Jobs.pop_front();
+                }
+
+                if (Job.Work)
+                    Job.Work();
+
+                std::lock_guard<std::mutex> Lock(m_Lock);
+                if (Job.Done) {
+                    m_Completions.push_back(std::move(Job.Done));
+                } else {
+                    m_Pending--;
+                }
+            }
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        bool CWorkerPool::Post(size_t Index, COnWorkerJobEvent &&Work, COnWorkerJobEvent &&Done) {
+            if (m_Queues.empty() || m_Terminated)
+                return false;
+
+            if (m_MaxJobs != 0 && m_Pending >= m_MaxJobs) {
+                m_Rejected++;
+                return false;
+            }
+
+            const auto pQueue = m_Queues[Index % m_Queues.size()];
+
+            {
+                std::lock_guard<std::mutex> Lock(pQueue->Lock);
+                pQueue->Jobs.push_back({std::move(Work), std::move(Done)});
+            }
+
+            m_Pending++;
+            m_Posted++;
+
+            pQueue->Signal.notify_one();
+
+            return true;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        bool CWorkerPool::Post(COnWorkerJobEvent &&Work, COnWorkerJobEvent &&Done) {
+            return Post(m_Next++, std::move(Work), std::move(Done));
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        bool CWorkerPool::Post(const CString &Key, COnWorkerJobEvent &&Work, COnWorkerJobEvent &&Done) {
+            return Post(std::hash<std::string>()(std::string(Key.c_str(), Key.Size())), std::move(Work), std::move(Done));
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        size_t CWorkerPool::Dispatch() {
+            std::deque<COnWorkerJobEvent> Completions;
+
+            {
+                std::lock_guard<std::mutex> Lock(m_Lock);
+                Completions.swap(m_Completions);
+                m_Pending -= Completions.size();
+            }
+
+            for (auto &Done : Completions) {
+                Done();
+            }
+
+            return Completions.size();
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CWorkerPool::Metrics(CString &Output, const CString &Module) const {
+            Output += CString().Format("# TYPE apostol_worker_pool_jobs_total counter\n"
+                                       "apostol_worker_pool_jobs_total{module=\"%s\"} %llu\n",
+                                       Module.c_str(), (unsigned long long) m_Posted.load());
+            Output += CString().Format("# TYPE apostol_worker_pool_rejected_total counter\n"
+                                       "apostol_worker_pool_rejected_total{module=\"%s\"} %llu\n",
+                                       Module.c_str(), (unsigned long long) m_Rejected.load());
+            Output += CString().Format("# TYPE apostol_worker_pool_pending gauge\n"
+                                       "apostol_worker_pool_pending{module=\"%s\"} %llu\n",
+                                       Module.c_str(), (unsigned long long) m_Pending.load());
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+    }
+}
+}
@@ -0,0 +1,118 @@
+/*++
+
+Program name:
+
+  Apostol CRM
+
+Module Name:
+
+  WorkerPool.hpp
+
+Notices:
+
+  Module: Worker Pool
+
+Author:
+
+  Copyright (c) Prepodobny Alen
+
+  mailto: alienufo@inbox.ru
+  mailto: ufocomp@gmail.com
+
+--*/
+
+#ifndef APOSTOL_WORKER_POOL_HPP
+#define APOSTOL_WORKER_POOL_HPP
+//----------------------------------------------------------------------------------------------------------------------
+
+#include <atomic>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <functional>
+#include <condition_variable>
+//----------------------------------------------------------------------------------------------------------------------
+
+extern "C++" {
+
+namespace Apostol {
+
+    namespace Module {
+
+        typedef std::function<void ()> COnWorkerJobEvent;
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        //-- CWorkerQueue ----------------------------------------------------------------------------------------------
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        typedef struct worker_job_s {
+            COnWorkerJobEvent Work;
+            COnWorkerJobEvent Done;
+        } CWorkerJob;
+        //--------------------------------------------------------------------------------------------------------------
+
+        typedef struct worker_queue_s {
+            std::mutex Lock;
+            std::condition_variable Signal;
+            std::deque<CWorkerJob> Jobs;
+            std::thread Thread;
+        } CWorkerQueue;
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        //-- CWorkerPool -----------------------------------------------------------------------------------------------
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        class CWorkerPool {
+        private:
+
+            std::vector<CWorkerQueue *> m_Queues;
+
+            std::mutex m_Lock;
+            std::deque<COnWorkerJobEvent> m_Completions;
+
+            size_t m_MaxJobs;
+            size_t m_Next;
+
+            std::atomic<size_t> m_Pending;
+            std::atomic<bool> m_Terminated;
+
+            std::atomic<uint64_t> m_Posted;
+            std::atomic<uint64_t> m_Rejected;
+
+            void Execute(CWorkerQueue *AQueue);
+
+            bool Post(size_t Index, COnWorkerJobEvent &&Work, COnWorkerJobEvent &&Done);
+
+        public:
+
+            CWorkerPool();
+
+            ~CWorkerPool();
+
+            void Start(size_t Threads, size_t MaxJobs);
+            void Stop();
+
+            bool Active() const { return !m_Queues.empty(); }
+
+            size_t Pending() const { return m_Pending; }
+
+            bool Post(COnWorkerJobEvent &&Work, COnWorkerJobEvent &&Done);
+            bool Post(const CString &Key, COnWorkerJobEvent &&Work, COnWorkerJobEvent &&Done);
+
+            size_t Dispatch();
+
+            void Metrics(CString &Output, const CString &Module) const;
+
+        };
+
+    }
+}
+
+using namespace Apostol::Module;
+}
+#endif //APOSTOL_WORKER_POOL_HPP